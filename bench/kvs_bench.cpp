@@ -0,0 +1,677 @@
+////////////////////////////////////////////////////////////////////////////
+// Name:        kvs_bench.cpp
+// Purpose:     benchmarks of a CKeyValueStore: load time, point read and
+//							write throughput at several store sizes and thread counts,
+//							shared counter increments against read-then-write,
+//							SyncToDiskStorage() cost with and without encryption and
+//							the overhead that adds,
+//							BulkLoad() and Export() in both formats,
+//							DeleteKeysStartingWith(), the RAM held per key and prefix
+//							scans over a hierarchical keyset, binary values repeated
+//							across keys with and without deduplication, and the base64
+//							codec.
+//
+//							Results are written as JSON. Keys, values and access
+//							patterns come from fixed seeds, so runs are comparable.
+//
+//							kvs_bench [--quick] [--dir <scratch dir>] [--out <file.json>]
+/////////////////////////////////////////////////////////////////////////////
+
+#include <chrono>
+#include <algorithm>
+#include <random>
+#include <thread>
+#include <fstream>
+#include <sstream>
+#include <iostream>
+#include "kvs.h"
+#if defined(__GLIBC__) && (__GLIBC__ > 2 || __GLIBC_MINOR__ >= 33)
+#include <malloc.h>
+#define BENCH_HEAP_BYTES    (1)           // mallinfo2() can count the heap
+#endif
+
+#define BENCH_SEED          (20140418)
+#define BENCH_PREFIXES      (100)         // keys are spread over this many prefixes
+#define BENCH_VALUE_SIZE    (32)
+#define BENCH_SITE_CAMERAS  (16)          // hierarchical keys: cameras per site,
+#define BENCH_CAMERA_STREAMS (4)          // streams per camera
+#define BENCH_BLOB_SIZE     (4096)        // repeated binary values: bytes each,
+#define BENCH_DISTINCT_BLOBS (8)          // and how many differ
+
+static const uint8_t gBenchKey[] = "kvs_bench encryption passphrase";
+
+///////////////////////////////////////////////////////////////////////////////////
+class CBenchOptions
+{
+public:
+	CBenchOptions() : m_quick(false), m_dir("kvs_bench_data") {}
+
+	bool        m_quick;
+	std::string m_dir;
+	std::string m_out;
+};
+
+///////////////////////////////////////////////////////////////////////////////////
+// collects result objects, each a flat set of name/value fields
+class CBenchResults
+{
+public:
+	void Begin( const char* bench )
+	{
+		m_current = std::string("{\"bench\": \"") + bench + "\"";
+	}
+	// counts are written exactly; measurements with every digit a double holds:
+	void Field( const char* name, int64_t value )
+	{
+		m_current += std::string(", \"") + name + "\": " + std::to_string(value);
+	}
+	void Field( const char* name, double value )
+	{
+		char buf[64];
+		snprintf( buf, sizeof(buf), "%.17g", value );
+		m_current += std::string(", \"") + name + "\": " + buf;
+	}
+	void Field( const char* name, bool value )
+	{
+		m_current += std::string(", \"") + name + "\": " + ((value) ? "true" : "false");
+	}
+	void End( void )
+	{
+		m_current += "}";
+		m_results.push_back( m_current );
+		std::cerr << m_current << std::endl;
+	}
+
+	std::string Json( const CBenchOptions& options )
+	{
+		std::string json = "{\n  \"benchmark\": \"kvs_bench\",\n";
+		json += "  \"config\": {\"quick\": " + std::string((options.m_quick) ? "true" : "false") +
+		        ", \"seed\": " + std::to_string(BENCH_SEED) +
+		        ", \"hardware_threads\": " + std::to_string(std::thread::hardware_concurrency()) +
+		        ", \"value_size\": " + std::to_string(BENCH_VALUE_SIZE) + "},\n";
+		json += "  \"results\": [\n";
+		for (size_t i = 0; i < m_results.size(); i++)
+			json += "    " + m_results[i] + ((i + 1 < m_results.size()) ? ",\n" : "\n");
+		json += "  ]\n}\n";
+		return json;
+	}
+
+private:
+	std::string              m_current;
+	std::vector<std::string> m_results;
+};
+
+///////////////////////////////////////////////////////////////////////////////////
+static double Seconds( std::chrono::steady_clock::time_point start )
+{
+	return std::chrono::duration<double>( std::chrono::steady_clock::now() - start ).count();
+}
+
+///////////////////////////////////////////////////////////////////////////////////
+static std::string BenchKey( uint32_t i )
+{
+	return "bench/" + std::to_string(i % BENCH_PREFIXES) + "/key/" + std::to_string(i);
+}
+
+///////////////////////////////////////////////////////////////////////////////////
+static std::vector<std::string> BenchKeys( uint32_t count )
+{
+	std::vector<std::string> keys;
+	keys.reserve( count );
+	for (uint32_t i = 0; i < count; i++)
+		keys.push_back( BenchKey(i) );
+	return keys;
+}
+
+///////////////////////////////////////////////////////////////////////////////////
+// configuration style keys, "site/42/camera/17/stream/0/bitrate", in no particular order
+static std::vector<std::string> HierarchicalKeys( uint32_t count )
+{
+	static const char* params[] = { "bitrate", "codec", "framerate", "gop", "height", "profile", "url", "width" };
+	const uint32_t     nparams = sizeof(params) / sizeof(params[0]);
+
+	std::vector<std::string> keys;
+	keys.reserve( count );
+	for (uint32_t i = 0; i < count; i++)
+	{
+		uint32_t stream = i / nparams;
+		uint32_t camera = stream / BENCH_CAMERA_STREAMS;
+		keys.push_back( "site/" + std::to_string(camera / BENCH_SITE_CAMERAS) + "/camera/" + std::to_string(camera % BENCH_SITE_CAMERAS) +
+		                "/stream/" + std::to_string(stream % BENCH_CAMERA_STREAMS) + "/" + params[i % nparams] );
+	}
+	std::shuffle( keys.begin(), keys.end(), std::mt19937( BENCH_SEED ) );
+	return keys;
+}
+
+///////////////////////////////////////////////////////////////////////////////////
+static uint64_t HeapBytes( void )
+{
+#ifdef BENCH_HEAP_BYTES
+	return (uint64_t)mallinfo2().uordblks;
+#else
+	return 0;
+#endif
+}
+
+///////////////////////////////////////////////////////////////////////////////////
+static std::string BenchPath( const CBenchOptions& options, const char* name, uint32_t count )
+{
+	return options.m_dir + "/" + name + "_" + std::to_string(count) + ".sqlite";
+}
+
+///////////////////////////////////////////////////////////////////////////////////
+static CKeyValueStore* OpenStore( const std::string& path, bool encrypted )
+{
+	std::remove( path.c_str() );
+
+	CKeyValueStore* p_store = (encrypted)
+		? new CKeyValueStore( path.c_str(), NULL, NULL, gBenchKey, sizeof(gBenchKey) )
+		: new CKeyValueStore( path.c_str(), NULL, NULL );
+	p_store->Init();
+	return p_store;
+}
+
+///////////////////////////////////////////////////////////////////////////////////
+static void Populate( CKeyValueStore* p_store, const std::vector<std::string>& keys )
+{
+	std::mt19937 rng( BENCH_SEED );
+	std::string  value( BENCH_VALUE_SIZE, ' ' );
+
+	for (size_t i = 0; i < keys.size(); i++)
+	{
+		for (size_t c = 0; c < value.size(); c++)
+			value[c] = (char)('a' + rng() % 26);
+
+		std::string key = keys[i];
+		p_store->WriteString( key, (char*)value.c_str() );
+	}
+}
+
+///////////////////////////////////////////////////////////////////////////////////
+// load_threads is an upper limit; stores below KVS_LOAD_MIN_THREAD_ROWS per thread use fewer
+static void BenchLoad( const CBenchOptions& options, CBenchResults& results, uint32_t count, uint32_t load_threads )
+{
+	std::string path = BenchPath( options, "load", count );
+	std::vector<std::string> keys = BenchKeys( count );
+
+	CKeyValueStore* p_store = OpenStore( path, false );
+	Populate( p_store, keys );
+	p_store->SyncToDiskStorage();
+	delete p_store;
+
+	std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+	p_store = new CKeyValueStore( path.c_str(), NULL, NULL );
+	p_store->SetLoadThreads( load_threads );
+	p_store->Init();
+	double seconds = Seconds( start );
+
+	results.Begin( "load" );
+	results.Field( "keys", (int64_t)count );
+	results.Field( "load_threads", (int64_t)load_threads );
+	results.Field( "loaded", (int64_t)p_store->m_pairs.size() );
+	results.Field( "seconds", seconds );
+	results.Field( "rows_per_sec", count / seconds );
+	results.End();
+
+	delete p_store;
+	std::remove( path.c_str() );
+}
+
+///////////////////////////////////////////////////////////////////////////////////
+// each thread runs ops_per_thread reads or writes of uniformly random keys
+static void BenchPoint( const CBenchOptions& options, CBenchResults& results, uint32_t count,
+                        uint32_t threads, bool writes )
+{
+	std::string path = BenchPath( options, "point", count );
+	std::vector<std::string> keys = BenchKeys( count );
+
+	CKeyValueStore* p_store = OpenStore( path, false );
+	Populate( p_store, keys );
+
+	uint32_t total_ops = (options.m_quick) ? 200000 : 2000000;
+	uint32_t ops_per_thread = total_ops / threads;
+
+	std::vector<std::thread> workers;
+	std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+
+	for (uint32_t t = 0; t < threads; t++)
+	{
+		workers.push_back( std::thread( [&, t]()
+		{
+			std::mt19937 rng( BENCH_SEED + t );
+			for (uint32_t i = 0; i < ops_per_thread; i++)
+			{
+				std::string& key = keys[ rng() % count ];
+				if (writes)
+					p_store->WriteInt( key, (int32_t)i );
+				else
+					p_store->ReadString( key, (char*)"" );
+			}
+		} ) );
+	}
+	for (size_t t = 0; t < workers.size(); t++)
+		workers[t].join();
+
+	double seconds = Seconds( start );
+
+	results.Begin( (writes) ? "write" : "read" );
+	results.Field( "keys", (int64_t)count );
+	results.Field( "threads", (int64_t)threads );
+	results.Field( "ops", (int64_t)(ops_per_thread * threads) );
+	results.Field( "seconds", seconds );
+	results.Field( "ops_per_sec", (ops_per_thread * threads) / seconds );
+	results.End();
+
+	delete p_store;
+	std::remove( path.c_str() );
+}
+
+///////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+// every thread bumps the same few counters; lost is how far the total falls short
+static void BenchCounter( const CBenchOptions& options, CBenchResults& results, uint32_t threads, bool atomic )
+{
+	std::string path = BenchPath( options, "counter", threads );
+	CKeyValueStore* p_store = OpenStore( path, false );
+
+	std::vector<std::string> keys = BenchKeys( 4 );
+	uint32_t total_ops = (options.m_quick) ? 200000 : 2000000;
+	uint32_t ops_per_thread = total_ops / threads;
+
+	std::vector<std::thread> workers;
+	std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+
+	for (uint32_t t = 0; t < threads; t++)
+	{
+		workers.push_back( std::thread( [&, t]()
+		{
+			for (uint32_t i = 0; i < ops_per_thread; i++)
+			{
+				std::string& key = keys[ (i + t) % keys.size() ];
+				if (atomic)
+					p_store->Increment( key, 1 );
+				else
+					p_store->WriteInt( key, p_store->ReadInt( key, 0 ) + 1 );
+			}
+		} ) );
+	}
+	for (size_t t = 0; t < workers.size(); t++)
+		workers[t].join();
+
+	double seconds = Seconds( start );
+
+	int64_t total = 0;
+	for (size_t k = 0; k < keys.size(); k++)
+		total += p_store->ReadInt( keys[k], 0 );
+
+	results.Begin( "counter" );
+	results.Field( "atomic", atomic );
+	results.Field( "threads", (int64_t)threads );
+	results.Field( "ops", (int64_t)(ops_per_thread * threads) );
+	results.Field( "lost", (int64_t)ops_per_thread * threads - total );
+	results.Field( "seconds", seconds );
+	results.Field( "ops_per_sec", (ops_per_thread * threads) / seconds );
+	results.End();
+
+	delete p_store;
+	std::remove( path.c_str() );
+}
+
+///////////////
+// the first sync inserts every row; the second is a full one, replacing every row, as an
+// incremental sync would find none written since. Each pass's seconds go to seconds[pass]
+static void BenchSync( const CBenchOptions& options, CBenchResults& results, uint32_t count, bool encrypted, double* seconds )
+{
+	std::string path = BenchPath( options, "sync", count );
+	std::vector<std::string> keys = BenchKeys( count );
+
+	CKeyValueStore* p_store = OpenStore( path, encrypted );
+	Populate( p_store, keys );
+
+	for (int32_t pass = 0; pass < 2; pass++)
+	{
+		std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+		bool ok = p_store->SyncToDiskStorage( false, false, pass == 1 );
+		seconds[pass] = Seconds( start );
+
+		results.Begin( "sync" );
+		results.Field( "keys", (int64_t)count );
+		results.Field( "encrypted", encrypted );
+		results.Field( "pass", (int64_t)pass + 1 );
+		results.Field( "ok", ok );
+		results.Field( "seconds", seconds[pass] );
+		results.Field( "rows_per_sec", count / seconds[pass] );
+		results.End();
+	}
+
+	delete p_store;
+	std::remove( path.c_str() );
+}
+
+///////////////////////////////////////////////////////////////////////////////////
+// exports a populated store, then bulk loads the export into an empty one
+static void BenchBulk( const CBenchOptions& options, CBenchResults& results, uint32_t count, int32_t format )
+{
+	std::string path = BenchPath( options, "export", count );
+	std::vector<std::string> keys = BenchKeys( count );
+
+	CKeyValueStore* p_store = OpenStore( path, false );
+	Populate( p_store, keys );
+
+	std::stringstream stream;
+	std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+	int64_t exported = p_store->Export( stream, format );
+	double seconds = Seconds( start );
+
+	results.Begin( "export" );
+	results.Field( "keys", (int64_t)count );
+	results.Field( "jsonl", format == KVS_BULK_JSONL );
+	results.Field( "ok", exported == (int64_t)count );
+	results.Field( "seconds", seconds );
+	results.Field( "rows_per_sec", count / seconds );
+	results.End();
+
+	delete p_store;
+	std::remove( path.c_str() );
+
+	path = BenchPath( options, "bulk_load", count );
+	p_store = OpenStore( path, false );
+	p_store->Init();
+
+	start = std::chrono::steady_clock::now();
+	int64_t loaded = p_store->BulkLoad( stream, format );
+	seconds = Seconds( start );
+
+	results.Begin( "bulk_load" );
+	results.Field( "keys", (int64_t)count );
+	results.Field( "jsonl", format == KVS_BULK_JSONL );
+	results.Field( "ok", loaded == (int64_t)count );
+	results.Field( "seconds", seconds );
+	results.Field( "rows_per_sec", count / seconds );
+	results.End();
+
+	delete p_store;
+	std::remove( path.c_str() );
+}
+
+///////////////////////////////////////////////////////////////////////////////////
+// deletes one of the BENCH_PREFIXES prefixes, so count / BENCH_PREFIXES keys
+static void BenchDeletePrefix( const CBenchOptions& options, CBenchResults& results, uint32_t count )
+{
+	std::string path = BenchPath( options, "delete", count );
+	std::vector<std::string> keys = BenchKeys( count );
+
+	CKeyValueStore* p_store = OpenStore( path, false );
+	Populate( p_store, keys );
+	p_store->SyncToDiskStorage();
+
+	std::string prefix = "bench/7/";
+	std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+	int32_t deleted = p_store->DeleteKeysStartingWith( prefix );
+	double seconds = Seconds( start );
+
+	results.Begin( "delete_prefix" );
+	results.Field( "keys", (int64_t)count );
+	results.Field( "deleted", (int64_t)deleted );
+	results.Field( "seconds", seconds );
+	results.End();
+
+	delete p_store;
+	std::remove( path.c_str() );
+}
+
+///////////////////////////////////////////////////////////////////////////////////
+// the heap a loaded store holds per key, with int values so the keys dominate; 0 where
+// the heap can't be counted
+static void BenchKeyMemory( const CBenchOptions& options, CBenchResults& results, uint32_t count )
+{
+	std::string path = BenchPath( options, "memory", count );
+	std::vector<std::string> keys = HierarchicalKeys( count );
+
+	uint64_t key_bytes = 0;
+	for (uint32_t i = 0; i < count; i++)
+		key_bytes += keys[i].size();
+
+	CKeyValueStore* p_store = OpenStore( path, false );
+	uint64_t before = HeapBytes();
+	for (uint32_t i = 0; i < count; i++)
+		p_store->WriteInt( keys[i], (int32_t)i );
+	uint64_t after = HeapBytes();
+
+	results.Begin( "key_memory" );
+	results.Field( "keys", (int64_t)count );
+	results.Field( "key_bytes_per_key", (double)key_bytes / count );
+	results.Field( "heap_bytes_per_key", (after > before) ? (double)(after - before) / count : 0.0 );
+	results.End();
+
+	delete p_store;
+	std::remove( path.c_str() );
+}
+
+///////////////////////////////////////////////////////////////////////////////////
+// over a hierarchical keyset: a cursor over one camera's keys, then the delete of one site
+static void BenchPrefixScan( const CBenchOptions& options, CBenchResults& results, uint32_t count )
+{
+	std::string path = BenchPath( options, "prefix", count );
+	std::vector<std::string> keys = HierarchicalKeys( count );
+
+	CKeyValueStore* p_store = OpenStore( path, false );
+	Populate( p_store, keys );
+	p_store->SyncToDiskStorage();
+
+	std::string camera = "site/0/camera/1/";
+	std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+	CKvsCursor* p_cursor = p_store->Cursor( camera );
+	uint32_t scanned = 0;
+	while (p_cursor->Next())
+		scanned++;
+	delete p_cursor;
+	double scan_seconds = Seconds( start );
+
+	std::string site = "site/0/";
+	start = std::chrono::steady_clock::now();
+	int32_t deleted = p_store->DeleteKeysStartingWith( site );
+	double delete_seconds = Seconds( start );
+
+	results.Begin( "prefix_scan" );
+	results.Field( "keys", (int64_t)count );
+	results.Field( "scanned", (int64_t)scanned );
+	results.Field( "scan_seconds", scan_seconds );
+	results.Field( "deleted", (int64_t)deleted );
+	results.Field( "delete_seconds", delete_seconds );
+	results.End();
+
+	delete p_store;
+	std::remove( path.c_str() );
+}
+
+///////////////////////////////////////////////////////////////////////////////////
+// count keys each holding one of a few binary values: the write cost, heap per key, sync
+// time and db size, with the values shared or each key's own
+static void BenchDedup( const CBenchOptions& options, CBenchResults& results, uint32_t count, bool dedup )
+{
+	std::string path = BenchPath( options, (dedup) ? "dedup" : "no_dedup", count );
+	std::vector<std::string> keys = BenchKeys( count );
+
+	std::mt19937 rng( BENCH_SEED );
+	std::vector< std::vector<uint8_t> > blobs( BENCH_DISTINCT_BLOBS, std::vector<uint8_t>( BENCH_BLOB_SIZE ) );
+	for (size_t b = 0; b < blobs.size(); b++)
+	{
+		for (size_t i = 0; i < BENCH_BLOB_SIZE; i++)
+			blobs[b][i] = (uint8_t)rng();
+	}
+
+	CKeyValueStore* p_store = OpenStore( path, false );
+	if (dedup)
+		p_store->SetDedupThreshold( BENCH_BLOB_SIZE );
+
+	uint64_t before = HeapBytes();
+	std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+	for (uint32_t i = 0; i < count; i++)
+		p_store->WriteBinary( keys[i], blobs[i % BENCH_DISTINCT_BLOBS].data(), BENCH_BLOB_SIZE );
+	double write_seconds = Seconds( start );
+	uint64_t after = HeapBytes();
+
+	start = std::chrono::steady_clock::now();
+	bool synced = p_store->SyncToDiskStorage();
+	double sync_seconds = Seconds( start );
+	delete p_store;
+
+	std::ifstream db( path.c_str(), std::ios::binary | std::ios::ate );
+	int64_t db_bytes = (db) ? (int64_t)db.tellg() : 0;
+
+	results.Begin( "dedup" );
+	results.Field( "keys", (int64_t)count );
+	results.Field( "dedup", dedup );
+	results.Field( "write_ns", write_seconds * 1e9 / count );
+	results.Field( "heap_bytes_per_key", (after > before) ? (double)(after - before) / count : 0.0 );
+	results.Field( "sync_ok", synced );
+	results.Field( "sync_seconds", sync_seconds );
+	results.Field( "db_bytes", db_bytes );
+	results.End();
+
+	std::remove( path.c_str() );
+}
+
+///////////////////////////////////////////////////////////////////////////////////
+static void BenchBase64( const CBenchOptions& options, CBenchResults& results, uint32_t byte_size )
+{
+	CKeyValueStore codec( (options.m_dir + "/unused.sqlite").c_str(), NULL, NULL );
+
+	std::mt19937 rng( BENCH_SEED );
+	std::vector<uint8_t> raw( byte_size );
+	for (uint32_t i = 0; i < byte_size; i++)
+		raw[i] = (uint8_t)rng();
+
+	uint64_t total = (options.m_quick) ? (16u << 20) : (128u << 20);
+	uint32_t rounds = (uint32_t)((total + byte_size - 1) / byte_size);
+
+	std::string encoded;
+	std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+	for (uint32_t r = 0; r < rounds; r++)
+		encoded = codec.base64_encode( raw.data(), byte_size );
+	double encode_seconds = Seconds( start );
+
+	std::string decoded;
+	start = std::chrono::steady_clock::now();
+	for (uint32_t r = 0; r < rounds; r++)
+		decoded = codec.base64_decode( encoded );
+	double decode_seconds = Seconds( start );
+
+	double mb = (double)rounds * byte_size / (1024.0 * 1024.0);
+
+	results.Begin( "base64" );
+	results.Field( "bytes", (int64_t)byte_size );
+	results.Field( "roundtrip_ok", decoded.size() == byte_size && memcmp( decoded.data(), raw.data(), byte_size ) == 0 );
+	results.Field( "encode_mb_per_sec", mb / encode_seconds );
+	results.Field( "decode_mb_per_sec", mb / decode_seconds );
+	results.End();
+}
+
+///////////////////////////////////////////////////////////////////////////////////
+int main( int argc, char** argv )
+{
+	CBenchOptions options;
+	for (int i = 1; i < argc; i++)
+	{
+		std::string arg = argv[i];
+		if (arg == "--quick")
+			options.m_quick = true;
+		else if (arg == "--dir" && i + 1 < argc)
+			options.m_dir = argv[++i];
+		else if (arg == "--out" && i + 1 < argc)
+			options.m_out = argv[++i];
+		else
+		{
+			std::cerr << "usage: kvs_bench [--quick] [--dir <scratch dir>] [--out <file.json>]" << std::endl;
+			return 1;
+		}
+	}
+
+	std::vector<uint32_t> sizes;
+	sizes.push_back( 1000 );
+	sizes.push_back( 10000 );
+	if (!options.m_quick)
+		sizes.push_back( 100000 );
+
+	std::vector<uint32_t> thread_counts;
+	thread_counts.push_back( 1 );
+	thread_counts.push_back( 2 );
+	thread_counts.push_back( 4 );
+	thread_counts.push_back( 8 );
+
+	CBenchResults results;
+
+	for (size_t s = 0; s < sizes.size(); s++)
+	{
+		for (size_t t = 0; t < thread_counts.size(); t++)
+			BenchLoad( options, results, sizes[s], thread_counts[t] );
+	}
+
+	for (size_t s = 0; s < sizes.size(); s++)
+	{
+		for (size_t t = 0; t < thread_counts.size(); t++)
+		{
+			BenchPoint( options, results, sizes[s], thread_counts[t], false );
+			BenchPoint( options, results, sizes[s], thread_counts[t], true );
+		}
+	}
+
+	for (size_t t = 0; t < thread_counts.size(); t++)
+	{
+		BenchCounter( options, results, thread_counts[t], false );
+		BenchCounter( options, results, thread_counts[t], true );
+	}
+
+	for (size_t s = 0; s < sizes.size(); s++)
+	{
+		double plain[2], sealed[2];
+		BenchSync( options, results, sizes[s], false, plain );
+		BenchSync( options, results, sizes[s], true, sealed );
+
+		// what encryption adds to each pass, in percent of the plaintext one's time:
+		for (int32_t pass = 0; pass < 2; pass++)
+		{
+			results.Begin( "sync_overhead" );
+			results.Field( "keys", (int64_t)sizes[s] );
+			results.Field( "pass", (int64_t)pass + 1 );
+			results.Field( "percent", (sealed[pass] / plain[pass] - 1.0) * 100.0 );
+			results.End();
+		}
+	}
+
+	for (size_t s = 0; s < sizes.size(); s++)
+	{
+		BenchBulk( options, results, sizes[s], KVS_BULK_BINARY );
+		BenchBulk( options, results, sizes[s], KVS_BULK_JSONL );
+	}
+
+	for (size_t s = 0; s < sizes.size(); s++)
+		BenchDeletePrefix( options, results, sizes[s] );
+
+	for (size_t s = 0; s < sizes.size(); s++)
+	{
+		BenchKeyMemory( options, results, sizes[s] );
+		BenchPrefixScan( options, results, sizes[s] );
+	}
+
+	// about a GB of values at the largest size, so the two smaller ones only:
+	for (size_t s = 0; s < sizes.size() && s < 2; s++)
+	{
+		BenchDedup( options, results, sizes[s], false );
+		BenchDedup( options, results, sizes[s], true );
+	}
+
+	BenchBase64( options, results, 1024 );
+	BenchBase64( options, results, 1024 * 1024 );
+
+	std::string json = results.Json( options );
+	std::cout << json;
+
+	if (!options.m_out.empty())
+	{
+		std::ofstream out( options.m_out.c_str() );
+		out << json;
+	}
+
+	return 0;
+}
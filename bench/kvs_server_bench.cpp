@@ -0,0 +1,318 @@
+////////////////////////////////////////////////////////////////////////////
+// Name:        kvs_server_bench.cpp
+// Purpose:     benchmarks of kvs_server on loopback: ops/sec and round trip
+//							latency percentiles for many concurrent clients, over TCP
+//							and a Unix socket, each client sending one request per
+//							round trip, a pipeline of requests, or one batched GET.
+//
+//							The server runs in process on its own threads. Requests are
+//							90% reads of uniformly random keys, 10% writes. Results are
+//							written as JSON, like kvs_bench's.
+//
+//							kvs_server_bench [--quick] [--dir <scratch dir>] [--out <file.json>]
+/////////////////////////////////////////////////////////////////////////////
+
+#include <chrono>
+#include <random>
+#include <thread>
+#include <fstream>
+#include <iostream>
+#include <algorithm>
+#include "kvs.h"
+#include "server.h"
+#include "client.h"
+
+#define BENCH_SEED          (20140418)
+#define BENCH_KEYS          (100000)
+#define BENCH_VALUE_SIZE    (32)
+#define BENCH_DEPTH         (32)          // requests per round trip when pipelined or batched
+#define BENCH_WRITE_PCT     (10)
+
+// how each client sends its requests:
+#define BENCH_SINGLE        (0)           // one per round trip
+#define BENCH_PIPELINE      (1)           // BENCH_DEPTH queued, then flushed
+#define BENCH_BATCH         (2)           // one GET of BENCH_DEPTH keys
+
+static const char* gBenchModes[] = { "single", "pipeline", "batch" };
+
+///////////////////////////////////////////////////////////////////////////////////
+class CBenchOptions
+{
+public:
+	CBenchOptions() : m_quick(false), m_dir("kvs_bench_data") {}
+
+	bool        m_quick;
+	std::string m_dir;
+	std::string m_out;
+};
+
+///////////////////////////////////////////////////////////////////////////////////
+// collects result objects, each a flat set of name/value fields
+class CBenchResults
+{
+public:
+	void Begin( const char* bench )
+	{
+		m_current = std::string("{\"bench\": \"") + bench + "\"";
+	}
+	// counts are written exactly; measurements with every digit a double holds:
+	void Field( const char* name, int64_t value )
+	{
+		m_current += std::string(", \"") + name + "\": " + std::to_string(value);
+	}
+	void Field( const char* name, double value )
+	{
+		char buf[64];
+		snprintf( buf, sizeof(buf), "%.17g", value );
+		m_current += std::string(", \"") + name + "\": " + buf;
+	}
+	void Field( const char* name, const char* value )
+	{
+		m_current += std::string(", \"") + name + "\": \"" + value + "\"";
+	}
+	void Field( const char* name, bool value )
+	{
+		m_current += std::string(", \"") + name + "\": " + ((value) ? "true" : "false");
+	}
+	void End( void )
+	{
+		m_current += "}";
+		m_results.push_back( m_current );
+		std::cerr << m_current << std::endl;
+	}
+
+	std::string Json( const CBenchOptions& options, uint32_t server_threads )
+	{
+		std::string json = "{\n  \"benchmark\": \"kvs_server_bench\",\n";
+		json += "  \"config\": {\"quick\": " + std::string((options.m_quick) ? "true" : "false") +
+		        ", \"seed\": " + std::to_string(BENCH_SEED) +
+		        ", \"hardware_threads\": " + std::to_string(std::thread::hardware_concurrency()) +
+		        ", \"server_threads\": " + std::to_string(server_threads) +
+		        ", \"keys\": " + std::to_string(BENCH_KEYS) +
+		        ", \"depth\": " + std::to_string(BENCH_DEPTH) +
+		        ", \"value_size\": " + std::to_string(BENCH_VALUE_SIZE) + "},\n";
+		json += "  \"results\": [\n";
+		for (size_t i = 0; i < m_results.size(); i++)
+			json += "    " + m_results[i] + ((i + 1 < m_results.size()) ? ",\n" : "\n");
+		json += "  ]\n}\n";
+		return json;
+	}
+
+private:
+	std::string              m_current;
+	std::vector<std::string> m_results;
+};
+
+///////////////////////////////////////////////////////////////////////////////////
+static std::string BenchKey( uint32_t i )
+{
+	return "bench/" + std::to_string(i % 100) + "/key/" + std::to_string(i);
+}
+
+///////////////////////////////////////////////////////////////////////////////////
+// what one client did: requests completed, and each round trip's time in microseconds
+class CBenchClient
+{
+public:
+	CBenchClient() : m_ops(0), m_errors(0) {}
+
+	uint64_t              m_ops;
+	uint64_t              m_errors;
+	std::vector<float>    m_latencies;
+};
+
+///////////////////////////////////////////////////////////////////////////////////
+static void RunClient( const std::string& address, const std::vector<std::string>& keys, int32_t mode,
+                       uint32_t seed, std::chrono::steady_clock::time_point until, CBenchClient& result )
+{
+	CKvsClient client;
+	if (!client.Connect( address ))
+	{
+		result.m_errors++;
+		return;
+	}
+
+	std::mt19937             rng( seed );
+	std::string              value( BENCH_VALUE_SIZE, 'v' );
+	std::vector<std::string> batch( BENCH_DEPTH );
+	std::vector<std::string> values;
+	std::vector<bool>        found;
+	std::vector<CKvsReply>   replies;
+
+	while (std::chrono::steady_clock::now() < until)
+	{
+		std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+		bool     ok = true;
+		uint32_t ops = 1;
+
+		if (mode == BENCH_SINGLE)
+		{
+			std::string key = keys[ rng() % keys.size() ];
+			if (rng() % 100 < BENCH_WRITE_PCT)
+				client.WriteString( key, (char*)value.c_str() );
+			else
+				client.ReadString( key, (char*)"" );
+			ok = client.isConnected();
+		}
+		else if (mode == BENCH_PIPELINE)
+		{
+			for (uint32_t i = 0; i < BENCH_DEPTH; i++)
+			{
+				const std::string& key = keys[ rng() % keys.size() ];
+				if (rng() % 100 < BENCH_WRITE_PCT)
+					client.QueueSet( key, value );
+				else
+					client.QueueGet( key );
+			}
+			ok = client.Flush( replies );
+			ops = BENCH_DEPTH;
+		}
+		else
+		{
+			for (uint32_t i = 0; i < BENCH_DEPTH; i++)
+				batch[i] = keys[ rng() % keys.size() ];
+			ok = client.Get( batch, values, found );
+			ops = BENCH_DEPTH;
+		}
+
+		if (!ok)
+		{
+			result.m_errors++;
+			return;
+		}
+		result.m_ops += ops;
+		result.m_latencies.push_back( std::chrono::duration<float, std::micro>( std::chrono::steady_clock::now() - start ).count() );
+	}
+}
+
+///////////////////////////////////////////////////////////////////////////////////
+static double Percentile( const std::vector<float>& sorted, double p )
+{
+	if (sorted.empty())
+		return 0;
+	size_t at = (size_t)(p * (sorted.size() - 1));
+	return sorted[at];
+}
+
+///////////////////////////////////////////////////////////////////////////////////
+static void BenchClients( const CBenchOptions& options, CBenchResults& results, const std::string& address,
+                          const char* transport, const std::vector<std::string>& keys, uint32_t clients, int32_t mode )
+{
+	double seconds = (options.m_quick) ? 1.0 : 3.0;
+
+	std::vector<CBenchClient> outcomes( clients );
+	std::vector<std::thread>  workers;
+
+	std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+	std::chrono::steady_clock::time_point until = start + std::chrono::microseconds( (int64_t)(seconds * 1e6) );
+	for (uint32_t c = 0; c < clients; c++)
+		workers.push_back( std::thread( RunClient, address, std::cref(keys), mode, BENCH_SEED + c, until, std::ref(outcomes[c]) ) );
+	for (size_t c = 0; c < workers.size(); c++)
+		workers[c].join();
+	seconds = std::chrono::duration<double>( std::chrono::steady_clock::now() - start ).count();
+
+	uint64_t           ops = 0;
+	uint64_t           errors = 0;
+	std::vector<float> latencies;
+	for (size_t c = 0; c < outcomes.size(); c++)
+	{
+		ops += outcomes[c].m_ops;
+		errors += outcomes[c].m_errors;
+		latencies.insert( latencies.end(), outcomes[c].m_latencies.begin(), outcomes[c].m_latencies.end() );
+	}
+	std::sort( latencies.begin(), latencies.end() );
+
+	results.Begin( "server" );
+	results.Field( "transport", transport );
+	results.Field( "mode", gBenchModes[mode] );
+	results.Field( "clients", (int64_t)clients );
+	results.Field( "ops", (int64_t)ops );
+	results.Field( "errors", (int64_t)errors );
+	results.Field( "seconds", seconds );
+	results.Field( "ops_per_sec", ops / seconds );
+	results.Field( "p50_us", Percentile( latencies, 0.50 ) );
+	results.Field( "p99_us", Percentile( latencies, 0.99 ) );
+	results.Field( "p999_us", Percentile( latencies, 0.999 ) );
+	results.End();
+}
+
+///////////////////////////////////////////////////////////////////////////////////
+int main( int argc, char** argv )
+{
+	CBenchOptions options;
+	for (int i = 1; i < argc; i++)
+	{
+		std::string arg = argv[i];
+		if (arg == "--quick")
+			options.m_quick = true;
+		else if (arg == "--dir" && i + 1 < argc)
+			options.m_dir = argv[++i];
+		else if (arg == "--out" && i + 1 < argc)
+			options.m_out = argv[++i];
+		else
+		{
+			std::cerr << "usage: kvs_server_bench [--quick] [--dir <scratch dir>] [--out <file.json>]" << std::endl;
+			return 1;
+		}
+	}
+
+	std::string path = options.m_dir + "/server.sqlite";
+	std::string socketPath = options.m_dir + "/kvs_server_bench.sock";
+	std::remove( path.c_str() );
+
+	CKeyValueStore* p_store = new CKeyValueStore( path.c_str(), NULL, NULL );
+	p_store->Init();
+
+	std::vector<std::string> keys;
+	std::string              value( BENCH_VALUE_SIZE, 'v' );
+	for (uint32_t i = 0; i < BENCH_KEYS; i++)
+	{
+		keys.push_back( BenchKey(i) );
+		p_store->WriteString( keys.back(), (char*)value.c_str() );
+	}
+
+	uint32_t    serverThreads = std::max( 1u, std::thread::hardware_concurrency() );
+	CKvsServer* p_server = new CKvsServer( p_store );
+	if (!p_server->Listen( "tcp:127.0.0.1:0" ) || !p_server->Listen( "unix:" + socketPath ) || !p_server->Start( serverThreads ))
+	{
+		std::cerr << "kvs_server_bench: " << p_server->GetErrorMsg() << std::endl;
+		return 1;
+	}
+
+	std::vector<std::pair<std::string, const char*> > addresses;
+	addresses.push_back( std::make_pair( "tcp:127.0.0.1:" + std::to_string(p_server->GetPort()), "tcp" ) );
+	addresses.push_back( std::make_pair( "unix:" + socketPath, "unix" ) );
+
+	std::vector<uint32_t> client_counts;
+	client_counts.push_back( 1 );
+	client_counts.push_back( 16 );
+	client_counts.push_back( 64 );
+	if (!options.m_quick)
+		client_counts.push_back( 256 );
+
+	CBenchResults results;
+
+	for (size_t a = 0; a < addresses.size(); a++)
+	{
+		for (int32_t mode = BENCH_SINGLE; mode <= BENCH_BATCH; mode++)
+		{
+			for (size_t c = 0; c < client_counts.size(); c++)
+				BenchClients( options, results, addresses[a].first, addresses[a].second, keys, client_counts[c], mode );
+		}
+	}
+
+	delete p_server;
+	delete p_store;
+	std::remove( path.c_str() );
+
+	std::string json = results.Json( options, serverThreads );
+	std::cout << json;
+
+	if (!options.m_out.empty())
+	{
+		std::ofstream out( options.m_out.c_str() );
+		out << json;
+	}
+
+	return 0;
+}
@@ -0,0 +1,144 @@
+////////////////////////////////////////////////////////////////////////////
+// Name:        async.cpp
+// Purpose:     the I/O thread behind a CKeyValueStore's awaitable calls
+/////////////////////////////////////////////////////////////////////////////
+
+#include "kvs.h"
+
+// set on an I/O thread let go by Stop(), whose executor is gone once its job returns:
+static thread_local bool gIoDetached = false;
+
+///////////////////////////////////////////////////////////////////////////////////
+CKvsIoExecutor::CKvsIoExecutor()
+{
+	m_stopped = false;
+}
+
+///////////////////////////////////////////////////////////////////////////////////
+CKvsIoExecutor::~CKvsIoExecutor()
+{
+	Stop();
+}
+
+///////////////////////////////////////////////////////////////////////////////////
+void CKvsIoExecutor::Post( std::function<void(void)> job )
+{
+	{
+		std::lock_guard<std::mutex> guard( m_mutex );
+		if (!m_stopped)
+		{
+			if (!m_thread.joinable())
+				m_thread = std::thread( [this]() { Run(); } );
+			m_jobs.push_back( std::move(job) );
+			m_wake.notify_one();
+			return;
+		}
+	}
+
+	// too late for the thread, yet the coroutine still has to resume:
+	job();
+}
+
+///////////////////////////////////////////////////////////////////////////////////
+void CKvsIoExecutor::Stop( void )
+{
+	{
+		std::lock_guard<std::mutex> guard( m_mutex );
+		m_stopped = true;
+		m_wake.notify_one();
+	}
+	if (!m_thread.joinable())
+		return;
+	if (m_thread.get_id() != std::this_thread::get_id())
+	{
+		m_thread.join();
+		return;
+	}
+
+	// the last reference went in a job on the I/O thread, which cannot join itself: what is
+	// queued runs here instead, and the thread is let go, Run() leaving as that job returns:
+	std::deque< std::function<void(void)> > jobs;
+	{
+		std::lock_guard<std::mutex> guard( m_mutex );
+		jobs.swap( m_jobs );
+	}
+	for (size_t i = 0; i < jobs.size(); i++)
+		jobs[i]();
+
+	gIoDetached = true;
+	m_thread.detach();
+}
+
+///////////////////////////////////////////////////////////////////////////////////
+void CKvsIoExecutor::SetResumer( const CKvsResumer& resumer )
+{
+	std::lock_guard<std::mutex> guard( m_mutex );
+	m_resumer = resumer;
+}
+
+///////////////////////////////////////////////////////////////////////////////////
+void CKvsIoExecutor::Resume( std::coroutine_handle<> handle )
+{
+	CKvsResumer resumer;
+	{
+		std::lock_guard<std::mutex> guard( m_mutex );
+		resumer = m_resumer;
+	}
+
+	if (resumer)
+		resumer( handle );
+	else
+		handle.resume();
+}
+
+///////////////////////////////////////////////////////////////////////////////////
+// jobs queued before Stop() still run, so no awaiting coroutine is left suspended
+void CKvsIoExecutor::Run( void )
+{
+	std::unique_lock<std::mutex> lock( m_mutex );
+	for (;;)
+	{
+		m_wake.wait( lock, [this]() { return m_stopped || !m_jobs.empty(); } );
+		if (m_jobs.empty())
+			return;
+
+		std::function<void(void)> job = std::move( m_jobs.front() );
+		m_jobs.pop_front();
+
+		lock.unlock();
+		job();
+		if (gIoDetached)
+			return;
+		lock.lock();
+	}
+}
+
+///////////////////////////////////////////////////////////////////////////////////
+void CKeyValueStore::SetResumer( const CKvsResumer& resumer )
+{
+	m_io.SetResumer( resumer );
+}
+
+///////////////////////////////////////////////////////////////////////////////////
+CKvsAwaitable<int32_t> CKeyValueStore::OpenAsync( void )
+{
+	return CKvsAwaitable<int32_t>( m_io, [this]() { return Init(); } );
+}
+
+///////////////////////////////////////////////////////////////////////////////////
+CKvsAwaitable<bool> CKeyValueStore::SyncAsync( void )
+{
+	return CKvsAwaitable<bool>( m_io, [this]() { return SyncToDiskStorage(); } );
+}
+
+///////////////////////////////////////////////////////////////////////////////////
+CKvsAwaitable<bool> CKeyValueStore::DeleteAsync( std::string key )
+{
+	return CKvsAwaitable<bool>( m_io, [this, key]() mutable { return DeleteKey( key ); } );
+}
+
+///////////////////////////////////////////////////////////////////////////////////
+CKvsAwaitable<int32_t> CKeyValueStore::DeletePrefixAsync( std::string keyPrefix )
+{
+	return CKvsAwaitable<int32_t>( m_io, [this, keyPrefix]() mutable { return DeleteKeysStartingWith( keyPrefix ); } );
+}
@@ -0,0 +1,79 @@
+/////////////////////////////////////////////////////////////////////////////
+// Name:        async.h
+// Purpose:     awaitable variants of the CKeyValueStore calls that reach the
+//							db, for callers running on coroutines.
+//
+//							Each store has one I/O thread, started on first use, that
+//							runs the db work of OpenAsync(), SyncAsync(), DeleteAsync()
+//							and DeletePrefixAsync() in the order they were awaited. The
+//							awaiting coroutine is then resumed through the resumer the
+//							store was given with SetResumer(), typically one posting to
+//							the caller's own executor; without one it resumes on the I/O
+//							thread. Reads and writes of RAM stay plain calls.
+/////////////////////////////////////////////////////////////////////////////
+
+#ifndef _KVS_ASYNC_H_
+#define _KVS_ASYNC_H_
+
+#include <coroutine>
+#include <condition_variable>
+#include <functional>
+#include <deque>
+#include <mutex>
+#include <thread>
+#include <utility>
+
+// resumes a coroutine whose db work is done, such as by posting it to an executor:
+typedef std::function<void(std::coroutine_handle<>)> CKvsResumer;
+
+class CKvsIoExecutor
+{
+public:
+	CKvsIoExecutor();
+	~CKvsIoExecutor();
+
+	// runs job on the I/O thread, starting it if need be; once stopped, on the caller's:
+	void        Post( std::function<void(void)> job );
+	// runs what is queued, then ends the thread:
+	void        Stop( void );
+
+	void        SetResumer( const CKvsResumer& resumer );
+	void        Resume( std::coroutine_handle<> handle );
+
+private:
+	CKvsIoExecutor( const CKvsIoExecutor& );
+	CKvsIoExecutor& operator=( const CKvsIoExecutor& );
+
+	void        Run( void );
+
+	std::thread             m_thread;
+	std::mutex              m_mutex;
+	std::condition_variable m_wake;
+	std::deque< std::function<void(void)> > m_jobs;
+	bool                    m_stopped;
+	CKvsResumer             m_resumer;
+};
+
+// co_await gives what work returned, work having run on the store's I/O thread:
+template <typename T>
+class CKvsAwaitable
+{
+public:
+	CKvsAwaitable( CKvsIoExecutor& io, std::function<T(void)> work )
+		: mp_io(&io), m_work(std::move(work)), m_result() {}
+
+	bool await_ready( void ) { return false; }
+	void await_suspend( std::coroutine_handle<> handle )
+	{
+		// the awaitable lives in the suspended coroutine's frame until it is resumed:
+		mp_io->Post( [this, handle]() { m_result = m_work(); mp_io->Resume( handle ); } );
+	}
+	T    await_resume( void ) { return m_result; }
+
+private:
+	CKvsIoExecutor*        mp_io;
+	std::function<T(void)> m_work;
+	T                      m_result;
+};
+
+#endif // _KVS_ASYNC_H_
@@ -0,0 +1,163 @@
+////////////////////////////////////////////////////////////////////////////
+// Name:        backup.cpp
+// Purpose:     online backups and checkpoints of a CKeyValueStore's db
+/////////////////////////////////////////////////////////////////////////////
+
+#include <chrono>
+#include <boost/filesystem.hpp>
+#include "kvs.h"
+
+#define KVS_BACKUP_RETRY_MS   (10)      // wait before a step that found the db busy is tried again
+
+///////////////////////////////////////////////////////////////////////////////////
+void CKeyValueStore::SetWriteAheadLog( bool wal )
+{
+	m_writeAheadLog = wal;
+}
+
+///////////////////////////////////////////////////////////////////////////////////
+bool CKeyValueStore::Backup( const std::string& destPath, const CKvsBackupOptions& options )
+{
+	LazyInit(); // even if LazyInit fails, we continue...
+
+	if (!mp_db)
+	{
+		m_emsg = "Backup() mp_db=0";
+		return false;
+	}
+
+	if (options.m_syncFirst && !SyncToDiskStorage())
+	{
+		m_emsg = "Backup() the sync before it failed";
+		return false;
+	}
+
+	std::string partialPath = destPath + ".partial";
+	std::remove( partialPath.c_str() );
+
+	sqlite3* p_dest = NULL;
+	if (sqlite3_open_v2( partialPath.c_str(), &p_dest, SQLITE_OPEN_READWRITE | SQLITE_OPEN_CREATE, NULL ) != SQLITE_OK)
+	{
+		m_emsg = std::string("Backup() Can't open: ") + partialPath + " " + sqlite3_errmsg(p_dest);
+		sqlite3_close( p_dest );
+		return false;
+	}
+
+	sqlite3_backup* p_backup;
+	{
+		std::lock_guard<std::mutex> dbLock(m_dbMutex);
+		p_backup = sqlite3_backup_init( p_dest, "main", mp_db, "main" );
+	}
+	if (!p_backup)
+	{
+		m_emsg = std::string("Backup() ") + sqlite3_errmsg(p_dest);
+		sqlite3_close( p_dest );
+		std::remove( partialPath.c_str() );
+		return false;
+	}
+
+	// each step under the db lock, so it never meets a sync's transaction half done. Another
+	// connection writing can keep the db busy, so retries stop once it has been for m_busyMs:
+	int32_t rc;
+	int32_t total = 0;
+	bool    cancelled = false;
+	bool    busy = false;
+	std::chrono::steady_clock::time_point busySince;
+	while (true)
+	{
+		int32_t remaining;
+		{
+			std::lock_guard<std::mutex> dbLock(m_dbMutex);
+			rc = sqlite3_backup_step( p_backup, (options.m_stepPages > 0) ? options.m_stepPages : -1 );
+			remaining = sqlite3_backup_remaining( p_backup );
+			total = sqlite3_backup_pagecount( p_backup );
+		}
+
+		if (rc != SQLITE_OK && rc != SQLITE_DONE && rc != SQLITE_BUSY && rc != SQLITE_LOCKED)
+			break;
+
+		if (rc == SQLITE_BUSY || rc == SQLITE_LOCKED)
+		{
+			std::chrono::steady_clock::time_point now = std::chrono::steady_clock::now();
+			if (!busy)
+				busySince = now;
+			else if (now - busySince >= std::chrono::milliseconds( options.m_busyMs ))
+				break;
+			busy = true;
+		}
+		else
+		{
+			busy = false;
+		}
+
+		if (options.m_progress && !options.m_progress( remaining, total ) && rc != SQLITE_DONE)
+		{
+			cancelled = true;
+			break;
+		}
+		if (rc == SQLITE_DONE)
+			break;
+
+		uint32_t pause = (rc == SQLITE_OK) ? options.m_pauseMs : KVS_BACKUP_RETRY_MS;
+		if (pause)
+			std::this_thread::sleep_for( std::chrono::milliseconds( pause ) );
+	}
+
+	{
+		std::lock_guard<std::mutex> dbLock(m_dbMutex);
+		sqlite3_backup_finish( p_backup );
+	}
+	if ((rc == SQLITE_BUSY || rc == SQLITE_LOCKED) && !cancelled)
+		m_emsg = std::string("Backup() gave up after ") + std::to_string( options.m_busyMs ) + " ms: " + sqlite3_errstr(rc);
+	else if (rc != SQLITE_DONE && !cancelled)
+		m_emsg = std::string("Backup() Step Error: ") + sqlite3_errstr(rc);
+	sqlite3_close( p_dest );
+
+	if (rc != SQLITE_DONE || cancelled)
+	{
+		if (cancelled)
+			m_emsg = "Backup() cancelled";
+		std::remove( partialPath.c_str() );
+		return false;
+	}
+
+	// only a whole copy takes destPath's place:
+	boost::system::error_code ec;
+	boost::filesystem::rename( partialPath, destPath, ec );
+	if (ec)
+	{
+		m_emsg = std::string("Backup() Can't rename to ") + destPath + ": " + ec.message();
+		std::remove( partialPath.c_str() );
+		return false;
+	}
+
+	m_stats.Add( KVS_STAT_BACKUP_PAGES, (uint64_t)total );
+	return true;
+}
+
+///////////////////////////////////////////////////////////////////////////////////
+// the log holds only what syncs committed, so RAM is not synced first
+bool CKeyValueStore::Checkpoint( int32_t mode )
+{
+	LazyInit(); // even if LazyInit fails, we continue...
+
+	if (!mp_db)
+	{
+		m_emsg = "Checkpoint() mp_db=0";
+		return false;
+	}
+
+	int32_t rc;
+	{
+		std::lock_guard<std::mutex> dbLock(m_dbMutex);
+		rc = sqlite3_wal_checkpoint_v2( mp_db, NULL, mode, NULL, NULL );
+	}
+	if (rc != SQLITE_OK)
+	{
+		m_emsg = std::string("Checkpoint() ") + sqlite3_errstr(rc);
+		return false;
+	}
+
+	m_stats.Add( KVS_STAT_CHECKPOINTS, 1 );
+	return true;
+}
@@ -0,0 +1,52 @@
+/////////////////////////////////////////////////////////////////////////////
+// Name:        backup.h
+// Purpose:     online backups and checkpoints of a CKeyValueStore's db.
+//
+//							Backup() copies the db with sqlite's online backup API, a
+//							few pages a step. Each step holds the store's db lock only
+//							while it runs, so syncs, deletes and commits go on between
+//							steps; writers to RAM never wait on it at all. Writes made
+//							to the db during the backup go through the store's own
+//							connection, which sqlite carries into the copy as they
+//							happen, so the backup never has to start over and ends
+//							matching the db as of its last step.
+//
+//							The copy is made beside destPath and renamed over it once
+//							whole, so destPath is never a partial backup. Sealed values
+//							are copied sealed, and open with the store's key.
+//
+//							With the write ahead log on, Checkpoint() moves committed
+//							pages from the log into the db file; without it there is
+//							nothing to move, and it succeeds at once.
+/////////////////////////////////////////////////////////////////////////////
+
+#ifndef _KVS_BACKUP_H_
+#define _KVS_BACKUP_H_
+
+#include <cstdint>
+#include <functional>
+
+#define KVS_BACKUP_STEP_PAGES     (256)     // pages copied per step by default, 1MB at 4KB pages
+#define KVS_BACKUP_BUSY_MS        (10000)   // how long steps may find the db busy before a backup fails, by default
+
+// checkpoint modes, as sqlite3_wal_checkpoint_v2()'s:
+#define KVS_CHECKPOINT_PASSIVE    (0)       // as much as can be done without waiting on readers
+#define KVS_CHECKPOINT_FULL       (1)       // waits for readers, then the whole log
+#define KVS_CHECKPOINT_TRUNCATE   (3)       // as FULL, then truncates the log file to 0 bytes
+
+// called after each step with the pages left and the db's page count; false cancels:
+typedef std::function<bool(int32_t remaining, int32_t total)> KVS_BACKUP_PROGRESS;
+
+class CKvsBackupOptions
+{
+public:
+	CKvsBackupOptions() : m_stepPages(KVS_BACKUP_STEP_PAGES), m_pauseMs(0), m_busyMs(KVS_BACKUP_BUSY_MS), m_syncFirst(true) {}
+
+	int32_t  m_stepPages;       // pages per step, the longest the db lock is held; <= 0 copies all in one
+	uint32_t m_pauseMs;         // sleep between steps, so the backup's disk and lock use can be paced
+	uint32_t m_busyMs;          // how long steps may keep finding the db busy or locked before it fails
+	bool     m_syncFirst;       // sync RAM to the db first, so the backup holds every write made before it
+	KVS_BACKUP_PROGRESS m_progress;
+};
+
+#endif // _KVS_BACKUP_H_
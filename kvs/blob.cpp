@@ -0,0 +1,644 @@
+////////////////////////////////////////////////////////////////////////////
+// Name:        blob.cpp
+// Purpose:     chunked large binary values of a CKeyValueStore
+/////////////////////////////////////////////////////////////////////////////
+
+#include "kvs.h"
+
+///////////////////////////////////////////////////////////////////////////////////
+// a chunk is sealed bound to its key and row number, so chunks cannot be swapped around,
+// nor between generations; the NUL keeps it apart from the aad of any value, which is its
+// key alone
+static std::string kvs_blob_aad( const std::string& key, int64_t chunk )
+{
+	return key + std::string( 1, '\0' ) + std::to_string( chunk );
+}
+
+///////////////////////////////////////////////////////////////////////////////////
+// the chunk row of index chunk in generation gen:
+static int64_t kvs_blob_row( int64_t gen, int64_t chunk )
+{
+	return (gen << KVS_BLOB_GEN_SHIFT) + chunk;
+}
+
+///////////////////////////////////////////////////////////////////////////////////
+// runs sql on key's rows, with a and b bound to ?2 and ?3 if it has them; the caller
+// holds m_dbMutex, and who names it in emsg
+static bool kvs_blob_exec( sqlite3* db, const char* sql, const std::string& key, int64_t a, int64_t b,
+                           const char* who, std::string& emsg )
+{
+	sqlite3_stmt* statement;
+	if (sqlite3_prepare_v2(db, sql, -1, &statement, NULL) != SQLITE_OK)
+	{
+		emsg = std::string(who) + " Prepare Error: " + std::string(sqlite3_errmsg(db));
+		return false;
+	}
+
+	int32_t params = sqlite3_bind_parameter_count(statement);
+	sqlite3_bind_text(statement, 1, key.c_str(), (int)key.size(), SQLITE_STATIC);
+	if (params >= 2)
+		sqlite3_bind_int64(statement, 2, a);
+	if (params >= 3)
+		sqlite3_bind_int64(statement, 3, b);
+	bool ok = sqlite3_step(statement) == SQLITE_DONE;
+	if (!ok)
+		emsg = std::string(who) + " " + std::string(sqlite3_errmsg(db));
+	sqlite3_finalize(statement);
+
+	return ok;
+}
+
+///////////////////////////////////////////////////////////////////////////////////
+CKvsBlobCache::CKvsBlobCache()
+{
+	m_capacity = 0;
+	m_size = 0;
+}
+
+///////////////////////////////////////////////////////////////////////////////////
+void CKvsBlobCache::SetCapacity( uint64_t byte_size )
+{
+	std::lock_guard<std::mutex> guard(m_mutex);
+	m_capacity = byte_size;
+	Evict();
+}
+
+///////////////////////////////////////////////////////////////////////////////////
+void CKvsBlobCache::Evict( void )
+{
+	while (m_size > m_capacity && !m_lru.empty())
+	{
+		m_size -= m_lru.back().m_data.size();
+		m_index.erase( m_lru.back().m_id );
+		m_lru.pop_back();
+	}
+}
+
+///////////////////////////////////////////////////////////////////////////////////
+bool CKvsBlobCache::Get( const std::string& key, int64_t chunk, std::string& data )
+{
+	std::lock_guard<std::mutex> guard(m_mutex);
+
+	std::map<CChunkId, std::list<CEntry>::iterator>::iterator it = m_index.find( CChunkId( key, chunk ) );
+	if (it == m_index.end())
+		return false;
+
+	m_lru.splice( m_lru.begin(), m_lru, it->second );
+	data = it->second->m_data;
+	return true;
+}
+
+///////////////////////////////////////////////////////////////////////////////////
+void CKvsBlobCache::Put( const std::string& key, int64_t chunk, const std::string& data )
+{
+	std::lock_guard<std::mutex> guard(m_mutex);
+
+	if (data.size() > m_capacity)
+		return;
+
+	CChunkId id( key, chunk );
+	std::map<CChunkId, std::list<CEntry>::iterator>::iterator it = m_index.find( id );
+	if (it != m_index.end())
+	{
+		m_size -= it->second->m_data.size();
+		m_lru.erase( it->second );
+		m_index.erase( it );
+	}
+
+	CEntry entry;
+	entry.m_id = id;
+	entry.m_data = data;
+	m_lru.push_front( entry );
+	m_index[id] = m_lru.begin();
+	m_size += data.size();
+
+	Evict();
+}
+
+///////////////////////////////////////////////////////////////////////////////////
+void CKvsBlobCache::Erase( const std::string& key, int64_t from_chunk )
+{
+	std::lock_guard<std::mutex> guard(m_mutex);
+
+	std::map<CChunkId, std::list<CEntry>::iterator>::iterator it = m_index.lower_bound( CChunkId( key, from_chunk ) );
+	while (it != m_index.end() && it->first.first == key)
+	{
+		m_size -= it->second->m_data.size();
+		m_lru.erase( it->second );
+		it = m_index.erase( it );
+	}
+}
+
+
+///////////////////////////////////////////////////////////////////////////////////
+CKvsBlobWriter::CKvsBlobWriter( CKeyValueStore* p_store, const std::string& key )
+{
+	mp_store = p_store;
+	m_key = key;
+	m_gen = 0;
+	m_chunk = 0;
+	m_size = 0;
+	m_open = true;
+	m_ok = true;
+	m_buffer.reserve( KVS_BLOB_CHUNK_SIZE );
+}
+
+///////////////////////////////////////////////////////////////////////////////////
+CKvsBlobWriter::~CKvsBlobWriter()
+{
+	Close();
+}
+
+///////////////////////////////////////////////////////////////////////////////////
+uint64_t CKvsBlobWriter::Size( void )
+{
+	return m_size;
+}
+
+///////////////////////////////////////////////////////////////////////////////////
+std::string CKvsBlobWriter::GetErrorMsg( void )
+{
+	return m_emsg;
+}
+
+///////////////////////////////////////////////////////////////////////////////////
+// a fresh blob is written as the next generation, the old one left whole until Close();
+// an appended one takes up its last chunk again if that was not full. Either drops the
+// chunks of generations past the live one, which a writer that never closed left
+bool CKvsBlobWriter::Begin( bool append )
+{
+	int64_t  gen = 0;
+	int64_t  chunks = 0;
+	uint64_t size = 0;
+
+	if (!mp_store->BlobChunks( m_key, gen, chunks, size ))
+	{
+		m_emsg = mp_store->m_emsg;
+		return false;
+	}
+
+	{
+		std::lock_guard<std::mutex> dbLock(mp_store->m_dbMutex);
+
+		if (!kvs_blob_exec( mp_store->mp_db, "DELETE FROM keyValueBlobs WHERE key = ?1 AND chunk >= ?2;",
+		                    m_key, kvs_blob_row( gen + 1, 0 ), 0, "CKvsBlobWriter()", m_emsg ))
+			return false;
+
+		// a blob from before the heads table is given one, so what is appended stays
+		// unseen until Close() records the new size:
+		if (append && chunks &&
+		    !kvs_blob_exec( mp_store->mp_db, "INSERT OR IGNORE INTO keyValueBlobHeads (key, gen, size) VALUES (?1, ?2, ?3);",
+		                    m_key, gen, (int64_t)size, "CKvsBlobWriter()", m_emsg ))
+			return false;
+	}
+
+	if (!append || chunks == 0)
+	{
+		gen++;
+		chunks = 0;
+		size = 0;
+	}
+
+	m_gen = gen;
+	m_size = size;
+	m_chunk = chunks;
+	if (size < (uint64_t)chunks * KVS_BLOB_CHUNK_SIZE)
+	{
+		CKvsBlobReader reader( mp_store, m_key, gen, size );
+		m_chunk = chunks - 1;
+		if (!reader.Load( m_chunk ))
+		{
+			m_emsg = reader.GetErrorMsg();
+			return false;
+		}
+		m_buffer.swap( reader.m_buffer );
+	}
+	return true;
+}
+
+///////////////////////////////////////////////////////////////////////////////////
+bool CKvsBlobWriter::Write( const uint8_t* data, uint32_t byte_size )
+{
+	if (!m_open || !m_ok)
+		return false;
+
+	while (byte_size)
+	{
+		uint32_t n = KVS_BLOB_CHUNK_SIZE - (uint32_t)m_buffer.size();
+		if (n > byte_size)
+			n = byte_size;
+
+		m_buffer.append( (const char*)data, n );
+		data += n;
+		byte_size -= n;
+		m_size += n;
+
+		if (m_buffer.size() == KVS_BLOB_CHUNK_SIZE)
+		{
+			if (!Flush())
+				return false;
+			m_buffer.clear();
+			m_chunk++;
+		}
+	}
+	return true;
+}
+
+///////////////////////////////////////////////////////////////////////////////////
+bool CKvsBlobWriter::Close( void )
+{
+	if (!m_open)
+		return m_ok;
+	m_open = false;
+
+	// an empty blob is still one, as a single empty chunk:
+	if (m_ok && (!m_buffer.empty() || m_size == 0))
+		Flush();
+	if (m_ok)
+		Commit();
+
+	std::string().swap( m_buffer );
+	return m_ok;
+}
+
+///////////////////////////////////////////////////////////////////////////////////
+// the head names the written generation at its size, and the older generations' chunks
+// go, in one transaction
+bool CKvsBlobWriter::Commit( void )
+{
+	sqlite3* db = mp_store->mp_db;
+	{
+		std::lock_guard<std::mutex> dbLock(mp_store->m_dbMutex);
+
+		m_ok = sqlite3_exec(db, "BEGIN IMMEDIATE TRANSACTION", NULL, NULL, NULL) == SQLITE_OK;
+		if (!m_ok)
+		{
+			m_emsg = std::string("CKvsBlobWriter() ") + std::string(sqlite3_errmsg(db));
+			return false;
+		}
+
+		m_ok = kvs_blob_exec( db, "REPLACE INTO keyValueBlobHeads (key, gen, size) VALUES (?1, ?2, ?3);",
+		                      m_key, m_gen, (int64_t)m_size, "CKvsBlobWriter()", m_emsg ) &&
+		       kvs_blob_exec( db, "DELETE FROM keyValueBlobs WHERE key = ?1 AND chunk < ?2;",
+		                      m_key, kvs_blob_row( m_gen, 0 ), 0, "CKvsBlobWriter()", m_emsg );
+		if (m_ok && sqlite3_exec(db, "END TRANSACTION", NULL, NULL, NULL) != SQLITE_OK)
+		{
+			m_emsg = std::string("CKvsBlobWriter() ") + std::string(sqlite3_errmsg(db));
+			m_ok = false;
+		}
+		if (!m_ok)
+			sqlite3_exec(db, "ROLLBACK TRANSACTION", NULL, NULL, NULL);
+	}
+
+	// the old generation's chunks may be cached:
+	mp_store->m_blobCache.Erase( m_key, 0 );
+	return m_ok;
+}
+
+///////////////////////////////////////////////////////////////////////////////////
+// the chunk row is made at its final size, then filled through an incremental blob handle
+bool CKvsBlobWriter::Flush( void )
+{
+	sqlite3*    db = mp_store->mp_db;
+	std::string sealed;
+	const char* data = m_buffer.data();
+	uint32_t    size = (uint32_t)m_buffer.size();
+	int64_t     row = kvs_blob_row( m_gen, m_chunk );
+
+	if (mp_store->mp_cipher)
+	{
+		if (!mp_store->mp_cipher->Seal( kvs_blob_aad( m_key, row ), (const uint8_t*)data, size, sealed ))
+		{
+			m_emsg = "CKvsBlobWriter() unable to encrypt chunk " + std::to_string( m_chunk );
+			m_ok = false;
+			return false;
+		}
+		data = sealed.data();
+		size = (uint32_t)sealed.size();
+	}
+
+	std::lock_guard<std::mutex> dbLock(mp_store->m_dbMutex);
+
+	sqlite3_stmt* statement;
+	sqlite3_blob* blob = NULL;
+
+	m_ok = sqlite3_prepare_v2(db, "REPLACE INTO keyValueBlobs (key, chunk, data) VALUES (?1, ?2, zeroblob(?3));", -1, &statement, NULL) == SQLITE_OK;
+	if (m_ok)
+	{
+		sqlite3_exec(db, "BEGIN TRANSACTION", NULL, NULL, NULL);
+
+		sqlite3_bind_text(statement, 1, m_key.c_str(), (int)m_key.size(), SQLITE_STATIC);
+		sqlite3_bind_int64(statement, 2, row);
+		sqlite3_bind_int(statement, 3, (int)size);
+		m_ok = sqlite3_step(statement) == SQLITE_DONE &&
+		       sqlite3_blob_open(db, "main", "keyValueBlobs", "data", sqlite3_last_insert_rowid(db), 1, &blob) == SQLITE_OK &&
+		       sqlite3_blob_write(blob, data, (int)size, 0) == SQLITE_OK;
+		sqlite3_blob_close(blob);
+
+		if (m_ok)
+			m_ok = sqlite3_exec(db, "END TRANSACTION", NULL, NULL, NULL) == SQLITE_OK;
+		if (!m_ok)
+		{
+			m_emsg = std::string("CKvsBlobWriter() ") + std::string(sqlite3_errmsg(db));
+			sqlite3_exec(db, "ROLLBACK TRANSACTION", NULL, NULL, NULL);
+		}
+	}
+	else
+	{
+		m_emsg = std::string("CKvsBlobWriter() Prepare Error: ") + std::string(sqlite3_errmsg(db));
+	}
+	sqlite3_finalize(statement);
+
+	mp_store->m_blobCache.Erase( m_key, row );
+	if (m_ok)
+		mp_store->m_stats.Add( KVS_STAT_BYTES_PERSISTED, m_key.size() + size );
+
+	return m_ok;
+}
+
+
+///////////////////////////////////////////////////////////////////////////////////
+CKvsBlobReader::CKvsBlobReader( CKeyValueStore* p_store, const std::string& key, int64_t gen, uint64_t size )
+{
+	mp_store = p_store;
+	m_key = key;
+	m_gen = gen;
+	m_size = size;
+	m_offset = 0;
+	m_chunk = -1;
+	mp_openCtx = (p_store->mp_cipher) ? p_store->mp_cipher->NewOpenContext() : NULL;
+}
+
+///////////////////////////////////////////////////////////////////////////////////
+CKvsBlobReader::~CKvsBlobReader()
+{
+	CKvsCipher::FreeContext( mp_openCtx );
+}
+
+///////////////////////////////////////////////////////////////////////////////////
+uint64_t CKvsBlobReader::Size( void )
+{
+	return m_size;
+}
+
+///////////////////////////////////////////////////////////////////////////////////
+uint64_t CKvsBlobReader::Tell( void )
+{
+	return m_offset;
+}
+
+///////////////////////////////////////////////////////////////////////////////////
+std::string CKvsBlobReader::GetErrorMsg( void )
+{
+	return m_emsg;
+}
+
+///////////////////////////////////////////////////////////////////////////////////
+bool CKvsBlobReader::Seek( uint64_t offset )
+{
+	if (offset > m_size)
+		return false;
+
+	m_offset = offset;
+	return true;
+}
+
+///////////////////////////////////////////////////////////////////////////////////
+uint32_t CKvsBlobReader::Read( uint8_t* dest, uint32_t byte_size )
+{
+	uint32_t done = 0;
+
+	while (done < byte_size && m_offset < m_size)
+	{
+		int64_t  chunk = (int64_t)(m_offset / KVS_BLOB_CHUNK_SIZE);
+		uint32_t at = (uint32_t)(m_offset % KVS_BLOB_CHUNK_SIZE);
+
+		if (chunk != m_chunk && !Load( chunk ))
+			break;
+		if (at >= m_buffer.size())
+		{
+			m_emsg = "CKvsBlobReader() chunk " + std::to_string( chunk ) + " is short";
+			break;
+		}
+
+		uint32_t n = (uint32_t)m_buffer.size() - at;
+		if (n > byte_size - done)
+			n = byte_size - done;
+
+		memcpy( dest + done, m_buffer.data() + at, n );
+		done += n;
+		m_offset += n;
+	}
+	return done;
+}
+
+///////////////////////////////////////////////////////////////////////////////////
+// the chunk into m_buffer, from the cache if it is there; the db is only held while
+// the chunk is read out through its blob handle
+bool CKvsBlobReader::Load( int64_t chunk )
+{
+	int64_t row = kvs_blob_row( m_gen, chunk );
+
+	m_chunk = -1;
+	if (mp_store->m_blobCache.Get( m_key, row, m_buffer ))
+	{
+		m_chunk = chunk;
+		return true;
+	}
+
+	sqlite3*    db = mp_store->mp_db;
+	std::string& stored = (mp_store->mp_cipher) ? m_raw : m_buffer;
+	bool        ok;
+	{
+		std::lock_guard<std::mutex> dbLock(mp_store->m_dbMutex);
+
+		sqlite3_stmt* statement;
+		sqlite3_blob* blob = NULL;
+
+		ok = sqlite3_prepare_v2(db, "SELECT rowid FROM keyValueBlobs WHERE key = ?1 AND chunk = ?2;", -1, &statement, NULL) == SQLITE_OK;
+		if (ok)
+		{
+			sqlite3_bind_text(statement, 1, m_key.c_str(), (int)m_key.size(), SQLITE_STATIC);
+			sqlite3_bind_int64(statement, 2, row);
+			ok = sqlite3_step(statement) == SQLITE_ROW &&
+			     sqlite3_blob_open(db, "main", "keyValueBlobs", "data", sqlite3_column_int64(statement, 0), 0, &blob) == SQLITE_OK;
+			if (ok)
+			{
+				stored.resize( sqlite3_blob_bytes(blob) );
+				ok = stored.empty() || sqlite3_blob_read(blob, &stored[0], (int)stored.size(), 0) == SQLITE_OK;
+			}
+			sqlite3_blob_close(blob);
+		}
+		if (!ok)
+			m_emsg = "CKvsBlobReader() chunk " + std::to_string( chunk ) + ": " + std::string(sqlite3_errmsg(db));
+		sqlite3_finalize(statement);
+	}
+	if (!ok)
+		return false;
+
+	if (mp_store->mp_cipher &&
+	    !mp_store->mp_cipher->Open( kvs_blob_aad( m_key, row ), (const uint8_t*)m_raw.data(), (uint32_t)m_raw.size(), m_buffer, mp_openCtx ))
+	{
+		m_emsg = "CKvsBlobReader() chunk " + std::to_string( chunk ) + " would not decrypt";
+		return false;
+	}
+
+	mp_store->m_blobCache.Put( m_key, row, m_buffer );
+	m_chunk = chunk;
+	return true;
+}
+
+
+///////////////////////////////////////////////////////////////////////////////////
+CKvsBlobWriter* CKeyValueStore::OpenBlobWriter( std::string& key, bool append )
+{
+	LazyInit(); // even if LazyInit fails, we continue...
+
+	if (RejectFrozen( "OpenBlobWriter()" ))
+		return NULL;
+
+	if (!mp_db)
+	{
+		m_emsg = "OpenBlobWriter() mp_db=0";
+		return NULL;
+	}
+
+	CKvsBlobWriter* p_writer = new CKvsBlobWriter( this, key );
+	if (!p_writer->Begin( append ))
+	{
+		m_emsg = p_writer->GetErrorMsg();
+		p_writer->m_open = false;
+		delete p_writer;
+		return NULL;
+	}
+	return p_writer;
+}
+
+///////////////////////////////////////////////////////////////////////////////////
+CKvsBlobReader* CKeyValueStore::OpenBlobReader( std::string& key )
+{
+	LazyInit(); // even if LazyInit fails, we continue...
+
+	int64_t  gen, chunks;
+	uint64_t size;
+	if (!mp_db || !BlobChunks( key, gen, chunks, size ) || chunks == 0)
+		return NULL;
+
+	return new CKvsBlobReader( this, key, gen, size );
+}
+
+///////////////////////////////////////////////////////////////////////////////////
+int64_t CKeyValueStore::BlobSize( std::string& key )
+{
+	LazyInit(); // even if LazyInit fails, we continue...
+
+	int64_t  gen, chunks;
+	uint64_t size;
+	if (!mp_db || !BlobChunks( key, gen, chunks, size ) || chunks == 0)
+		return -1;
+
+	return (int64_t)size;
+}
+
+///////////////////////////////////////////////////////////////////////////////////
+// from the blob's head; a blob with none is of generation 0, as many chunks as it has
+bool CKeyValueStore::BlobChunks( const std::string& key, int64_t& gen, int64_t& chunks, uint64_t& size )
+{
+	std::lock_guard<std::mutex> dbLock(m_dbMutex);
+
+	sqlite3_stmt* statement;
+	if (sqlite3_prepare_v2(mp_db, "SELECT gen, size FROM keyValueBlobHeads WHERE key = ?1;", -1, &statement, NULL) != SQLITE_OK)
+	{
+		m_emsg = std::string("BlobChunks() Prepare Error: ") + std::string(sqlite3_errmsg(mp_db));
+		return false;
+	}
+
+	sqlite3_bind_text(statement, 1, key.c_str(), (int)key.size(), SQLITE_STATIC);
+	int32_t rc = sqlite3_step(statement);
+	if (rc == SQLITE_ROW)
+	{
+		gen = sqlite3_column_int64(statement, 0);
+		size = (uint64_t)sqlite3_column_int64(statement, 1);
+		// an empty blob is a single empty chunk:
+		chunks = (size) ? (int64_t)((size + KVS_BLOB_CHUNK_SIZE - 1) / KVS_BLOB_CHUNK_SIZE) : 1;
+	}
+	sqlite3_finalize(statement);
+	if (rc == SQLITE_ROW)
+		return true;
+	if (rc != SQLITE_DONE)
+	{
+		m_emsg = std::string("BlobChunks() ") + std::string(sqlite3_errmsg(mp_db));
+		return false;
+	}
+
+	gen = 0;
+	if (sqlite3_prepare_v2(mp_db, "SELECT COUNT(*), TOTAL(length(data)) FROM keyValueBlobs WHERE key = ?1 AND chunk < ?2;", -1, &statement, NULL) != SQLITE_OK)
+	{
+		m_emsg = std::string("BlobChunks() Prepare Error: ") + std::string(sqlite3_errmsg(mp_db));
+		return false;
+	}
+
+	sqlite3_bind_text(statement, 1, key.c_str(), (int)key.size(), SQLITE_STATIC);
+	sqlite3_bind_int64(statement, 2, kvs_blob_row( 1, 0 ));
+	bool ok = sqlite3_step(statement) == SQLITE_ROW;
+	if (ok)
+	{
+		chunks = sqlite3_column_int64(statement, 0);
+		size = (uint64_t)sqlite3_column_double(statement, 1);
+		// each sealed chunk carries its nonce and tag:
+		if (mp_cipher)
+			size -= (uint64_t)chunks * (KVS_CIPHER_NONCE_SIZE + KVS_CIPHER_TAG_SIZE);
+	}
+	else
+	{
+		m_emsg = std::string("BlobChunks() ") + std::string(sqlite3_errmsg(mp_db));
+	}
+	sqlite3_finalize(statement);
+
+	return ok;
+}
+
+///////////////////////////////////////////////////////////////////////////////////
+bool CKeyValueStore::DeleteBlob( std::string& key )
+{
+	LazyInit(); // even if LazyInit fails, we continue...
+
+	if (RejectFrozen( "DeleteBlob()" ))
+		return false;
+
+	if (!mp_db)
+	{
+		m_emsg = "DeleteBlob() mp_db=0";
+		return false;
+	}
+
+	std::lock_guard<std::mutex> dbLock(m_dbMutex);
+
+	// the head and every generation's chunks, together:
+	bool ok = sqlite3_exec(mp_db, "BEGIN IMMEDIATE TRANSACTION", NULL, NULL, NULL) == SQLITE_OK;
+	if (!ok)
+	{
+		m_emsg = std::string("DeleteBlob() ") + std::string(sqlite3_errmsg(mp_db));
+		return false;
+	}
+
+	ok = kvs_blob_exec( mp_db, "DELETE FROM keyValueBlobHeads WHERE key = ?1;", key, 0, 0, "DeleteBlob()", m_emsg ) &&
+	     kvs_blob_exec( mp_db, "DELETE FROM keyValueBlobs WHERE key = ?1;", key, 0, 0, "DeleteBlob()", m_emsg );
+	if (ok && sqlite3_exec(mp_db, "END TRANSACTION", NULL, NULL, NULL) != SQLITE_OK)
+	{
+		m_emsg = std::string("DeleteBlob() ") + std::string(sqlite3_errmsg(mp_db));
+		ok = false;
+	}
+	if (!ok)
+		sqlite3_exec(mp_db, "ROLLBACK TRANSACTION", NULL, NULL, NULL);
+
+	m_blobCache.Erase( key, 0 );
+
+	return ok;
+}
+
+///////////////////////////////////////////////////////////////////////////////////
+void CKeyValueStore::SetBlobCacheSize( uint64_t byte_size )
+{
+	m_blobCache.SetCapacity( byte_size );
+}
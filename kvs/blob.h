@@ -0,0 +1,144 @@
+/////////////////////////////////////////////////////////////////////////////
+// Name:        blob.h
+// Purpose:     large binary values streamed to and from a CKeyValueStore's
+//							db in chunks, from OpenBlobWriter() and OpenBlobReader().
+//
+//							A blob is kept apart from the other values, in the db's
+//							keyValueBlobs table as one row per KVS_BLOB_CHUNK_SIZE bytes,
+//							every chunk but the last full. Nothing of it lives in RAM
+//							beyond a chunk buffer per reader or writer, and syncs never
+//							rewrite it. Chunks are written and read through sqlite's
+//							incremental blob I/O; with an encryption key each chunk is
+//							sealed on its own, bound to its key and position.
+//
+//							A writer's chunks are committed as each fills, but under a
+//							generation of their own, numbered into the high bits of the
+//							chunk column: keyValueBlobHeads names each blob's live
+//							generation and its size, and only Close() moves it to the
+//							new one and drops the old chunks, in one transaction. Until
+//							then readers see the blob as it was, and a crash or failed
+//							write leaves it so; the chunks left behind are dropped by
+//							the key's next writer. An appending writer adds to the live
+//							generation, readers seeing no more than its recorded size.
+//							Blobs written before the heads table, with no head, are of
+//							generation 0 and sized by their chunks. One writer per key
+//							at a time.
+//
+//							Chunks read can optionally be kept in a LRU cache of bounded
+//							size, see CKeyValueStore::SetBlobCacheSize().
+/////////////////////////////////////////////////////////////////////////////
+
+#ifndef _KVS_BLOB_H_
+#define _KVS_BLOB_H_
+
+#include <cstdint>
+#include <string>
+#include <list>
+#include <map>
+#include <mutex>
+#include "cipher.h"
+#include "sqlite3.h"
+
+#define KVS_BLOB_CHUNK_SIZE  (256 * 1024)   // bytes per chunk row; part of the stored format
+#define KVS_BLOB_GEN_SHIFT   (32)           // a chunk row's number is its generation << this | its index
+
+class CKeyValueStore;
+
+// decoded chunks, least recently used evicted first once over capacity:
+class CKvsBlobCache
+{
+public:
+	CKvsBlobCache();
+
+	void     SetCapacity( uint64_t byte_size );
+	bool     Get( const std::string& key, int64_t chunk, std::string& data );
+	void     Put( const std::string& key, int64_t chunk, const std::string& data );
+	void     Erase( const std::string& key, int64_t from_chunk );    // chunks from_chunk on
+
+private:
+	typedef std::pair<std::string, int64_t> CChunkId;
+	struct CEntry
+	{
+		CChunkId    m_id;
+		std::string m_data;
+	};
+
+	void     Evict( void );
+
+	std::mutex                                          m_mutex;
+	uint64_t                                            m_capacity;
+	uint64_t                                            m_size;
+	std::list<CEntry>                                   m_lru;      // most recent first
+	std::map<CChunkId, std::list<CEntry>::iterator>     m_index;
+};
+
+class CKvsBlobWriter
+{
+public:
+	~CKvsBlobWriter();		// closes, if Close() was not called
+
+	// appends bytes to the blob, a chunk reaching the db each time the buffer fills:
+	bool        Write( const uint8_t* data, uint32_t byte_size );
+	// flushes the last chunk; false if it or any earlier one failed:
+	bool        Close( void );
+
+	uint64_t    Size( void );
+	std::string GetErrorMsg( void );
+
+private:
+	friend class CKeyValueStore;
+	CKvsBlobWriter( CKeyValueStore* p_store, const std::string& key );
+	CKvsBlobWriter( const CKvsBlobWriter& );
+	CKvsBlobWriter& operator=( const CKvsBlobWriter& );
+
+	bool        Begin( bool append );
+	bool        Flush( void );
+	bool        Commit( void );     // makes the written generation and size the blob's
+
+	CKeyValueStore* mp_store;
+	std::string     m_key;
+	std::string     m_buffer;       // the chunk being filled
+	int64_t         m_gen;          // the generation written
+	int64_t         m_chunk;        // its index
+	uint64_t        m_size;
+	bool            m_open;
+	bool            m_ok;
+	std::string     m_emsg;
+};
+
+class CKvsBlobReader
+{
+public:
+	~CKvsBlobReader();
+
+	// reads up to byte_size bytes from the current position, returning how many; 0 at
+	// the end of the blob, or upon an error, when GetErrorMsg() is not empty:
+	uint32_t    Read( uint8_t* dest, uint32_t byte_size );
+	bool        Seek( uint64_t offset );
+	uint64_t    Tell( void );
+	uint64_t    Size( void );
+
+	std::string GetErrorMsg( void );
+
+private:
+	friend class CKeyValueStore;
+	friend class CKvsBlobWriter;		// which reads back a last chunk to append to it
+	CKvsBlobReader( CKeyValueStore* p_store, const std::string& key, int64_t gen, uint64_t size );
+	CKvsBlobReader( const CKvsBlobReader& );
+	CKvsBlobReader& operator=( const CKvsBlobReader& );
+
+	bool        Load( int64_t chunk );
+
+	CKeyValueStore* mp_store;
+	std::string     m_key;
+	int64_t         m_gen;          // the generation read
+	uint64_t        m_size;
+	uint64_t        m_offset;
+	std::string     m_buffer;       // the decoded chunk m_chunk
+	std::string     m_raw;          // a chunk as stored, when it has to be opened
+	int64_t         m_chunk;        // -1 when m_buffer holds none
+	EVP_CIPHER_CTX* mp_openCtx;     // the reader's own, when values are encrypted
+	std::string     m_emsg;
+};
+
+#endif // _KVS_BLOB_H_
@@ -0,0 +1,655 @@
+////////////////////////////////////////////////////////////////////////////
+// Name:        bulk.cpp
+// Purpose:     bulk import and export of a CKeyValueStore
+/////////////////////////////////////////////////////////////////////////////
+
+#include "kvs.h"
+#include <algorithm>
+#include <tuple>
+
+///////////////////////////////////////////////////////////////////////////////////
+static void kvs_put_u32( std::ostream& out, uint32_t v )
+{
+	char b[4] = { (char)v, (char)(v >> 8), (char)(v >> 16), (char)(v >> 24) };
+	out.write( b, 4 );
+}
+
+///////////////////////////////////////////////////////////////////////////////////
+static void kvs_put_i64( std::ostream& out, int64_t v )
+{
+	kvs_put_u32( out, (uint32_t)(uint64_t)v );
+	kvs_put_u32( out, (uint32_t)((uint64_t)v >> 32) );
+}
+
+///////////////////////////////////////////////////////////////////////////////////
+// false at the end of the stream, with eof set when it ended cleanly before any byte:
+static bool kvs_get_u32( std::istream& in, uint32_t& v, bool& eof )
+{
+	unsigned char b[4];
+	in.read( (char*)b, 4 );
+	eof = (in.gcount() == 0);
+	if (in.gcount() != 4)
+		return false;
+
+	v = (uint32_t)b[0] | ((uint32_t)b[1] << 8) | ((uint32_t)b[2] << 16) | ((uint32_t)b[3] << 24);
+	return true;
+}
+
+///////////////////////////////////////////////////////////////////////////////////
+static bool kvs_get_bytes( std::istream& in, std::string& s )
+{
+	uint32_t size;
+	bool     eof;
+	if (!kvs_get_u32( in, size, eof ) || size > KVS_BULK_MAX_FIELD)
+		return false;
+
+	s.resize( size );
+	if (size)
+		in.read( &s[0], size );
+	return (uint32_t)in.gcount() == size;
+}
+
+///////////////////////////////////////////////////////////////////////////////////
+static bool kvs_parse_binary( std::istream& in, std::deque<CKeyValue>& rows, std::string& emsg )
+{
+	char magic[4];
+	in.read( magic, 4 );
+	if (in.gcount() != 4 || memcmp( magic, KVS_BULK_MAGIC, 4 ) != 0)
+	{
+		emsg = "BulkLoad() not a " KVS_BULK_MAGIC " stream";
+		return false;
+	}
+
+	std::string key;
+	for (;;)
+	{
+		uint32_t size, lo, hi;
+		bool     eof;
+		if (!kvs_get_u32( in, size, eof ))
+		{
+			if (eof)
+				return true;
+			break;
+		}
+		if (size > KVS_BULK_MAX_FIELD)
+			break;
+
+		key.resize( size );
+		if (size)
+			in.read( &key[0], size );
+		if ((uint32_t)in.gcount() != size)
+			break;
+
+		rows.emplace_back( "", "" );
+		CKeyValue& kv = rows.back();
+		kv.m_key.swap( key );		// by size; BulkLoad() rejects a key holding a NUL
+		if (!kvs_get_bytes( in, kv.m_value ) || !kvs_get_u32( in, lo, eof ) || !kvs_get_u32( in, hi, eof ))
+			break;
+		kv.m_expires = (int64_t)((uint64_t)lo | ((uint64_t)hi << 32));
+	}
+
+	emsg = "BulkLoad() truncated or corrupt record " + std::to_string( rows.size() );
+	return false;
+}
+
+///////////////////////////////////////////////////////////////////////////////////
+static void kvs_json_ws( const std::string& s, size_t& i )
+{
+	while (i < s.size() && (s[i] == ' ' || s[i] == '\t' || s[i] == '\r' || s[i] == '\n'))
+		i++;
+}
+
+///////////////////////////////////////////////////////////////////////////////////
+static void kvs_utf8( std::string& out, uint32_t cp )
+{
+	if (cp < 0x80)
+	{
+		out += (char)cp;
+	}
+	else if (cp < 0x800)
+	{
+		out += (char)(0xc0 | (cp >> 6));
+		out += (char)(0x80 | (cp & 0x3f));
+	}
+	else if (cp < 0x10000)
+	{
+		out += (char)(0xe0 | (cp >> 12));
+		out += (char)(0x80 | ((cp >> 6) & 0x3f));
+		out += (char)(0x80 | (cp & 0x3f));
+	}
+	else
+	{
+		out += (char)(0xf0 | (cp >> 18));
+		out += (char)(0x80 | ((cp >> 12) & 0x3f));
+		out += (char)(0x80 | ((cp >> 6) & 0x3f));
+		out += (char)(0x80 | (cp & 0x3f));
+	}
+}
+
+///////////////////////////////////////////////////////////////////////////////////
+static bool kvs_json_hex4( const std::string& s, size_t& i, uint32_t& cp )
+{
+	if (i + 4 > s.size())
+		return false;
+
+	cp = 0;
+	for (int32_t n = 0; n < 4; n++)
+	{
+		char c = s[i++];
+		cp <<= 4;
+		if      (c >= '0' && c <= '9') cp |= (uint32_t)(c - '0');
+		else if (c >= 'a' && c <= 'f') cp |= (uint32_t)(c - 'a' + 10);
+		else if (c >= 'A' && c <= 'F') cp |= (uint32_t)(c - 'A' + 10);
+		else return false;
+	}
+	return true;
+}
+
+///////////////////////////////////////////////////////////////////////////////////
+// a JSON string starting at s[i], its opening quote; i ends past the closing one:
+static bool kvs_json_string( const std::string& s, size_t& i, std::string& out )
+{
+	if (i >= s.size() || s[i] != '"')
+		return false;
+	i++;
+
+	out.clear();
+	while (i < s.size())
+	{
+		char c = s[i++];
+		if (c == '"')
+			return true;
+		if (c != '\\')
+		{
+			out += c;
+			continue;
+		}
+		if (i >= s.size())
+			return false;
+
+		uint32_t cp;
+		switch (s[i++])
+		{
+			case '"':  out += '"';  break;
+			case '\\': out += '\\'; break;
+			case '/':  out += '/';  break;
+			case 'b':  out += '\b'; break;
+			case 'f':  out += '\f'; break;
+			case 'n':  out += '\n'; break;
+			case 'r':  out += '\r'; break;
+			case 't':  out += '\t'; break;
+			case 'u':
+				if (!kvs_json_hex4( s, i, cp ))
+					return false;
+				// a surrogate pair spells one code point beyond the BMP:
+				if (cp >= 0xd800 && cp < 0xdc00)
+				{
+					uint32_t lo;
+					if (i + 2 > s.size() || s[i] != '\\' || s[i + 1] != 'u')
+						return false;
+					i += 2;
+					if (!kvs_json_hex4( s, i, lo ) || lo < 0xdc00 || lo >= 0xe000)
+						return false;
+					cp = 0x10000 + ((cp - 0xd800) << 10) + (lo - 0xdc00);
+				}
+				kvs_utf8( out, cp );
+				break;
+			default:
+				return false;
+		}
+	}
+	return false;
+}
+
+///////////////////////////////////////////////////////////////////////////////////
+static bool kvs_json_int( const std::string& s, size_t& i, int64_t& v )
+{
+	size_t start = i;
+	if (i < s.size() && s[i] == '-')
+		i++;
+	while (i < s.size() && s[i] >= '0' && s[i] <= '9')
+		i++;
+	if (i == start || (i == start + 1 && s[start] == '-'))
+		return false;
+
+	v = strtoll( s.c_str() + start, NULL, 10 );
+	return true;
+}
+
+///////////////////////////////////////////////////////////////////////////////////
+// one {"key":..,"value":..,"expires":..} object; other members must be strings or integers:
+static bool kvs_json_row( const std::string& line, CKeyValue& kv, std::string& emsg )
+{
+	size_t      i = 0;
+	bool        hasKey = false, hasValue = false;
+	std::string name, text;
+	int64_t     number;
+
+	kvs_json_ws( line, i );
+	if (i >= line.size() || line[i++] != '{')
+	{
+		emsg = "expected an object";
+		return false;
+	}
+
+	kvs_json_ws( line, i );
+	if (i < line.size() && line[i] == '}')
+		i++;
+	else for (;;)
+	{
+		kvs_json_ws( line, i );
+		if (!kvs_json_string( line, i, name ))
+		{
+			emsg = "expected a member name";
+			return false;
+		}
+		kvs_json_ws( line, i );
+		if (i >= line.size() || line[i++] != ':')
+		{
+			emsg = "expected ':'";
+			return false;
+		}
+		kvs_json_ws( line, i );
+
+		if (i < line.size() && line[i] == '"')
+		{
+			if (!kvs_json_string( line, i, text ))
+			{
+				emsg = "bad string";
+				return false;
+			}
+			if (name == "key")
+			{
+				kv.m_key.swap( text );
+				hasKey = true;
+			}
+			else if (name == "value")
+			{
+				kv.m_value.swap( text );
+				hasValue = true;
+			}
+		}
+		else if (kvs_json_int( line, i, number ))
+		{
+			if (name == "expires")
+				kv.m_expires = number;
+		}
+		else
+		{
+			emsg = "unsupported value for \"" + name + "\"";
+			return false;
+		}
+
+		kvs_json_ws( line, i );
+		if (i < line.size() && line[i] == ',')
+		{
+			i++;
+			continue;
+		}
+		if (i < line.size() && line[i] == '}')
+		{
+			i++;
+			break;
+		}
+		emsg = "expected ',' or '}'";
+		return false;
+	}
+
+	kvs_json_ws( line, i );
+	if (i != line.size())
+	{
+		emsg = "trailing characters";
+		return false;
+	}
+	if (!hasKey || !hasValue)
+	{
+		emsg = "\"key\" and \"value\" are required";
+		return false;
+	}
+	return true;
+}
+
+///////////////////////////////////////////////////////////////////////////////////
+static bool kvs_parse_jsonl( std::istream& in, std::deque<CKeyValue>& rows, std::string& emsg )
+{
+	std::string line;
+	uint64_t    number = 0;
+
+	while (std::getline( in, line ))
+	{
+		number++;
+
+		size_t i = 0;
+		kvs_json_ws( line, i );
+		if (i == line.size())
+			continue;
+
+		rows.emplace_back( "", "" );
+		if (!kvs_json_row( line, rows.back(), emsg ))
+		{
+			emsg = "BulkLoad() line " + std::to_string( number ) + ": " + emsg;
+			return false;
+		}
+	}
+
+	if (in.bad())
+	{
+		emsg = "BulkLoad() stream read failed";
+		return false;
+	}
+	return true;
+}
+
+///////////////////////////////////////////////////////////////////////////////////
+static void kvs_json_escaped( std::string& out, const std::string& s )
+{
+	static const char hex[] = "0123456789abcdef";
+
+	out += '"';
+	for (size_t i = 0; i < s.size(); i++)
+	{
+		unsigned char c = (unsigned char)s[i];
+		switch (c)
+		{
+			case '"':  out += "\\\""; break;
+			case '\\': out += "\\\\"; break;
+			case '\n': out += "\\n";  break;
+			case '\r': out += "\\r";  break;
+			case '\t': out += "\\t";  break;
+			default:
+				if (c < 0x20)
+				{
+					out += "\\u00";
+					out += hex[c >> 4];
+					out += hex[c & 0xf];
+				}
+				else
+				{
+					out += (char)c;
+				}
+				break;
+		}
+	}
+	out += '"';
+}
+
+///////////////////////////////////////////////////////////////////////////////////
+// sorts by key, keeping rows of the same key in stream order: each thread stable sorts
+// its own run, then neighbouring runs are merged in parallel until one is left
+static void kvs_sort_rows( std::vector<CKeyValue*>& order, uint32_t threads )
+{
+	auto less = []( const CKeyValue* a, const CKeyValue* b ) { return a->m_key < b->m_key; };
+
+	if (threads > order.size() / KVS_BULK_MIN_THREAD_ROWS)
+		threads = (uint32_t)(order.size() / KVS_BULK_MIN_THREAD_ROWS);
+	if (threads <= 1)
+	{
+		std::stable_sort( order.begin(), order.end(), less );
+		return;
+	}
+
+	std::vector<size_t> bounds;
+	for (uint32_t t = 0; t <= threads; t++)
+		bounds.push_back( order.size() * t / threads );
+
+	std::vector<std::thread> sorters;
+	for (uint32_t t = 0; t < threads; t++)
+		sorters.emplace_back( [&order, &bounds, &less, t]() { std::stable_sort( order.begin() + bounds[t], order.begin() + bounds[t + 1], less ); } );
+	for (size_t t = 0; t < sorters.size(); t++)
+		sorters[t].join();
+
+	while (bounds.size() > 2)
+	{
+		std::vector<size_t>      next( 1, 0 );
+		std::vector<std::thread> mergers;
+
+		for (size_t i = 0; i + 1 < bounds.size(); i += 2)
+		{
+			if (i + 2 < bounds.size())
+			{
+				size_t lo = bounds[i], mid = bounds[i + 1], hi = bounds[i + 2];
+				mergers.emplace_back( [&order, &less, lo, mid, hi]() { std::inplace_merge( order.begin() + lo, order.begin() + mid, order.begin() + hi, less ); } );
+				next.push_back( hi );
+			}
+			else
+			{
+				next.push_back( bounds[i + 1] );		// an odd run out waits for the next round
+			}
+		}
+		for (size_t t = 0; t < mergers.size(); t++)
+			mergers[t].join();
+
+		bounds.swap( next );
+	}
+}
+
+///////////////////////////////////////////////////////////////////////////////////
+// parse, sort, write the db, then merge into m_pairs; the db goes first so a failed
+// write leaves the store as it was, and both are done under both locks
+int64_t CKeyValueStore::BulkLoad( std::istream& in, int32_t format )
+{
+	LazyInit(); // even if LazyInit fails, we continue...
+
+	if (RejectFrozen( "BulkLoad()" ))
+		return -1;
+
+	std::deque<CKeyValue> rows;		// a deque, so the rows never move as it grows
+	std::string           emsg;
+
+	bool parsed = (format == KVS_BULK_JSONL) ? kvs_parse_jsonl( in, rows, emsg )
+	                                         : kvs_parse_binary( in, rows, emsg );
+	if (!parsed)
+	{
+		m_emsg = emsg;
+		return -1;
+	}
+
+	// keys are C strings everywhere else, so one with a NUL would be cut short there, and
+	// collide with another key:
+	std::vector<CKeyValue*> order;
+	order.reserve( rows.size() );
+	for (size_t i = 0; i < rows.size(); i++)
+	{
+		if (rows[i].m_key.find( '\0' ) != std::string::npos)
+		{
+			m_emsg = "BulkLoad() the key of record " + std::to_string( i ) + " holds a NUL";
+			return -1;
+		}
+		if (!rows[i].Expired())
+			order.push_back( &rows[i] );
+	}
+
+	uint32_t threads = m_loadThreads;
+	if (threads == 0)
+		threads = std::thread::hardware_concurrency();
+	if (threads > KVS_LOAD_MAX_THREADS)
+		threads = KVS_LOAD_MAX_THREADS;
+	kvs_sort_rows( order, threads );
+
+	// a key given more than once keeps its last value, the last of its sorted run:
+	size_t unique = 0;
+	for (size_t i = 0; i < order.size(); i++)
+	{
+		if (i + 1 < order.size() && order[i + 1]->m_key == order[i]->m_key)
+			continue;
+		order[unique++] = order[i];
+	}
+	order.resize( unique );
+
+	// the store is held from the db write through the merge, its lock before the db's as
+	// everywhere, so no write or sync in between leaves RAM and the db apart:
+	CKvsTimedLock guard(m_mutex, m_stats);
+
+	if (mp_db)
+	{
+		// rows arriving in key order extend the primary key's b-tree at its right edge
+		// rather than splitting pages all through it:
+		std::unique_lock<std::mutex> dbLock(m_dbMutex);
+
+		sqlite3_stmt* statement;
+		if (sqlite3_prepare_v2(mp_db, KVS_SQL_REPLACE_ROW, -1, &statement, NULL) != SQLITE_OK)
+		{
+			m_emsg = std::string("BulkLoad() Prepare Error: ") + std::string(sqlite3_errmsg(mp_db));
+			return -1;
+		}
+
+		uint64_t count = 0, bytes = 0;
+		size_t   next = 0;
+
+		sqlite3_exec(mp_db, "BEGIN IMMEDIATE TRANSACTION", NULL, NULL, NULL);
+		bool ok = StepRows( statement, [&]() -> const CKeyValue* { return (next < order.size()) ? order[next++] : NULL; }, count, bytes );
+		if (ok)
+			ok = sqlite3_exec(mp_db, "END TRANSACTION", NULL, NULL, NULL) == SQLITE_OK;
+		if (!ok)
+		{
+			m_emsg = std::string("BulkLoad() ") + std::string(sqlite3_errmsg(mp_db));
+			sqlite3_exec(mp_db, "ROLLBACK TRANSACTION", NULL, NULL, NULL);
+		}
+		sqlite3_finalize(statement);
+
+		if (!ok)
+			return -1;
+
+		m_stats.Add( KVS_STAT_SYNC_ROWS, count );
+		m_stats.Add( KVS_STAT_BYTES_PERSISTED, bytes );
+	}
+
+	// one ordered pass over m_pairs: each row lands just before the hint, so new keys
+	// are inserted in constant time and the whole merge is linear in both sizes:
+	CKvsPairs::iterator hint = m_pairs.end();
+	if (!order.empty())
+		hint = m_pairs.lower_bound( order[0]->m_key );
+
+	for (size_t i = 0; i < order.size(); i++)
+	{
+		CKeyValue& row = *order[i];
+		while (hint != m_pairs.end() && hint->first < row.m_key)
+			++hint;
+
+		bool     found = (hint != m_pairs.end() && hint->first == row.m_key);
+		uint64_t version = NextVersion( row.m_key, found ? hint : m_pairs.end() );
+
+		if (!found)
+		{
+			CKeyValue added( "", "" );
+			added.m_key = row.m_key;
+			hint = kvs_insert_pair( m_pairs, hint, added ).first;
+		}
+
+		CKeyValue& kv = hint->second;
+		kv.SetValue( "" );
+		kv.m_value.swap( row.m_value );
+		kv.m_expires = row.m_expires;
+		kv.m_version = version;
+		// its row was written above, so syncs leave it be, as they do the rows Refresh() applies:
+		if (mp_db)
+			m_refreshedKeys[kv.m_key] = version;
+		if (kv.m_expires)
+			m_wheel.Schedule( kv.m_key, kv.m_expires );
+		if (mp_log)
+			mp_log->Append( KVS_LOG_SET, kv.m_key, kv.m_value, kv.m_expires );
+
+		++hint;
+	}
+
+	m_stats.Add( KVS_STAT_WRITES_STRING, order.size() );
+
+	return (int64_t)order.size();
+}
+
+///////////////////////////////////////////////////////////////////////////////////
+// a batch of rows at a time is copied out under the lock, then decoded and written
+// with the lock released, so memory stays bounded and writers are held up briefly
+int64_t CKeyValueStore::Export( std::ostream& out, int32_t format )
+{
+	LazyInit(); // even if LazyInit fails, we continue...
+
+	if (format != KVS_BULK_JSONL)
+		out.write( KVS_BULK_MAGIC, 4 );
+
+	std::vector<CKeyValue> batch;
+	std::string            last;		// the last key copied out
+	std::string            line;
+	std::string            emsg;
+	int64_t                rows = 0;
+	bool                   started = false;
+	bool                   done = false;
+
+	batch.reserve( KVS_BULK_EXPORT_ROWS );
+
+	while (!done)
+	{
+		batch.clear();
+		{
+			CKvsTimedLock guard(m_mutex, m_stats);
+
+			CKvsPairs::iterator it = started ? m_pairs.upper_bound( last ) : m_pairs.begin();
+			int64_t now = kvs_now_ms();
+			for (; it != m_pairs.end() && batch.size() < KVS_BULK_EXPORT_ROWS; ++it)
+			{
+				const CKeyValue& kv = it->second;
+				last = it->first;
+				if (kv.m_expires && kv.m_expires <= now)
+					continue;
+
+				batch.emplace_back( "", "" );
+				CKeyValue& copy = batch.back();
+				copy.m_key = kv.m_key;
+				copy.m_expires = kv.m_expires;
+				if (kv.mp_counter)
+				{
+					copy.m_value = std::to_string( kv.mp_counter->load() );
+				}
+				else
+				{
+					copy.m_value = kv.m_value;
+					copy.m_codec = kv.m_codec;
+					copy.m_packed = kv.m_packed;
+					if (kv.m_shared)
+						copy.m_shared = kv.m_shared;		// its text is made outside the lock, as it decodes
+				}
+			}
+			done = (it == m_pairs.end());
+			started = true;
+		}
+
+		for (size_t i = 0; i < batch.size(); i++)
+		{
+			CKeyValue& kv = batch[i];
+			if (!DecodeValue( kv, NULL, emsg ))
+			{
+				m_emsg = "Export() " + emsg;
+				return -1;
+			}
+
+			if (format == KVS_BULK_JSONL)
+			{
+				line = "{\"key\":";
+				kvs_json_escaped( line, kv.m_key );
+				line += ",\"value\":";
+				kvs_json_escaped( line, kv.m_value );
+				if (kv.m_expires)
+					line += ",\"expires\":" + std::to_string( kv.m_expires );
+				line += "}\n";
+				out.write( line.data(), (std::streamsize)line.size() );
+			}
+			else
+			{
+				kvs_put_u32( out, (uint32_t)kv.m_key.size() );
+				out.write( kv.m_key.data(), (std::streamsize)kv.m_key.size() );
+				kvs_put_u32( out, (uint32_t)kv.m_value.size() );
+				out.write( kv.m_value.data(), (std::streamsize)kv.m_value.size() );
+				kvs_put_i64( out, kv.m_expires );
+			}
+			rows++;
+		}
+
+		if (!out)
+		{
+			m_emsg = "Export() stream write failed";
+			return -1;
+		}
+	}
+
+	return rows;
+}
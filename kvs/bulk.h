@@ -0,0 +1,34 @@
+/////////////////////////////////////////////////////////////////////////////
+// Name:        bulk.h
+// Purpose:     formats of CKeyValueStore::BulkLoad() and Export().
+//
+//							KVS_BULK_BINARY is the magic "KVS1" followed by one record
+//							per key until the end of the stream:
+//
+//								uint32 key size, key bytes,
+//								uint32 value size, value bytes,
+//								int64  expires
+//
+//							all integers little endian. KVS_BULK_JSONL is one object per
+//							line: {"key":"...","value":"...","expires":0}, expires being
+//							optional. Either way values are in their text form, binary
+//							values base64 as Read/WriteString() see them, and expires is
+//							the kvs_now_ms() time a key expires, 0 for never.
+//
+//							A key appearing more than once takes its last value, and rows
+//							already expired are skipped. A key holding a NUL rejects the
+//							stream.
+/////////////////////////////////////////////////////////////////////////////
+
+#ifndef _KVS_BULK_H_
+#define _KVS_BULK_H_
+
+#define KVS_BULK_BINARY           (0)
+#define KVS_BULK_JSONL            (1)
+
+#define KVS_BULK_MAGIC            "KVS1"
+#define KVS_BULK_MAX_FIELD        (0x40000000)  // bytes; a larger size is taken as a corrupt stream
+#define KVS_BULK_EXPORT_ROWS      (1024)        // rows copied out under one hold of m_mutex
+#define KVS_BULK_MIN_THREAD_ROWS  (65536)       // fewer rows than this per thread sort serially
+
+#endif // _KVS_BULK_H_
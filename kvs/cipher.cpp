@@ -0,0 +1,174 @@
+////////////////////////////////////////////////////////////////////////////
+// Name:        cipher.cpp
+// Purpose:     AES-256-GCM sealing of persisted values
+/////////////////////////////////////////////////////////////////////////////
+
+#include <cstring>
+#include <openssl/evp.h>
+#include <openssl/hmac.h>
+#include <openssl/rand.h>
+#include <openssl/crypto.h>
+#include "cipher.h"
+
+///////////////////////////////////////////////////////////////////////////////////
+CKvsCipher::CKvsCipher( const uint8_t* key, uint32_t key_size )
+{
+	m_valid = false;
+	memset( m_hashKey, 0, sizeof(m_hashKey) );
+	mp_sealCtx = EVP_CIPHER_CTX_new();
+	mp_openCtx = EVP_CIPHER_CTX_new();
+
+	if (!mp_sealCtx || !mp_openCtx || !key || !key_size)
+		return;
+
+	uint8_t aesKey[KVS_CIPHER_KEY_SIZE];
+	if (key_size == KVS_CIPHER_KEY_SIZE)
+	{
+		memcpy( aesKey, key, KVS_CIPHER_KEY_SIZE );
+	}
+	else
+	{
+		unsigned int digest_size = 0;
+		if (!EVP_Digest( key, key_size, aesKey, &digest_size, EVP_sha256(), NULL ) || digest_size != KVS_CIPHER_KEY_SIZE)
+			return;
+	}
+
+	if (RAND_bytes( m_nonce, KVS_CIPHER_NONCE_SIZE ) != 1)
+	{
+		OPENSSL_cleanse( aesKey, sizeof(aesKey) );
+		return;
+	}
+
+	// the expanded key schedule lives in each context from here on, and the hash key apart:
+	static const char hashLabel[] = "kvs shared value hash";
+	unsigned int hashKeySize = 0;
+	m_valid = EVP_EncryptInit_ex( mp_sealCtx, EVP_aes_256_gcm(), NULL, aesKey, NULL ) == 1 &&
+	          EVP_DecryptInit_ex( mp_openCtx, EVP_aes_256_gcm(), NULL, aesKey, NULL ) == 1 &&
+	          HMAC( EVP_sha256(), aesKey, KVS_CIPHER_KEY_SIZE, (const uint8_t*)hashLabel, sizeof(hashLabel) - 1,
+	                m_hashKey, &hashKeySize ) != NULL && hashKeySize == KVS_CIPHER_KEY_SIZE;
+
+	OPENSSL_cleanse( aesKey, sizeof(aesKey) );
+}
+
+///////////////////////////////////////////////////////////////////////////////////
+CKvsCipher::~CKvsCipher()
+{
+	if (mp_sealCtx) EVP_CIPHER_CTX_free( mp_sealCtx );
+	if (mp_openCtx) EVP_CIPHER_CTX_free( mp_openCtx );
+	OPENSSL_cleanse( m_hashKey, sizeof(m_hashKey) );
+}
+
+///////////////////////////////////////////////////////////////////////////////////
+bool CKvsCipher::IsValid( void )
+{
+	return m_valid;
+}
+
+///////////////////////////////////////////////////////////////////////////////////
+// the low 64 bits of the nonce count up, carrying into nothing: 2^64 seals per key
+void CKvsCipher::NextNonce( uint8_t* nonce )
+{
+	for (int32_t i = KVS_CIPHER_NONCE_SIZE - 1; i >= KVS_CIPHER_NONCE_SIZE - 8; i--)
+	{
+		if (++m_nonce[i] != 0)
+			break;
+	}
+	memcpy( nonce, m_nonce, KVS_CIPHER_NONCE_SIZE );
+}
+
+///////////////////////////////////////////////////////////////////////////////////
+bool CKvsCipher::Seal( const std::string& aad, const uint8_t* plain, uint32_t byte_size, std::string& out )
+{
+	if (!m_valid)
+		return false;
+
+	std::lock_guard<std::mutex> guard(m_sealMutex);
+
+	out.resize( KVS_CIPHER_NONCE_SIZE + byte_size + KVS_CIPHER_TAG_SIZE );
+	uint8_t* nonce  = (uint8_t*)&out[0];
+	uint8_t* cipher = nonce + KVS_CIPHER_NONCE_SIZE;
+	uint8_t* tag    = cipher + byte_size;
+
+	NextNonce( nonce );
+
+	int len = 0;
+	bool ok = EVP_EncryptInit_ex( mp_sealCtx, NULL, NULL, NULL, nonce ) == 1 &&
+	          EVP_EncryptUpdate( mp_sealCtx, NULL, &len, (const uint8_t*)aad.data(), (int)aad.size() ) == 1 &&
+	          EVP_EncryptUpdate( mp_sealCtx, cipher, &len, plain, (int)byte_size ) == 1 &&
+	          EVP_EncryptFinal_ex( mp_sealCtx, cipher + len, &len ) == 1 &&
+	          EVP_CIPHER_CTX_ctrl( mp_sealCtx, EVP_CTRL_GCM_GET_TAG, KVS_CIPHER_TAG_SIZE, tag ) == 1;
+
+	if (!ok)
+		out.clear();
+	return ok;
+}
+
+///////////////////////////////////////////////////////////////////////////////////
+bool CKvsCipher::Open( const std::string& aad, const uint8_t* sealed, uint32_t byte_size, std::string& out )
+{
+	return Open( aad, sealed, byte_size, out, NULL );
+}
+
+///////////////////////////////////////////////////////////////////////////////////
+bool CKvsCipher::Open( const std::string& aad, const uint8_t* sealed, uint32_t byte_size, std::string& out, EVP_CIPHER_CTX* p_ctx )
+{
+	out.clear();
+	if (!m_valid || byte_size < KVS_CIPHER_NONCE_SIZE + KVS_CIPHER_TAG_SIZE)
+		return false;
+
+	if (p_ctx)
+		return OpenWith( p_ctx, aad, sealed, byte_size, out );
+
+	std::lock_guard<std::mutex> guard(m_openMutex);
+	return OpenWith( mp_openCtx, aad, sealed, byte_size, out );
+}
+
+///////////////////////////////////////////////////////////////////////////////////
+// a copy carries the expanded key schedule, so no key material is kept around to make it
+EVP_CIPHER_CTX* CKvsCipher::NewOpenContext( void )
+{
+	if (!m_valid)
+		return NULL;
+
+	EVP_CIPHER_CTX* p_ctx = EVP_CIPHER_CTX_new();
+	if (!p_ctx)
+		return NULL;
+
+	std::lock_guard<std::mutex> guard(m_openMutex);
+	if (EVP_CIPHER_CTX_copy( p_ctx, mp_openCtx ) != 1)
+	{
+		EVP_CIPHER_CTX_free( p_ctx );
+		return NULL;
+	}
+	return p_ctx;
+}
+
+///////////////////////////////////////////////////////////////////////////////////
+void CKvsCipher::FreeContext( EVP_CIPHER_CTX* p_ctx )
+{
+	if (p_ctx) EVP_CIPHER_CTX_free( p_ctx );
+}
+
+///////////////////////////////////////////////////////////////////////////////////
+bool CKvsCipher::OpenWith( EVP_CIPHER_CTX* p_ctx, const std::string& aad, const uint8_t* sealed, uint32_t byte_size, std::string& out )
+{
+	uint32_t       plain_size = byte_size - KVS_CIPHER_NONCE_SIZE - KVS_CIPHER_TAG_SIZE;
+	const uint8_t* nonce  = sealed;
+	const uint8_t* cipher = nonce + KVS_CIPHER_NONCE_SIZE;
+	uint8_t        tag[KVS_CIPHER_TAG_SIZE];
+	memcpy( tag, cipher + plain_size, KVS_CIPHER_TAG_SIZE );
+
+	out.resize( plain_size );
+	uint8_t* plain = (plain_size) ? (uint8_t*)&out[0] : tag;	// EVP wants a non-null output
+
+	int len = 0;
+	bool ok = EVP_DecryptInit_ex( p_ctx, NULL, NULL, NULL, nonce ) == 1 &&
+	          EVP_DecryptUpdate( p_ctx, NULL, &len, (const uint8_t*)aad.data(), (int)aad.size() ) == 1 &&
+	          EVP_DecryptUpdate( p_ctx, plain, &len, cipher, (int)plain_size ) == 1 &&
+	          EVP_CIPHER_CTX_ctrl( p_ctx, EVP_CTRL_GCM_SET_TAG, KVS_CIPHER_TAG_SIZE, tag ) == 1 &&
+	          EVP_DecryptFinal_ex( p_ctx, plain + len, &len ) == 1;
+
+	if (!ok)
+		out.clear();
+	return ok;
+}
@@ -0,0 +1,76 @@
+/////////////////////////////////////////////////////////////////////////////
+// Name:        cipher.h
+// Purpose:     authenticated encryption of values persisted by CKeyValueStore.
+//							AES-256-GCM through OpenSSL's EVP interface, which selects
+//							AES-NI/CLMUL (or VAES/AVX512) kernels at runtime and falls
+//							back to portable code on cpus without them.
+//
+//							A sealed value is a 12 byte nonce, the ciphertext, and a
+//							16 byte tag. The row's key is bound in as associated data,
+//							so a sealed value moved to another key fails to open.
+//
+//							The key schedule is set up once and reused for every value,
+//							so sealing a sync's worth of rows costs one IV setup per row.
+//
+//							A second key, derived from the store key by HMAC-SHA-256
+//							under a label of its own, keys the hashes naming shared
+//							values (see dedup.h), so the db holds no plain hash of any
+//							value.
+/////////////////////////////////////////////////////////////////////////////
+
+#ifndef _KVS_CIPHER_H_
+#define _KVS_CIPHER_H_
+
+#include <cstdint>
+#include <string>
+#include <mutex>
+
+#define KVS_CIPHER_KEY_SIZE    (32)
+#define KVS_CIPHER_NONCE_SIZE  (12)
+#define KVS_CIPHER_TAG_SIZE    (16)
+
+typedef struct evp_cipher_ctx_st EVP_CIPHER_CTX;
+
+class CKvsCipher
+{
+public:
+	// key_size of 32 uses the key as given, any other size is hashed with SHA-256
+	// into a 32 byte key. Check IsValid() after construction.
+	CKvsCipher( const uint8_t* key, uint32_t key_size );
+	~CKvsCipher();
+
+	bool IsValid( void );
+
+	// the key shared values are hashed under, KVS_CIPHER_KEY_SIZE bytes:
+	const uint8_t* HashKey( void ) const { return m_hashKey; }
+
+	// out = nonce | ciphertext | tag
+	bool Seal( const std::string& aad, const uint8_t* plain, uint32_t byte_size, std::string& out );
+	// out = plaintext; false if the value was tampered with, or sealed under another key or aad
+	bool Open( const std::string& aad, const uint8_t* sealed, uint32_t byte_size, std::string& out );
+	//
+	// threads opening many values at once each take a copy of the open context, so
+	// they do not queue on the shared one; p_ctx NULL uses the shared context:
+	EVP_CIPHER_CTX* NewOpenContext( void );
+	static void     FreeContext( EVP_CIPHER_CTX* p_ctx );
+	bool Open( const std::string& aad, const uint8_t* sealed, uint32_t byte_size, std::string& out, EVP_CIPHER_CTX* p_ctx );
+
+private:
+	CKvsCipher( const CKvsCipher& );
+	CKvsCipher& operator=( const CKvsCipher& );
+
+	void NextNonce( uint8_t* nonce );
+	bool OpenWith( EVP_CIPHER_CTX* p_ctx, const std::string& aad, const uint8_t* sealed, uint32_t byte_size, std::string& out );
+
+	EVP_CIPHER_CTX* mp_sealCtx;
+	EVP_CIPHER_CTX* mp_openCtx;
+	std::mutex      m_sealMutex;
+	std::mutex      m_openMutex;
+
+	// nonces are a random base plus a counter, unique for the life of the key:
+	uint8_t         m_nonce[KVS_CIPHER_NONCE_SIZE];
+	uint8_t         m_hashKey[KVS_CIPHER_KEY_SIZE];
+	bool            m_valid;
+};
+
+#endif // _KVS_CIPHER_H_
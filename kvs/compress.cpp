@@ -0,0 +1,221 @@
+////////////////////////////////////////////////////////////////////////////
+// Name:        compress.cpp
+// Purpose:     LZ4 block format compression for large key/value values
+/////////////////////////////////////////////////////////////////////////////
+
+#include <cstring>
+#include <vector>
+#include "compress.h"
+
+#define KVS_LZ4_MINMATCH      (4)     // shortest match the format can express
+#define KVS_LZ4_LASTLITERALS  (5)     // the last 5 bytes of a block are always literals
+#define KVS_LZ4_MFLIMIT       (12)    // a match may not start within 12 bytes of the end
+#define KVS_LZ4_MAX_DISTANCE  (65535) // offsets are 16 bits
+#define KVS_LZ4_HASH_LOG      (14)
+#define KVS_LZ4_HEADER_SIZE   (4)     // uncompressed size prefix
+#define KVS_LZ4_MAX_RATIO     (255)   // a spilled length byte adds at most 255 bytes of output
+#define KVS_LZ4_MAX_RAW_SIZE  (0x40000000) // 1 GB, sqlite's largest value by default
+
+///////////////////////////////////////////////////////////////////////////////////
+static inline uint32_t kvs_read32( const uint8_t* p )
+{
+	uint32_t v;
+	memcpy( &v, p, sizeof(v) );
+	return v;
+}
+
+///////////////////////////////////////////////////////////////////////////////////
+static inline uint32_t kvs_hash32( uint32_t sequence )
+{
+	return (sequence * 2654435761U) >> (32 - KVS_LZ4_HASH_LOG);
+}
+
+///////////////////////////////////////////////////////////////////////////////////
+// lengths of 15 or more spill into following bytes of 255s plus a remainder:
+static inline void kvs_write_length( std::string& out, uint32_t len )
+{
+	while (len >= 255)
+	{
+		out += (char)255;
+		len -= 255;
+	}
+	out += (char)len;
+}
+
+///////////////////////////////////////////////////////////////////////////////////
+static void kvs_emit_sequence( std::string& out, const uint8_t* literals, uint32_t lit_len,
+															 uint32_t offset, uint32_t match_len, bool last )
+{
+	uint32_t ml = (last) ? 0 : match_len - KVS_LZ4_MINMATCH;
+
+	uint8_t token = (uint8_t)(((lit_len < 15) ? lit_len : 15) << 4);
+	if (!last)
+		token |= (uint8_t)((ml < 15) ? ml : 15);
+	out += (char)token;
+
+	if (lit_len >= 15)
+		kvs_write_length( out, lit_len - 15 );
+	out.append( (const char*)literals, lit_len );
+
+	if (last)
+		return;
+
+	out += (char)(offset & 0xff);
+	out += (char)(offset >> 8);
+
+	if (ml >= 15)
+		kvs_write_length( out, ml - 15 );
+}
+
+///////////////////////////////////////////////////////////////////////////////////
+bool kvs_lz4_compress( const uint8_t* src, uint32_t byte_size, std::string& out )
+{
+	out.clear();
+	out.reserve( KVS_LZ4_HEADER_SIZE + byte_size / 2 );
+
+	out += (char)(byte_size & 0xff);
+	out += (char)((byte_size >> 8) & 0xff);
+	out += (char)((byte_size >> 16) & 0xff);
+	out += (char)((byte_size >> 24) & 0xff);
+
+	uint32_t anchor = 0;
+
+	if (byte_size > KVS_LZ4_MFLIMIT)
+	{
+		std::vector<uint32_t> table( (size_t)1 << KVS_LZ4_HASH_LOG, 0 );
+
+		const uint32_t mflimit    = byte_size - KVS_LZ4_MFLIMIT;
+		const uint32_t matchlimit = byte_size - KVS_LZ4_LASTLITERALS;
+
+		uint32_t ip = 1;
+		table[ kvs_hash32( kvs_read32(src) ) ] = 0;
+
+		while (ip < mflimit)
+		{
+			uint32_t h    = kvs_hash32( kvs_read32(src + ip) );
+			uint32_t cand = table[h];
+			table[h] = ip;
+
+			if (cand >= ip || ip - cand > KVS_LZ4_MAX_DISTANCE || kvs_read32(src + cand) != kvs_read32(src + ip))
+			{
+				// no match; step faster through data that is not compressing:
+				ip += 1 + ((ip - anchor) >> 6);
+				continue;
+			}
+
+			// extend the match backwards over pending literals:
+			while (ip > anchor && cand > 0 && src[ip - 1] == src[cand - 1])
+			{
+				ip--;
+				cand--;
+			}
+
+			// and forwards:
+			uint32_t len = KVS_LZ4_MINMATCH;
+			while (ip + len < matchlimit && src[cand + len] == src[ip + len])
+				len++;
+
+			kvs_emit_sequence( out, src + anchor, ip - anchor, ip - cand, len, false );
+
+			ip += len;
+			anchor = ip;
+
+			if (ip - 2 < mflimit)
+				table[ kvs_hash32( kvs_read32(src + ip - 2) ) ] = ip - 2;
+
+			if (out.size() >= KVS_LZ4_HEADER_SIZE + byte_size)
+				return false;
+		}
+	}
+
+	kvs_emit_sequence( out, src + anchor, byte_size - anchor, 0, 0, true );
+
+	return out.size() < byte_size;
+}
+
+///////////////////////////////////////////////////////////////////////////////////
+bool kvs_lz4_decompress( const uint8_t* src, uint32_t byte_size, std::string& out )
+{
+	out.clear();
+	if (byte_size < KVS_LZ4_HEADER_SIZE + 1)
+		return false;
+
+	uint32_t raw_size = (uint32_t)src[0] | ((uint32_t)src[1] << 8) | ((uint32_t)src[2] << 16) | ((uint32_t)src[3] << 24);
+
+	// the header is not trusted with the allocation: no block can expand to more than
+	// about 255 times its size, and no value the store keeps exceeds the cap:
+	if (raw_size > KVS_LZ4_MAX_RAW_SIZE ||
+	    raw_size > (uint64_t)(byte_size - KVS_LZ4_HEADER_SIZE) * KVS_LZ4_MAX_RATIO + 64)
+		return false;
+	out.resize( raw_size );
+
+	uint8_t*       op  = (uint8_t*)&out[0];
+	uint8_t*       oend = op + raw_size;
+	uint8_t* const ostart = op;
+	const uint8_t* ip   = src + KVS_LZ4_HEADER_SIZE;
+	const uint8_t* iend = src + byte_size;
+
+	while (ip < iend)
+	{
+		uint8_t  token   = *ip++;
+		uint32_t lit_len = token >> 4;
+		if (lit_len == 15)
+		{
+			uint8_t b;
+			do
+			{
+				if (ip >= iend) { out.clear(); return false; }
+				b = *ip++;
+				lit_len += b;
+			} while (b == 255);
+		}
+
+		if ((uint32_t)(iend - ip) < lit_len || (uint32_t)(oend - op) < lit_len) { out.clear(); return false; }
+		memcpy( op, ip, lit_len );
+		op += lit_len;
+		ip += lit_len;
+
+		if (ip == iend)
+			break;		// the final sequence carries literals only
+
+		if (iend - ip < 2) { out.clear(); return false; }
+		uint32_t offset = (uint32_t)ip[0] | ((uint32_t)ip[1] << 8);
+		ip += 2;
+		if (offset == 0 || offset > (uint32_t)(op - ostart)) { out.clear(); return false; }
+
+		uint32_t match_len = token & 15;
+		if (match_len == 15)
+		{
+			uint8_t b;
+			do
+			{
+				if (ip >= iend) { out.clear(); return false; }
+				b = *ip++;
+				match_len += b;
+			} while (b == 255);
+		}
+		match_len += KVS_LZ4_MINMATCH;
+
+		if ((uint32_t)(oend - op) < match_len) { out.clear(); return false; }
+
+		// matches may overlap their own output, so copy forwards byte by byte when close:
+		const uint8_t* match = op - offset;
+		if (offset >= match_len)
+		{
+			memcpy( op, match, match_len );
+			op += match_len;
+		}
+		else
+		{
+			while (match_len--)
+				*op++ = *match++;
+		}
+	}
+
+	if (op != oend)
+	{
+		out.clear();
+		return false;
+	}
+	return true;
+}
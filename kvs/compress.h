@@ -0,0 +1,26 @@
+/////////////////////////////////////////////////////////////////////////////
+// Name:        compress.h
+// Purpose:     value compression used by CKeyValueStore when persisting
+//							large values. The codec is the LZ4 block format, implemented
+//							here so the store carries no extra library dependency.
+//
+//							A compressed value is a 4 byte little endian uncompressed
+//							size followed by a single LZ4 block.
+/////////////////////////////////////////////////////////////////////////////
+
+#ifndef _KVS_COMPRESS_H_
+#define _KVS_COMPRESS_H_
+
+#include <cstdint>
+#include <string>
+
+// compress byte_size bytes from src into out; returns false if the
+// compressed form would not be smaller than the source:
+bool kvs_lz4_compress( const uint8_t* src, uint32_t byte_size, std::string& out );
+
+// decompress a value produced by kvs_lz4_compress() into out; returns false
+// if the compressed data is truncated or corrupt, or its header claims a size
+// the block cannot expand to:
+bool kvs_lz4_decompress( const uint8_t* src, uint32_t byte_size, std::string& out );
+
+#endif // _KVS_COMPRESS_H_
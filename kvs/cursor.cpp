@@ -0,0 +1,355 @@
+////////////////////////////////////////////////////////////////////////////
+// Name:        cursor.cpp
+// Purpose:     key ordered iteration of a CKeyValueStore from its db
+/////////////////////////////////////////////////////////////////////////////
+
+#include "kvs.h"
+
+///////////////////////////////////////////////////////////////////////////////////
+CKvsCursor::CKvsCursor( CKeyValueStore* p_store, const std::string& prefix, uint32_t prefetch, const std::string& after )
+{
+	mp_store = p_store;
+
+	mp_db = NULL;
+	mp_statement = NULL;
+	mp_statements[0] = NULL;
+	mp_statements[1] = NULL;
+	mp_openCtx = NULL;
+
+	// a db that won't open reads as empty, as the store then runs from RAM alone:
+	if (sqlite3_open_v2( p_store->m_path.c_str(), &mp_db, SQLITE_OPEN_READONLY | SQLITE_OPEN_NOMUTEX, NULL ) != SQLITE_OK)
+	{
+		sqlite3_close( mp_db );
+		mp_db = NULL;
+	}
+	else
+	{
+		sqlite3_busy_timeout( mp_db, KVS_CURSOR_BUSY_MS );
+	}
+
+	if (p_store->mp_cipher)
+		mp_openCtx = p_store->mp_cipher->NewOpenContext();
+
+	Restart( prefix, prefetch, after );
+}
+
+///////////////////////////////////////////////////////////////////////////////////
+CKvsCursor::~CKvsCursor()
+{
+	sqlite3_finalize( mp_statements[0] );
+	sqlite3_finalize( mp_statements[1] );
+	sqlite3_close( mp_db );
+	CKvsCipher::FreeContext( mp_openCtx );
+}
+
+///////////////////////////////////////////////////////////////////////////////////
+// everything but the connection, its statements and the cipher context starts over
+bool CKvsCursor::Restart( const std::string& prefix, uint32_t prefetch, const std::string& after )
+{
+	m_prefix = prefix;
+	m_prefetch = (prefetch) ? prefetch : 1;
+	m_emsg.clear();
+
+	m_dbRows.clear();
+	m_dbStarted = false;
+	m_dbDone = (mp_db == NULL);
+	m_dbLast.clear();
+	m_ramRows.clear();
+	m_ramStarted = false;
+	m_ramLast.clear();
+
+	m_current.m_key.clear();
+	m_current.m_value.clear();
+	m_current.m_codec = KVS_CODEC_NONE;
+	m_current.m_expires = 0;
+	m_current.m_dirty = false;
+
+	// the first key past every key with the prefix; none when it is empty or all 0xff:
+	m_end = prefix;
+	while (!m_end.empty() && (unsigned char)m_end.back() == 0xff)
+		m_end.erase( m_end.size() - 1 );
+	if (!m_end.empty())
+		m_end[m_end.size() - 1] = (char)((unsigned char)m_end.back() + 1);
+
+	// a background open fills m_pairs without the lock, so one under way is waited for.
+	// A store not loaded is left that way, its RAM not looked at:
+	m_loaded = mp_store->m_initDone.load();
+	if (!m_loaded && mp_store->m_opener.joinable())
+	{
+		mp_store->Init();
+		m_loaded = true;
+	}
+	m_ramDone = !m_loaded;
+
+	// resuming past a key is picking up as if it were the last fetched from both sides:
+	if (after > prefix)
+	{
+		m_dbStarted = true;
+		m_dbLast = after;
+		m_ramStarted = true;
+		m_ramLast = after;
+	}
+
+	if (!mp_db)
+		return true;
+
+	// a scan with an end bound has its own statement, each prepared upon first use:
+	int32_t bounded = (m_end.empty()) ? 0 : 1;
+	if (!mp_statements[bounded])
+	{
+		std::string sql = "SELECT key, value, codec, expires FROM keyValueStore WHERE key >= ?1";
+		if (bounded)
+			sql += " AND key < ?2";
+		sql += " ORDER BY key LIMIT ?3;";
+
+		if (sqlite3_prepare_v2( mp_db, sql.c_str(), -1, &mp_statements[bounded], NULL ) != SQLITE_OK)
+		{
+			m_emsg = std::string("CKvsCursor() Prepare Error: ") + std::string(sqlite3_errmsg(mp_db));
+			sqlite3_finalize( mp_statements[bounded] );
+			mp_statements[bounded] = NULL;
+		}
+	}
+	mp_statement = mp_statements[bounded];
+
+	return m_emsg.empty();
+}
+
+///////////////////////////////////////////////////////////////////////////////////
+const std::string& CKvsCursor::Key( void )
+{
+	return m_current.m_key;
+}
+
+///////////////////////////////////////////////////////////////////////////////////
+const std::string& CKvsCursor::Value( void )
+{
+	return m_current.m_value;
+}
+
+///////////////////////////////////////////////////////////////////////////////////
+int64_t CKvsCursor::Expires( void )
+{
+	return m_current.m_expires;
+}
+
+///////////////////////////////////////////////////////////////////////////////////
+std::string CKvsCursor::GetErrorMsg( void )
+{
+	return m_emsg;
+}
+
+///////////////////////////////////////////////////////////////////////////////////
+// the next batch after the last key fetched; the statement is reset once the batch is
+// read, so no read lock is held between batches
+bool CKvsCursor::FetchDB( void )
+{
+	// after the first batch ?1 is the last key fetched, which comes back and is skipped:
+	const std::string& from = (m_dbStarted) ? m_dbLast : m_prefix;
+
+	sqlite3_bind_text( mp_statement, 1, from.c_str(), (int)from.size(), SQLITE_TRANSIENT );
+	if (!m_end.empty())
+		sqlite3_bind_text( mp_statement, 2, m_end.c_str(), (int)m_end.size(), SQLITE_STATIC );
+	sqlite3_bind_int( mp_statement, 3, (int)m_prefetch + 1 );
+
+	uint32_t fetched = 0;
+	int32_t  rc;
+	while (SQLITE_ROW == (rc = sqlite3_step( mp_statement )))
+	{
+		fetched++;
+
+		const char* keyText = reinterpret_cast<const char*>(sqlite3_column_text( mp_statement, 0 ));
+		if (!keyText)
+			continue;
+
+		CRow row;
+		row.m_key.assign( keyText, sqlite3_column_bytes( mp_statement, 0 ) );
+		if (m_dbStarted && row.m_key == m_dbLast)
+			continue;
+
+		row.m_codec = sqlite3_column_int( mp_statement, 2 );
+		row.m_expires = sqlite3_column_int64( mp_statement, 3 );
+		row.m_dirty = false;
+		if (row.m_codec == KVS_CODEC_NONE)
+		{
+			const char* valText = reinterpret_cast<const char*>(sqlite3_column_text( mp_statement, 1 ));
+			if (valText)
+				row.m_value.assign( valText, sqlite3_column_bytes( mp_statement, 1 ) );
+		}
+		else
+		{
+			const char* packed = reinterpret_cast<const char*>(sqlite3_column_blob( mp_statement, 1 ));
+			row.m_packed.assign( (packed) ? packed : "", sqlite3_column_bytes( mp_statement, 1 ) );
+		}
+		m_dbRows.push_back( std::move(row) );
+	}
+	sqlite3_reset( mp_statement );
+
+	if (rc != SQLITE_DONE)
+	{
+		m_emsg = std::string("CKvsCursor() Step Error: ") + std::string(sqlite3_errmsg(mp_db));
+		return false;
+	}
+
+	m_dbStarted = true;
+	if (!m_dbRows.empty())
+		m_dbLast = m_dbRows.back().m_key;
+	if (fetched <= m_prefetch)
+		m_dbDone = true;
+
+	return true;
+}
+
+///////////////////////////////////////////////////////////////////////////////////
+// the next batch of RAM entries, only those written since the load carrying a value
+void CKvsCursor::FetchRAM( void )
+{
+	CKvsTimedLock guard(mp_store->m_mutex, mp_store->m_stats);
+
+	CKvsPairs& pairs = mp_store->m_pairs;
+	CKvsPairs::iterator it = (m_ramStarted) ? pairs.upper_bound( m_ramLast ) : pairs.lower_bound( m_prefix );
+	m_ramStarted = true;
+
+	for (uint32_t n = 0; n < m_prefetch; n++, ++it)
+	{
+		if (it == pairs.end() || (!m_end.empty() && it->first >= m_end))
+		{
+			m_ramDone = true;
+			return;
+		}
+
+		const CKeyValue& kv = it->second;
+
+		CRow row;
+		row.m_key = it->first;
+		row.m_codec = KVS_CODEC_NONE;
+		row.m_expires = kv.m_expires;
+		row.m_dirty = (kv.m_version != 0 || kv.mp_counter != NULL);
+		if (row.m_dirty)
+		{
+			if (kv.mp_counter)
+			{
+				row.m_value = std::to_string( kv.mp_counter->load() );
+			}
+			else if (kv.m_shared)
+			{
+				row.m_value = mp_store->base64_encode( kv.m_shared->mp_data, kv.m_shared->m_size );
+			}
+			else
+			{
+				row.m_value = kv.m_value;
+				row.m_codec = kv.m_codec;
+				row.m_packed = kv.m_packed;
+			}
+		}
+		m_ramLast = it->first;
+		m_ramRows.push_back( std::move(row) );
+	}
+}
+
+///////////////////////////////////////////////////////////////////////////////////
+// a default inserted by a Read* has no version, yet is not in the db until the next sync
+bool CKvsCursor::ReadRAM( CRow& row )
+{
+	CKvsTimedLock guard(mp_store->m_mutex, mp_store->m_stats);
+
+	CKvsPairs::iterator it = mp_store->m_pairs.find( row.m_key );
+	if (it == mp_store->m_pairs.end())
+		return false;
+
+	const CKeyValue& kv = it->second;
+	row.m_expires = kv.m_expires;
+	row.m_dirty = true;
+	if (kv.mp_counter)
+	{
+		row.m_value = std::to_string( kv.mp_counter->load() );
+	}
+	else if (kv.m_shared)
+	{
+		row.m_value = mp_store->base64_encode( kv.m_shared->mp_data, kv.m_shared->m_size );
+	}
+	else
+	{
+		row.m_value = kv.m_value;
+		row.m_codec = kv.m_codec;
+		row.m_packed = kv.m_packed;
+	}
+	return true;
+}
+
+///////////////////////////////////////////////////////////////////////////////////
+bool CKvsCursor::Decode( CRow& row )
+{
+	if (row.m_codec == KVS_CODEC_NONE)
+		return true;
+
+	CKeyValue   kv( row.m_key.c_str(), "" );
+	std::string emsg;
+
+	kv.m_codec = row.m_codec;
+	kv.m_packed.swap( row.m_packed );
+	if (!mp_store->DecodeValue( kv, mp_openCtx, emsg ))
+	{
+		m_emsg = std::string("CKvsCursor() ") + emsg;
+		return false;
+	}
+
+	row.m_value.swap( kv.m_value );
+	row.m_codec = KVS_CODEC_NONE;
+	return true;
+}
+
+///////////////////////////////////////////////////////////////////////////////////
+// merges the db rows and the RAM entries in key order, a RAM entry taking the place of
+// the row of its key when it has been written since the load
+bool CKvsCursor::Next( void )
+{
+	if (!m_emsg.empty())
+		return false;
+
+	int64_t now = kvs_now_ms();
+	for (;;)
+	{
+		if (m_dbRows.empty() && !m_dbDone && !FetchDB())
+			return false;
+		if (m_ramRows.empty() && !m_ramDone)
+			FetchRAM();
+
+		bool hasDB = !m_dbRows.empty();
+		bool hasRAM = !m_ramRows.empty();
+		if (!hasDB && !hasRAM)
+			return false;
+
+		int32_t cmp = (!hasDB) ? 1 : (!hasRAM) ? -1 : m_dbRows.front().m_key.compare( m_ramRows.front().m_key );
+		if (cmp < 0)
+		{
+			m_current = std::move( m_dbRows.front() );
+			m_dbRows.pop_front();
+
+			// with the store loaded, a row with no RAM entry is of a key since deleted:
+			if (m_loaded)
+				continue;
+		}
+		else
+		{
+			CRow& ram = m_ramRows.front();
+			if (cmp == 0)
+			{
+				m_current = (ram.m_dirty) ? std::move( ram ) : std::move( m_dbRows.front() );
+				m_dbRows.pop_front();
+				m_ramRows.pop_front();
+			}
+			else
+			{
+				m_current = std::move( ram );
+				m_ramRows.pop_front();
+				if (!m_current.m_dirty && !ReadRAM( m_current ))
+					continue;
+			}
+		}
+
+		if (m_current.m_expires && m_current.m_expires <= now)
+			continue;
+
+		return Decode( m_current );
+	}
+}
@@ -0,0 +1,101 @@
+/////////////////////////////////////////////////////////////////////////////
+// Name:        cursor.h
+// Purpose:     key ordered iteration of a CKeyValueStore straight from its
+//							db, from CKeyValueStore::Cursor().
+//
+//							A cursor reads the db over its own read only connection with
+//							one prepared statement, a bounded batch of rows at a time; the
+//							read lock is dropped between batches, so syncs are not held
+//							up. It does not load the store, so an offline tool can scan a
+//							store of any size in constant memory.
+//
+//							When the store is loaded, what RAM holds is overlaid on the
+//							db rows, a batch at a time under the store's lock: keys written
+//							since the load, counters, and keys not yet synced read as in
+//							RAM, and rows of keys gone from RAM are skipped. Keys read as
+//							of when each batch is taken, not as of one moment; use a
+//							Snapshot() for that.
+/////////////////////////////////////////////////////////////////////////////
+
+#ifndef _KVS_CURSOR_H_
+#define _KVS_CURSOR_H_
+
+#include <cstdint>
+#include <string>
+#include <vector>
+#include <deque>
+#include "cipher.h"
+#include "sqlite3.h"
+
+#define KVS_CURSOR_BUSY_MS   (10000) // how long a batch waits on a sync holding the db
+
+class CKeyValueStore;
+
+class CKvsCursor
+{
+public:
+	~CKvsCursor();
+
+	// moves to the next key, the first upon the first call; false at the end, or upon an
+	// error, when GetErrorMsg() is not empty:
+	bool               Next( void );
+
+	// the current key and its decoded text, binary values as base64:
+	const std::string& Key( void );
+	const std::string& Value( void );
+	int64_t            Expires( void );      // kvs_now_ms() time, 0 for never
+
+	std::string        GetErrorMsg( void );
+
+	// starts a new scan, as Cursor() would, reusing this cursor's db connection; false
+	// upon an error, when GetErrorMsg() is not empty:
+	bool               Restart( const std::string& prefix, uint32_t prefetch, const std::string& after );
+
+private:
+	friend class CKeyValueStore;
+	CKvsCursor( CKeyValueStore* p_store, const std::string& prefix, uint32_t prefetch, const std::string& after );
+	CKvsCursor( const CKvsCursor& );
+	CKvsCursor& operator=( const CKvsCursor& );
+
+	// a row fetched from the db or RAM, its value still in stored form until current:
+	struct CRow
+	{
+		std::string m_key;
+		std::string m_value;
+		std::string m_packed;
+		int32_t     m_codec;
+		int64_t     m_expires;
+		bool        m_dirty;     // from RAM: written since the load, so it carries its value
+	};
+
+	bool               FetchDB( void );
+	void               FetchRAM( void );
+	// the clean RAM entry of a key not in the db, as a dirty one; false if it is gone:
+	bool               ReadRAM( CRow& row );
+	bool               Decode( CRow& row );
+
+	CKeyValueStore*    mp_store;
+	std::string        m_prefix;
+	std::string        m_end;          // keys are below this, or unbounded when empty
+	uint32_t           m_prefetch;
+	bool               m_loaded;       // the store was loaded, so RAM has the final word
+	std::string        m_emsg;
+
+	sqlite3*           mp_db;
+	sqlite3_stmt*      mp_statement;   // of mp_statements, the one for this scan
+	sqlite3_stmt*      mp_statements[2];  // without, then with an end bound, once prepared
+	EVP_CIPHER_CTX*    mp_openCtx;     // the cursor's own, when values are encrypted
+
+	std::deque<CRow>   m_dbRows;
+	bool               m_dbStarted;
+	bool               m_dbDone;
+	std::string        m_dbLast;       // the last key fetched from the db
+	std::deque<CRow>   m_ramRows;
+	bool               m_ramStarted;
+	bool               m_ramDone;
+	std::string        m_ramLast;      // the last key fetched from RAM
+
+	CRow               m_current;
+};
+
+#endif // _KVS_CURSOR_H_
@@ -0,0 +1,448 @@
+////////////////////////////////////////////////////////////////////////////
+// Name:        dedup.cpp
+// Purpose:     the shared binary values of a CKeyValueStore
+/////////////////////////////////////////////////////////////////////////////
+
+#include <openssl/evp.h>
+#include <openssl/hmac.h>
+#include <openssl/crypto.h>
+#include "kvs.h"
+
+///////////////////////////////////////////////////////////////////////////////////
+CKvsShared::CKvsShared( const std::string& hash, const uint8_t* data, uint32_t byte_size )
+	: m_hash(hash), m_refs(0), m_keys(0), m_syncedKeys(-1), m_persisted(false)
+{
+	m_size = 0;
+	mp_data = (uint8_t*)malloc( sizeof(uint8_t) * ((byte_size) ? byte_size : 1) );
+	if (mp_data)
+	{
+		m_size = byte_size;
+		memcpy( mp_data, data, byte_size );
+	}
+}
+
+///////////////////////////////////////////////////////////////////////////////////
+CKvsShared::~CKvsShared()
+{
+	free( mp_data );
+}
+
+///////////////////////////////////////////////////////////////////////////////////
+CKvsDedup::~CKvsDedup()
+{
+	std::unordered_map<std::string, CKvsShared*>::iterator it;
+	for (it = m_entries.begin(); it != m_entries.end(); it++)
+		delete it->second;
+
+	OPENSSL_cleanse( m_key, sizeof(m_key) );
+}
+
+///////////////////////////////////////////////////////////////////////////////////
+void CKvsDedup::SetKey( const uint8_t* key )
+{
+	memcpy( m_key, key, KVS_DEDUP_HASH_SIZE );
+	m_keyed = true;
+}
+
+///////////////////////////////////////////////////////////////////////////////////
+std::string CKvsDedup::Hash( const uint8_t* data, uint32_t byte_size ) const
+{
+	uint8_t      digest[EVP_MAX_MD_SIZE];
+	unsigned int digest_size = 0;
+
+	if (m_keyed)
+	{
+		if (!HMAC( EVP_sha256(), m_key, KVS_DEDUP_HASH_SIZE, data, byte_size, digest, &digest_size ) || digest_size != KVS_DEDUP_HASH_SIZE)
+			return std::string();
+	}
+	else if (!EVP_Digest( data, byte_size, digest, &digest_size, EVP_sha256(), NULL ) || digest_size != KVS_DEDUP_HASH_SIZE)
+		return std::string();
+
+	return std::string( (const char*)digest, digest_size );
+}
+
+///////////////////////////////////////////////////////////////////////////////////
+CKvsShared* CKvsDedup::Acquire( const std::string& hash )
+{
+	std::lock_guard<std::mutex> lock( m_mutex );
+
+	std::unordered_map<std::string, CKvsShared*>::iterator it = m_entries.find( hash );
+	if (it == m_entries.end())
+		return NULL;
+
+	it->second->AddRef();
+	return it->second;
+}
+
+///////////////////////////////////////////////////////////////////////////////////
+CKvsShared* CKvsDedup::Acquire( const std::string& hash, const uint8_t* data, uint32_t byte_size, bool& found )
+{
+	std::lock_guard<std::mutex> lock( m_mutex );
+
+	std::unordered_map<std::string, CKvsShared*>::iterator it = m_entries.find( hash );
+	found = (it != m_entries.end());
+	if (!found)
+	{
+		CKvsShared* p_shared = new CKvsShared( hash, data, byte_size );
+		if (!p_shared->mp_data)
+		{
+			delete p_shared;
+			return NULL;
+		}
+		it = m_entries.emplace( hash, p_shared ).first;
+	}
+
+	it->second->AddRef();
+	return it->second;
+}
+
+///////////////////////////////////////////////////////////////////////////////////
+size_t CKvsDedup::Size( void )
+{
+	std::lock_guard<std::mutex> lock( m_mutex );
+	return m_entries.size();
+}
+
+///////////////////////////////////////////////////////////////////////////////////
+void CKeyValueStore::SetDedupThreshold( uint32_t byte_size )
+{
+	m_dedupThreshold = byte_size;
+}
+
+///////////////////////////////////////////////////////////////////////////////////
+// the caller holds m_mutex; a key already naming the entry is written again all the same,
+// so it takes a new version
+bool CKeyValueStore::ShareBinary( std::string& key, CKvsPairs::iterator it, const std::string& hash,
+                                  const uint8_t* data, uint32_t byte_size, uint64_t version, int64_t expires )
+{
+	bool found;
+	CKvsShared* p_shared = m_dedup.Acquire( hash, data, byte_size, found );
+	if (!p_shared)
+		return false;
+	if (found)
+		m_stats.Add( KVS_STAT_DEDUP_HITS, 1 );
+
+	if (it == m_pairs.end())
+		it = kvs_insert_pair( m_pairs, m_pairs.end(), CKeyValue( key.c_str(), "" ) ).first;
+
+	CKeyValue& kv = it->second;
+	kv.SetValue( "" );
+	kv.Share( p_shared );
+	kv.m_version = version;
+
+	if (mp_log)
+		mp_log->Append( KVS_LOG_SET, key, base64_encode( p_shared->mp_data, p_shared->m_size ), expires );
+
+	return true;
+}
+
+///////////////////////////////////////////////////////////////////////////////////
+// a shared key's row holds the hash, sealed under the key as any value is
+CKvsShared* CKeyValueStore::ResolveShared( const CKeyValue& kv, EVP_CIPHER_CTX* p_openCtx )
+{
+	if (!(kv.m_codec & KVS_CODEC_ENCRYPTED))
+		return m_dedup.Acquire( kv.m_packed );
+
+	std::string hash;
+	if (!mp_cipher || !mp_cipher->Open( kv.m_key, (const uint8_t*)kv.m_packed.data(), (uint32_t)kv.m_packed.size(), hash, p_openCtx ))
+		return NULL;
+
+	return m_dedup.Acquire( hash );
+}
+
+///////////////////////////////////////////////////////////////////////////////////
+// after the keys are loaded: the shared values go into m_dedup, and the keys naming them
+// are pointed at them. A value that will not open or decompress is left out, so its keys
+// stay packed and fail to decode upon their first read, as other such values do
+bool CKeyValueStore::LoadShared( void )
+{
+	bool ok = LoadSharedValues();
+
+	if (m_dedup.Size() == 0)
+		return ok;
+
+	// loaded, a shared key's row is still only the hash:
+	for (CKvsPairs::iterator it = m_pairs.begin(); it != m_pairs.end(); ++it)
+	{
+		CKeyValue& kv = it->second;
+		if ((kv.m_codec & KVS_CODEC_MASK) != KVS_CODEC_SHARED || kv.m_shared)
+			continue;
+
+		CKvsShared* p_shared = ResolveShared( kv, NULL );
+		if (p_shared)
+			kv.Share( p_shared );
+	}
+
+	if (m_dedup.IsKeyed())
+		RekeyShared();
+
+	return ok;
+}
+
+///////////////////////////////////////////////////////////////////////////////////
+// with a key, values named by their plain SHA-256, as a db written before shared names
+// were keyed holds them, are named again by their keyed hash. Their keys are listed for
+// the next sync, which writes their rows with the new name, and deletes the old rows
+// once nothing names them
+void CKeyValueStore::RekeyShared( void )
+{
+	std::unordered_map<CKvsShared*, std::string> renamed;   // empty if the name stands
+
+	for (CKvsPairs::iterator it = m_pairs.begin(); it != m_pairs.end(); ++it)
+	{
+		CKeyValue& kv = it->second;
+		if (!kv.m_shared)
+			continue;
+
+		CKvsShared* p_old = kv.m_shared.Get();
+		std::unordered_map<CKvsShared*, std::string>::iterator r = renamed.find( p_old );
+		if (r == renamed.end())
+		{
+			std::string hash = m_dedup.Hash( p_old->mp_data, p_old->m_size );
+			if (hash == p_old->m_hash)
+				hash.clear();
+			r = renamed.emplace( p_old, hash ).first;
+		}
+		if (r->second.empty())
+			continue;
+
+		bool found;
+		CKvsShared* p_shared = m_dedup.Acquire( r->second, p_old->mp_data, p_old->m_size, found );
+		if (!p_shared)
+			continue;
+
+		kv.Share( p_shared );
+		m_unsyncedKeys.push_back( kv.m_key );	// changed without a version, so listed for the sync
+	}
+}
+
+///////////////////////////////////////////////////////////////////////////////////
+// entries already held are left as they are, but taken as persisted with the row's refs
+bool CKeyValueStore::LoadSharedValues( void )
+{
+	sqlite3_stmt* statement;
+
+	if (sqlite3_prepare_v2(mp_db, "SELECT hash, value, codec, refs FROM keyValueShared;", -1, &statement, NULL) != SQLITE_OK)
+	{
+		m_emsg = std::string("LoadShared() Prepare Error: ") + std::string(sqlite3_errmsg(mp_db));
+		return false;
+	}
+
+	bool        ok = true;
+	std::string opened, raw;
+	int32_t     rc;
+	while (SQLITE_ROW == (rc = sqlite3_step(statement)))
+	{
+		const char* hashBytes = reinterpret_cast<const char*>(sqlite3_column_blob(statement, 0));
+		if (!hashBytes || sqlite3_column_bytes(statement, 0) != KVS_DEDUP_HASH_SIZE)
+			continue;
+		std::string hash( hashBytes, KVS_DEDUP_HASH_SIZE );
+
+		const uint8_t* p_data = reinterpret_cast<const uint8_t*>(sqlite3_column_blob(statement, 1));
+		uint32_t       byte_size = (uint32_t)sqlite3_column_bytes(statement, 1);
+		int32_t        codec = sqlite3_column_int(statement, 2);
+
+		// opened with the hash as the associated data, then decompressed:
+		if (codec & KVS_CODEC_ENCRYPTED)
+		{
+			if (!mp_cipher || !mp_cipher->Open( hash, p_data, byte_size, opened ))
+				continue;
+			p_data = (const uint8_t*)opened.data();
+			byte_size = (uint32_t)opened.size();
+		}
+		if ((codec & KVS_CODEC_MASK) == KVS_CODEC_LZ4_BINARY)
+		{
+			if (!kvs_lz4_decompress( p_data, byte_size, raw ))
+				continue;
+			p_data = (const uint8_t*)raw.data();
+			byte_size = (uint32_t)raw.size();
+		}
+
+		bool found;
+		CKvsShared* p_shared = m_dedup.Acquire( hash, (p_data) ? p_data : (const uint8_t*)"", byte_size, found );
+		if (!p_shared)
+		{
+			m_emsg = "LoadShared() out of memory";
+			ok = false;
+			break;
+		}
+		p_shared->m_persisted.store( true );
+		p_shared->m_syncedKeys = sqlite3_column_int(statement, 3);
+		p_shared->Release();
+	}
+	sqlite3_finalize(statement);
+
+	if (ok && rc != SQLITE_DONE)
+	{
+		m_emsg = std::string("LoadShared() Step Error: ") + std::string(sqlite3_errmsg(mp_db));
+		ok = false;
+	}
+
+	return ok;
+}
+
+///////////////////////////////////////////////////////////////////////////////////
+// the caller holds m_mutex, at the start of a sync. The keys naming each entry are
+// counted afresh: those named by none have their rows deleted, and once nothing else
+// references them either, are freed. Those whose row is missing or counts other than
+// now are given in dirty, each with a reference taken and its count; with all, as for a
+// full sync, every entry named is, its row written afresh
+void CKeyValueStore::CollectShared( std::vector< std::pair<CKvsShared*, int32_t> >& dirty, std::vector<std::string>& deletes, bool all )
+{
+	std::lock_guard<std::mutex> lock( m_dedup.m_mutex );
+
+	deletes.swap( m_dedup.m_deletes );
+	if (m_dedup.m_entries.empty())
+		return;
+
+	std::unordered_map<std::string, CKvsShared*>::iterator e;
+	for (e = m_dedup.m_entries.begin(); e != m_dedup.m_entries.end(); e++)
+		e->second->m_keys = 0;
+
+	for (CKvsPairs::iterator it = m_pairs.begin(); it != m_pairs.end(); ++it)
+	{
+		if (it->second.m_shared)
+			it->second.m_shared->m_keys++;
+	}
+
+	e = m_dedup.m_entries.begin();
+	while (e != m_dedup.m_entries.end())
+	{
+		CKvsShared* p_shared = e->second;
+		if (p_shared->m_keys == 0)
+		{
+			if (p_shared->m_persisted.load())
+			{
+				deletes.push_back( p_shared->m_hash );
+				p_shared->m_persisted.store( false );
+				p_shared->m_syncedKeys = -1;
+			}
+			if (p_shared->m_refs.load() == 0)
+			{
+				delete p_shared;
+				e = m_dedup.m_entries.erase( e );
+				continue;
+			}
+		}
+		else if (all || !p_shared->m_persisted.load() || p_shared->m_keys != p_shared->m_syncedKeys)
+		{
+			if (all)
+				p_shared->m_persisted.store( false );
+			p_shared->AddRef();
+			p_shared->m_syncedKeys = p_shared->m_keys;
+			dirty.push_back( std::make_pair( p_shared, p_shared->m_keys ) );
+		}
+		e++;
+	}
+}
+
+///////////////////////////////////////////////////////////////////////////////////
+// the caller holds m_dbMutex and the transaction. An entry's row goes in before any key
+// naming it is stepped, which is why StepRows() leaves a key whose entry is not yet
+// persisted as its row was
+bool CKeyValueStore::PersistShared( const std::vector< std::pair<CKvsShared*, int32_t> >& dirty, const std::vector<std::string>& deletes )
+{
+	bool          ok = true;
+	sqlite3_stmt* statement;
+
+	if (!deletes.empty())
+	{
+		if (sqlite3_prepare_v2(mp_db, "DELETE FROM keyValueShared WHERE hash = ?1;", -1, &statement, NULL) != SQLITE_OK)
+			return false;
+		for (size_t i = 0; i < deletes.size(); i++)
+		{
+			sqlite3_bind_blob(statement, 1, deletes[i].data(), (int)deletes[i].size(), SQLITE_STATIC);
+			if (sqlite3_step(statement) != SQLITE_DONE)
+				ok = false;
+			sqlite3_reset(statement);
+		}
+		sqlite3_finalize(statement);
+	}
+
+	if (dirty.empty())
+		return ok;
+
+	sqlite3_stmt* update;
+	if (sqlite3_prepare_v2(mp_db, "REPLACE INTO keyValueShared (hash, value, codec, refs) VALUES (?1, ?2, ?3, ?4);", -1, &statement, NULL) != SQLITE_OK)
+		return false;
+	if (sqlite3_prepare_v2(mp_db, "UPDATE keyValueShared SET refs = ?2 WHERE hash = ?1;", -1, &update, NULL) != SQLITE_OK)
+	{
+		sqlite3_finalize(statement);
+		return false;
+	}
+
+	for (size_t i = 0; i < dirty.size(); i++)
+	{
+		CKvsShared* p_shared = dirty[i].first;
+
+		if (p_shared->m_persisted.load())
+		{
+			sqlite3_bind_blob(update, 1, p_shared->m_hash.data(), (int)p_shared->m_hash.size(), SQLITE_STATIC);
+			sqlite3_bind_int(update, 2, dirty[i].second);
+			if (sqlite3_step(update) != SQLITE_DONE)
+				ok = false;
+			sqlite3_reset(update);
+			continue;
+		}
+
+		// the raw bytes, compressed if large enough, then sealed under the hash:
+		CPackedValue packed;
+		packed.mp_data = (const char*)p_shared->mp_data;
+		packed.m_size = p_shared->m_size;
+		if (m_compressThreshold && p_shared->m_size >= m_compressThreshold &&
+		    kvs_lz4_compress( p_shared->mp_data, p_shared->m_size, packed.m_scratch ))
+		{
+			packed.mp_data = packed.m_scratch.data();
+			packed.m_size = (uint32_t)packed.m_scratch.size();
+			packed.m_codec = KVS_CODEC_LZ4_BINARY;
+		}
+		if (mp_cipher)
+		{
+			if (!mp_cipher->Seal( p_shared->m_hash, (const uint8_t*)packed.mp_data, packed.m_size, packed.m_sealed ))
+			{
+				ok = false;
+				continue;
+			}
+			packed.mp_data = packed.m_sealed.data();
+			packed.m_size = (uint32_t)packed.m_sealed.size();
+			packed.m_codec |= KVS_CODEC_ENCRYPTED;
+		}
+
+		sqlite3_bind_blob(statement, 1, p_shared->m_hash.data(), (int)p_shared->m_hash.size(), SQLITE_STATIC);
+		sqlite3_bind_blob(statement, 2, packed.mp_data, (int)packed.m_size, SQLITE_STATIC);
+		sqlite3_bind_int(statement, 3, packed.m_codec);
+		sqlite3_bind_int(statement, 4, dirty[i].second);
+		if (sqlite3_step(statement) == SQLITE_DONE)
+			p_shared->m_persisted.store( true );
+		else
+			ok = false;
+		sqlite3_reset(statement);
+	}
+
+	sqlite3_finalize(statement);
+	sqlite3_finalize(update);
+	return ok;
+}
+
+///////////////////////////////////////////////////////////////////////////////////
+// after the transaction, without m_dbMutex. Rolled back, the entries are written whole
+// by the next sync, and the deletes tried again
+void CKeyValueStore::ReleaseShared( std::vector< std::pair<CKvsShared*, int32_t> >& dirty, std::vector<std::string>& deletes, bool ok )
+{
+	if (!ok && (!dirty.empty() || !deletes.empty()))
+	{
+		CKvsTimedLock guard(m_mutex, m_stats);
+		std::lock_guard<std::mutex> lock( m_dedup.m_mutex );
+
+		for (size_t i = 0; i < dirty.size(); i++)
+		{
+			dirty[i].first->m_persisted.store( false );
+			dirty[i].first->m_syncedKeys = -1;
+		}
+		m_dedup.m_deletes.insert( m_dedup.m_deletes.end(), deletes.begin(), deletes.end() );
+	}
+
+	for (size_t i = 0; i < dirty.size(); i++)
+		dirty[i].first->Release();
+	dirty.clear();
+}
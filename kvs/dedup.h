@@ -0,0 +1,137 @@
+/////////////////////////////////////////////////////////////////////////////
+// Name:        dedup.h
+// Purpose:     content addressed binary values. With a dedup threshold set,
+//							each distinct WriteBinary() value at or above it is held
+//							once, named by its SHA-256, and every key holding those bytes
+//							points at the one copy. With an encryption key the name is
+//							an HMAC-SHA-256 under a key derived from it instead, as the
+//							names are stored in the clear.
+//
+//							In RAM a CKvsShared holds the raw bytes, counted by the
+//							CKeyValues referencing it, with no base64 kept. In the db
+//							the keyValueShared table holds them once, compressed and
+//							sealed as other values are, with the number of keys naming
+//							them; each of those keys' rows holds only the hash, under
+//							codec KVS_CODEC_SHARED. Writing bytes the store already
+//							holds costs a hash and a lookup: no allocation, copy or
+//							encode.
+//
+//							Entries nothing references are freed, and their rows
+//							deleted, by the next sync.
+/////////////////////////////////////////////////////////////////////////////
+
+#ifndef _KVS_DEDUP_H_
+#define _KVS_DEDUP_H_
+
+#include <cstdint>
+#include <cstdlib>
+#include <string>
+#include <unordered_map>
+#include <vector>
+#include <mutex>
+#include <atomic>
+
+#define KVS_DEDUP_HASH_SIZE   (32)    // SHA-256, or HMAC-SHA-256 with a key
+
+class CKvsShared
+{
+public:
+	CKvsShared( const std::string& hash, const uint8_t* data, uint32_t byte_size );
+	~CKvsShared();
+
+	void AddRef( void )  { m_refs.fetch_add( 1, std::memory_order_relaxed ); }
+	void Release( void ) { m_refs.fetch_sub( 1, std::memory_order_acq_rel ); }
+
+	std::string          m_hash;
+	uint8_t*             mp_data;
+	uint32_t             m_size;
+	std::atomic<int32_t> m_refs;        // CKeyValues referencing it, in the store or copied out
+
+	// guarded by the store's m_mutex; only the sync uses them:
+	int32_t              m_keys;        // keys of the store naming it, as last counted
+	int32_t              m_syncedKeys;  // the refs its row holds, -1 if unknown
+	std::atomic<bool>    m_persisted;   // its row is in the db, or going in with this sync
+
+private:
+	CKvsShared( const CKvsShared& );
+	CKvsShared& operator=( const CKvsShared& );
+};
+
+// a reference to a CKvsShared, as held by a CKeyValue; copies count as references:
+class CKvsSharedRef
+{
+public:
+	CKvsSharedRef() : mp_shared(NULL) {}
+	CKvsSharedRef( const CKvsSharedRef& other ) : mp_shared(other.mp_shared) { if (mp_shared) mp_shared->AddRef(); }
+	CKvsSharedRef( CKvsSharedRef&& other ) : mp_shared(other.mp_shared) { other.mp_shared = NULL; }
+	~CKvsSharedRef() { Reset(); }
+
+	CKvsSharedRef& operator=( const CKvsSharedRef& other )
+	{
+		if (other.mp_shared)
+			other.mp_shared->AddRef();
+		Reset();
+		mp_shared = other.mp_shared;
+		return *this;
+	}
+	CKvsSharedRef& operator=( CKvsSharedRef&& other )
+	{
+		if (this != &other)
+		{
+			Reset();
+			mp_shared = other.mp_shared;
+			other.mp_shared = NULL;
+		}
+		return *this;
+	}
+
+	// takes over a reference the caller holds:
+	void        Adopt( CKvsShared* p_shared ) { Reset(); mp_shared = p_shared; }
+	void        Reset( void ) { if (mp_shared) mp_shared->Release(); mp_shared = NULL; }
+
+	CKvsShared* Get( void ) const { return mp_shared; }
+	CKvsShared* operator->( void ) const { return mp_shared; }
+	explicit operator bool( void ) const { return mp_shared != NULL; }
+
+private:
+	CKvsShared* mp_shared;
+};
+
+// the store's shared values by hash. Its own mutex guards the table, so values loaded
+// with their key's hash alone can be found from outside the store's lock:
+class CKvsDedup
+{
+public:
+	CKvsDedup() : m_keyed(false) {}
+	~CKvsDedup();
+
+	// Hash() is keyed with the KVS_DEDUP_HASH_SIZE bytes of key from here on; set before
+	// any value is hashed:
+	void        SetKey( const uint8_t* key );
+	bool        IsKeyed( void ) const { return m_keyed; }
+
+	// the SHA-256 of data, or its HMAC under the key, as KVS_DEDUP_HASH_SIZE raw bytes;
+	// empty if it failed:
+	std::string Hash( const uint8_t* data, uint32_t byte_size ) const;
+
+	// the entry of hash with a reference taken for the caller, NULL if there is none:
+	CKvsShared* Acquire( const std::string& hash );
+	// as Acquire(), creating the entry from data if missing; found says which. NULL only
+	// if out of memory:
+	CKvsShared* Acquire( const std::string& hash, const uint8_t* data, uint32_t byte_size, bool& found );
+
+	size_t      Size( void );
+
+	std::mutex  m_mutex;
+	std::unordered_map<std::string, CKvsShared*> m_entries;
+	std::vector<std::string> m_deletes;   // hashes whose rows the next sync deletes
+
+private:
+	CKvsDedup( const CKvsDedup& );
+	CKvsDedup& operator=( const CKvsDedup& );
+
+	uint8_t     m_key[KVS_DEDUP_HASH_SIZE];
+	bool        m_keyed;
+};
+
+#endif // _KVS_DEDUP_H_
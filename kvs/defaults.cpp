@@ -0,0 +1,74 @@
+////////////////////////////////////////////////////////////////////////////
+// Name:        defaults.cpp
+// Purpose:     the registry of default values read in place of missing keys
+/////////////////////////////////////////////////////////////////////////////
+
+#include <algorithm>
+#include "kvs.h"
+
+///////////////////////////////////////////////////////////////////////////////////
+static bool kvs_default_less( const CKvsDefault& a, const CKvsDefault& b )
+{
+	return strcmp( a.m_key, b.m_key ) < 0;
+}
+
+///////////////////////////////////////////////////////////////////////////////////
+void CKvsDefaults::Register( const CKvsDefault* table, size_t count )
+{
+	bool sorted = kvs_defaults_sorted( table, count ) &&
+	              (m_entries.empty() || !count || strcmp( m_entries.back().m_key, table[0].m_key ) < 0);
+
+	m_entries.insert( m_entries.end(), table, table + count );
+	if (sorted)
+		return;
+
+	// a stable sort keeps each key's registrations in order, so the last of them is kept:
+	std::stable_sort( m_entries.begin(), m_entries.end(), kvs_default_less );
+
+	size_t kept = 0;
+	for (size_t i = 0; i < m_entries.size(); i++)
+	{
+		if (kept && strcmp( m_entries[kept - 1].m_key, m_entries[i].m_key ) == 0)
+			m_entries[kept - 1] = m_entries[i];
+		else
+			m_entries[kept++] = m_entries[i];
+	}
+	m_entries.resize( kept );
+}
+
+///////////////////////////////////////////////////////////////////////////////////
+const char* CKvsDefaults::Find( const std::string& key ) const
+{
+	size_t lo = 0;
+	size_t hi = m_entries.size();
+	while (lo < hi)
+	{
+		size_t mid = lo + (hi - lo) / 2;
+		int32_t cmp = strcmp( m_entries[mid].m_key, key.c_str() );
+		if (cmp == 0)
+			return m_entries[mid].m_value;
+		if (cmp < 0)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	return NULL;
+}
+
+///////////////////////////////////////////////////////////////////////////////////
+size_t CKvsDefaults::Size( void ) const
+{
+	return m_entries.size();
+}
+
+///////////////////////////////////////////////////////////////////////////////////
+void CKeyValueStore::RegisterDefaults( const CKvsDefault* table, size_t count )
+{
+	m_defaults.Register( table, count );
+}
+
+///////////////////////////////////////////////////////////////////////////////////
+void CKeyValueStore::SetMaterializeDefaults( bool materialize )
+{
+	m_materializeDefaults = materialize;
+}
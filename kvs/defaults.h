@@ -0,0 +1,95 @@
+/////////////////////////////////////////////////////////////////////////////
+// Name:        defaults.h
+// Purpose:     a registry of default values, kept apart from the store's keys.
+//
+//							An application registers its defaults once, typically from a
+//							constexpr table of string literals. A read of a missing key
+//							with a registered default returns it without creating the
+//							key, so defaults never reach m_pairs or the db; only keys
+//							actually written are stored. Looking a default up is a binary
+//							search over the table's pointers, with no allocation.
+//
+//							The registry holds the table's pointers, not copies: the
+//							strings must outlive the store, as literals do. Register
+//							before other threads use the store.
+/////////////////////////////////////////////////////////////////////////////
+
+#ifndef _KVS_DEFAULTS_H_
+#define _KVS_DEFAULTS_H_
+
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <vector>
+
+// a key's default, in the text form Write*() would store (bools "1"/"0"):
+struct CKvsDefault
+{
+	const char* m_key;
+	const char* m_value;
+};
+
+// true if table's keys are in strictly ascending order, so a constexpr table can be
+// checked with static_assert; a sorted table registers without a sort:
+constexpr bool kvs_defaults_sorted( const CKvsDefault* table, size_t count )
+{
+	for (size_t i = 1; i < count; i++)
+	{
+		const char* a = table[i - 1].m_key;
+		const char* b = table[i].m_key;
+		while (*a && *a == *b)
+		{
+			a++;
+			b++;
+		}
+		if ((unsigned char)*a >= (unsigned char)*b)
+			return false;
+	}
+	return true;
+}
+
+// a registered default's text parsed as a read of that type would parse a stored value;
+// the caller's default when there is none, or it doesn't parse:
+inline int32_t kvs_default_int( const char* text, int32_t defaultValue )
+{
+	if (!text)
+		return defaultValue;
+	char* p;
+	int32_t value = (int32_t)strtol( text, &p, 0 );
+	return (*p == 0) ? value : defaultValue;
+}
+
+inline bool kvs_default_bool( const char* text, bool defaultValue )
+{
+	if (!text)
+		return defaultValue;
+	char* p;
+	int32_t value = (int32_t)strtol( text, &p, 0 );
+	return (*p == 0) ? (value != 0) : defaultValue;
+}
+
+inline float kvs_default_real( const char* text, float defaultValue )
+{
+	if (!text)
+		return defaultValue;
+	char* p;
+	float value = (float)strtod( text, &p );
+	return (*p == 0) ? value : defaultValue;
+}
+
+class CKvsDefaults
+{
+public:
+	// adds table's entries, a key registered again taking its latest value:
+	void        Register( const CKvsDefault* table, size_t count );
+
+	// the default text of key, NULL if none is registered:
+	const char* Find( const std::string& key ) const;
+	size_t      Size( void ) const;
+
+private:
+	std::vector<CKvsDefault> m_entries;   // sorted by key, no key twice
+};
+
+#endif // _KVS_DEFAULTS_H_
@@ -0,0 +1,435 @@
+////////////////////////////////////////////////////////////////////////////
+// Name:        digest.cpp
+// Purpose:     Merkle digests of a CKeyValueStore's keys and values
+/////////////////////////////////////////////////////////////////////////////
+
+#include <algorithm>
+#include "kvs.h"
+
+#define KVS_DIGEST_MAGIC        "KVSD"
+#define KVS_DIGEST_LEAF_SEED    (0x243f6a8885a308d3ull)   // which leaf a key falls in
+#define KVS_DIGEST_KEY_SEED     (0x13198a2e03707344ull)   // a key's digest, the key's part
+#define KVS_DIGEST_EXPIRES_SEED (0xa4093822299f31d0ull)   // and its expiry's
+
+///////////////////////////////////////////////////////////////////////////////////
+static inline uint64_t kvs_digest_mix( uint64_t h )
+{
+	h ^= h >> 33;
+	h *= 0xff51afd7ed558ccdull;
+	h ^= h >> 33;
+	h *= 0xc4ceb9fe1a85ec53ull;
+	h ^= h >> 33;
+	return h;
+}
+
+///////////////////////////////////////////////////////////////////////////////////
+// eight bytes a step, then the tail
+static inline uint64_t kvs_digest_hash( const char* p, size_t n, uint64_t seed )
+{
+	uint64_t h = seed ^ ((uint64_t)n * 0x9e3779b97f4a7c15ull);
+
+	while (n >= 8)
+	{
+		uint64_t w;
+		memcpy( &w, p, 8 );
+		h = (h ^ kvs_digest_mix( w )) * 0x87c37b91114253d5ull;
+		p += 8;
+		n -= 8;
+	}
+	uint64_t w = 0;
+	memcpy( &w, p, n );
+	h ^= kvs_digest_mix( w + n );
+	return kvs_digest_mix( h );
+}
+
+///////////////////////////////////////////////////////////////////////////////////
+// a node's hash of its children, 0 only above empty leaves
+static inline uint64_t kvs_digest_combine( uint64_t left, uint64_t right )
+{
+	if (!left && !right)
+		return 0;
+	uint64_t h = kvs_digest_mix( kvs_digest_mix( left ) ^ (right + 0x9e3779b97f4a7c15ull) );
+	return (h) ? h : 1;
+}
+
+///////////////////////////////////////////////////////////////////////////////////
+static void kvs_digest_put_u32( std::string& out, uint32_t v )
+{
+	char b[4];
+	for (int32_t i = 0; i < 4; i++)
+		b[i] = (char)(v >> (8 * i));
+	out.append( b, 4 );
+}
+
+///////////////////////////////////////////////////////////////////////////////////
+static uint32_t kvs_digest_get_u32( const char* p )
+{
+	const uint8_t* b = reinterpret_cast<const uint8_t*>(p);
+	return (uint32_t)b[0] | ((uint32_t)b[1] << 8) | ((uint32_t)b[2] << 16) | ((uint32_t)b[3] << 24);
+}
+
+///////////////////////////////////////////////////////////////////////////////////
+void CKvsDigestTree::Reset( uint32_t depth )
+{
+	m_depth = depth;
+	m_nodes.assign( (size_t)2 << depth, 0 );
+}
+
+///////////////////////////////////////////////////////////////////////////////////
+uint32_t CKvsDigestTree::Leaf( const std::string& key, uint32_t depth )
+{
+	if (depth == 0)
+		return 0;
+	return (uint32_t)(kvs_digest_hash( key.data(), key.size(), KVS_DIGEST_LEAF_SEED ) >> (64 - depth));
+}
+
+///////////////////////////////////////////////////////////////////////////////////
+// the value is hashed seeded by the key's hash, so no split of the same bytes between
+// key and value digests alike. Never 0, which a CKeyValue's m_digest keeps for uncounted
+uint64_t CKvsDigestTree::KeyDigest( const std::string& key, const std::string& value, int64_t expires )
+{
+	uint64_t h = kvs_digest_hash( key.data(), key.size(), KVS_DIGEST_KEY_SEED );
+	h = kvs_digest_hash( value.data(), value.size(), h );
+	h = kvs_digest_mix( h ^ kvs_digest_mix( (uint64_t)expires + KVS_DIGEST_EXPIRES_SEED ) );
+	return (h) ? h : 1;
+}
+
+///////////////////////////////////////////////////////////////////////////////////
+bool CKvsDigestTree::Diff( const CKvsDigestTree& a, const CKvsDigestTree& b, std::vector<uint32_t>& leaves )
+{
+	leaves.clear();
+	if (a.m_depth != b.m_depth || a.m_nodes.size() != b.m_nodes.size())
+		return false;
+
+	// depth first, the right child pushed first, so leaves come out in order:
+	uint32_t first = a.Leaves();
+	std::vector<uint32_t> stack( 1, 1 );
+	while (!stack.empty())
+	{
+		uint32_t node = stack.back();
+		stack.pop_back();
+		if (a.m_nodes[node] == b.m_nodes[node])
+			continue;
+
+		if (node >= first)
+		{
+			leaves.push_back( node - first );
+			continue;
+		}
+		stack.push_back( 2 * node + 1 );
+		stack.push_back( 2 * node );
+	}
+	return true;
+}
+
+///////////////////////////////////////////////////////////////////////////////////
+void CKvsDigestTree::DiffKeys( const std::vector<KVS_DIGEST_KEY>& a, const std::vector<KVS_DIGEST_KEY>& b,
+                               std::vector<std::string>& keys )
+{
+	keys.clear();
+
+	size_t i = 0, j = 0;
+	while (i < a.size() || j < b.size())
+	{
+		if (j == b.size() || (i < a.size() && a[i].first < b[j].first))
+		{
+			keys.push_back( a[i++].first );
+		}
+		else if (i == a.size() || b[j].first < a[i].first)
+		{
+			keys.push_back( b[j++].first );
+		}
+		else
+		{
+			if (a[i].second != b[j].second)
+				keys.push_back( a[i].first );
+			i++;
+			j++;
+		}
+	}
+}
+
+///////////////////////////////////////////////////////////////////////////////////
+std::string CKvsDigestTree::Serialize( void ) const
+{
+	std::string out( KVS_DIGEST_MAGIC );
+	kvs_digest_put_u32( out, m_depth );
+	for (size_t n = 1; n < m_nodes.size(); n++)
+	{
+		kvs_digest_put_u32( out, (uint32_t)m_nodes[n] );
+		kvs_digest_put_u32( out, (uint32_t)(m_nodes[n] >> 32) );
+	}
+	return out;
+}
+
+///////////////////////////////////////////////////////////////////////////////////
+bool CKvsDigestTree::Parse( const std::string& data )
+{
+	if (data.size() < 8 || data.compare( 0, 4, KVS_DIGEST_MAGIC ) != 0)
+		return false;
+
+	uint32_t depth = kvs_digest_get_u32( data.data() + 4 );
+	if (depth > KVS_DIGEST_MAX_DEPTH || data.size() != 8 + 8 * (((size_t)2 << depth) - 1))
+		return false;
+
+	Reset( depth );
+	const char* p = data.data() + 8;
+	for (size_t n = 1; n < m_nodes.size(); n++, p += 8)
+		m_nodes[n] = (uint64_t)kvs_digest_get_u32( p ) | ((uint64_t)kvs_digest_get_u32( p + 4 ) << 32);
+	return true;
+}
+
+///////////////////////////////////////////////////////////////////////////////////
+void CKvsDigest::Reset( uint32_t depth )
+{
+	m_depth = depth;
+	m_tree.Reset( depth );
+	m_sums.assign( m_tree.Leaves(), 0 );
+	m_counts.assign( m_tree.Leaves(), 0 );
+	m_isDirty.assign( m_tree.Leaves(), 0 );
+	m_dirty.clear();
+	std::vector<std::string>().swap( m_pending );
+}
+
+///////////////////////////////////////////////////////////////////////////////////
+void CKvsDigest::Add( const std::string& key, uint64_t digest )
+{
+	uint32_t leaf = CKvsDigestTree::Leaf( key, m_depth );
+	m_sums[leaf] += digest;
+	m_counts[leaf]++;
+	if (!m_isDirty[leaf])
+	{
+		m_isDirty[leaf] = 1;
+		m_dirty.push_back( leaf );
+	}
+}
+
+///////////////////////////////////////////////////////////////////////////////////
+void CKvsDigest::Remove( const std::string& key, uint64_t digest )
+{
+	uint32_t leaf = CKvsDigestTree::Leaf( key, m_depth );
+	m_sums[leaf] -= digest;
+	m_counts[leaf]--;
+	if (!m_isDirty[leaf])
+	{
+		m_isDirty[leaf] = 1;
+		m_dirty.push_back( leaf );
+	}
+}
+
+///////////////////////////////////////////////////////////////////////////////////
+// a level at a time from the leaves up, each changed node's parent once
+void CKvsDigest::Update( void )
+{
+	if (m_dirty.empty())
+		return;
+
+	uint32_t first = m_tree.Leaves();
+	std::vector<uint32_t> nodes;
+	nodes.reserve( m_dirty.size() );
+	for (size_t i = 0; i < m_dirty.size(); i++)
+	{
+		uint32_t leaf = m_dirty[i];
+		uint64_t h = 0;
+		if (m_counts[leaf])
+		{
+			h = kvs_digest_mix( m_sums[leaf] ^ kvs_digest_mix( (uint64_t)m_counts[leaf] ) );
+			if (!h)
+				h = 1;
+		}
+		m_tree.m_nodes[first + leaf] = h;
+		m_isDirty[leaf] = 0;
+		nodes.push_back( first + leaf );
+	}
+	m_dirty.clear();
+
+	while (nodes.size() > 1 || (nodes.size() == 1 && nodes[0] > 1))
+	{
+		for (size_t i = 0; i < nodes.size(); i++)
+			nodes[i] /= 2;
+		std::sort( nodes.begin(), nodes.end() );
+		nodes.erase( std::unique( nodes.begin(), nodes.end() ), nodes.end() );
+
+		for (size_t i = 0; i < nodes.size(); i++)
+			m_tree.m_nodes[nodes[i]] = kvs_digest_combine( m_tree.m_nodes[2 * nodes[i]], m_tree.m_nodes[2 * nodes[i] + 1] );
+	}
+}
+
+///////////////////////////////////////////////////////////////////////////////////
+// as Freeze() reads values: counters by their count, shared values as their base64; a
+// value that will not decode is hashed packed, and differs from its decoded form elsewhere
+uint64_t CKeyValueStore::ValueDigest( CKeyValue& kv )
+{
+	m_stats.Add( KVS_STAT_DIGEST_KEYS, 1 );
+
+	if (kv.mp_counter)
+		return CKvsDigestTree::KeyDigest( kv.m_key, std::to_string( kv.mp_counter->load() ), kv.m_expires );
+	if (kv.m_shared)
+		return CKvsDigestTree::KeyDigest( kv.m_key, base64_encode( kv.m_shared->mp_data, kv.m_shared->m_size ), kv.m_expires );
+	if ((kv.m_codec & KVS_CODEC_MASK) != KVS_CODEC_SHARED && DecodePacked( kv ))
+		return CKvsDigestTree::KeyDigest( kv.m_key, kv.m_value, kv.m_expires );
+	return CKvsDigestTree::KeyDigest( kv.m_key, std::to_string( kv.m_codec ) + kv.m_packed, kv.m_expires );
+}
+
+///////////////////////////////////////////////////////////////////////////////////
+// under m_mutex: builds the tree the first time, after that adds the digests of keys
+// written since and of counters changed since
+void CKeyValueStore::FlushDigests( void )
+{
+	if (!m_digests.m_built)
+	{
+		m_digests.Reset( m_digests.m_depth );
+		for (CKvsPairs::iterator it = m_pairs.begin(); it != m_pairs.end(); ++it)
+		{
+			it->second.m_digest = ValueDigest( it->second );
+			m_digests.Add( it->second.m_key, it->second.m_digest );
+		}
+		m_digests.m_built = true;
+		m_digests.Update();
+		return;
+	}
+
+	// keys created by a read's default, or as a counter, have no version and are not listed
+	// by NextVersion(); they are in m_unsyncedKeys until the sync after this:
+	for (int32_t list = 0; list < 2; list++)
+	{
+		const std::vector<std::string>& keys = (list == 0) ? m_digests.m_pending : m_unsyncedKeys;
+		for (size_t i = 0; i < keys.size(); i++)
+		{
+			CKvsPairs::iterator it = m_pairs.find( keys[i] );
+			if (it == m_pairs.end() || it->second.m_digest)
+				continue;
+			it->second.m_digest = ValueDigest( it->second );
+			m_digests.Add( it->second.m_key, it->second.m_digest );
+		}
+	}
+	std::vector<std::string>().swap( m_digests.m_pending );
+
+	for (std::deque<CKvsCounter>::iterator c = m_counters.begin(); c != m_counters.end(); ++c)
+	{
+		CKvsPairs::iterator it = m_pairs.find( c->m_key );
+		if (it == m_pairs.end() || it->second.mp_counter != &c->m_value)
+			continue;
+
+		CKeyValue& kv = it->second;
+		uint64_t digest = CKvsDigestTree::KeyDigest( kv.m_key, std::to_string( c->m_value.load() ), kv.m_expires );
+		if (digest == kv.m_digest)
+			continue;
+		if (kv.m_digest)
+			m_digests.Remove( kv.m_key, kv.m_digest );
+		kv.m_digest = digest;
+		m_digests.Add( kv.m_key, digest );
+	}
+
+	m_digests.Update();
+}
+
+///////////////////////////////////////////////////////////////////////////////////
+// under m_mutex, from NextVersion(): the key's old digest comes out now, while its old
+// value is there to have made it, and the new one goes in upon the next flush
+void CKeyValueStore::UncountDigest( const std::string& key, CKvsPairs::iterator it )
+{
+	if (it == m_pairs.end())
+	{
+		m_digests.m_pending.push_back( key );
+	}
+	else if (it->second.m_digest)
+	{
+		m_digests.Remove( key, it->second.m_digest );
+		it->second.m_digest = 0;
+		m_digests.m_pending.push_back( key );
+	}
+}
+
+///////////////////////////////////////////////////////////////////////////////////
+void CKeyValueStore::SetDigestDepth( uint32_t depth )
+{
+	if (depth > KVS_DIGEST_MAX_DEPTH)
+		depth = KVS_DIGEST_MAX_DEPTH;
+
+	// prevent other threads from changing our data during this operation:
+	CKvsTimedLock guard(m_mutex, m_stats);
+	if (depth == m_digests.m_depth)
+		return;
+
+	// rebuilt at the new depth when next asked for:
+	m_digests.m_depth = depth;
+	m_digests.m_built = false;
+	std::vector<std::string>().swap( m_digests.m_pending );
+}
+
+///////////////////////////////////////////////////////////////////////////////////
+bool CKeyValueStore::Digest( CKvsDigestTree& tree )
+{
+	LazyInit(); // even if LazyInit fails, we continue...
+
+	// prevent other threads from changing our data during this operation:
+	CKvsTimedLock guard(m_mutex, m_stats);
+
+	// keys past their expiry would read as missing, so they are gone first:
+	ReclaimExpired();
+	FlushDigests();
+	tree = m_digests.m_tree;
+	return true;
+}
+
+///////////////////////////////////////////////////////////////////////////////////
+uint64_t CKeyValueStore::Fingerprint( void )
+{
+	LazyInit(); // even if LazyInit fails, we continue...
+
+	// prevent other threads from changing our data during this operation:
+	CKvsTimedLock guard(m_mutex, m_stats);
+
+	ReclaimExpired();
+	FlushDigests();
+	return m_digests.m_tree.Root();
+}
+
+///////////////////////////////////////////////////////////////////////////////////
+bool CKeyValueStore::Diff( const CKvsDigestTree& other, std::vector<uint32_t>& leaves )
+{
+	CKvsDigestTree mine;
+	Digest( mine );
+
+	if (!CKvsDigestTree::Diff( mine, other, leaves ))
+	{
+		m_emsg = "Diff() the trees' depths differ, " + std::to_string( mine.Depth() ) + " and " + std::to_string( other.Depth() );
+		return false;
+	}
+	return true;
+}
+
+///////////////////////////////////////////////////////////////////////////////////
+// a leaf's keys are spread over the key order, so this is a pass over every key; only
+// those in the leaves are copied out, and none hashed but those written since
+bool CKeyValueStore::DigestKeys( const std::vector<uint32_t>& leaves, std::vector<KVS_DIGEST_KEY>& keys )
+{
+	LazyInit(); // even if LazyInit fails, we continue...
+
+	keys.clear();
+
+	// prevent other threads from changing our data during this operation:
+	CKvsTimedLock guard(m_mutex, m_stats);
+
+	ReclaimExpired();
+	FlushDigests();
+
+	std::vector<uint8_t> wanted( m_digests.m_tree.Leaves(), 0 );
+	for (size_t i = 0; i < leaves.size(); i++)
+	{
+		if (leaves[i] >= wanted.size())
+		{
+			m_emsg = "DigestKeys() no leaf " + std::to_string( leaves[i] ) + " in a tree of depth " + std::to_string( m_digests.m_depth );
+			return false;
+		}
+		wanted[leaves[i]] = 1;
+	}
+
+	for (CKvsPairs::iterator it = m_pairs.begin(); it != m_pairs.end(); ++it)
+	{
+		if (wanted[CKvsDigestTree::Leaf( it->second.m_key, m_digests.m_depth )])
+			keys.push_back( KVS_DIGEST_KEY( it->second.m_key, it->second.m_digest ) );
+	}
+	return true;
+}
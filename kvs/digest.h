@@ -0,0 +1,98 @@
+/////////////////////////////////////////////////////////////////////////////
+// Name:        digest.h
+// Purpose:     Merkle digests of a store's keys and values, telling whether
+//							two stores hold the same, and if not where they differ,
+//							without comparing them key by key.
+//
+//							Keys are spread over 2^depth leaves by a hash of the key, so
+//							each leaf is a range of that hash's space and the same key
+//							lands in the same leaf on every node. A key's digest is a
+//							64 bit hash of the key, its value as read and its expiry; a
+//							leaf's is the sum of its keys', so a write changes it by
+//							taking the old digest away and adding the new. Each node
+//							above hashes its two children, and the root is the whole
+//							store's fingerprint.
+//
+//							The store keeps its tree from the first Digest(), Fingerprint(),
+//							Diff() or DigestKeys() on; until then writes pay nothing.
+//							From then, a write takes its key's old digest out of its leaf
+//							and lists the key, and its new digest is hashed the next time
+//							the tree is read, or by the next sync, so writes hash nothing.
+//							Counters, which change without the store's lock, are hashed
+//							by value then too.
+//
+//							Diff() descends only into nodes whose hashes differ, so d
+//							differing leaves are found in O(d * depth). DigestKeys() then
+//							lists those leaves' keys with their digests, for DiffKeys() to
+//							compare with the other side's list.
+/////////////////////////////////////////////////////////////////////////////
+
+#ifndef _KVS_DIGEST_H_
+#define _KVS_DIGEST_H_
+
+#include <cstdint>
+#include <string>
+#include <vector>
+#include <utility>
+
+#define KVS_DIGEST_DEPTH        (12)      // 4096 leaves by default
+#define KVS_DIGEST_MAX_DEPTH    (24)
+
+// a key and its digest, as DigestKeys() lists them:
+typedef std::pair<std::string, uint64_t> KVS_DIGEST_KEY;
+
+// a tree of digests, the store's or a copy of it: node 1 is the root, node i's children
+// are 2i and 2i + 1, and leaf l is node Leaves() + l. An empty leaf, or node above only
+// empty ones, is 0
+class CKvsDigestTree
+{
+public:
+	CKvsDigestTree() : m_depth(0), m_nodes(2, 0) {}
+
+	void     Reset( uint32_t depth );
+	uint32_t Depth( void ) const  { return m_depth; }
+	uint32_t Leaves( void ) const { return 1u << m_depth; }
+	uint64_t Root( void ) const   { return m_nodes[1]; }
+
+	// the leaf key falls in, in a tree of depth:
+	static uint32_t Leaf( const std::string& key, uint32_t depth );
+	// a key's digest, from its value in text form:
+	static uint64_t KeyDigest( const std::string& key, const std::string& value, int64_t expires );
+
+	// the leaves whose digests differ between a and b, in order; false if their depths differ:
+	static bool Diff( const CKvsDigestTree& a, const CKvsDigestTree& b, std::vector<uint32_t>& leaves );
+	// the keys in only one of two lists sorted by key, or in both with different digests:
+	static void DiffKeys( const std::vector<KVS_DIGEST_KEY>& a, const std::vector<KVS_DIGEST_KEY>& b,
+	                      std::vector<std::string>& keys );
+
+	// to send to another node: "KVSD", u32 depth, then nodes 1 on as u64s, little endian:
+	std::string Serialize( void ) const;
+	bool        Parse( const std::string& data );
+
+	uint32_t              m_depth;
+	std::vector<uint64_t> m_nodes;
+};
+
+// the store's tree and what keeps it current, all guarded by the store's m_mutex:
+class CKvsDigest
+{
+public:
+	CKvsDigest() : m_built(false), m_depth(KVS_DIGEST_DEPTH) {}
+
+	void     Reset( uint32_t depth );
+	void     Add( const std::string& key, uint64_t digest );
+	void     Remove( const std::string& key, uint64_t digest );
+	// rehashes the leaves changed since, and the nodes above them:
+	void     Update( void );
+
+	bool                     m_built;       // the tree holds every key; false until first asked for
+	uint32_t                 m_depth;       // of the tree once built
+	CKvsDigestTree           m_tree;
+	std::vector<uint64_t>    m_sums;        // each leaf's keys' digests, summed
+	std::vector<uint32_t>    m_counts;      // and how many there are
+	std::vector<uint32_t>    m_dirty;       // leaves changed since Update()
+	std::vector<uint8_t>     m_isDirty;
+	std::vector<std::string> m_pending;     // keys written since, their new digests not yet added
+};
+
+#endif // _KVS_DIGEST_H_
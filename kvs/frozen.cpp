@@ -0,0 +1,352 @@
+////////////////////////////////////////////////////////////////////////////
+// Name:        frozen.cpp
+// Purpose:     the minimal perfect hash index of a frozen CKeyValueStore
+/////////////////////////////////////////////////////////////////////////////
+
+#include <algorithm>
+#include "kvs.h"
+
+#define KVS_FROZEN_SEEDS    (16)      // seeds tried before Build() gives up
+
+///////////////////////////////////////////////////////////////////////////////////
+static inline uint64_t kvs_frozen_mix( uint64_t h )
+{
+	h ^= h >> 33;
+	h *= 0xff51afd7ed558ccdull;
+	h ^= h >> 33;
+	h *= 0xc4ceb9fe1a85ec53ull;
+	h ^= h >> 33;
+	return h;
+}
+
+///////////////////////////////////////////////////////////////////////////////////
+// eight bytes a step, then the tail
+static inline uint64_t kvs_frozen_hash( const std::string& key, uint64_t seed )
+{
+	const char* p = key.data();
+	size_t      n = key.size();
+	uint64_t    h = seed ^ ((uint64_t)n * 0x9e3779b97f4a7c15ull);
+
+	while (n >= 8)
+	{
+		uint64_t w;
+		memcpy( &w, p, 8 );
+		h = (h ^ kvs_frozen_mix( w )) * 0x87c37b91114253d5ull;
+		p += 8;
+		n -= 8;
+	}
+	uint64_t w = 0;
+	memcpy( &w, p, n );
+	h ^= kvs_frozen_mix( w + n );
+	return kvs_frozen_mix( h );
+}
+
+///////////////////////////////////////////////////////////////////////////////////
+// x scaled into [0, n) by a multiply, as a modulo would without the divide
+static inline uint32_t kvs_frozen_reduce( uint32_t x, uint32_t n )
+{
+	return (uint32_t)(((uint64_t)x * n) >> 32);
+}
+
+///////////////////////////////////////////////////////////////////////////////////
+static inline uint32_t kvs_frozen_displaced( uint64_t hash, uint32_t displace, uint32_t n )
+{
+	return kvs_frozen_reduce( (uint32_t)kvs_frozen_mix( hash + displace * 0x9e3779b97f4a7c15ull ), n );
+}
+
+///////////////////////////////////////////////////////////////////////////////////
+CKvsFrozen::CKvsFrozen()
+{
+	m_seed = 0;
+	m_buckets = 0;
+	mp_block = NULL;
+	mp_arena = NULL;
+	m_arenaSize = 0;
+}
+
+///////////////////////////////////////////////////////////////////////////////////
+CKvsFrozen::~CKvsFrozen()
+{
+	free( mp_block );
+}
+
+///////////////////////////////////////////////////////////////////////////////////
+bool CKvsFrozen::Build( const std::vector<const std::string*>& keys, const std::vector<const std::string*>& values,
+                        const std::vector<int64_t>& expires )
+{
+	uint32_t n = (uint32_t)keys.size();
+	if (keys.size() >= KVS_FROZEN_DIRECT)
+		return false;
+
+	// a seed under which two keys share a whole hash can't be perfect, so is passed over:
+	std::vector<uint64_t> hashes( n );
+	bool placed = false;
+	for (uint64_t seed = 0; !placed && seed < KVS_FROZEN_SEEDS; seed++)
+	{
+		for (uint32_t i = 0; i < n; i++)
+			hashes[i] = kvs_frozen_hash( *keys[i], seed );
+
+		std::vector<uint64_t> sorted( hashes );
+		std::sort( sorted.begin(), sorted.end() );
+		if (std::adjacent_find( sorted.begin(), sorted.end() ) != sorted.end())
+			continue;
+
+		placed = Place( hashes, seed );
+	}
+	if (!placed)
+		return false;
+
+	// the records go in slot order, so neighbouring slots have neighbouring records:
+	uint64_t total = 0;
+	for (uint32_t s = 0; s < n; s++)
+	{
+		uint32_t i = m_order[s];
+		total += ((expires[i]) ? 8 : 0) + keys[i]->size() + values[i]->size();
+	}
+	if (total > 0xffffffffull)
+		return false;
+
+	m_arenaSize = (size_t)total;
+	mp_block = (char*)malloc( m_arenaSize + 64 );
+	if (!mp_block)
+		return false;
+	mp_arena = (char*)(((uintptr_t)mp_block + 63) & ~(uintptr_t)63);
+
+	m_slots.resize( n );
+	uint32_t offset = 0;
+	for (uint32_t s = 0; s < n; s++)
+	{
+		uint32_t        i = m_order[s];
+		CKvsFrozenSlot& slot = m_slots[s];
+
+		slot.m_hash = hashes[i];
+		slot.m_offset = offset;
+		slot.m_keySize = (uint32_t)keys[i]->size();
+		slot.m_valueSize = (uint32_t)values[i]->size();
+		slot.m_flags = 0;
+
+		char* p;
+		slot.m_int = (int32_t)strtol( values[i]->c_str(), &p, 0 );
+		if (*p == 0)
+			slot.m_flags |= KVS_FROZEN_INT;
+		slot.m_real = (float)strtod( values[i]->c_str(), &p );
+		if (*p == 0)
+			slot.m_flags |= KVS_FROZEN_REAL;
+
+		if (expires[i])
+		{
+			slot.m_flags |= KVS_FROZEN_TTL;
+			memcpy( mp_arena + offset, &expires[i], 8 );
+			offset += 8;
+		}
+		memcpy( mp_arena + offset, keys[i]->data(), slot.m_keySize );
+		offset += slot.m_keySize;
+		memcpy( mp_arena + offset, values[i]->data(), slot.m_valueSize );
+		offset += slot.m_valueSize;
+	}
+
+	std::vector<uint32_t>().swap( m_order );
+	return true;
+}
+
+///////////////////////////////////////////////////////////////////////////////////
+// the buckets with most keys are placed first, while most slots are free; those of one
+// key take the free slots left, in order
+bool CKvsFrozen::Place( const std::vector<uint64_t>& hashes, uint64_t seed )
+{
+	uint32_t n = (uint32_t)hashes.size();
+
+	m_seed = seed;
+	m_buckets = (n + KVS_FROZEN_BUCKET_KEYS - 1) / KVS_FROZEN_BUCKET_KEYS;
+	if (m_buckets == 0)
+		m_buckets = 1;
+	m_displace.assign( m_buckets, 0 );
+	m_order.assign( n, 0 );
+
+	// the keys of each bucket, contiguous, by a counting sort:
+	std::vector<uint32_t> start( m_buckets + 1, 0 );
+	for (uint32_t i = 0; i < n; i++)
+		start[ kvs_frozen_reduce( (uint32_t)(hashes[i] >> 32), m_buckets ) + 1 ]++;
+	for (uint32_t b = 0; b < m_buckets; b++)
+		start[b + 1] += start[b];
+
+	std::vector<uint32_t> members( n );
+	std::vector<uint32_t> fill( start.begin(), start.end() - 1 );
+	for (uint32_t i = 0; i < n; i++)
+		members[ fill[ kvs_frozen_reduce( (uint32_t)(hashes[i] >> 32), m_buckets ) ]++ ] = i;
+
+	std::vector<uint32_t> byCount( m_buckets );
+	for (uint32_t b = 0; b < m_buckets; b++)
+		byCount[b] = b;
+	std::stable_sort( byCount.begin(), byCount.end(), [&start]( uint32_t a, uint32_t b )
+		{ return start[a + 1] - start[a] > start[b + 1] - start[b]; } );
+
+	std::vector<char>     taken( n, 0 );
+	std::vector<uint32_t> slots;
+	uint32_t              nextFree = 0;
+
+	for (uint32_t k = 0; k < m_buckets; k++)
+	{
+		uint32_t b = byCount[k];
+		uint32_t size = start[b + 1] - start[b];
+		if (size == 0)
+			break;
+
+		if (size == 1)
+		{
+			while (taken[nextFree])
+				nextFree++;
+			taken[nextFree] = 1;
+			m_displace[b] = KVS_FROZEN_DIRECT | nextFree;
+			m_order[nextFree] = members[ start[b] ];
+			continue;
+		}
+
+		bool found = false;
+		for (uint32_t d = 0; !found && d < KVS_FROZEN_MAX_TRIES; d++)
+		{
+			slots.clear();
+			found = true;
+			for (uint32_t j = start[b]; found && j < start[b + 1]; j++)
+			{
+				uint32_t s = kvs_frozen_displaced( hashes[ members[j] ], d, n );
+				if (taken[s] || std::find( slots.begin(), slots.end(), s ) != slots.end())
+					found = false;
+				else
+					slots.push_back( s );
+			}
+			if (found)
+			{
+				m_displace[b] = d;
+				for (uint32_t j = 0; j < size; j++)
+				{
+					taken[ slots[j] ] = 1;
+					m_order[ slots[j] ] = members[ start[b] + j ];
+				}
+			}
+		}
+		if (!found)
+			return false;
+	}
+	return true;
+}
+
+///////////////////////////////////////////////////////////////////////////////////
+uint32_t CKvsFrozen::Slot( uint64_t hash ) const
+{
+	uint32_t d = m_displace[ kvs_frozen_reduce( (uint32_t)(hash >> 32), m_buckets ) ];
+	if (d & KVS_FROZEN_DIRECT)
+		return d & ~KVS_FROZEN_DIRECT;
+	return kvs_frozen_displaced( hash, d, (uint32_t)m_slots.size() );
+}
+
+///////////////////////////////////////////////////////////////////////////////////
+const CKvsFrozenSlot* CKvsFrozen::Find( const std::string& key ) const
+{
+	if (m_slots.empty())
+		return NULL;
+
+	uint64_t hash = kvs_frozen_hash( key, m_seed );
+	const CKvsFrozenSlot* p_slot = &m_slots[ Slot( hash ) ];
+	if (p_slot->m_hash != hash || p_slot->m_keySize != key.size())
+		return NULL;
+
+	const char* p = mp_arena + p_slot->m_offset;
+	if (p_slot->m_flags & KVS_FROZEN_TTL)
+	{
+		int64_t expires;
+		memcpy( &expires, p, 8 );
+		if (expires <= kvs_now_ms())
+			return NULL;
+		p += 8;
+	}
+	return (memcmp( p, key.data(), key.size() ) == 0) ? p_slot : NULL;
+}
+
+///////////////////////////////////////////////////////////////////////////////////
+const char* CKvsFrozen::Value( const CKvsFrozenSlot* p_slot ) const
+{
+	return mp_arena + p_slot->m_offset + ((p_slot->m_flags & KVS_FROZEN_TTL) ? 8 : 0) + p_slot->m_keySize;
+}
+
+///////////////////////////////////////////////////////////////////////////////////
+size_t CKvsFrozen::Size( void ) const
+{
+	return m_slots.size();
+}
+
+///////////////////////////////////////////////////////////////////////////////////
+// values are decoded and counters read once, here, so reads of the index are plain
+bool CKeyValueStore::Freeze( void )
+{
+	LazyInit(); // even if LazyInit fails, we continue...
+
+	CKvsTimedLock guard(m_mutex, m_stats);
+	if (mp_frozen.load())
+		return true;
+
+	std::vector<const std::string*> keys;
+	std::vector<const std::string*> values;
+	std::vector<int64_t>            expires;
+	std::deque<std::string>         madeValues;		// of counters and shared values, held by no entry
+
+	keys.reserve( m_pairs.size() );
+	values.reserve( m_pairs.size() );
+	expires.reserve( m_pairs.size() );
+
+	for (CKvsPairs::iterator it = m_pairs.begin(); it != m_pairs.end(); ++it)
+	{
+		CKeyValue& kv = it->second;
+		if (kv.Expired())
+			continue;
+
+		if (kv.mp_counter)
+		{
+			madeValues.push_back( std::to_string( kv.mp_counter->load() ) );
+			values.push_back( &madeValues.back() );
+		}
+		else if (kv.m_shared)
+		{
+			madeValues.push_back( base64_encode( kv.m_shared->mp_data, kv.m_shared->m_size ) );
+			values.push_back( &madeValues.back() );
+		}
+		else
+		{
+			if (!DecodePacked( kv ))
+			{
+				m_emsg = "Freeze() unable to decode the value of " + kv.m_key;
+				return false;
+			}
+			values.push_back( &kv.m_value );
+		}
+		keys.push_back( &kv.m_key );
+		expires.push_back( kv.m_expires );
+	}
+
+	CKvsFrozen* p_frozen = new CKvsFrozen;
+	if (!p_frozen->Build( keys, values, expires ))
+	{
+		delete p_frozen;
+		m_emsg = "Freeze() unable to build the index";
+		return false;
+	}
+
+	mp_frozen.store( p_frozen, std::memory_order_release );
+	return true;
+}
+
+///////////////////////////////////////////////////////////////////////////////////
+bool CKeyValueStore::isFrozen( void )
+{
+	return mp_frozen.load( std::memory_order_acquire ) != NULL;
+}
+
+///////////////////////////////////////////////////////////////////////////////////
+bool CKeyValueStore::RejectFrozen( const char* op )
+{
+	if (!mp_frozen.load( std::memory_order_acquire ))
+		return false;
+
+	m_emsg = std::string(op) + " the store is frozen";
+	return true;
+}
@@ -0,0 +1,81 @@
+/////////////////////////////////////////////////////////////////////////////
+// Name:        frozen.h
+// Purpose:     the read only index of a frozen CKeyValueStore: a minimal
+//							perfect hash over its keys, and their values packed together.
+//
+//							The hash is hash-and-displace (CHD): a key's 64 bit hash picks
+//							a bucket of about KVS_FROZEN_BUCKET_KEYS keys, and the
+//							bucket's displacement, found at build time, sends each of
+//							its keys to a slot no other key has. Buckets of one key
+//							name their slot outright, which lets the last keys fill the
+//							last free slots, so there are exactly as many slots as keys.
+//
+//							A lookup is one hash, one displacement, one slot and one key
+//							compare, with no lock. Each slot holds the hash, where its
+//							record lies in the arena, and the value parsed as an int and
+//							a real; the arena is one 64 byte aligned block of records,
+//							each its key then its value.
+/////////////////////////////////////////////////////////////////////////////
+
+#ifndef _KVS_FROZEN_H_
+#define _KVS_FROZEN_H_
+
+#include <cstdint>
+#include <cstring>
+#include <string>
+#include <vector>
+
+#define KVS_FROZEN_BUCKET_KEYS    (4)         // average keys per bucket
+#define KVS_FROZEN_MAX_TRIES      (1 << 20)   // displacements tried per bucket before a new seed
+#define KVS_FROZEN_DIRECT         (0x80000000u)  // flag: a displacement that is the slot itself
+
+// slot flags:
+#define KVS_FROZEN_INT            (0x01)      // m_int holds the value
+#define KVS_FROZEN_REAL           (0x02)      // m_real holds the value
+#define KVS_FROZEN_TTL            (0x04)      // the record starts with its i64 expires
+
+struct CKvsFrozenSlot
+{
+	uint64_t m_hash;
+	uint32_t m_offset;          // of the record in the arena
+	uint32_t m_keySize;
+	uint32_t m_valueSize;
+	int32_t  m_int;
+	float    m_real;
+	uint32_t m_flags;
+};
+
+class CKvsFrozen
+{
+public:
+	CKvsFrozen();
+	~CKvsFrozen();
+
+	// key and value pairs, the values as decoded text; expires 0 for never. False if no
+	// perfect hash was found, which in practice does not happen:
+	bool        Build( const std::vector<const std::string*>& keys, const std::vector<const std::string*>& values,
+	                   const std::vector<int64_t>& expires );
+
+	// key's slot; NULL if it is missing or has expired:
+	const CKvsFrozenSlot* Find( const std::string& key ) const;
+	const char* Value( const CKvsFrozenSlot* p_slot ) const;
+	size_t      Size( void ) const;
+
+private:
+	CKvsFrozen( const CKvsFrozen& );
+	CKvsFrozen& operator=( const CKvsFrozen& );
+
+	uint32_t    Slot( uint64_t hash ) const;
+	bool        Place( const std::vector<uint64_t>& hashes, uint64_t seed );
+
+	uint64_t              m_seed;
+	uint32_t              m_buckets;
+	std::vector<uint32_t> m_displace;   // per bucket
+	std::vector<CKvsFrozenSlot> m_slots;
+	std::vector<uint32_t> m_order;      // during Build(), the key index of each slot
+	char*                 mp_block;     // as allocated
+	char*                 mp_arena;     // mp_block aligned to 64 bytes
+	size_t                m_arenaSize;
+};
+
+#endif // _KVS_FROZEN_H_
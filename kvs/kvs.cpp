@@ -8,8 +8,6 @@
 
 #include "kvs.h"
 
-#define ACTUALLY_DO_ENCRYPTION (0)   // if false, encryption does not happen
-
 ///////////////////////////////////////////////////////////////////////////////////
 CKeyValue::CKeyValue( const char* keyStr, const char* valueStr )
 {
@@ -17,6 +15,11 @@ CKeyValue::CKeyValue( const char* keyStr, const char* valueStr )
 	m_value = valueStr;
 	mp_binaryData = NULL;
 	m_binarySize = 0;
+	m_codec = KVS_CODEC_NONE;
+	mp_counter = NULL;
+	m_expires = 0;
+	m_version = 0;
+	m_digest = 0;
 }
 
 //////////////////////////////////////////////////////////////////////////////////////////
@@ -28,6 +31,12 @@ CKeyValue::CKeyValue( const char* keyStr, std::string& valueStr, uint8_t* value,
 {
 	m_key = keyStr;
 	m_value = valueStr;
+	m_binarySize = 0;
+	m_codec = KVS_CODEC_NONE;
+	mp_counter = NULL;
+	m_expires = 0;
+	m_version = 0;
+	m_digest = 0;
 	mp_binaryData = (uint8_t*)malloc( sizeof(uint8_t) * byte_size );
 	if ( mp_binaryData != NULL )
 	{ 
@@ -37,11 +46,77 @@ CKeyValue::CKeyValue( const char* keyStr, std::string& valueStr, uint8_t* value,
 }
 
 CKeyValue::~CKeyValue() {}
+
+///////////////////////////////////////////////////////////////////////////////////
+void CKeyValue::SetValue( const char* valueStr )
+{
+	m_value = valueStr;
+
+	FreeBinary();
+
+	m_codec = KVS_CODEC_NONE;
+	std::string().swap( m_packed );
+
+	// a thread still holding the old counter bumps it unseen, as if before this write:
+	mp_counter = NULL;
+	m_expires = 0;
+}
+
+///////////////////////////////////////////////////////////////////////////////////
+void CKeyValue::FreeBinary( void )
+{
+	// a shared value's bytes are the entry's:
+	if (!m_shared || mp_binaryData != m_shared->mp_data)
+		free( mp_binaryData );
+	if (m_shared)
+		m_shared.Reset();
+
+	mp_binaryData = NULL;
+	m_binarySize = 0;
+}
+
+///////////////////////////////////////////////////////////////////////////////////
+void CKeyValue::Share( CKvsShared* p_shared )
+{
+	FreeBinary();
+
+	m_shared.Adopt( p_shared );
+	mp_binaryData = p_shared->mp_data;
+	m_binarySize = p_shared->m_size;
+
+	std::string().swap( m_value );
+	std::string().swap( m_packed );
+	m_codec = KVS_CODEC_SHARED;
+}
+
+///////////////////////////////////////////////////////////////////////////////////
+// the node is made in a map of its own, where its key can be pointed at its own m_key
+// before it moves into pairs; nodes never move again, so the view stays good
+std::pair<CKvsPairs::iterator, bool> kvs_insert_pair( CKvsPairs& pairs, CKvsPairs::const_iterator hint, const CKeyValue& kv )
+{
+	CKvsPairs one;
+	one.emplace( std::string_view( kv.m_key ), kv );
+
+	CKvsPairs::node_type node = one.extract( one.begin() );
+	node.key() = node.mapped().m_key;
+
+	size_t              count = pairs.size();
+	CKvsPairs::iterator it = pairs.insert( hint, std::move( node ) );
+	return std::make_pair( it, pairs.size() != count );
+}
 ///////////////////////////////////////////////////////////////////////////////////
 
 
 ///////////////////////////////////////////////////////////////////////////////////
 CKeyValueStore::CKeyValueStore( const char* keyValueStorePath, KVS_ERROR_CALLBACK cb, void* cb_data )
+	: CKeyValueStore( keyValueStorePath, cb, cb_data, NULL, 0 )
+{
+}
+
+///////////////////////////////////////////////////////////////////////////////////
+CKeyValueStore::CKeyValueStore( const char* keyValueStorePath, KVS_ERROR_CALLBACK cb, void* cb_data,
+                                const uint8_t* key, uint32_t key_size )
+	: m_wheel( kvs_now_ms(), KVS_TTL_TICK_MS ), m_staleTimers( 0 )
 {
 	mp_error_callback = cb;
 	mp_error_object = cb_data;
@@ -55,38 +130,80 @@ CKeyValueStore::CKeyValueStore( const char* keyValueStorePath, KVS_ERROR_CALLBAC
 
 	m_readBinaryErrorState = 0;
 	m_writeBinaryErrorState = 0;
-	
-	// when working with a private compile of this code, change this for weak but okay
-	// encryption on the usernames and passwords embedded in ip cam urls and email settings:
-	m_passkey = "zg[dh$K;r.,!~YJ[db*qGxY2_JQwnrWh(;%Nk+'7ebqb,J`#w&^C[4T]_,+(GVZt^g7n7ha3n?DE[R_"; 
-	// be sure to check ACTUALLY_DO_ENCRYPTION !!
-	// Actually, if you really care about encryption, replace the encrypt/decrypt logic with your own.
+
+	m_compressThreshold = KVS_DEFAULT_COMPRESS_THRESHOLD;
+	m_dedupThreshold = 0;
+
+	m_version = 0;
+	m_syncedVersion = 0;
+	m_refreshSeq = 0;
+	m_dataVersion = 0;
+	m_watching.store( false );
+	m_tombstoneAgeMs = KVS_TOMBSTONE_AGE_MS;
+	m_prunedMs = 0;
+
+	mp_log = NULL;
+	m_logSequence = 0;
+	m_logOffset = 0;
+
+	m_materializeDefaults = true;
+
+	m_writeEpoch.m_value.store( 0 );
+	m_readCache.store( false );
+	m_cacheId = CKvsReadCache::NextId();
+	mp_frozen.store( NULL );
+
+	m_loadThreads = 0;
+	m_decodeOnLoad = false;
+	m_writeAheadLog = false;
+	m_initDone.store( false );
+
+	// no key, no encryption:
+	mp_cipher = NULL;
+	if (key && key_size)
+	{
+		mp_cipher = new CKvsCipher( key, key_size );
+		if (!mp_cipher->IsValid())
+		{
+			// refuse to silently persist plaintext; Init() will report the error
+			m_emsg = "CKeyValueStore() unable to set up value encryption";
+			m_state = 1;
+		}
+		else
+			m_dedup.SetKey( mp_cipher->HashKey() );
+	}
 }
 
 ///////////////////////////////////////////////////////////////////////////////////
 CKeyValueStore::~CKeyValueStore()
 {
+	// the watcher stops first, as it refreshes on its own thread:
+	Unwatch();
+	// a background open still loading has to finish before anything is torn down:
+	if (m_opener.joinable())
+		m_opener.join();
+	// and so do any *Async() calls still queued:
+	m_io.Stop();
+
 	if (m_state == 0)
 	{
-		SyncToDiskStorage(false);
+		SyncToDiskStorage(false, true);
 
 		// spin through getting rid of any allocated binary data and each map element:
-		std::map<std::string, CKeyValue>::iterator it = m_pairs.begin();
+		CKvsPairs::iterator it = m_pairs.begin();
 		while (it != m_pairs.end())
 		{
-			CKeyValue& kv = it->second;
-			if (kv.mp_binaryData)
-			{
-				free(kv.mp_binaryData);
-				kv.mp_binaryData = NULL;
-			}
-
+			it->second.FreeBinary();
 			it = m_pairs.erase(it);
 		}
 
 	}
 
 	 if (mp_db) sqlite3_close(mp_db);
+
+	 delete mp_log;
+	 delete mp_frozen.load();
+	 delete mp_cipher;
 }
 
 ////////////////////////////////////////////////////////////////////////////////
@@ -125,12 +242,39 @@ bool CKeyValueStore::VerifyCreateDirectory(std::string& directory)
 ////////////////////////////////////////////////////////////////////
 bool CKeyValueStore::DeleteKey( std::string& key )
 {
-	std::map<std::string, CKeyValue>::iterator it = m_pairs.find(key);
-	if (it == m_pairs.end())
-		 return false;					// key did not exist
+	if (RejectFrozen( "DeleteKey()" ))
+		return false;
+
+	std::unique_lock<std::mutex> dbLock;
+	{
+		// prevent other threads from changing our data during this operation:
+		CKvsTimedLock guard(m_mutex, m_stats);
+
+		CKvsPairs::iterator it = m_pairs.find(key);
+		if (it == m_pairs.end())
+			 return false;					// key did not exist
+
+		NextVersion( key, it );
+		if (it->second.m_expires)
+			m_staleTimers++;
+		it->second.FreeBinary();
+		m_pairs.erase(it);				// remove from RAM cache
+
+		if (mp_log)
+			mp_log->Append( KVS_LOG_DELETE, key, std::string(), 0 );
+
+		// the db lock is taken before the store's lock is let go, as a commit does, so no
+		// write and sync of the key made after this can reach the db ahead of its delete:
+		if (mp_db)
+			dbLock = std::unique_lock<std::mutex>( m_dbMutex );
+	}
 
-	RemoveKeyFromDB(key);			// remove from disk cache
-	m_pairs.erase(it);				// remove from RAM cache
+	if (dbLock.owns_lock() && RemoveKeyFromDB(key) != 0)		// remove from disk cache
+	{
+		dbLock.unlock();
+		RequeueDelete( key, false );
+	}
+	m_stats.Add( KVS_STAT_DELETES, 1 );
 
 	return true;
 }
@@ -138,46 +282,68 @@ bool CKeyValueStore::DeleteKey( std::string& key )
 ////////////////////////////////////////////////////////////////////
 int32_t CKeyValueStore::DeleteKeysStartingWith(std::string& keyPrefix )
 {
+	if (RejectFrozen( "DeleteKeysStartingWith()" ))
+		return 0;
+
 	int32_t deleted_key_count = 0;
 	int32_t prefix_len = (int32_t)keyPrefix.size();
+	std::unique_lock<std::mutex> dbLock;
 
-	// spin through...
-	std::map<std::string, CKeyValue>::iterator it = m_pairs.begin();
-	while (it != m_pairs.end())
 	{
-		CKeyValue& kv = it->second;
-		if (kv.m_key.compare( 0, prefix_len, keyPrefix ) == 0)
+		// prevent other threads from changing our data during this operation:
+		CKvsTimedLock guard(m_mutex, m_stats);
+
+		// the keys with the prefix are contiguous, from the first not below it:
+		CKvsPairs::iterator it = m_pairs.lower_bound( keyPrefix );
+		while (it != m_pairs.end() && it->first.compare( 0, prefix_len, keyPrefix ) == 0)
 		{
-			RemoveKeyFromDB(kv.m_key);	// remove from disk cache
+			CKeyValue& kv = it->second;
+			NextVersion( kv.m_key, it );
+			if (kv.m_expires)
+				m_staleTimers++;
+			kv.FreeBinary();
 			it = m_pairs.erase(it);			// remove from RAM cache
 			deleted_key_count++;
 		}
-		else it++;
+
+		// one record for them all, a follower finding the same keys:
+		if (mp_log && deleted_key_count)
+			mp_log->Append( KVS_LOG_DELETE_PREFIX, keyPrefix, std::string(), 0 );
+
+		// ordered with the store's lock, as DeleteKey() does:
+		if (mp_db && deleted_key_count)
+			dbLock = std::unique_lock<std::mutex>( m_dbMutex );
+	}
+
+	if (dbLock.owns_lock() && RemoveKeysFromDB(keyPrefix) != 0)	// remove from disk cache
+	{
+		dbLock.unlock();
+		RequeueDelete( keyPrefix, true );
 	}
 
+	m_stats.Add( KVS_STAT_DELETES, deleted_key_count );
+
 	return deleted_key_count;
 }
 
-///////////////////////////////////////////////////////////////////////////////////
-uint8_t* CKeyValueStore::encrypt( uint8_t* msg, uint32_t msg_len, std::string const&key )
+////////////////////////////////////////////////////////////////////
+// a row a delete left in the db goes with the next sync's deletes, ahead of its writes. A key
+// written again since has its row written after them, though it has no newer version by then
+void CKeyValueStore::RequeueDelete( const std::string& key, bool prefix )
 {
-	if (ACTUALLY_DO_ENCRYPTION == false)
-		 return msg;
+	CKvsTimedLock guard(m_mutex, m_stats);
 
-	if (key.empty())
-     return msg;
-    
-	int32_t key_size = (int32_t)key.size();
-  for (uint32_t i = 0; i < msg_len; i++)
-      msg[i] ^= key[ i%key_size ];
-  
-	return msg;
-}
+	if (prefix)
+		m_deletedPrefixes.push_back( key );
+	else
+		m_expiredKeys.push_back( key );
 
-///////////////////////////////////////////////////////////////////////////////////
-uint8_t* CKeyValueStore::decrypt( uint8_t* msg, uint32_t msg_len, std::string const&key )
-{
-	return encrypt( msg, msg_len, key );
+	CKvsPairs::iterator it = m_pairs.lower_bound( key );
+	while (it != m_pairs.end() && (it->first == key || (prefix && it->first.compare( 0, key.size(), key ) == 0)))
+	{
+		m_unsyncedKeys.push_back( it->second.m_key );
+		++it;
+	}
 }
 
 ///////////////////////////////////////////////////////////////////////////////////////////////
@@ -192,9 +358,17 @@ int32_t CKeyValueStore::Init( void )
 	if (!this)
 		 return 1;
 
+	if (m_initDone.load( std::memory_order_acquire ))
+		return m_state;
+
+	// a background open may be under way; wait for it rather than open twice:
+	std::lock_guard<std::mutex> guard(m_initMutex);
+
 	// if just created, not initialized yet
 	if (m_state == -1) 
 	{
+		std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+
 		if (OpenDB( m_path.c_str() ))
 		{
 			ReadKeyValueStoreFromDisk();
@@ -203,11 +377,41 @@ int32_t CKeyValueStore::Init( void )
 		{
 			m_state = 1;	// means read error
 		}
+
+		m_stats.Add( KVS_STAT_LOADS, 1 );
+		m_stats.Add( KVS_STAT_LOAD_NS, (uint64_t)std::chrono::duration_cast<std::chrono::nanoseconds>(
+		                                std::chrono::steady_clock::now() - start).count() );
+		m_stats.Add( KVS_STAT_LOAD_ROWS, m_pairs.size() );
 	}
 	
+	m_initDone.store( true, std::memory_order_release );
 	return m_state;
 }
 
+///////////////////////////////////////////////////////////////////////////////////
+void CKeyValueStore::OpenInBackground( void )
+{
+	std::lock_guard<std::mutex> guard(m_initMutex);
+
+	if (m_opener.joinable() || m_initDone.load())
+		return;
+
+	// errors are left for the first LazyInit() to report, on the caller's thread:
+	m_opener = std::thread( [this]() { Init(); } );
+}
+
+///////////////////////////////////////////////////////////////////////////////////
+void CKeyValueStore::SetLoadThreads( uint32_t threads )
+{
+	m_loadThreads = threads;
+}
+
+///////////////////////////////////////////////////////////////////////////////////
+void CKeyValueStore::SetDecodeOnLoad( bool decode )
+{
+	m_decodeOnLoad = decode;
+}
+
 ///////////////////////////////////////////////////////////////////////////////////
 int32_t CKeyValueStore::GetStatus( void )
 {
@@ -256,30 +460,63 @@ bool CKeyValueStore::isParam( std::string& valueStr, float& value )
 ///////////////////////////////////////////////////////////////////////////////////
 bool CKeyValueStore::isKey( std::string& key )
 {
+	const CKvsFrozen* p_frozen = mp_frozen.load( std::memory_order_acquire );
+	if (p_frozen)
+		return p_frozen->Find( key ) != NULL;
+
 	LazyInit(); // even if LazyInit fails, we continue...
 
-	std::map<std::string, CKeyValue>::iterator it = m_pairs.find(key);
+	// prevent other threads from changing our data during this operation:
+	CKvsTimedLock guard(m_mutex, m_stats);
+
+	CKvsPairs::iterator it = m_pairs.find(key);
 	if (it == m_pairs.end())
 		 return false;					// key did not exist
 
-	return true;
+	return !it->second.Expired();
 }
 
 ///////////////////////////////////////////////////////////////////////////////////
 bool CKeyValueStore::ReadBool( std::string& key, bool defaultValue )
 {
+	// frozen, a lookup of the index is all there is:
+	const CKvsFrozen* p_frozen = mp_frozen.load( std::memory_order_acquire );
+	if (p_frozen)
+	{
+		const CKvsFrozenSlot* p_slot = p_frozen->Find( key );
+		if (p_slot)
+			return (p_slot->m_flags & KVS_FROZEN_INT) ? (p_slot->m_int != 0) : defaultValue;
+		return kvs_default_bool( m_defaults.Find( key ), defaultValue );
+	}
+
+	CKvsCachedValue* p_cached = CachedRead( key );
+	if (p_cached)
+		return (p_cached->m_isInt) ? (p_cached->m_int != 0) : defaultValue;
+
 	LazyInit(); // even if LazyInit fails, we continue...
 
+	CKvsOpTimer timer(m_stats, KVS_HIST_READ);
+
+	// prevent other threads from changing our data during this operation, as a value
+	// still packed is decoded in place:
+	CKvsTimedLock guard(m_mutex, m_stats);
+
 	// Create an iterator of map
-	std::map<std::string, CKeyValue>::iterator it;
+	CKvsPairs::iterator it;
 
 	// Find the element with key:
 	it = m_pairs.find(key);
 
-	// Check if element exists in map or not
-	if (it != m_pairs.end()) 
+	// Check if element exists in map or not, an expired one reading as missing:
+	if (it != m_pairs.end() && !it->second.Expired()) 
 	{
-		CKeyValue kv = it->second;
+		m_stats.Add( KVS_STAT_READ_HITS, 1 );
+
+		CKeyValue& kv = it->second;
+		if (kv.mp_counter)
+			return (kv.mp_counter->load() != 0);
+		if (!DecodePacked( kv ))
+			return defaultValue;
 
 		// expecting the value to be a zero or one, it could be anything:
 		int32_t numVal;
@@ -297,12 +534,24 @@ bool CKeyValueStore::ReadBool( std::string& key, bool defaultValue )
 	}
 	else 
 	{
+		m_stats.Add( KVS_STAT_READ_MISSES, 1 );
+
+		// a registered default is only read, as is any default with materializing off:
+		const char* registered = m_defaults.Find( key );
+		if (registered || !m_materializeDefaults)
+			return kvs_default_bool( registered, defaultValue );
+
 		// the key was not found, so it is created:
 		const char *boolStrVal = (defaultValue) ? "1" : "0";
 		//
 		CKeyValue kv(key.c_str(), boolStrVal);
 		//
-		m_pairs.insert(std::make_pair(key, kv));		// insert into RAM cache
+		// an expired key keeps its place until reclaimed, so only a missing one gets the default:
+		if (kvs_insert_pair( m_pairs, m_pairs.end(), kv ).second)		// insert into RAM cache
+		{
+			m_stats.Add( KVS_STAT_READ_DEFAULT_INSERTS, 1 );
+			m_unsyncedKeys.push_back( kv.m_key );	// created without a version, so listed for the sync
+		}
 		// SetValToDB( kv );														// insert into DB cache
 	}
 
@@ -312,18 +561,44 @@ bool CKeyValueStore::ReadBool( std::string& key, bool defaultValue )
 ///////////////////////////////////////////////////////////////////////////////////
 int32_t CKeyValueStore::ReadInt( std::string& key, int32_t defaultValue )
 {
+	// frozen, a lookup of the index is all there is:
+	const CKvsFrozen* p_frozen = mp_frozen.load( std::memory_order_acquire );
+	if (p_frozen)
+	{
+		const CKvsFrozenSlot* p_slot = p_frozen->Find( key );
+		if (p_slot)
+			return (p_slot->m_flags & KVS_FROZEN_INT) ? p_slot->m_int : defaultValue;
+		return kvs_default_int( m_defaults.Find( key ), defaultValue );
+	}
+
+	CKvsCachedValue* p_cached = CachedRead( key );
+	if (p_cached)
+		return (p_cached->m_isInt) ? p_cached->m_int : defaultValue;
+
 	LazyInit(); // even if LazyInit fails, we continue...
 
+	CKvsOpTimer timer(m_stats, KVS_HIST_READ);
+
+	// prevent other threads from changing our data during this operation, as a value
+	// still packed is decoded in place:
+	CKvsTimedLock guard(m_mutex, m_stats);
+
 	// Create an iterator of map
-	std::map<std::string, CKeyValue>::iterator it;
+	CKvsPairs::iterator it;
 
 	// Find the element with key:
 	it = m_pairs.find(key);
 
-	// Check if element exists in map or not
-	if (it != m_pairs.end()) 
+	// Check if element exists in map or not, an expired one reading as missing:
+	if (it != m_pairs.end() && !it->second.Expired()) 
 	{
-		CKeyValue kv = it->second;
+		m_stats.Add( KVS_STAT_READ_HITS, 1 );
+
+		CKeyValue& kv = it->second;
+		if (kv.mp_counter)
+			return kv.mp_counter->load();
+		if (!DecodePacked( kv ))
+			return defaultValue;
 
 		// expecting the value to be a number, it could be anything:
 		int32_t numVal;
@@ -341,12 +616,24 @@ int32_t CKeyValueStore::ReadInt( std::string& key, int32_t defaultValue )
 	}
 	else
 	{
+		m_stats.Add( KVS_STAT_READ_MISSES, 1 );
+
+		// a registered default is only read, as is any default with materializing off:
+		const char* registered = m_defaults.Find( key );
+		if (registered || !m_materializeDefaults)
+			return kvs_default_int( registered, defaultValue );
+
 		// the key was not found, so it is created:
 		std::string valueStr = std::to_string(defaultValue);
 		//
 		CKeyValue kv( key.c_str(), valueStr.c_str() );
 		//
-		m_pairs.insert(std::make_pair(key, kv));		// insert into RAM cache
+		// an expired key keeps its place until reclaimed, so only a missing one gets the default:
+		if (kvs_insert_pair( m_pairs, m_pairs.end(), kv ).second)		// insert into RAM cache
+		{
+			m_stats.Add( KVS_STAT_READ_DEFAULT_INSERTS, 1 );
+			m_unsyncedKeys.push_back( kv.m_key );	// created without a version, so listed for the sync
+		}
 		// SetValToDB( kv );														// insert into DB cache
 	}
 
@@ -356,18 +643,44 @@ int32_t CKeyValueStore::ReadInt( std::string& key, int32_t defaultValue )
 ///////////////////////////////////////////////////////////////////////////////////
 float CKeyValueStore::ReadReal( std::string& key, float defaultValue )
 {
+	// frozen, a lookup of the index is all there is:
+	const CKvsFrozen* p_frozen = mp_frozen.load( std::memory_order_acquire );
+	if (p_frozen)
+	{
+		const CKvsFrozenSlot* p_slot = p_frozen->Find( key );
+		if (p_slot)
+			return (p_slot->m_flags & KVS_FROZEN_REAL) ? p_slot->m_real : defaultValue;
+		return kvs_default_real( m_defaults.Find( key ), defaultValue );
+	}
+
+	CKvsCachedValue* p_cached = CachedRead( key );
+	if (p_cached)
+		return (p_cached->m_isReal) ? p_cached->m_real : defaultValue;
+
 	LazyInit(); // even if LazyInit fails, we continue...
 
+	CKvsOpTimer timer(m_stats, KVS_HIST_READ);
+
+	// prevent other threads from changing our data during this operation, as a value
+	// still packed is decoded in place:
+	CKvsTimedLock guard(m_mutex, m_stats);
+
 	// Create an iterator of map
-	std::map<std::string, CKeyValue>::iterator it;
+	CKvsPairs::iterator it;
 
 	// Find the element with key:
 	it = m_pairs.find(key);
 
-	// Check if element exists in map or not
-	if (it != m_pairs.end()) 
+	// Check if element exists in map or not, an expired one reading as missing:
+	if (it != m_pairs.end() && !it->second.Expired()) 
 	{
-		CKeyValue kv = it->second;
+		m_stats.Add( KVS_STAT_READ_HITS, 1 );
+
+		CKeyValue& kv = it->second;
+		if (kv.mp_counter)
+			return (float)kv.mp_counter->load();
+		if (!DecodePacked( kv ))
+			return defaultValue;
 
 		// expecting the value to be a float, it could be anything:
 		float numVal;
@@ -385,12 +698,24 @@ float CKeyValueStore::ReadReal( std::string& key, float defaultValue )
 	}
 	else
 	{
+		m_stats.Add( KVS_STAT_READ_MISSES, 1 );
+
+		// a registered default is only read, as is any default with materializing off:
+		const char* registered = m_defaults.Find( key );
+		if (registered || !m_materializeDefaults)
+			return kvs_default_real( registered, defaultValue );
+
 		// the key was not found, so it is created:
 		std::string valueStr = std::to_string(defaultValue);
 		//
 		CKeyValue kv( key.c_str(), valueStr.c_str() );
 		//
-		m_pairs.insert(std::make_pair(key, kv));		// insert into RAM cache
+		// an expired key keeps its place until reclaimed, so only a missing one gets the default:
+		if (kvs_insert_pair( m_pairs, m_pairs.end(), kv ).second)		// insert into RAM cache
+		{
+			m_stats.Add( KVS_STAT_READ_DEFAULT_INSERTS, 1 );
+			m_unsyncedKeys.push_back( kv.m_key );	// created without a version, so listed for the sync
+		}
 		// SetValToDB( kv );														// insert into DB cache
 	}
 
@@ -400,27 +725,65 @@ float CKeyValueStore::ReadReal( std::string& key, float defaultValue )
 ///////////////////////////////////////////////////////////////////////////////////
 std::string CKeyValueStore::ReadString( std::string& key, char* defaultValue )
 {
+	// frozen, a lookup of the index is all there is:
+	const CKvsFrozen* p_frozen = mp_frozen.load( std::memory_order_acquire );
+	if (p_frozen)
+	{
+		const CKvsFrozenSlot* p_slot = p_frozen->Find( key );
+		if (p_slot)
+			return std::string( p_frozen->Value( p_slot ), p_slot->m_valueSize );
+		return std::string( (m_defaults.Find( key )) ? m_defaults.Find( key ) : defaultValue );
+	}
+
+	CKvsCachedValue* p_cached = CachedRead( key );
+	if (p_cached)
+		return p_cached->m_value;
+
 	LazyInit(); // even if LazyInit fails, we continue...
 
+	CKvsOpTimer timer(m_stats, KVS_HIST_READ);
+
+	// prevent other threads from changing our data during this operation, as a value
+	// still packed is decoded in place:
+	CKvsTimedLock guard(m_mutex, m_stats);
+
 	// Create an iterator of map
-	std::map<std::string, CKeyValue>::iterator it;
+	CKvsPairs::iterator it;
 
 	// Find the element with key:
 	it = m_pairs.find(key);
 
-	// Check if element exists in map or not
-	if (it != m_pairs.end()) 
+	// Check if element exists in map or not, an expired one reading as missing:
+	if (it != m_pairs.end() && !it->second.Expired()) 
 	{
-		CKeyValue kv = it->second;
+		m_stats.Add( KVS_STAT_READ_HITS, 1 );
+
+		CKeyValue& kv = it->second;
+		if (kv.mp_counter)
+			return std::to_string( kv.mp_counter->load() );
+		if (!DecodePacked( kv ))
+			return std::string( defaultValue );
 		
 		return kv.m_value;
 	}
 	else
 	{
+		m_stats.Add( KVS_STAT_READ_MISSES, 1 );
+
+		// a registered default is only read, as is any default with materializing off:
+		const char* registered = m_defaults.Find( key );
+		if (registered || !m_materializeDefaults)
+			return std::string( (registered) ? registered : defaultValue );
+
 		// the key was not found, so it is created:
 		CKeyValue kv( key.c_str(), defaultValue );
 		//
-		m_pairs.insert(std::make_pair(key, kv));		// insert into RAM cache
+		// an expired key keeps its place until reclaimed, so only a missing one gets the default:
+		if (kvs_insert_pair( m_pairs, m_pairs.end(), kv ).second)		// insert into RAM cache
+		{
+			m_stats.Add( KVS_STAT_READ_DEFAULT_INSERTS, 1 );
+			m_unsyncedKeys.push_back( kv.m_key );	// created without a version, so listed for the sync
+		}
 		// SetValToDB( kv );														// insert into DB cache
 	}
 
@@ -529,47 +892,47 @@ uint8_t* CKeyValueStore::ReadBinary( std::string& key, uint8_t* defaultValue, ui
 {
 	LazyInit(); // even if LazyInit fails, we continue...
 
+	CKvsOpTimer timer(m_stats, KVS_HIST_READ);
+
+	// prevent other threads from changing our data during this operation, as a value
+	// still packed is decoded in place:
+	CKvsTimedLock guard(m_mutex, m_stats);
+
 	// Create an iterator of map
-	std::map<std::string, CKeyValue>::iterator it;
+	CKvsPairs::iterator it;
 
 	// Find the element with key:
 	it = m_pairs.find(key);
 
-	// Check if element exists in map or not
-	if (it != m_pairs.end()) 
+	// Check if element exists in map or not, an expired one reading as missing:
+	if (it != m_pairs.end() && !it->second.Expired()) 
 	{
-		CKeyValue kv = it->second;
+		m_stats.Add( KVS_STAT_READ_HITS, 1 );
 
-		// because this is binary data encoded as base64, it needs storage for the decoded version.
-		// That decoded version is created upon first ReadBinary(). Look for it first:
-		if (kv.m_binarySize)
-		{
-			// already decoded this one, so just return that:
-			return kv.mp_binaryData;
-		}
-
-		std::string rawDecode = base64_decode( kv.m_value );
+		return BinaryData( key, it->second, defaultValue, byte_size, false );
+	}
 
-		if ( rawDecode.size() != byte_size )
-		{
-			assert( 1 );
-		}
 
-		kv.mp_binaryData = (uint8_t*)malloc( sizeof(uint8_t) * byte_size );
-		if ( kv.mp_binaryData != NULL )
-		{
-			kv.m_binarySize = byte_size;
-			memcpy( kv.mp_binaryData, rawDecode.c_str(), byte_size );
-		}
-		return kv.mp_binaryData;
+	// binary defaults are not registered, so only materializing matters; a frozen store never does:
+	if (!m_materializeDefaults || isFrozen())
+	{
+		m_stats.Add( KVS_STAT_READ_MISSES, 1 );
+		return defaultValue;
 	}
 
-
 	// the key was not found, so it is created:
 	std::string base64_version = base64_encode((uint8_t*)defaultValue, byte_size);
 	CKeyValue kv( (const char *)key.c_str(), base64_version, defaultValue, byte_size );
 	//
-	m_pairs.insert(std::make_pair(key, kv));		// insert into RAM cache
+	m_stats.Add( KVS_STAT_READ_MISSES, 1 );
+	// an expired key keeps its place until reclaimed, so only a missing one gets the default:
+	if (kvs_insert_pair( m_pairs, m_pairs.end(), kv ).second)		// insert into RAM cache
+	{
+		m_stats.Add( KVS_STAT_READ_DEFAULT_INSERTS, 1 );
+		m_unsyncedKeys.push_back( kv.m_key );	// created without a version, so listed for the sync
+	}
+	else
+		kv.FreeBinary();
 	// SetValToDB( kv );														// insert into DB cache
 
 
@@ -577,22 +940,111 @@ uint8_t* CKeyValueStore::ReadBinary( std::string& key, uint8_t* defaultValue, ui
 }
 
 ///////////////////////////////////////////////////////////////////////////////////
-bool CKeyValueStore::WriteBool( std::string& key, bool value )
+// a shared value is read in place only by ReadBinaryView(), read only. ReadBinary()'s
+// caller may write to what it is given, so a key holding one is given its own copy upon
+// its first read; it still names the shared value, and its row the hash
+uint8_t* CKeyValueStore::BinaryData( const std::string& key, CKeyValue& kv, uint8_t* defaultValue, uint32_t byte_size, bool view )
+{
+	if (kv.m_shared)
+	{
+		if (kv.m_binarySize != byte_size)
+			return BinarySizeMismatch( key, kv.m_binarySize, byte_size, defaultValue );
+		if (view)
+			return kv.m_shared->mp_data;
+		if (kv.mp_binaryData == kv.m_shared->mp_data)
+		{
+			uint8_t* p_copy = (uint8_t*)malloc( sizeof(uint8_t) * ((byte_size) ? byte_size : 1) );
+			if (!p_copy)
+				return defaultValue;
+			memcpy( p_copy, kv.m_shared->mp_data, byte_size );
+			kv.mp_binaryData = p_copy;
+		}
+		return kv.mp_binaryData;
+	}
+
+	if (kv.mp_counter || !DecodePacked( kv ))
+		return defaultValue;
+
+	// because this is binary data encoded as base64, it needs storage for the decoded version.
+	// That decoded version is created upon first ReadBinary(). Look for it first:
+	if (kv.m_binarySize)
+	{
+		// already decoded this one, so just return that:
+		return (kv.m_binarySize == byte_size) ? kv.mp_binaryData : BinarySizeMismatch( key, kv.m_binarySize, byte_size, defaultValue );
+	}
+
+	std::string rawDecode = base64_decode( kv.m_value );
+
+	// a value of another size, such as a struct whose layout has changed since, is not
+	// copied short or past its end:
+	if ( rawDecode.size() != byte_size )
+		return BinarySizeMismatch( key, (uint32_t)rawDecode.size(), byte_size, defaultValue );
+
+	kv.mp_binaryData = (uint8_t*)malloc( sizeof(uint8_t) * byte_size );
+	if ( kv.mp_binaryData != NULL )
+	{
+		kv.m_binarySize = byte_size;
+		memcpy( kv.mp_binaryData, rawDecode.c_str(), byte_size );
+	}
+	return kv.mp_binaryData;
+}
+
+///////////////////////////////////////////////////////////////////////////////////
+const uint8_t* CKeyValueStore::ReadBinaryView( std::string& key, uint32_t byte_size )
+{
+	LazyInit(); // even if LazyInit fails, we continue...
+
+	CKvsOpTimer timer(m_stats, KVS_HIST_READ);
+	CKvsTimedLock guard(m_mutex, m_stats);
+
+	CKvsPairs::iterator it = m_pairs.find(key);
+	if (it == m_pairs.end() || it->second.Expired())
+	{
+		m_stats.Add( KVS_STAT_READ_MISSES, 1 );
+		return NULL;
+	}
+	m_stats.Add( KVS_STAT_READ_HITS, 1 );
+
+	return BinaryData( key, it->second, NULL, byte_size, true );
+}
+
+///////////////////////////////////////////////////////////////////////////////////
+uint8_t* CKeyValueStore::BinarySizeMismatch( const std::string& key, uint32_t held, uint32_t byte_size, uint8_t* defaultValue )
+{
+	m_emsg = std::string("ReadBinary() key ") + key + " holds " + std::to_string( held ) + " bytes, not " + std::to_string( byte_size );
+	m_stats.Add( KVS_STAT_READ_MISMATCHES, 1 );
+	return defaultValue;
+}
+
+///////////////////////////////////////////////////////////////////////////////////
+bool CKeyValueStore::WriteBool( std::string& key, bool value, uint64_t ttl_ms )
 {
 	LazyInit(); // even if LazyInit fails, we continue...
 
+	if (RejectFrozen( "WriteBool()" ))
+		return value;
+
+	CKvsOpTimer timer(m_stats, KVS_HIST_WRITE);
+	m_stats.Add( KVS_STAT_WRITES_BOOL, 1 );
+
+	int64_t expires = (ttl_ms) ? kvs_now_ms() + (int64_t)ttl_ms : 0;
+
 	// Create an iterator of map
-	std::map<std::string, CKeyValue>::iterator it;
+	CKvsPairs::iterator it;
 
 	// prevent other threads from changing our data during this operation:
-	std::lock_guard<std::mutex> guard(m_mutex);
+	CKvsTimedLock guard(m_mutex, m_stats);
 
 	// Find the element with key:
 	it = m_pairs.find(key);
+	uint64_t version = NextVersion( key, it );
+	int64_t  before = 0;
 	if (it != m_pairs.end()) 
 	{
 		CKeyValue& kv = it->second;
-		kv.m_value = (value) ? "1" : "0";
+		before = kv.m_expires;
+		kv.SetValue( (value) ? "1" : "0" );
+		kv.m_version = version;
 		// if (!delayWrite) { SetValToDB( kv ); }
 	}
 	else
@@ -602,30 +1054,53 @@ bool CKeyValueStore::WriteBool( std::string& key, bool value )
 		//
 		CKeyValue kv(key.c_str(), boolStrVal);
 		//
-		m_pairs.insert(std::make_pair(key, kv));		// insert into RAM cache
+		kv.m_version = version;
+		it = kvs_insert_pair( m_pairs, m_pairs.end(), kv ).first;		// insert into RAM cache
 		// if (!delayWrite) { SetValToDB( kv ); }
 	}
+	SetExpiry( key, it->second, before, expires );
+
+	if (mp_log)
+		mp_log->Append( KVS_LOG_SET, key, (value) ? "1" : "0", expires );
+
+	if (ttl_ms)
+		ReclaimExpired();
 
 	return value;
 }
 
 ///////////////////////////////////////////////////////////////////////////////////
-int32_t CKeyValueStore::WriteInt( std::string& key, int32_t value )
+int32_t CKeyValueStore::WriteInt( std::string& key, int32_t value, uint64_t ttl_ms )
 {	
 	LazyInit(); // even if LazyInit fails, we continue...
 
+	if (RejectFrozen( "WriteInt()" ))
+		return value;
+
+	CKvsOpTimer timer(m_stats, KVS_HIST_WRITE);
+	m_stats.Add( KVS_STAT_WRITES_INT, 1 );
+
+	int64_t expires = (ttl_ms) ? kvs_now_ms() + (int64_t)ttl_ms : 0;
+
 	// Create an iterator of map
-	std::map<std::string, CKeyValue>::iterator it;
+	CKvsPairs::iterator it;
 
 	// prevent other threads from changing our data during this operation:
-	std::lock_guard<std::mutex> guard(m_mutex);
+	CKvsTimedLock guard(m_mutex, m_stats);
 
 	// Find the element with key:
 	it = m_pairs.find(key);
+	uint64_t version = NextVersion( key, it );
+	int64_t  before = 0;
 	if (it != m_pairs.end()) 
 	{
 		CKeyValue& kv = it->second;
-		kv.m_value = std::to_string(value);
+		before = kv.m_expires;
+		if (kv.mp_counter)
+			kv.mp_counter->store( value );	// counters stay native
+		else
+			kv.SetValue( std::to_string(value).c_str() );
+		kv.m_version = version;
 		// if (!delayWrite) { SetValToDB( kv ); }
 	}
 	else
@@ -633,30 +1108,50 @@ int32_t CKeyValueStore::WriteInt( std::string& key, int32_t value )
 		// the key was not found, so it is created:
 		CKeyValue kv(key.c_str(), std::to_string(value).c_str());
 		//
-		m_pairs.insert(std::make_pair(key, kv));		// insert into RAM cache
+		kv.m_version = version;
+		it = kvs_insert_pair( m_pairs, m_pairs.end(), kv ).first;		// insert into RAM cache
 		// if (!delayWrite) { SetValToDB( kv ); }
 	}
+	SetExpiry( key, it->second, before, expires );
+
+	if (mp_log)
+		mp_log->Append( KVS_LOG_SET, key, std::to_string(value), expires );
+
+	if (ttl_ms)
+		ReclaimExpired();
 
 	return value;
 }
 
 ///////////////////////////////////////////////////////////////////////////////////
-float CKeyValueStore::WriteReal( std::string& key, float value )
+float CKeyValueStore::WriteReal( std::string& key, float value, uint64_t ttl_ms )
 {
 	LazyInit(); // even if LazyInit fails, we continue...
 
+	if (RejectFrozen( "WriteReal()" ))
+		return value;
+
+	CKvsOpTimer timer(m_stats, KVS_HIST_WRITE);
+	m_stats.Add( KVS_STAT_WRITES_REAL, 1 );
+
+	int64_t expires = (ttl_ms) ? kvs_now_ms() + (int64_t)ttl_ms : 0;
+
 	// Create an iterator of map
-	std::map<std::string, CKeyValue>::iterator it;
+	CKvsPairs::iterator it;
 
 	// prevent other threads from changing our data during this operation:
-	std::lock_guard<std::mutex> guard(m_mutex);
+	CKvsTimedLock guard(m_mutex, m_stats);
 
 	// Find the element with key:
 	it = m_pairs.find(key);
+	uint64_t version = NextVersion( key, it );
+	int64_t  before = 0;
 	if (it != m_pairs.end()) 
 	{
 		CKeyValue& kv = it->second;
-		kv.m_value = std::to_string(value);
+		before = kv.m_expires;
+		kv.SetValue( std::to_string(value).c_str() );
+		kv.m_version = version;
 		// if (!delayWrite) { SetValToDB( kv ); }
 	}
 	else
@@ -664,30 +1159,50 @@ float CKeyValueStore::WriteReal( std::string& key, float value )
 		// the key was not found, so it is created:
 		CKeyValue kv(key.c_str(), std::to_string(value).c_str());
 		//
-		m_pairs.insert(std::make_pair(key, kv));		// insert into RAM cache
+		kv.m_version = version;
+		it = kvs_insert_pair( m_pairs, m_pairs.end(), kv ).first;		// insert into RAM cache
 		// if (!delayWrite) { SetValToDB( kv ); }
 	}
+	SetExpiry( key, it->second, before, expires );
+
+	if (mp_log)
+		mp_log->Append( KVS_LOG_SET, key, std::to_string(value), expires );
+
+	if (ttl_ms)
+		ReclaimExpired();
 
 	return value;
 }
 
 ///////////////////////////////////////////////////////////////////////////////////
-char* CKeyValueStore::WriteString( std::string& key, char* value )
+char* CKeyValueStore::WriteString( std::string& key, char* value, uint64_t ttl_ms )
 {
 	LazyInit(); // even if LazyInit fails, we continue...
 
+	if (RejectFrozen( "WriteString()" ))
+		return value;
+
+	CKvsOpTimer timer(m_stats, KVS_HIST_WRITE);
+	m_stats.Add( KVS_STAT_WRITES_STRING, 1 );
+
+	int64_t expires = (ttl_ms) ? kvs_now_ms() + (int64_t)ttl_ms : 0;
+
 	// Create an iterator of map
-	std::map<std::string, CKeyValue>::iterator it;
+	CKvsPairs::iterator it;
 
 	// prevent other threads from changing our data during this operation:
-	std::lock_guard<std::mutex> guard(m_mutex);
+	CKvsTimedLock guard(m_mutex, m_stats);
 
 	// Find the element with key:
 	it = m_pairs.find(key);
+	uint64_t version = NextVersion( key, it );
+	int64_t  before = 0;
 	if (it != m_pairs.end()) 
 	{
 		CKeyValue& kv = it->second;
-		kv.m_value = value;
+		before = kv.m_expires;
+		kv.SetValue( value );
+		kv.m_version = version;
 		// if (!delayWrite) { SetValToDB( kv ); }
 	}
 	else
@@ -695,30 +1210,65 @@ char* CKeyValueStore::WriteString( std::string& key, char* value )
 		// the key was not found, so it is created:
 		CKeyValue kv(key.c_str(), value);
 		//
-		m_pairs.insert(std::make_pair(key, kv));		// insert into RAM cache
+		kv.m_version = version;
+		it = kvs_insert_pair( m_pairs, m_pairs.end(), kv ).first;		// insert into RAM cache
 		// if (!delayWrite) { SetValToDB( kv ); }
 	}
+	SetExpiry( key, it->second, before, expires );
+
+	if (mp_log)
+		mp_log->Append( KVS_LOG_SET, key, value, expires );
+
+	if (ttl_ms)
+		ReclaimExpired();
 
 	return value;
 }
 
 ///////////////////////////////////////////////////////////////////////////////////
-uint8_t* CKeyValueStore::WriteBinary( std::string& key, uint8_t* valuePtr, uint32_t byte_size )
+uint8_t* CKeyValueStore::WriteBinary( std::string& key, uint8_t* valuePtr, uint32_t byte_size, uint64_t ttl_ms )
 {
 	LazyInit(); // even if LazyInit fails, we continue...
 
+	if (RejectFrozen( "WriteBinary()" ))
+		return valuePtr;
+
+	CKvsOpTimer timer(m_stats, KVS_HIST_WRITE);
+	m_stats.Add( KVS_STAT_WRITES_BINARY, 1 );
+
+	// a value large enough to share is named by its hash, taken before the lock:
+	std::string hash;
+	if (m_dedupThreshold && byte_size >= m_dedupThreshold)
+		hash = m_dedup.Hash( valuePtr, byte_size );
+
+	int64_t expires = (ttl_ms) ? kvs_now_ms() + (int64_t)ttl_ms : 0;
+
 	// Create an iterator of map
-	std::map<std::string, CKeyValue>::iterator it;
+	CKvsPairs::iterator it;
 
 	// prevent other threads from changing our data during this operation:
-	std::lock_guard<std::mutex> guard(m_mutex);
+	CKvsTimedLock guard(m_mutex, m_stats);
 
 	// Find the element with key:
 	it = m_pairs.find(key);
+	uint64_t version = NextVersion( key, it );
+	int64_t  before = (it != m_pairs.end()) ? it->second.m_expires : 0;
+	if (!hash.empty() && ShareBinary( key, it, hash, valuePtr, byte_size, version, expires ))
+	{
+		SetExpiry( key, m_pairs.find( key )->second, before, expires );
+		if (ttl_ms)
+			ReclaimExpired();
+		return valuePtr;
+	}
+
 	if (it != m_pairs.end()) 
 	{
 		CKeyValue& kv = it->second;
 
+		// a shared value's bytes are not this key's to reuse:
+		if (kv.m_shared)
+			kv.FreeBinary();
+
 		// binary data is stored both as it's raw bytes and as a base64 encoded string
 
 		// here I insure the binary byte storage is the correct size: 
@@ -736,31 +1286,739 @@ uint8_t* CKeyValueStore::WriteBinary( std::string& key, uint8_t* valuePtr, uint3
 		}
 
 		// if we have storage for the binary data, copy here:
+		kv.m_binarySize = 0;
 		if (kv.mp_binaryData)
 		{
+			kv.m_binarySize = byte_size;
 			memcpy( kv.mp_binaryData, valuePtr, byte_size );
 		}
 
 		// update the base64 encoded version:
 		kv.m_value = base64_encode(valuePtr, byte_size).c_str();
+
+		// any still compressed form loaded from the db is now stale, as is any counter:
+		kv.m_codec = KVS_CODEC_NONE;
+		std::string().swap( kv.m_packed );
+		kv.mp_counter = NULL;
+		SetExpiry( key, kv, before, expires );
 		
+		kv.m_version = version;
 		// if (!delayWrite) { SetValToDB( kv ); }
+
+		if (mp_log)
+			mp_log->Append( KVS_LOG_SET, key, kv.m_value, expires );
 	}
 	else
 	{
-		// the key was not found, so it is created:
-		CKeyValue kv(key.c_str(), base64_encode(valuePtr, byte_size).c_str());
+		// the key was not found, so it is created, keeping the raw bytes for later reads:
+		std::string base64_version = base64_encode(valuePtr, byte_size);
+		CKeyValue kv( key.c_str(), base64_version, valuePtr, byte_size );
 		//
-		m_pairs.insert(std::make_pair(key, kv));		// insert into RAM cache
+		kv.m_version = version;
+		it = kvs_insert_pair( m_pairs, m_pairs.end(), kv ).first;		// insert into RAM cache
+		SetExpiry( key, it->second, 0, expires );
 		// if (!delayWrite) { SetValToDB( kv ); }
+
+		if (mp_log)
+			mp_log->Append( KVS_LOG_SET, key, base64_version, expires );
 	}
+
+	if (ttl_ms)
+		ReclaimExpired();
+
 	return valuePtr;
 }
 
 ///////////////////////////////////////////////////////////////////////////////////
-bool CKeyValueStore::SyncToDiskStorage(bool doNotInit)
+// a write without a ttl is one with a ttl of 0, the value and its expiry set together
+char* CKeyValueStore::WriteString( std::string& key, char* value )
 {
-	if (!doNotInit)
+	return WriteString( key, value, 0 );
+}
+
+///////////////////////////////////////////////////////////////////////////////////
+bool CKeyValueStore::WriteBool( std::string& key, bool value )
+{
+	return WriteBool( key, value, 0 );
+}
+
+///////////////////////////////////////////////////////////////////////////////////
+int32_t CKeyValueStore::WriteInt( std::string& key, int32_t value )
+{
+	return WriteInt( key, value, 0 );
+}
+
+///////////////////////////////////////////////////////////////////////////////////
+float CKeyValueStore::WriteReal( std::string& key, float value )
+{
+	return WriteReal( key, value, 0 );
+}
+
+///////////////////////////////////////////////////////////////////////////////////
+uint8_t* CKeyValueStore::WriteBinary( std::string& key, uint8_t* valuePtr, uint32_t byte_size )
+{
+	return WriteBinary( key, valuePtr, byte_size, 0 );
+}
+
+///////////////////////////////////////////////////////////////////////////////////
+bool CKeyValueStore::Expire( std::string& key, uint64_t ttl_ms )
+{
+	LazyInit(); // even if LazyInit fails, we continue...
+
+	if (RejectFrozen( "Expire()" ))
+		return false;
+
+	// prevent other threads from changing our data during this operation:
+	CKvsTimedLock guard(m_mutex, m_stats);
+
+	CKvsPairs::iterator it = m_pairs.find(key);
+	if (it == m_pairs.end() || it->second.Expired())
+		return false;
+
+	CKeyValue& kv = it->second;
+	kv.m_version = NextVersion( key, it );
+	SetExpiry( key, kv, kv.m_expires, (ttl_ms) ? kvs_now_ms() + (int64_t)ttl_ms : 0 );
+
+	if (mp_log)
+		mp_log->Append( KVS_LOG_EXPIRE, key, std::string(), kv.m_expires );
+
+	// keys given a ttl reclaim those before them, keeping RAM bounded between syncs:
+	ReclaimExpired();
+
+	return true;
+}
+
+///////////////////////////////////////////////////////////////////////////////////
+// the caller holds m_mutex and has just written kv, which expired at before: it expires at
+// expires from here on, 0 for never. The key's old timer is left in the wheel, stale, to be
+// dropped when due; once stale timers outnumber half the keys, the wheel is built again
+// from the keys' expiries, so rewriting keys with a ttl does not grow it without bound
+void CKeyValueStore::SetExpiry( const std::string& key, CKeyValue& kv, int64_t before, int64_t expires )
+{
+	kv.m_expires = expires;
+	if (expires == before)
+		return;
+
+	if (expires)
+		m_wheel.Schedule( key, expires );
+	if (before)
+		m_staleTimers++;
+
+	if (m_staleTimers > KVS_STALE_TIMERS_MIN && m_staleTimers > m_pairs.size() / 2)
+		RebuildWheel();
+}
+
+///////////////////////////////////////////////////////////////////////////////////
+// the caller holds m_mutex
+void CKeyValueStore::RebuildWheel( void )
+{
+	int64_t now_ms = kvs_now_ms();
+	m_wheel = CKvsTimerWheel( now_ms, KVS_TTL_TICK_MS );
+	m_staleTimers = 0;
+
+	for (CKvsPairs::iterator it = m_pairs.begin(); it != m_pairs.end(); ++it)
+	{
+		if (it->second.m_expires)
+			m_wheel.Schedule( it->second.m_key, it->second.m_expires );
+	}
+}
+
+///////////////////////////////////////////////////////////////////////////////////
+int32_t CKeyValueStore::ExpireKeys( void )
+{
+	LazyInit(); // even if LazyInit fails, we continue...
+
+	// prevent other threads from changing our data during this operation:
+	CKvsTimedLock guard(m_mutex, m_stats);
+
+	return ReclaimExpired();
+}
+
+///////////////////////////////////////////////////////////////////////////////////
+int32_t CKeyValueStore::ReclaimExpired( void )
+{
+	std::vector<CKvsTimer> due;
+	m_wheel.Advance( kvs_now_ms(), due );
+
+	int32_t reclaimed = 0;
+	for (size_t i = 0; i < due.size(); i++)
+	{
+		// a key rewritten or deleted since its timer was set is left alone:
+		CKvsPairs::iterator it = m_pairs.find( due[i].m_key );
+		if (it == m_pairs.end() || it->second.m_expires != due[i].m_expires)
+		{
+			if (m_staleTimers)
+				m_staleTimers--;
+			continue;
+		}
+
+		NextVersion( due[i].m_key, it );
+		it->second.FreeBinary();
+		m_pairs.erase( it );
+
+		m_expiredKeys.push_back( due[i].m_key );
+		reclaimed++;
+	}
+
+	if (reclaimed)
+		m_stats.Add( KVS_STAT_EXPIRED, reclaimed );
+
+	return reclaimed;
+}
+
+///////////////////////////////////////////////////////////////////////////////////
+CKvsSnapshot* CKeyValueStore::Snapshot( void )
+{
+	LazyInit(); // even if LazyInit fails, we continue...
+
+	// prevent other threads from changing our data during this operation:
+	CKvsTimedLock guard(m_mutex, m_stats);
+
+	m_snapshots.insert( m_version );
+	return new CKvsSnapshot( this, m_version, kvs_now_ms() );
+}
+
+///////////////////////////////////////////////////////////////////////////////////
+CKvsCursor* CKeyValueStore::Cursor( const std::string& prefix, uint32_t prefetch, const std::string& after )
+{
+	return new CKvsCursor( this, prefix, prefetch, after );
+}
+
+///////////////////////////////////////////////////////////////////////////////////
+uint64_t CKeyValueStore::NextVersion( const std::string& key, CKvsPairs::iterator it )
+{
+	uint64_t version = ++m_version;
+	m_writeEpoch.m_value.store( version, std::memory_order_release );
+
+	if (m_digests.m_built)
+		UncountDigest( key, it );
+
+	// a value written after the newest snapshot was taken is not visible to any:
+	if (it == m_pairs.end() || m_snapshots.empty() || it->second.m_version > *m_snapshots.rbegin())
+		return version;
+
+	CKvsVersion old( it->second, version );
+	old.m_kv.mp_binaryData = NULL;			// the base64 in m_value, or m_shared, is enough to read it back
+	old.m_kv.m_binarySize = 0;
+	if (old.m_kv.mp_counter)
+	{
+		old.m_kv.m_value = std::to_string( old.m_kv.mp_counter->load() );
+		old.m_kv.mp_counter = NULL;
+	}
+
+	m_history[key].push_back( old );
+	m_historyOrder.push_back( std::make_pair( version, key ) );
+
+	return version;
+}
+
+///////////////////////////////////////////////////////////////////////////////////
+bool CKeyValueStore::SnapshotValue( uint64_t version, int64_t at_ms, const std::string& key, CKeyValue& out )
+{
+	// prevent other threads from changing our data during this operation:
+	CKvsTimedLock guard(m_mutex, m_stats);
+
+	const CKeyValue* p_kv = NULL;
+
+	CKvsPairs::iterator it = m_pairs.find(key);
+	if (it != m_pairs.end() && it->second.m_version <= version)
+	{
+		p_kv = &it->second;
+	}
+	else
+	{
+		// overwritten or deleted since, so look for the value the snapshot saw:
+		std::map<std::string, std::deque<CKvsVersion> >::iterator h = m_history.find(key);
+		if (h != m_history.end())
+		{
+			std::deque<CKvsVersion>& versions = h->second;
+			for (size_t i = versions.size(); i-- > 0; )
+			{
+				if (versions[i].m_from <= version && version < versions[i].m_to)
+				{
+					p_kv = &versions[i].m_kv;
+					break;
+				}
+			}
+		}
+	}
+
+	if (!p_kv || (p_kv->m_expires && p_kv->m_expires <= at_ms))
+		return false;
+
+	out.m_value = p_kv->m_value;
+	out.m_codec = p_kv->m_codec;
+	out.m_packed = p_kv->m_packed;
+	out.m_expires = p_kv->m_expires;
+	out.m_version = p_kv->m_version;
+	if (p_kv->mp_counter)
+		out.m_value = std::to_string( p_kv->mp_counter->load() );
+	if (p_kv->m_shared)
+	{
+		p_kv->m_shared->AddRef();
+		out.Share( p_kv->m_shared.Get() );
+	}
+
+	return true;
+}
+
+///////////////////////////////////////////////////////////////////////////////////
+void CKeyValueStore::ReleaseSnapshot( uint64_t version )
+{
+	// prevent other threads from changing our data during this operation:
+	CKvsTimedLock guard(m_mutex, m_stats);
+
+	std::multiset<uint64_t>::iterator s = m_snapshots.find( version );
+	if (s != m_snapshots.end())
+		m_snapshots.erase( s );
+
+	// values replaced at or before the oldest open snapshot can no longer be read; they
+	// were kept in the order they were replaced, so they go from the front:
+	uint64_t oldest = (m_snapshots.empty()) ? UINT64_MAX : *m_snapshots.begin();
+	while (!m_historyOrder.empty() && m_historyOrder.front().first <= oldest)
+	{
+		std::map<std::string, std::deque<CKvsVersion> >::iterator h = m_history.find( m_historyOrder.front().second );
+		if (h != m_history.end())
+		{
+			h->second.pop_front();
+			if (h->second.empty())
+				m_history.erase( h );
+		}
+		m_historyOrder.pop_front();
+	}
+}
+
+///////////////////////////////////////////////////////////////////////////////////
+std::atomic<int32_t>* CKeyValueStore::Counter( std::string& key )
+{
+	if (RejectFrozen( "Counter()" ))
+		return NULL;
+
+	// the map is looked up under the lock, as other threads insert and erase; only the
+	// counter's own update, by the caller, goes without it:
+	CKvsTimedLock guard(m_mutex, m_stats);
+
+	// the hot path, an existing counter:
+	CKvsPairs::iterator it = m_pairs.find(key);
+	if (it != m_pairs.end() && it->second.mp_counter && !it->second.Expired())
+		return it->second.mp_counter;
+
+	bool created = (it == m_pairs.end());
+	if (created)
+	{
+		it = kvs_insert_pair( m_pairs, m_pairs.end(), CKeyValue(key.c_str(), "0") ).first;
+		m_unsyncedKeys.push_back( key );	// created without a version, so listed for the sync
+	}
+
+	CKeyValue& kv = it->second;
+	if (kv.Expired())
+	{
+		kv.m_version = NextVersion( key, it );
+		kv.SetValue( "0" );		// counts again from 0, as if missing
+		created = true;
+	}
+
+	// a follower has to have the key before a flush logs the counter's value:
+	if (mp_log && created)
+		mp_log->Append( KVS_LOG_SET, key, "0", 0 );
+
+	if (!kv.mp_counter)
+	{
+		if (!DecodePacked( kv ))
+			return NULL;
+
+		// a value that isn't a number starts the counter at 0, as ReadInt( key, 0 ) would:
+		int32_t value = 0;
+		if (!isParam( kv.m_value, value ))
+			value = 0;
+
+		m_counters.emplace_back();
+		m_counters.back().m_value.store( value );
+		m_counters.back().m_key = key;
+		m_counters.back().m_logged = value;
+		m_counters.back().m_synced = value;
+		kv.mp_counter = &m_counters.back().m_value;
+
+		// counters change without a new version, so cached reads of the value must go:
+		m_writeEpoch.m_value.store( ++m_version, std::memory_order_release );
+	}
+
+	return kv.mp_counter;
+}
+
+///////////////////////////////////////////////////////////////////////////////////
+int32_t CKeyValueStore::Increment( std::string& key, int32_t delta )
+{
+	return FetchAdd( key, delta ) + delta;
+}
+
+///////////////////////////////////////////////////////////////////////////////////
+// a key whose value won't decode, such as a sealed value without the right key,
+// is left as is and reads as 0
+int32_t CKeyValueStore::FetchAdd( std::string& key, int32_t delta )
+{
+	LazyInit(); // even if LazyInit fails, we continue...
+
+	CKvsOpTimer timer(m_stats, KVS_HIST_WRITE);
+	m_stats.Add( KVS_STAT_COUNTER_OPS, 1 );
+
+	std::atomic<int32_t>* p_counter = Counter( key );
+	if (!p_counter)
+		return 0;
+
+	return p_counter->fetch_add( delta );
+}
+
+///////////////////////////////////////////////////////////////////////////////////
+bool CKeyValueStore::CompareAndSwap( std::string& key, int32_t expected, int32_t desired )
+{
+	LazyInit(); // even if LazyInit fails, we continue...
+
+	CKvsOpTimer timer(m_stats, KVS_HIST_WRITE);
+	m_stats.Add( KVS_STAT_COUNTER_OPS, 1 );
+
+	std::atomic<int32_t>* p_counter = Counter( key );
+	if (!p_counter)
+		return false;
+
+	return p_counter->compare_exchange_strong( expected, desired );
+}
+
+///////////////////////////////////////////////////////////////////////////////////
+void CKeyValueStore::SetCompressionThreshold( uint32_t byte_size )
+{
+	std::lock_guard<std::mutex> guard(m_mutex);
+	m_compressThreshold = byte_size;
+}
+
+///////////////////////////////////////////////////////////////////////////////////
+void CKeyValueStore::GetStats( CKvsStatsSnapshot& snapshot )
+{
+	m_stats.Snapshot( snapshot );
+}
+
+///////////////////////////////////////////////////////////////////////////////////
+void CKeyValueStore::EnableLatencyStats( bool enable )
+{
+	m_stats.EnableLatency( enable );
+}
+
+///////////////////////////////////////////////////////////////////////////////////
+// the store's stats in Prometheus text format, labelled with the store's path
+std::string CKeyValueStore::GetStatsPrometheus( void )
+{
+	std::string labels = "store=\"";
+	for (size_t i = 0; i < m_path.size(); i++)
+	{
+		char c = m_path[i];
+		if (c == '\\' || c == '"')  labels += '\\';
+		if (c == '\n')               { labels += "\\n"; continue; }
+		labels += c;
+	}
+	labels += "\"";
+
+	CKvsStatsSnapshot* p_snapshot = new CKvsStatsSnapshot();	// too large for some thread stacks
+	m_stats.Snapshot( *p_snapshot );
+
+	std::string out;
+	p_snapshot->WritePrometheus( out, labels );
+	delete p_snapshot;
+
+	char line[256];
+	snprintf( line, sizeof(line), "# TYPE kvs_keys gauge\nkvs_keys{%s} %llu\n# TYPE kvs_state gauge\nkvs_state{%s} %d\n",
+	          labels.c_str(), (unsigned long long)m_pairs.size(), labels.c_str(), m_state );
+	out += line;
+
+	return out;
+}
+
+///////////////////////////////////////////////////////////////////////////////////
+// on failure the packed form is kept, as is its row. A shared value given its own text
+// no longer matches its row, which names the shared one, so the next sync writes it
+bool CKeyValueStore::DecodePacked( CKeyValue& kv )
+{
+	bool shared = ((kv.m_codec & KVS_CODEC_MASK) == KVS_CODEC_SHARED);
+
+	if (!DecodeValue( kv, NULL, m_emsg ))
+		return false;
+
+	if (shared)
+		m_unsyncedKeys.push_back( kv.m_key );
+	return true;
+}
+
+///////////////////////////////////////////////////////////////////////////////////
+bool CKeyValueStore::DecodeValue( CKeyValue& kv, EVP_CIPHER_CTX* p_openCtx, std::string& emsg )
+{
+	if (kv.m_codec == KVS_CODEC_NONE)
+		 return true;
+
+	// a shared value read as text is given its text, no longer sharing; ReadBinary()
+	// copies the shared bytes, and ReadBinaryView() reads them, without coming here:
+	if ((kv.m_codec & KVS_CODEC_MASK) == KVS_CODEC_SHARED)
+	{
+		CKvsShared* p_shared = kv.m_shared.Get();
+		if (p_shared)
+			p_shared->AddRef();
+		else
+			p_shared = ResolveShared( kv, p_openCtx );
+		if (!p_shared)
+		{
+			emsg = std::string("DecodePacked() unable to find the shared value of key ") + kv.m_key;
+			return false;
+		}
+
+		kv.FreeBinary();
+		kv.m_value = base64_encode( p_shared->mp_data, p_shared->m_size );
+		kv.m_codec = KVS_CODEC_NONE;
+		std::string().swap( kv.m_packed );
+		p_shared->Release();
+		return true;
+	}
+
+	std::string raw;
+	bool ok = false;
+
+	// sealed values are opened first, then decompressed:
+	std::string opened;
+	const std::string* packed = &kv.m_packed;
+	if (kv.m_codec & KVS_CODEC_ENCRYPTED)
+	{
+		if (!mp_cipher || !mp_cipher->Open( kv.m_key, (const uint8_t*)kv.m_packed.data(), (uint32_t)kv.m_packed.size(), opened, p_openCtx ))
+		{
+			emsg = std::string("DecodePacked() unable to decrypt value of key ") + kv.m_key;
+			return false;
+		}
+		packed = &opened;
+	}
+
+	int32_t codec = kv.m_codec & KVS_CODEC_MASK;
+	if (codec == KVS_CODEC_NONE)
+	{
+		raw.swap( opened );
+		ok = true;
+	}
+	else if (codec == KVS_CODEC_LZ4 || codec == KVS_CODEC_LZ4_BINARY)
+	{
+		ok = kvs_lz4_decompress( (const uint8_t*)packed->data(), (uint32_t)packed->size(), raw );
+	}
+
+	if (!ok)
+	{
+		emsg = std::string("DecodePacked() unable to decode value of key ") + kv.m_key;
+		return false;
+	}
+
+	if (codec == KVS_CODEC_LZ4_BINARY)
+	{
+		// binary is kept as raw bytes and as base64, same as WriteBinary():
+		uint32_t byte_size = (uint32_t)raw.size();
+		kv.mp_binaryData = (uint8_t*)malloc( sizeof(uint8_t) * ((byte_size) ? byte_size : 1) );
+		if (kv.mp_binaryData)
+		{
+			kv.m_binarySize = byte_size;
+			memcpy( kv.mp_binaryData, raw.data(), byte_size );
+		}
+		kv.m_value = base64_encode( (const uint8_t*)raw.data(), byte_size );
+	}
+	else
+	{
+		kv.m_value.swap( raw );
+	}
+
+	kv.m_codec = KVS_CODEC_NONE;
+	std::string().swap( kv.m_packed );
+
+	return true;
+}
+
+///////////////////////////////////////////////////////////////////////////////////
+bool CKeyValueStore::PackValue( const CKeyValue& kv, CPackedValue& packed )
+{
+	packed.mp_data = kv.m_value.data();
+	packed.m_size = (uint32_t)kv.m_value.size();
+	packed.m_codec = KVS_CODEC_NONE;
+	packed.m_ok = true;
+
+	if (kv.mp_counter)
+	{
+		// a counter's m_value is stale, its text is made here:
+		packed.m_scratch = std::to_string( kv.mp_counter->load() );
+		packed.mp_data = packed.m_scratch.data();
+		packed.m_size = (uint32_t)packed.m_scratch.size();
+	}
+	else if (kv.m_shared)
+	{
+		// only the hash; the bytes are the entry's row, which has to be there first:
+		packed.mp_data = kv.m_shared->m_hash.data();
+		packed.m_size = (uint32_t)kv.m_shared->m_hash.size();
+		packed.m_codec = KVS_CODEC_SHARED;
+		packed.m_skip = !kv.m_shared->m_persisted.load();
+	}
+	else if (kv.m_codec != KVS_CODEC_NONE)
+	{
+		// never read since loaded, so still in its stored form:
+		packed.mp_data = kv.m_packed.data();
+		packed.m_size = (uint32_t)kv.m_packed.size();
+		packed.m_codec = kv.m_codec;
+	}
+	else if (m_compressThreshold)
+	{
+		// binary compresses from its raw bytes, provided they still match the base64:
+		bool isBinary = kv.mp_binaryData && kv.m_binarySize && 
+		                ((kv.m_binarySize + 2) / 3) * 4 == kv.m_value.size();
+
+		if (isBinary && kv.m_binarySize >= m_compressThreshold)
+		{
+			if (kvs_lz4_compress( kv.mp_binaryData, kv.m_binarySize, packed.m_scratch ))
+			{
+				packed.mp_data = packed.m_scratch.data();
+				packed.m_size = (uint32_t)packed.m_scratch.size();
+				packed.m_codec = KVS_CODEC_LZ4_BINARY;
+			}
+		}
+		else if (!isBinary && kv.m_value.size() >= m_compressThreshold)
+		{
+			if (kvs_lz4_compress( (const uint8_t*)kv.m_value.data(), (uint32_t)kv.m_value.size(), packed.m_scratch ))
+			{
+				packed.mp_data = packed.m_scratch.data();
+				packed.m_size = (uint32_t)packed.m_scratch.size();
+				packed.m_codec = KVS_CODEC_LZ4;
+			}
+		}
+	}
+
+	// seal anything not already sealed, such as rows loaded from a db written without a key,
+	// which only a full sync, or a write of their key, rewrites:
+	if (mp_cipher && !(packed.m_codec & KVS_CODEC_ENCRYPTED))
+	{
+		if (!mp_cipher->Seal( kv.m_key, (const uint8_t*)packed.mp_data, packed.m_size, packed.m_sealed ))
+		{
+			packed.m_ok = false;
+			return false;
+		}
+		packed.mp_data = packed.m_sealed.data();
+		packed.m_size = (uint32_t)packed.m_sealed.size();
+		packed.m_codec |= KVS_CODEC_ENCRYPTED;
+	}
+
+	return true;
+}
+
+///////////////////////////////////////////////////////////////////////////////////
+bool CKeyValueStore::PackBatch( const std::vector<const CKeyValue*>& batch, std::vector<CPackedValue>& packed )
+{
+	bool ok = true;
+
+	if (packed.size() < batch.size())
+		packed.resize( batch.size() );
+
+	for (size_t i = 0; i < batch.size(); i++)
+	{
+		if (!PackValue( *batch[i], packed[i] ))
+			ok = false;
+	}
+	return ok;
+}
+
+///////////////////////////////////////////////////////////////////////////////////
+bool CKeyValueStore::BindKeyValue( sqlite3_stmt* statement, const CKeyValue& kv, const CPackedValue& packed )
+{
+	if (!packed.m_ok)
+	{
+		m_emsg = std::string("BindKeyValue() unable to encrypt value of key ") + kv.m_key;
+		return false;
+	}
+
+	sqlite3_bind_text(statement, 1, kv.m_key.c_str(), (int)kv.m_key.size(), SQLITE_STATIC);
+
+	if (packed.m_codec == KVS_CODEC_NONE)
+		sqlite3_bind_text(statement, 2, packed.mp_data, (int)packed.m_size, SQLITE_STATIC);
+	else
+		sqlite3_bind_blob(statement, 2, packed.mp_data, (int)packed.m_size, SQLITE_STATIC);
+	sqlite3_bind_int(statement, 3, packed.m_codec);
+	sqlite3_bind_int64(statement, 4, kv.m_expires);
+
+	return true;
+}
+
+///////////////////////////////////////////////////////////////////////////////////
+bool CKeyValueStore::StepRows( sqlite3_stmt* statement, const std::function<const CKeyValue*(void)>& next, uint64_t& rows, uint64_t& bytes )
+{
+	bool ok = true;
+
+	// rows go to the db in batches. With encryption on a multi-core machine, the next
+	// batch is packed on a helper thread while the current one is stepped into the db:
+	bool pipelined = (mp_cipher != NULL) && std::thread::hardware_concurrency() > 1;
+
+	std::vector<const CKeyValue*> batch[2];
+	std::vector<CPackedValue>     packed[2];
+	std::future<bool>             packing;
+	int32_t                       cur = 0;
+	const CKeyValue*              kv;
+
+	// the rows take the next change sequences here, as ?5, and changeSeq is written once
+	// after them, rather than by the triggers for each row. The transaction holds the
+	// db's write lock, so no other writer takes the same ones:
+	int64_t seq = 0;
+	if (!ReadMeta( "changeSeq", seq ))
+	{
+		m_emsg = std::string("StepRows() unable to read changeSeq: ") + std::string(sqlite3_errmsg(mp_db));
+		return false;
+	}
+	int64_t firstSeq = seq;
+
+	while (batch[cur].size() < KVS_SYNC_BATCH_ROWS && (kv = next()) != NULL)
+		batch[cur].push_back( kv );
+	PackBatch( batch[cur], packed[cur] );
+
+	// spin through...
+	while (!batch[cur].empty())
+	{
+		int32_t next_batch = cur ^ 1;
+
+		batch[next_batch].clear();
+		while (batch[next_batch].size() < KVS_SYNC_BATCH_ROWS && (kv = next()) != NULL)
+			batch[next_batch].push_back( kv );
+
+		if (pipelined && !batch[next_batch].empty())
+			packing = std::async( std::launch::async, &CKeyValueStore::PackBatch, this, std::cref(batch[next_batch]), std::ref(packed[next_batch]) );
+
+		for (size_t i = 0; i < batch[cur].size(); i++)
+		{
+			// a key given a new shared value since the sync began keeps its row until the next:
+			if (packed[cur][i].m_skip)
+				continue;
+
+			if (!BindKeyValue( statement, *batch[cur][i], packed[cur][i] ) ||
+			    sqlite3_bind_int64(statement, 5, ++seq) != SQLITE_OK || sqlite3_step(statement) != SQLITE_DONE)
+			{
+				ok = false;
+			}
+			rows++;
+			bytes += batch[cur][i]->m_key.size() + packed[cur][i].m_size;
+
+			sqlite3_reset(statement);
+		}
+
+		if (packing.valid())
+			packing.get();
+		else
+			PackBatch( batch[next_batch], packed[next_batch] );
+
+		cur = next_batch;
+	}
+
+	if (seq != firstSeq && !WriteMeta( "changeSeq", seq ))
+		ok = false;
+
+	return ok;
+}
+
+///////////////////////////////////////////////////////////////////////////////////
+bool CKeyValueStore::SyncToDiskStorage(bool doNotInit, bool urgent, bool full)
+{
+	if (!doNotInit)
 		LazyInit(); // even if LazyInit fails, we continue...
 
 	if (!mp_db) 
@@ -769,48 +2027,248 @@ bool CKeyValueStore::SyncToDiskStorage(bool doNotInit)
 		return false; 
 	};
 
+	CKvsOpTimer timer(m_stats, KVS_HIST_SYNC);
+
+	// an urgent sync hurries along any paced one, and is itself unpaced, as one transaction:
+	CKvsSyncPacing pacing = m_pacer.Pacing();
+	bool paced = !urgent && pacing.m_bytesPerSec > 0;
+	if (urgent)
+		m_pacer.BeginUrgent();
+
+	// the mutation log is made durable ahead of the db, so it never lags it:
+	if (!FlushMutationLog( true ))
+	{
+		if (urgent)
+			m_pacer.EndUrgent();
+		return false;
+	}
+
+	// expired keys are reclaimed first, so they are not written again:
+	std::vector<std::string> expired;
+	std::vector<std::string> deletedPrefixes;	// of DeleteKeysStartingWith()s whose rows stayed
+	std::vector< std::pair<CKvsShared*, int32_t> > sharedDirty;
+	std::vector<std::string> sharedDeletes;
+	std::vector< std::pair<CKvsShared*, int32_t> > noDirty;
+	std::vector<std::string> noDeletes;
+	uint64_t logSequence;
+	uint64_t logOffset;
+	CKvsSyncFilter filter;		// only the rows changed since the last sync are written
+	uint64_t syncVersion;
+	std::vector<CKeyValue> copies;	// an unpaced sync's rows, copied out with the filter
+	// after m_mutex, as a transaction commit takes them in that order:
+	std::unique_lock<std::mutex> dbLock(m_dbMutex, std::defer_lock);
+	{
+		CKvsTimedLock guard(m_mutex, m_stats);
+		ReclaimExpired();
+		expired.swap( m_expiredKeys );
+		deletedPrefixes.swap( m_deletedPrefixes );
+		// before m_unsyncedKeys goes, as it lists keys the digest tree has yet to count:
+		if (m_digests.m_built)
+			FlushDigests();
+		CollectShared( sharedDirty, sharedDeletes, full );
+		logSequence = m_logSequence;
+		logOffset = m_logOffset;
+
+		filter.m_from = m_syncedVersion;
+		filter.m_all = full;
+		filter.m_unsynced.insert( m_unsyncedKeys.begin(), m_unsyncedKeys.end() );
+		std::vector<std::string>().swap( m_unsyncedKeys );
+		filter.m_refreshed = m_refreshedKeys;
+		syncVersion = m_version;
+
+		// counters change without a new version, so those changed since are listed by value:
+		for (std::deque<CKvsCounter>::iterator c = m_counters.begin(); c != m_counters.end(); ++c)
+		{
+			int32_t value = c->m_value.load();
+			if (value == c->m_synced)
+				continue;
+			CKvsPairs::iterator it = m_pairs.find( c->m_key );
+			if (it != m_pairs.end() && it->second.mp_counter == &c->m_value)
+			{
+				filter.m_unsynced.insert( c->m_key );
+				filter.m_counters.push_back( std::make_pair( &*c, value ) );
+			}
+		}
+
+		// unpaced, every row is copied now and m_mutex is let go only once m_dbMutex is
+		// taken, so a key deleted after its copy has its row deleted after the sync's,
+		// never brought back by it. A paced sync copies its rows chunk by chunk instead:
+		if (!paced)
+		{
+			for (CKvsPairs::iterator it = m_pairs.begin(); it != m_pairs.end(); ++it)
+			{
+				if (filter.Dirty( it->second ))
+					filter.Copy( it->second, copies );
+			}
+			dbLock.lock();
+		}
+	}
+
 	bool ok = true;
-  std::string sql;
+	bool firstCommitted = false;	// the expired rows and the shared values' rows are in
+	uint64_t rows = 0;
+	uint64_t bytes = 0;
   sqlite3_stmt *statement;
 
-  sql = "REPLACE INTO keyValueStore (key, value) VALUES (?1, ?2);";
-  sqlite3_prepare_v2(mp_db, sql.c_str(), -1, &statement, NULL);
+	if (paced)
+		dbLock.lock();
 
-  sqlite3_exec(mp_db, "BEGIN TRANSACTION", NULL, NULL, NULL);
+	// a commit that fails leaves the sync failed, so its keys stay dirty for the next:
+  if (sqlite3_exec(mp_db, "BEGIN IMMEDIATE TRANSACTION", NULL, NULL, NULL) != SQLITE_OK)
+  {
+    m_emsg = std::string("SyncToDiskStorage() ") + std::string(sqlite3_errmsg(mp_db));
+    ok = false;
+  }
 
-	// spin through...
-	std::map<std::string, CKeyValue>::iterator it = m_pairs.begin();
-	while (it != m_pairs.end())
+	// their rows go as one batch, ahead of the writes in case a key has been written again:
+	if (ok && !expired.empty())
 	{
-		CKeyValue& kv = it->second;
-		
-		sqlite3_bind_text(statement, 1, kv.m_key.c_str(),   -1, SQLITE_STATIC);
-		sqlite3_bind_text(statement, 2, kv.m_value.c_str(), -1, SQLITE_STATIC);
+		sqlite3_prepare_v2(mp_db, "DELETE FROM keyValueStore WHERE key = ?1;", -1, &statement, NULL);
+		for (size_t i = 0; i < expired.size(); i++)
+		{
+			sqlite3_bind_text(statement, 1, expired[i].c_str(), -1, SQLITE_STATIC);
+			if (sqlite3_step(statement) != SQLITE_DONE)
+				ok = false;
+			sqlite3_reset(statement);
+		}
+		sqlite3_finalize(statement);
+	}
+	for (size_t i = 0; ok && i < deletedPrefixes.size(); i++)
+	{
+		if (RemoveKeysFromDB( deletedPrefixes[i] ) != 0)
+			ok = false;
+	}
+
+	// shared values ahead of the rows naming them. Paced, the rows of values no key names
+	// wait for the last chunk, as until then the db has keys' rows naming them:
+	if (ok && !PersistShared( sharedDirty, (paced) ? noDeletes : sharedDeletes ))
+		ok = false;
 
-		if (sqlite3_step(statement) != SQLITE_DONE)
+  sqlite3_prepare_v2(mp_db, KVS_SQL_REPLACE_ROW, -1, &statement, NULL);
+
+	if (ok && !paced)
+	{
+		size_t next = 0;
+		if (!StepRows( statement, [&]() -> const CKeyValue* {
+				return (next == copies.size()) ? NULL : &copies[next++];
+			}, rows, bytes ))
+			ok = false;
+
+		// housekeeping, so a prune that fails is left to a later sync:
+		PruneTombstones();
+
+		// where replication stands, as of the rows just written or earlier:
+		if (logSequence && (!WriteMeta( "logSequence", (int64_t)logSequence ) || !WriteMeta( "logOffset", (int64_t)logOffset )))
+			ok = false;
+	}
+	else if (ok)
+	{
+		// the expired rows and shared values are a chunk of their own, then the keys' rows,
+		// copied out under m_mutex chunk by chunk:
+		if (sqlite3_exec(mp_db, "END TRANSACTION", NULL, NULL, NULL) != SQLITE_OK)
 		{
-		  ok = false;
+			m_emsg = std::string("SyncToDiskStorage() ") + std::string(sqlite3_errmsg(mp_db));
+			ok = false;
 		}
+		else
+		{
+			firstCommitted = true;
+			dbLock.unlock();
+			m_stats.Add( KVS_STAT_SYNC_CHUNKS, 1 );
 
-		sqlite3_reset(statement);
-		
-		it++;
+			ok = PacedRows( statement, dbLock, pacing, filter, sharedDeletes, logSequence, logOffset, rows, bytes );
+		}
 	}
-  
-  if (ok) sqlite3_exec(mp_db, "END TRANSACTION", NULL, NULL, NULL);
-  else    sqlite3_exec(mp_db, "ROLLBACK TRANSACTION", NULL, NULL, NULL);
+
+  if (ok && sqlite3_exec(mp_db, "END TRANSACTION", NULL, NULL, NULL) != SQLITE_OK)
+  {
+    m_emsg = std::string("SyncToDiskStorage() ") + std::string(sqlite3_errmsg(mp_db));
+    ok = false;
+  }
+  if (!ok)
+    sqlite3_exec(mp_db, "ROLLBACK TRANSACTION", NULL, NULL, NULL);
 
   sqlite3_finalize(statement);
+	dbLock.unlock();
+
+	if (ok)
+		firstCommitted = true;
+	if (urgent)
+		m_pacer.EndUrgent();
+
+	if (!firstCommitted && (!expired.empty() || !deletedPrefixes.empty()))
+	{
+		// rolled back, so the rows are still there for the next sync to delete:
+		CKvsTimedLock guard(m_mutex, m_stats);
+		m_expiredKeys.insert( m_expiredKeys.end(), expired.begin(), expired.end() );
+		m_deletedPrefixes.insert( m_deletedPrefixes.end(), deletedPrefixes.begin(), deletedPrefixes.end() );
+	}
+	{
+		// the keys written up to the sync's start are in the db; failed, all are written again:
+		CKvsTimedLock guard(m_mutex, m_stats);
+		if (ok)
+		{
+			if (syncVersion > m_syncedVersion)
+				m_syncedVersion = syncVersion;
+			for (size_t i = 0; i < filter.m_counters.size(); i++)
+				filter.m_counters[i].first->m_synced = filter.m_counters[i].second;
+			std::unordered_map<std::string, uint64_t>::iterator r = m_refreshedKeys.begin();
+			while (r != m_refreshedKeys.end())
+			{
+				if (r->second <= m_syncedVersion)
+					r = m_refreshedKeys.erase( r );
+				else
+					r++;
+			}
+		}
+		else
+		{
+			m_unsyncedKeys.insert( m_unsyncedKeys.end(), filter.m_unsynced.begin(), filter.m_unsynced.end() );
+		}
+	}
+	ReleaseShared( sharedDirty, noDeletes, firstCommitted );
+	ReleaseShared( noDirty, sharedDeletes, ok );
+
+	m_stats.Add( KVS_STAT_SYNCS, 1 );
+	if (ok)
+	{
+		m_stats.Add( KVS_STAT_SYNC_ROWS, rows );
+		m_stats.Add( KVS_STAT_BYTES_PERSISTED, bytes );
+	}
+	else
+	{
+		m_stats.Add( KVS_STAT_SYNC_FAILURES, 1 );
+	}
 
 	return ok;
 }
 
+///////////////////////////////////////////////////////////////////////////////////
+void CKeyValueStore::SetSyncPacing( const CKvsSyncPacing& pacing )
+{
+	m_pacer.Configure( pacing );
+}
+
 ///////////////////////////////////////////////////////////////////////////////////
 int32_t CKeyValueStore::ReadKeyValueStoreFromDisk( void )
 {
 	m_readBinaryErrorState = 0;
 	m_state = 0;
 
+	int64_t meta;
+	if (ReadMeta( "logSequence", meta ))
+		m_logSequence = (uint64_t)meta;
+	if (ReadMeta( "logOffset", meta ))
+		m_logOffset = (uint64_t)meta;
+
+	// where refreshes start: changes committed from here on may be loaded and refreshed both,
+	// which is harmless, but none can be missed by both:
+	if (!ReadChangeSeq( m_refreshSeq, m_dataVersion ))
+	{
+		m_refreshSeq = 0;
+		m_dataVersion = 0;
+	}
+
 	int32_t pair_count = GetValFromDB("SELECT COUNT(key) FROM keyValueStore;");
 	if (pair_count < 0)
 	{
@@ -818,39 +2276,213 @@ int32_t CKeyValueStore::ReadKeyValueStoreFromDisk( void )
 	}
 	else if (pair_count > 0)
 	{
-		bool					ok = true;
-		std::string		sql;
 		sqlite3_stmt	*statement;
+		int64_t				first = 0, last = -1;
 
-		sql = "SELECT * FROM keyValueStore;";
-		if (sqlite3_prepare_v2(mp_db, sql.c_str(), -1, &statement, NULL) != SQLITE_OK)
+		if (sqlite3_prepare_v2(mp_db, "SELECT MIN(rowid), MAX(rowid) FROM keyValueStore;", -1, &statement, NULL) != SQLITE_OK)
 		{
 		  m_emsg = std::string("ReadKeyValueStoreFromDisk() Prepare Error: ") + std::string(sqlite3_errmsg(mp_db));
 		  return -1;
 		}
+		if (sqlite3_step(statement) == SQLITE_ROW)
+		{
+			first = sqlite3_column_int64(statement, 0);
+			last = sqlite3_column_int64(statement, 1);
+		}
+		sqlite3_finalize(statement);
+
+		uint32_t threads = m_loadThreads;
+		if (threads == 0)
+			threads = std::thread::hardware_concurrency();
+		if (threads > KVS_LOAD_MAX_THREADS)
+			threads = KVS_LOAD_MAX_THREADS;
+		if (threads > (uint32_t)pair_count / KVS_LOAD_MIN_THREAD_ROWS)
+			threads = (uint32_t)pair_count / KVS_LOAD_MIN_THREAD_ROWS;
+		if (threads < 1 || last < first)
+			threads = 1;
 
-		// Execute the statement and iterate over all the resulting rows.
-		while (SQLITE_ROW == sqlite3_step(statement))
+		int64_t now = kvs_now_ms();
+		std::vector< std::vector<CKvsTimer> > timers( threads );
+
+		if (threads == 1)
+		{
+			if (!LoadRowRange( mp_db, first, last, now, m_pairs, timers[0], m_emsg ))
+				m_readBinaryErrorState = 1;
+		}
+		else
 		{
-			// Notice the columns have 0-based indices here.
-			std::string key = reinterpret_cast<const char*>(sqlite3_column_text(statement, 0));
-			std::string val = reinterpret_cast<const char*>(sqlite3_column_text(statement, 1));
-			
-			CKeyValue kv( key.c_str(), val.c_str() );
+			// split the rowids evenly; each thread reads its span over its own read only
+			// connection into its own map, so parsing, entry construction and any decoding
+			// all run in parallel. This thread takes the first span on mp_db.
+			uint64_t span = ((uint64_t)last - (uint64_t)first) / threads + 1;
+
+			std::vector< CKvsPairs > parts( threads );
+			std::vector<std::string> emsgs( threads );
+			std::vector<char>        loaded( threads, 0 );
+			std::vector<std::thread> loaders;
+
+			for (uint32_t t = 1; t < threads; t++)
+			{
+				loaders.emplace_back( [this, t, first, last, span, now, &parts, &timers, &emsgs, &loaded]()
+				{
+					int64_t lo = (int64_t)((uint64_t)first + span * t);
+					int64_t hi = (t + 1 == parts.size()) ? last : (int64_t)((uint64_t)lo + span - 1);
+
+					sqlite3* db = NULL;
+					if (sqlite3_open_v2( m_db_fname.c_str(), &db, SQLITE_OPEN_READONLY | SQLITE_OPEN_NOMUTEX, NULL ) == SQLITE_OK)
+						loaded[t] = LoadRowRange( db, lo, hi, now, parts[t], timers[t], emsgs[t] );
+					sqlite3_close( db );
+				} );
+			}
+
+			loaded[0] = LoadRowRange( mp_db, first, (int64_t)((uint64_t)first + span - 1), now, parts[0], timers[0], emsgs[0] );
+
+			for (size_t t = 0; t < loaders.size(); t++)
+				loaders[t].join();
 
-			m_pairs.insert( std::make_pair(key.c_str(),kv) );
+			// a span whose connection failed is read again here, on mp_db:
+			for (uint32_t t = 1; t < threads; t++)
+			{
+				if (!loaded[t])
+				{
+					int64_t lo = (int64_t)((uint64_t)first + span * t);
+					int64_t hi = (t + 1 == threads) ? last : (int64_t)((uint64_t)lo + span - 1);
+					timers[t].clear();
+					loaded[t] = LoadRowRange( mp_db, lo, hi, now, parts[t], timers[t], emsgs[t] );
+				}
+				if (!loaded[t])
+				{
+					m_emsg = emsgs[t];
+					m_readBinaryErrorState = 1;
+				}
+			}
+			if (!loaded[0])
+			{
+				m_emsg = emsgs[0];
+				m_readBinaryErrorState = 1;
+			}
+
+			// every part is sorted, so a k-way merge appends each node at the end of
+			// m_pairs; the nodes move across whole, nothing is copied or reallocated:
+			std::vector< CKvsPairs::iterator > heads( threads );
+			for (uint32_t t = 0; t < threads; t++)
+				heads[t] = parts[t].begin();
+
+			while (true)
+			{
+				int32_t next = -1;
+				for (uint32_t t = 0; t < threads; t++)
+				{
+					if (heads[t] != parts[t].end() && (next < 0 || heads[t]->first < heads[next]->first))
+						next = (int32_t)t;
+				}
+				if (next < 0)
+					break;
+
+				CKvsPairs::iterator it = heads[next]++;
+				m_pairs.insert( m_pairs.end(), parts[next].extract( it ) );
+			}
 		}
-		// Clean up the select statement
-		sqlite3_finalize(statement);
 
+		// rows that expired while the store was closed are deleted by the next sync:
+		for (uint32_t t = 0; t < threads; t++)
+		{
+			for (size_t i = 0; i < timers[t].size(); i++)
+			{
+				if (timers[t][i].m_expires <= now)
+					m_expiredKeys.push_back( timers[t][i].m_key );
+				else
+					m_wheel.Schedule( timers[t][i].m_key, timers[t][i].m_expires );
+			}
+		}
 	}
 
+	if (!LoadShared())
+		m_readBinaryErrorState = 1;
+
 	if (m_readBinaryErrorState)
 		m_state = 1;
 
 	return m_state;
 }
 
+///////////////////////////////////////////////////////////////////////////////////
+bool CKeyValueStore::LoadRowRange( sqlite3* db, int64_t first, int64_t last, int64_t now_ms, CKvsPairs& pairs,
+                                   std::vector<CKvsTimer>& timers, std::string& emsg )
+{
+	sqlite3_stmt	*statement;
+
+	const char* sql = "SELECT key, value, codec, expires FROM keyValueStore WHERE rowid BETWEEN ?1 AND ?2;";
+	if (sqlite3_prepare_v2(db, sql, -1, &statement, NULL) != SQLITE_OK)
+	{
+	  emsg = std::string("LoadRowRange() Prepare Error: ") + std::string(sqlite3_errmsg(db));
+	  return false;
+	}
+	sqlite3_bind_int64(statement, 1, first);
+	sqlite3_bind_int64(statement, 2, last);
+
+	// each loading thread opens sealed values with its own copy of the cipher context:
+	EVP_CIPHER_CTX* p_openCtx = (m_decodeOnLoad && mp_cipher) ? mp_cipher->NewOpenContext() : NULL;
+	std::string     decode_emsg;
+
+	// Execute the statement and iterate over all the resulting rows.
+	int32_t rc;
+	while (SQLITE_ROW == (rc = sqlite3_step(statement)))
+	{
+		// Notice the columns have 0-based indices here.
+		const char* keyText = reinterpret_cast<const char*>(sqlite3_column_text(statement, 0));
+		if (!keyText)
+			continue;
+		std::string key = keyText;
+		int32_t     codec = sqlite3_column_int(statement, 2);
+		int64_t     expires = sqlite3_column_int64(statement, 3);
+
+		if (expires)
+		{
+			CKvsTimer timer;
+			timer.m_key = key;
+			timer.m_expires = expires;
+			timers.push_back( timer );
+
+			if (expires <= now_ms)
+				continue;
+		}
+
+		CKeyValue kv( key.c_str(), "" );
+		kv.m_expires = expires;
+		if (codec == KVS_CODEC_NONE)
+		{
+			const char* valText = reinterpret_cast<const char*>(sqlite3_column_text(statement, 1));
+			if (valText)
+				kv.m_value = valText;
+		}
+		else
+		{
+			// compressed values stay packed until their first read, unless decoding on load:
+			const char* packed = reinterpret_cast<const char*>(sqlite3_column_blob(statement, 1));
+			kv.m_codec = codec;
+			kv.m_packed.assign( (packed) ? packed : "", sqlite3_column_bytes(statement, 1) );
+
+			// a value that fails to decode stays packed, and is reported upon its first read;
+			// shared values are found once all are loaded, by LoadShared():
+			if (m_decodeOnLoad && (codec & KVS_CODEC_MASK) != KVS_CODEC_SHARED)
+				DecodeValue( kv, p_openCtx, decode_emsg );
+		}
+
+		kvs_insert_pair( pairs, pairs.end(), kv );
+	}
+	// Clean up the select statement
+	sqlite3_finalize(statement);
+	CKvsCipher::FreeContext( p_openCtx );
+
+	if (rc != SQLITE_DONE)
+	{
+		emsg = std::string("LoadRowRange() Step Error: ") + std::string(sqlite3_errmsg(db));
+		return false;
+	}
+	return true;
+}
+
 ////////////////////////////////////////////////////////////////////////////////
 bool CKeyValueStore::ExecuteSQL(sqlite3* db, const char* sql, std::string& emsg)
 {
@@ -896,27 +2528,30 @@ int32_t CKeyValueStore::SetValToDB(const CKeyValue& keyValue)
 {
   if (!mp_db) { m_emsg = "SetValToDB() mp_db=0"; return -1; };
 
+	std::lock_guard<std::mutex> dbLock(m_dbMutex);
+
 	bool ok = true;
-  std::string sql;
   sqlite3_stmt *statement;
+  uint64_t rows = 0, bytes = 0;
+  const CKeyValue* p_next = &keyValue;
 
-  sql = "REPLACE INTO keyValueStore (key, value) VALUES (?1, ?2);";
-  sqlite3_prepare_v2(mp_db, sql.c_str(), -1, &statement, NULL);
-
-  sqlite3_exec(mp_db, "BEGIN TRANSACTION", NULL, NULL, NULL);
+  if (sqlite3_prepare_v2(mp_db, KVS_SQL_REPLACE_ROW, -1, &statement, NULL) != SQLITE_OK)
+  {
+    m_emsg = std::string("SetValToDB() Prepare Error: ") + std::string(sqlite3_errmsg(mp_db));
+    return false;
+  }
 
-  sqlite3_bind_text(statement, 1, keyValue.m_key.c_str(),   -1, SQLITE_STATIC);
-	sqlite3_bind_text(statement, 2, keyValue.m_value.c_str(), -1, SQLITE_STATIC);
+  if (sqlite3_exec(mp_db, "BEGIN IMMEDIATE TRANSACTION", NULL, NULL, NULL) != SQLITE_OK)
+    ok = false;
 
-  if (sqlite3_step(statement) != SQLITE_DONE)
-  {
+  // the row takes its change sequence as the sync's do:
+  if (ok && !StepRows( statement, [&]() -> const CKeyValue* { const CKeyValue* kv = p_next; p_next = NULL; return kv; }, rows, bytes ))
     ok = false;
-  }
 
-  sqlite3_reset(statement);
-  
-  if (ok) sqlite3_exec(mp_db, "END TRANSACTION", NULL, NULL, NULL);
-  else sqlite3_exec(mp_db, "ROLLBACK TRANSACTION", NULL, NULL, NULL);
+  if (ok && sqlite3_exec(mp_db, "END TRANSACTION", NULL, NULL, NULL) != SQLITE_OK)
+    ok = false;
+  if (!ok)
+    sqlite3_exec(mp_db, "ROLLBACK TRANSACTION", NULL, NULL, NULL);
   sqlite3_finalize(statement);
 
 	return ok;
@@ -924,22 +2559,69 @@ int32_t CKeyValueStore::SetValToDB(const CKeyValue& keyValue)
 
 ////////////////////////////////////////////////////////////////////////////////
 // removes an image from the DB (NOTE: if the image belopngs to a person with one image, the person is also deleted)
-// returns -1 = error, 0 = key removed
+// returns -1 = error, 0 = key removed; expects the caller to hold m_dbMutex
 ////////////////////////////////////////////////////////////////////////////////
 int32_t CKeyValueStore::RemoveKeyFromDB(std::string& key)
 {
   if (!mp_db) { m_emsg = "RemoveKeyFromDB() m_db=0"; return -1; };
-  
-	std::string sql, msg;
 
-  sql = std::string("DELETE FROM keyValueStore WHERE key = ") + key + ";";
-  if (!ExecuteSQL(mp_db, sql.c_str(), msg))
+	int32_t ret = 0;
+  sqlite3_stmt *statement;
+
+  // the key is bound rather than pasted into the sql, as keys are arbitrary text:
+  if (sqlite3_prepare_v2(mp_db, "DELETE FROM keyValueStore WHERE key = ?1;", -1, &statement, NULL) != SQLITE_OK)
+  {
+    m_emsg = std::string("RemoveKeyFromDB() Prepare Error: ") + std::string(sqlite3_errmsg(mp_db));
+    return -1;
+  }
+
+  sqlite3_bind_text(statement, 1, key.c_str(), (int)key.size(), SQLITE_STATIC);
+  if (sqlite3_step(statement) != SQLITE_DONE)
+  {
+    m_emsg = std::string("RemoveKeyFromDB() ") + std::string(sqlite3_errmsg(mp_db));
+    ret = -1;
+  }
+  sqlite3_finalize(statement);
+
+  return ret;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// one range over the primary key's index, which orders keys bytewise as m_pairs does:
+// key >= prefix, and below the prefix with its last byte short of 0xff raised by one.
+// Expects the caller to hold m_dbMutex
+int32_t CKeyValueStore::RemoveKeysFromDB(const std::string& keyPrefix)
+{
+  if (!mp_db) { m_emsg = "RemoveKeysFromDB() m_db=0"; return -1; };
+
+	std::string upper = keyPrefix;
+	while (!upper.empty() && (uint8_t)upper.back() == 0xff)
+		upper.pop_back();
+	if (!upper.empty())
+		upper.back() = (char)((uint8_t)upper.back() + 1);
+
+	int32_t ret = 0;
+  sqlite3_stmt *statement;
+
+  const char* sql = (upper.empty()) ? "DELETE FROM keyValueStore WHERE key >= ?1;"
+                                    : "DELETE FROM keyValueStore WHERE key >= ?1 AND key < ?2;";
+  if (sqlite3_prepare_v2(mp_db, sql, -1, &statement, NULL) != SQLITE_OK)
   {
-    m_emsg = std::string("RemoveKeyFromDB() ") + msg;
+    m_emsg = std::string("RemoveKeysFromDB() Prepare Error: ") + std::string(sqlite3_errmsg(mp_db));
     return -1;
   }
 
-  return 0;
+  sqlite3_bind_text(statement, 1, keyPrefix.c_str(), (int)keyPrefix.size(), SQLITE_STATIC);
+  if (!upper.empty())
+    sqlite3_bind_text(statement, 2, upper.c_str(), (int)upper.size(), SQLITE_STATIC);
+  if (sqlite3_step(statement) != SQLITE_DONE)
+  {
+    m_emsg = std::string("RemoveKeysFromDB() ") + std::string(sqlite3_errmsg(mp_db));
+    ret = -1;
+  }
+  sqlite3_finalize(statement);
+
+  return ret;
 }
 
 ////////////////////////////////////////////////////////////////////////////////
@@ -954,6 +2636,8 @@ bool CKeyValueStore::CreateTables(void)
   sql += "keyValueStore(";
   sql += "  key           TEXT PRIMARY KEY";
   sql += " ,value         TEXT";
+  sql += " ,codec         INTEGER DEFAULT 0";
+  sql += " ,expires       INTEGER DEFAULT 0";
   sql += ");";
   if (!ExecuteSQL(mp_db, sql.c_str(), msg)) 
 	{ 
@@ -961,6 +2645,150 @@ bool CKeyValueStore::CreateTables(void)
 		return false; 
 	};
 
+  // large binary values, a row per chunk:
+  sql = "CREATE TABLE IF NOT EXISTS ";
+  sql += "keyValueBlobs(";
+  sql += "  key           TEXT NOT NULL";
+  sql += " ,chunk         INTEGER NOT NULL";
+  sql += " ,data          BLOB";
+  sql += " ,UNIQUE (key, chunk)";
+  sql += ");";
+  if (!ExecuteSQL(mp_db, sql.c_str(), msg)) 
+	{ 
+		m_emsg = std::string("CreateTables() ") + msg; 
+		return false; 
+	};
+
+  // each blob's live generation of chunks and its size (see blob.h):
+  sql = "CREATE TABLE IF NOT EXISTS ";
+  sql += "keyValueBlobHeads(";
+  sql += "  key           TEXT PRIMARY KEY";
+  sql += " ,gen           INTEGER NOT NULL";
+  sql += " ,size          INTEGER NOT NULL";
+  sql += ");";
+  if (!ExecuteSQL(mp_db, sql.c_str(), msg)) 
+	{ 
+		m_emsg = std::string("CreateTables() ") + msg; 
+		return false; 
+	};
+
+  // binary values held once, by the SHA-256 that the rows of keys holding them carry:
+  sql = "CREATE TABLE IF NOT EXISTS ";
+  sql += "keyValueShared(";
+  sql += "  hash          BLOB PRIMARY KEY";
+  sql += " ,value         BLOB";
+  sql += " ,codec         INTEGER DEFAULT 0";
+  sql += " ,refs          INTEGER DEFAULT 0";
+  sql += ");";
+  if (!ExecuteSQL(mp_db, sql.c_str(), msg)) 
+	{ 
+		m_emsg = std::string("CreateTables() ") + msg; 
+		return false; 
+	};
+
+  // named integers, such as where replication stands:
+  sql = "CREATE TABLE IF NOT EXISTS ";
+  sql += "keyValueMeta(";
+  sql += "  name          TEXT PRIMARY KEY";
+  sql += " ,value         INTEGER";
+  sql += ");";
+  if (!ExecuteSQL(mp_db, sql.c_str(), msg)) 
+	{ 
+		m_emsg = std::string("CreateTables() ") + msg; 
+		return false; 
+	};
+
+  // dbs created before values were compressed lack the codec column:
+  if (!AddColumnIfMissing("keyValueStore", "codec", "INTEGER DEFAULT 0"))
+		return false;
+  // and before keys could expire, the expires column:
+  if (!AddColumnIfMissing("keyValueStore", "expires", "INTEGER DEFAULT 0"))
+		return false;
+  // and before changes were sequenced, the seq column; their rows are older than any change:
+  if (!AddColumnIfMissing("keyValueStore", "seq", "INTEGER DEFAULT 0"))
+		return false;
+
+  // rows deleted, by key, with the change sequence and kvs_now_ms() time of their deletion:
+  sql = "CREATE TABLE IF NOT EXISTS ";
+  sql += "keyValueDeleted(";
+  sql += "  key           TEXT PRIMARY KEY";
+  sql += " ,seq           INTEGER";
+  sql += " ,at            INTEGER DEFAULT 0";
+  sql += ");";
+  if (!ExecuteSQL(mp_db, sql.c_str(), msg)) 
+	{ 
+		m_emsg = std::string("CreateTables() ") + msg; 
+		return false; 
+	};
+  // dbs whose tombstones were not timed lack the at column; theirs are pruned first:
+  if (!AddColumnIfMissing("keyValueDeleted", "at", "INTEGER DEFAULT 0"))
+		return false;
+
+  // every row written or deleted, by any process or tool, takes the next change sequence.
+  // StepRows() numbers the rows it writes itself, past changeSeq, so the triggers leave
+  // them be, and a key's tombstone stays until it is deleted again, older than its row. A
+  // row inserted with no seq or an old one, or updated leaving it, is numbered by them.
+  // REPLACE fires only the insert trigger, as recursive triggers are off. Tombstones are
+  // pruned by syncs once old enough, prunedSeq the newest pruned (see PruneTombstones()):
+  sql  = "CREATE INDEX IF NOT EXISTS keyValueStoreSeq ON keyValueStore(seq);";
+  sql += "INSERT OR IGNORE INTO keyValueMeta (name, value) VALUES ('changeSeq', 0);";
+  sql += "INSERT OR IGNORE INTO keyValueMeta (name, value) VALUES ('prunedSeq', 0);";
+  sql += "CREATE TRIGGER IF NOT EXISTS keyValueStoreInserted AFTER INSERT ON keyValueStore";
+  sql += "  WHEN NEW.seq IS NULL OR NEW.seq <= (SELECT value FROM keyValueMeta WHERE name = 'changeSeq') BEGIN";
+  sql += "  UPDATE keyValueMeta SET value = value + 1 WHERE name = 'changeSeq';";
+  sql += "  UPDATE keyValueStore SET seq = (SELECT value FROM keyValueMeta WHERE name = 'changeSeq') WHERE rowid = NEW.rowid;";
+  sql += "  DELETE FROM keyValueDeleted WHERE key = NEW.key;";
+  sql += " END;";
+  sql += "CREATE TRIGGER IF NOT EXISTS keyValueStoreUpdated AFTER UPDATE OF key, value, codec, expires ON keyValueStore";
+  sql += "  WHEN NEW.seq IS OLD.seq BEGIN";
+  sql += "  UPDATE keyValueMeta SET value = value + 1 WHERE name = 'changeSeq';";
+  sql += "  UPDATE keyValueStore SET seq = (SELECT value FROM keyValueMeta WHERE name = 'changeSeq') WHERE rowid = NEW.rowid;";
+  sql += " END;";
+  sql += "CREATE TRIGGER IF NOT EXISTS keyValueStoreDeleted AFTER DELETE ON keyValueStore BEGIN";
+  sql += "  UPDATE keyValueMeta SET value = value + 1 WHERE name = 'changeSeq';";
+  sql += "  REPLACE INTO keyValueDeleted (key, seq, at) VALUES (OLD.key, (SELECT value FROM keyValueMeta WHERE name = 'changeSeq'),";
+  sql += "    CAST((julianday('now') - 2440587.5) * 86400000.0 AS INTEGER));";
+  sql += " END;";
+
+  // dbs created before tombstones were timed have a delete trigger that does not time them,
+  // replaced here in one transaction, so no deletion meanwhile goes without a tombstone:
+  int32_t timed = GetValFromDB("SELECT COUNT(*) FROM sqlite_master WHERE type = 'trigger' AND name = 'keyValueStoreDeleted' AND sql LIKE '%seq, at)%';");
+  if (timed < 0)
+		return false;
+  if (timed == 0)
+		sql = "BEGIN IMMEDIATE TRANSACTION; DROP TRIGGER IF EXISTS keyValueStoreDeleted;" + sql + "COMMIT TRANSACTION;";
+  if (!ExecuteSQL(mp_db, sql.c_str(), msg)) 
+	{ 
+		if (timed == 0)
+			sqlite3_exec(mp_db, "ROLLBACK TRANSACTION", NULL, NULL, NULL);
+		m_emsg = std::string("CreateTables() ") + msg; 
+		return false; 
+	};
+
+  return true;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+bool CKeyValueStore::AddColumnIfMissing(const char* table, const char* column, const char* declaration)
+{
+  if (!mp_db) { m_emsg = "AddColumnIfMissing() mp_db=0"; return false; };
+
+  std::string sql, msg;
+
+  sql = std::string("SELECT COUNT(*) FROM pragma_table_info('") + table + "') WHERE name = '" + column + "';";
+  int32_t found = GetValFromDB(sql.c_str());
+  if (found < 0)
+		return false;
+  if (found > 0)
+		return true;
+
+  sql = std::string("ALTER TABLE ") + table + " ADD COLUMN " + column + " " + declaration + ";";
+  if (!ExecuteSQL(mp_db, sql.c_str(), msg))
+  {
+		m_emsg = std::string("AddColumnIfMissing() ") + msg;
+		return false;
+  }
+
   return true;
 }
 
@@ -1026,6 +2854,18 @@ bool CKeyValueStore::OpenDB(const char* fname)
     return false;
   }
   
+  // readers on their own connections then see the last commit without blocking a sync:
+  if (m_writeAheadLog)
+  {
+    sql = "PRAGMA journal_mode = WAL";
+    if (!ExecuteSQL(mp_db, sql.c_str(), m_emsg))
+    {
+      sqlite3_close(mp_db);
+      mp_db = NULL;
+      return false;
+    }
+  }
+
   if (!CreateTables()) 
 		 return false;
 
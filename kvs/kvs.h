@@ -13,9 +13,26 @@
 //							Values are stored as strings: bools are "0" or "1",
 //							ints are strings, floats use std::to_string(), and binary is
 //							base64 encoded.  
+//
+//							Values at or above a size threshold are LZ4 compressed when
+//							written to the db, binary values compressed from their raw
+//							bytes rather than their base64. Each row records its codec.
+//							Compressed values are loaded as-is, and only decompressed
+//							upon the first read of their key.
+//
+//							Given a key at construction, values are sealed with
+//							AES-256-GCM when written to the db, after any compression.
+//							Sealed values stay sealed in RAM until first read.
 // 
+//							A value may be written with a time to live. Once expired it
+//							reads as missing at once, and a timer wheel reclaims it from
+//							RAM, its row deleted from the db by the next sync.
+//
 //							The db is lazy loaded, meaning it is not loaded until used.
 //							When used, it is loaded into RAM and maintained as a std::map. 
+//							Large dbs are loaded by several threads, each reading its own
+//							span of rows over its own connection, and the results merged.
+//							OpenInBackground() starts the load early on its own thread.
 //							When the CKeyValueStore is deleted, the sqlite db is committed 
 //							to disk. 
 //							Writing to the db can be triggered via SyncToDiskStorage() too.
@@ -35,18 +52,75 @@
 #ifndef _KVS_H_ 
 #define _KVS_H_ 
 
+#ifdef _WIN32
 #define WIN32_LEAN_AND_MEAN      // Exclude rarely-used stuff from Windows headers
 #include <windows.h>
+#endif
 
 #include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <cstdint>
 #include <string>
+#include <string_view>
 #include <vector>
 #include <map>
+#include <set>
+#include <deque>
 #include <mutex>
+#include <future>
+#include <thread>
+#include <atomic>
+#include <functional>
+#include <istream>
+#include <ostream>
 #include <assert.h>
 #include "base64.h"
+#include "compress.h"
+#include "cipher.h"
+#include "stats.h"
+#include "timerwheel.h"
+#include "bulk.h"
+#include "blob.h"
+#include "replication.h"
+#include "async.h"
+#include "defaults.h"
+#include "readcache.h"
+#include "frozen.h"
+#include "dedup.h"
+#include "backup.h"
+#include "pacing.h"
+#include "refresh.h"
+#include "digest.h"
+#include "structs.h"
 #include "sqlite3.h"
 
+// per row value codecs, held in the keyValueStore table's codec column:
+#define KVS_CODEC_NONE        (0)   // value is the text of m_value
+#define KVS_CODEC_LZ4         (1)   // value is m_value LZ4 compressed
+#define KVS_CODEC_LZ4_BINARY  (2)   // value is the raw binary bytes LZ4 compressed, no base64
+#define KVS_CODEC_SHARED      (3)   // value is the SHA-256 naming a row of keyValueShared (see dedup.h)
+#define KVS_CODEC_MASK        (0xff)
+#define KVS_CODEC_ENCRYPTED   (0x100) // flag: the value above is then sealed by CKvsCipher
+
+#define KVS_DEFAULT_COMPRESS_THRESHOLD  (4096)  // byte size at which values are compressed
+#define KVS_SYNC_BATCH_ROWS             (512)   // rows packed per batch while syncing
+// the one statement writing keys' rows, by StepRows(), which gives ?5 the row's change sequence:
+#define KVS_SQL_REPLACE_ROW   "REPLACE INTO keyValueStore (key, value, codec, expires, seq) VALUES (?1, ?2, ?3, ?4, ?5);"
+#define KVS_LOAD_MAX_THREADS            (16)    // upper limit on threads reading the db at load
+#define KVS_LOAD_MIN_THREAD_ROWS        (8192)  // fewer rows than this per thread load serially
+#define KVS_CURSOR_PREFETCH             (256)   // default rows a cursor fetches per batch, from the db and RAM alike
+
+// the native storage of a key used as a counter, a cache line to itself so
+// threads bumping different counters do not contend:
+struct alignas(64) CKvsCounter
+{
+	std::atomic<int32_t> m_value;
+	std::string          m_key;
+	int32_t              m_logged;      // the value last put in the mutation log
+	int32_t              m_synced;      // the value as of the last sync or refresh
+};
+
 class CKeyValue
 {
 public:
@@ -54,10 +128,77 @@ public:
 	CKeyValue( const char* keyStr, std::string& valueStr, uint8_t* value, uint32_t byte_size );
 	~CKeyValue(); 
 
+	// replaces the value with a string, dropping any binary or still compressed form:
+	void SetValue( const char* valueStr );
+	// frees the raw bytes, or lets go of the shared value:
+	void FreeBinary( void );
+	// makes the value the shared one, taking over a reference the caller holds:
+	void Share( CKvsShared* p_shared );
+
 	std::string	m_key;
 	std::string	m_value;
 	uint8_t*    mp_binaryData;
 	uint32_t    m_binarySize;
+
+	// a compressed value loaded from the db stays compressed until first read:
+	int32_t     m_codec;        // KVS_CODEC_NONE once m_value is usable
+	std::string m_packed;       // the value as loaded, when m_codec is not KVS_CODEC_NONE
+
+	// once used by Increment() & co, the value lives here rather than in m_value:
+	std::atomic<int32_t>* mp_counter;
+
+	int64_t     m_expires;      // kvs_now_ms() time the value expires, 0 for never
+
+	inline bool Expired( void ) const { return m_expires && m_expires <= kvs_now_ms(); }
+
+	uint64_t    m_version;      // the store version that last wrote the value, 0 if loaded
+	uint64_t    m_digest;       // its part of the store's digest tree, 0 while not counted (see digest.h)
+
+	// a deduplicated binary value: m_codec is KVS_CODEC_SHARED, m_value and m_packed are
+	// empty, and mp_binaryData is the shared bytes:
+	CKvsSharedRef m_shared;
+};
+
+// a value as it was before being overwritten or deleted, kept while a snapshot
+// taken between m_from and m_to may still read it:
+class CKvsVersion
+{
+public:
+	CKvsVersion( const CKeyValue& kv, uint64_t to ) : m_from(kv.m_version), m_to(to), m_kv(kv) {}
+
+	uint64_t    m_from;
+	uint64_t    m_to;
+	CKeyValue   m_kv;           // no binary bytes or counter, only the value and its form
+};
+
+// the key/value store itself. Each key is a view of its own entry's m_key, so a key is
+// held once rather than twice; entries go in through kvs_insert_pair(), which points the
+// view at the copy in the node, and their m_key is never changed while in the map.
+// A key such as "site/42/camera/17/stream/0/bitrate" is about 48 of the 250 or so bytes an
+// entry takes, the node and its CKeyValue the rest, so front coding the keys, or a radix
+// tree, could save at most a fifth more; nodes that never move keep iterators valid:
+typedef std::map<std::string_view, CKeyValue> CKvsPairs;
+
+// as std::map::insert() with a hint, for a copy of kv: a key already there keeps its
+// entry, and the second of the result is false:
+std::pair<CKvsPairs::iterator, bool> kvs_insert_pair( CKvsPairs& pairs, CKvsPairs::const_iterator hint, const CKeyValue& kv );
+
+class CKvsSnapshot;
+class CKvsCursor;
+
+// a value in its on-disk form, compressed and/or encrypted, ready to bind:
+class CPackedValue
+{
+public:
+	CPackedValue() : mp_data(NULL), m_size(0), m_codec(KVS_CODEC_NONE), m_ok(true), m_skip(false) {}
+
+	const char* mp_data;
+	uint32_t    m_size;
+	int32_t     m_codec;
+	bool        m_ok;         // false if the value could not be encrypted
+	bool        m_skip;       // the row is left as it is, its shared value not yet in the db
+	std::string m_scratch;    // backing storage when compressed
+	std::string m_sealed;     // backing storage when encrypted
 };
 
 typedef void(*KVS_ERROR_CALLBACK) (void* p_object);
@@ -68,6 +209,11 @@ public:
 	// this is a lazy constructor: it accepts the path at create, but
 	// does not use it until needed, throwing a path error then if need be:
 	CKeyValueStore( const char* keyValueStorePath, KVS_ERROR_CALLBACK cb, void* cb_data );
+	//
+	// as above, with values encrypted at rest under key; a key_size other than 32
+	// is treated as a passphrase and hashed into a 32 byte key:
+	CKeyValueStore( const char* keyValueStorePath, KVS_ERROR_CALLBACK cb, void* cb_data,
+	                const uint8_t* key, uint32_t key_size );
 	~CKeyValueStore();
 
 	//
@@ -81,6 +227,19 @@ public:
 	// but may be called independantly after creation to verify the path is good
 	int32_t Init( void );	
 
+	// runs Init() on a background thread, so the db is loaded by the time it is
+	// first used; anything needing the db before then waits for the load:
+	void OpenInBackground( void );
+	//
+	// threads reading the db at load, 0 picks one per core; set before Init():
+	void SetLoadThreads( uint32_t threads );
+	// decompress and decrypt values as they load, rather than upon first read:
+	void SetDecodeOnLoad( bool decode );
+	// puts the db in sqlite's write ahead log mode, so readers on connections of their own,
+	// such as cursors and backups, run alongside a sync; set before Init(). A db once in
+	// that mode stays in it:
+	void SetWriteAheadLog( bool wal );
+
 	std::string GetPath(std::string& s);
 	bool VerifyCreateDirectory(std::string& directory);
 
@@ -115,8 +274,37 @@ public:
 	float       ReadReal(   std::string& key, float  defaultValue );
 	std::string ReadString( std::string& key, char*    defaultValue );
 	//
-	// for use with constant sized data structures:
+	// for use with constant sized data structures; a value of any other size reads as the
+	// default, with m_emsg saying so. The bytes returned are the key's own, even for a
+	// shared value (see SetDedupThreshold()), copied for it upon its first read. See
+	// ReadStruct() for structs checked by type too:
 	uint8_t* ReadBinary( std::string& key, uint8_t* defaultValuePtr, uint32_t byte_size );
+	// the same bytes without a copy, read only: a shared value's are those every key holding
+	// it reads. NULL for a missing key or a value of another size; valid until the key is
+	// next written or deleted:
+	const uint8_t* ReadBinaryView( std::string& key, uint32_t byte_size );
+
+	// defaults (see defaults.h): a read of a missing key with a registered default returns
+	// it, parsed as the read's type, in place of the default passed, and creates no key.
+	// The table's strings must outlive the store. With materializing off, no read of a
+	// missing key creates it; on, the original behavior, those without a registered
+	// default are created holding the default passed, and persisted:
+	void     RegisterDefaults( const CKvsDefault* table, size_t count );
+	template <size_t N>
+	void     RegisterDefaults( const CKvsDefault (&table)[N] ) { RegisterDefaults( table, N ); }
+	void     SetMaterializeDefaults( bool materialize );
+
+	// Freeze() makes the store read only for good: it indexes the keys with a minimal perfect
+	// hash (see frozen.h), after which ReadBool/Int/Real/String() and isKey() take no lock
+	// and every write is refused with m_emsg saying so. False if it failed, with the
+	// store unchanged:
+	bool     Freeze( void );
+	bool     isFrozen( void );
+
+	// with the read cache on, ReadBool/Int/Real/String() keep what they read in a cache of
+	// the calling thread, valid until the store's next write of any key (see readcache.h).
+	// Off by default:
+	void     EnableReadCache( bool enable );
 
 	char*    WriteString( std::string& key, char*    value );
 	bool     WriteBool(   std::string& key, bool     value );
@@ -124,17 +312,156 @@ public:
 	float    WriteReal(   std::string& key, float  value );
 	//
 	uint8_t* WriteBinary( std::string& key, uint8_t* valuePtr, uint32_t byte_size );
+
+	// as above, the value expiring ttl_ms from now; a write without a ttl makes the key
+	// persistent again, as does a ttl_ms of 0. The value and its expiry are set under one
+	// lock, at one version, and logged as one record:
+	char*    WriteString( std::string& key, char*    value, uint64_t ttl_ms );
+	bool     WriteBool(   std::string& key, bool     value, uint64_t ttl_ms );
+	int32_t  WriteInt(    std::string& key, int32_t   value, uint64_t ttl_ms );
+	float    WriteReal(   std::string& key, float  value, uint64_t ttl_ms );
+	uint8_t* WriteBinary( std::string& key, uint8_t* valuePtr, uint32_t byte_size, uint64_t ttl_ms );
+	//
+	// sets the ttl of an existing key; false if there is no such key:
+	bool     Expire( std::string& key, uint64_t ttl_ms );
+	// reclaims the keys due to expire by now, returning how many; sync does this too:
+	int32_t  ExpireKeys( void );
+
+	// a consistent read only view of every key as of now, that writers do not wait on;
+	// delete it when done, before the store, to release the old values it holds:
+	CKvsSnapshot* Snapshot( void );
+
+	// iterates the keys starting with prefix, "" for all, in key order straight from the
+	// db, with what RAM holds laid over it (see cursor.h). Holds at most about two batches
+	// of prefetch rows, and does not load the store; delete it when done, before the store.
+	// A non-empty after resumes the iteration past that key:
+	CKvsCursor*   Cursor( const std::string& prefix, uint32_t prefetch = KVS_CURSOR_PREFETCH, const std::string& after = "" );
+
+	// atomic counters: a key's first use here converts its value to a native int, after
+	// which each call is a lookup plus one atomic instruction. Missing keys start at 0.
+	// WriteInt() on a counter stores into it, other writes turn it back into a value.
+	int32_t  Increment( std::string& key, int32_t delta );      // returns the new value
+	int32_t  FetchAdd( std::string& key, int32_t delta );       // returns the prior value
+	bool     CompareAndSwap( std::string& key, int32_t expected, int32_t desired );
+
+	// bulk import and export, format KVS_BULK_BINARY or KVS_BULK_JSONL (see bulk.h).
+	// BulkLoad() sorts the rows on up to SetLoadThreads() threads, writes them to the db in
+	// key order as one transaction, then merges them into RAM in one pass; it returns the
+	// rows loaded, or -1 with the store unchanged. Export() streams the store a batch at a
+	// time, returning the rows written or -1:
+	int64_t  BulkLoad( std::istream& in, int32_t format );
+	int64_t  Export( std::ostream& out, int32_t format );
+
+	// large binary values streamed to the db in chunks, kept apart from the other values
+	// and never held whole in RAM (see blob.h). A writer starts the blob afresh, or with
+	// append continues it, either taking the writer's bytes only at its Close(); a reader
+	// is NULL if key has no blob. Delete them when done:
+	CKvsBlobWriter* OpenBlobWriter( std::string& key, bool append );
+	CKvsBlobReader* OpenBlobReader( std::string& key );
+	int64_t         BlobSize( std::string& key );       // -1 if key has no blob
+	bool            DeleteBlob( std::string& key );
+	// blob chunks read are cached in RAM up to byte_size, 0 (the default) caching none:
+	void            SetBlobCacheSize( uint64_t byte_size );
+
+	// awaitable forms of the calls that reach the db, run on the store's I/O thread (see
+	// async.h); the awaiting coroutine resumes through the resumer set, if any:
+	CKvsAwaitable<int32_t> OpenAsync( void );
+	CKvsAwaitable<bool>    SyncAsync( void );
+	CKvsAwaitable<bool>    DeleteAsync( std::string key );
+	CKvsAwaitable<int32_t> DeletePrefixAsync( std::string keyPrefix );
+	void                   SetResumer( const CKvsResumer& resumer );
+
+	// replication (see replication.h): a primary appends its changes to the log at path,
+	// flushed to the file by FlushMutationLog() and by each sync. A follower store tails a
+	// log with Follow(), "" for one fed only by CKvsFollower::Apply(); delete it when done,
+	// before the store. ReadMutationLog() gives up to about max_bytes of the records past
+	// after_sequence, as written to the file, for shipping elsewhere. TruncateMutationLog()
+	// drops the records through acked_sequence, which every follower has to have applied:
+	bool          OpenMutationLog( const std::string& path );
+	bool          FlushMutationLog( bool durable = false );
+	bool          TruncateMutationLog( uint64_t acked_sequence );
+	uint64_t      GetLogSequence( void );   // the last record logged, or applied by a follower
+	CKvsFollower* Follow( const std::string& path );
+	bool          ReadMutationLog( uint64_t after_sequence, uint32_t max_bytes, std::string& records );
+
+	// values of byte_size or larger are compressed when written to the db, 0 disables:
+	void SetCompressionThreshold( uint32_t byte_size );
+	// WriteBinary() values of byte_size or larger are held once per distinct content,
+	// each key naming the shared copy by its hash (see dedup.h); 0, the default, disables:
+	void SetDedupThreshold( uint32_t byte_size );
 	
-	// sync to persistent storage the contents of the key/value store; if terminal is false try to store to shared memory
-	bool SyncToDiskStorage(bool doNotInit = false);				// attempt to sync to disk the contents of the key/value store
+	// counters and latency histograms, summed over all threads at the time of the call:
+	void        GetStats( CKvsStatsSnapshot& snapshot );
+	std::string GetStatsPrometheus( void );
+	// latency histograms cost two clock reads per operation, on by default:
+	void        EnableLatencyStats( bool enable );
+
+	// sync to persistent storage the contents of the key/value store; if terminal is false try to store to shared memory.
+	// An urgent sync is never paced, and cuts short the waits of any paced sync under way. Syncs write only the
+	// keys changed since the last (see refresh.h); a full one rewrites every row, sealing and compressing those
+	// loaded from a db written before a key or compression threshold was set:
+	bool SyncToDiskStorage(bool doNotInit = false, bool urgent = false, bool full = false);	// attempt to sync to disk the contents of the key/value store
+	// with a rate set, syncs commit in chunks paced by a token bucket (see pacing.h):
+	void SetSyncPacing( const CKvsSyncPacing& pacing );
 
 	int32_t ReadKeyValueStoreFromDisk(void); // read from disk the contents of the key/value store
 
-	uint8_t* encrypt( uint8_t* msg, uint32_t msg_len, std::string const& key );
-	uint8_t* decrypt( uint8_t* msg, uint32_t msg_len, std::string const& key );
-
+	// an online copy of the db at destPath, made a few pages at a time while the store stays
+	// in use (see backup.h); false with m_emsg set if it failed or was cancelled, leaving
+	// destPath as it was:
+	bool Backup( const std::string& destPath, const CKvsBackupOptions& options = CKvsBackupOptions() );
+	// with the write ahead log on, moves what syncs have committed to the log into the db
+	// file, mode one of KVS_CHECKPOINT_*; false with m_emsg set if it could not:
+	bool Checkpoint( int32_t mode = KVS_CHECKPOINT_PASSIVE );
+
+	// merges into RAM what other processes have changed in the db since the last refresh, or
+	// the load (see refresh.h); the keys changed, -1 with m_emsg set upon an error:
+	int32_t Refresh( void );
+	// a thread refreshing whenever the db's files change, or every poll_ms; callback, if set,
+	// is told of each refresh that changed keys or failed. Stopped by Unwatch() or deletion:
+	bool    Watch( uint32_t poll_ms = KVS_WATCH_POLL_MS, KVS_REFRESH_CALLBACK callback = NULL );
+	void    Unwatch( void );
+	// syncs prune tombstones of deleted rows older than age_ms, KVS_TOMBSTONE_AGE_MS by default;
+	// a store refreshing less often than that reads every key when it does:
+	void    SetTombstoneAge( uint64_t age_ms );
+
+	// Merkle digests of the keys and values (see digest.h), kept from the first call on.
+	// Digest() copies out the tree, Fingerprint() its root; Diff() lists the leaves where
+	// another store's tree differs, false if its depth does not match; DigestKeys() lists
+	// the keys in leaves with their digests, sorted by key:
+	bool     Digest( CKvsDigestTree& tree );
+	uint64_t Fingerprint( void );
+	bool     Diff( const CKvsDigestTree& other, std::vector<uint32_t>& leaves );
+	bool     DigestKeys( const std::vector<uint32_t>& leaves, std::vector<KVS_DIGEST_KEY>& keys );
+	// 2^depth leaves, KVS_DIGEST_DEPTH by default; every node's must match for Diff():
+	void     SetDigestDepth( uint32_t depth );
+
+	// trivially copyable structs behind a type, size and version header (see structs.h).
+	// ReadStruct() views the value in place, upgrading an older version first; the view
+	// is empty if the key is missing, and also, with m_emsg saying why, if it holds another
+	// type, size or a newer version. An upgrade takes a version's bytes to the next's:
+	template <typename T>
+	bool     WriteStruct( std::string& key, const T& value )
+	{
+		static_assert( std::is_trivially_copyable<T>::value, "WriteStruct() takes trivially copyable types" );
+		static_assert( alignof(T) <= KVS_STRUCT_ALIGN, "WriteStruct() takes types aligned to at most 16" );
+		return WriteStructBytes( key, CKvsStructType<T>::m_typeId, CKvsStructType<T>::m_version, (const uint8_t*)&value, sizeof(T) );
+	}
+	template <typename T>
+	CKvsStructView<T> ReadStruct( std::string& key )
+	{
+		static_assert( std::is_trivially_copyable<T>::value, "ReadStruct() takes trivially copyable types" );
+		static_assert( alignof(T) <= KVS_STRUCT_ALIGN, "ReadStruct() takes types aligned to at most 16" );
+		CKvsStructView<T> view;
+		const uint8_t* p_data = ReadStructBytes( key, CKvsStructType<T>::m_typeId, CKvsStructType<T>::m_version, sizeof(T),
+		                                         view.m_shared, view.m_copy );
+		if (p_data)
+			view.mp_value = std::launder( reinterpret_cast<const T*>( p_data ) );
+		return view;
+	}
+	void     RegisterStructUpgrade( uint32_t typeId, uint32_t fromVersion, KVS_STRUCT_UPGRADE upgrade );
 
-	std::string		m_passkey;
+	CKvsCipher*		mp_cipher;	// NULL when values are not encrypted
 	
 	std::string		m_path;		// where config file is stored
 
@@ -147,9 +474,87 @@ public:
 	int32_t			m_writeBinaryErrorState;
 	int32_t			m_readBinaryErrorState;
 
-	std::map<std::string, CKeyValue> m_pairs;	// the key/value store itself is a std::map
+	uint32_t		m_compressThreshold;
+	uint32_t		m_dedupThreshold;
+
+	uint32_t		m_loadThreads;
+	bool				m_decodeOnLoad;
+	bool				m_writeAheadLog;
+	std::thread	m_opener;						// the OpenInBackground() thread
+	std::mutex	m_initMutex;				// one Init() at a time
+	std::atomic<bool> m_initDone;
+	CKvsIoExecutor	m_io;						// runs the *Async() calls
+
+	CKvsDedup		m_dedup;						// shared binary values, outliving every key naming one
+	CKvsPairs		m_pairs;						// the key/value store itself is a std::map
+
+	std::atomic<bool> m_readCache;
+	uint64_t		m_cacheId;				// this store's tag in the read cache
+
+	std::atomic<CKvsFrozen*> mp_frozen;	// set once by Freeze(), NULL until then
+
+	CKvsDefaults	m_defaults;					// read in place of missing keys, never stored
+	bool				m_materializeDefaults;	// a read of a missing key without one creates it
+
+	// counter storage; never freed before the store, so a counter stays valid for a
+	// thread that found it even if its key is deleted meanwhile:
+	std::deque<CKvsCounter> m_counters;
+
+	// snapshots: each write takes the next version, and while any snapshot is open the
+	// values it overwrites are kept in m_history. m_historyOrder lists them by m_to,
+	// so they are released from the front. All guarded by m_mutex:
+	uint64_t		m_version;
+	CKvsEpoch		m_writeEpoch;			// m_version published for the read cache, set as it advances
+	std::multiset<uint64_t> m_snapshots;
+	std::map<std::string, std::deque<CKvsVersion> > m_history;
+	std::deque< std::pair<uint64_t, std::string> > m_historyOrder;
+
+	CKvsTimerWheel	m_wheel;				// when keys with a ttl expire, guarded by m_mutex
+	size_t			m_staleTimers;			// its timers whose keys were rewritten or deleted since, as counted
+	// reclaimed keys, and deleted keys whose rows a failed delete left, that the next sync
+	// deletes the rows of; and the prefixes of such DeleteKeysStartingWith()s:
+	std::vector<std::string> m_expiredKeys;
+	std::vector<std::string> m_deletedPrefixes;
+
+	// incremental syncs write the keys written since the last that succeeded, as of version
+	// m_syncedVersion (see refresh.h). Keys whose row is due without a new version are in
+	// m_unsyncedKeys; keys Refresh(), BulkLoad() or a transaction's commit wrote, with the
+	// version it gave, in m_refreshedKeys, as their rows are already in the db. All guarded
+	// by m_mutex:
+	uint64_t		m_syncedVersion;
+	std::vector<std::string> m_unsyncedKeys;
+	std::unordered_map<std::string, uint64_t> m_refreshedKeys;
+
+	// refresh: the change sequence and PRAGMA data_version last seen, guarded by m_refreshMutex,
+	// which one Refresh() at a time holds; and the Watch() thread:
+	std::mutex	m_refreshMutex;
+	int64_t			m_refreshSeq;
+	int64_t			m_dataVersion;
+	std::thread	m_watcher;
+	std::atomic<bool> m_watching;
+	// tombstone pruning, guarded by m_dbMutex:
+	uint64_t		m_tombstoneAgeMs;
+	int64_t			m_prunedMs;				// kvs_now_ms() of the last prune
+
+	CKvsDigest	m_digests;			// guarded by m_mutex
+
+	// upgrades by type id and the version they upgrade from, guarded by m_mutex:
+	std::map<std::pair<uint32_t, uint32_t>, KVS_STRUCT_UPGRADE> m_structUpgrades;
+
+	CKvsBlobCache	m_blobCache;
+
+	// replication: the log appended to under m_mutex, NULL when there is none; and the
+	// last record logged or applied, with the offset in the followed file just past it,
+	// both kept in keyValueMeta by each sync. Guarded by m_mutex:
+	CKvsMutationLog* mp_log;
+	uint64_t		m_logSequence;
+	uint64_t		m_logOffset;
 
 	std::mutex	m_mutex;			// multi-threaded security
+	std::mutex	m_dbMutex;		// one sqlite transaction on mp_db at a time; never wait on m_mutex holding it
+
+	CKvsStats		m_stats;
+	CKvsSyncPacer	m_pacer;					// paces syncs once SetSyncPacing() gives it a rate
 
 	// sqlite3 db fields:
 	sqlite3*    mp_db;
@@ -162,6 +567,94 @@ public:
   bool				OpenDB(const char* fname);
 	int32_t			SetValToDB(const CKeyValue& keyValue);
 	int32_t			RemoveKeyFromDB(std::string& key);
+	int32_t			RemoveKeysFromDB(const std::string& keyPrefix);	// every row whose key starts with keyPrefix
+	void				RequeueDelete(const std::string& key, bool prefix);
+	bool				AddColumnIfMissing(const char* table, const char* column, const char* declaration);
+	// loads rows first..last by rowid into pairs; safe to run on a loading thread
+	// with its own connection, as it touches no other store state. Rows with a ttl
+	// go in timers, and rows expired by now_ms go only there:
+	bool				LoadRowRange(sqlite3* db, int64_t first, int64_t last, int64_t now_ms, CKvsPairs& pairs,
+	                         std::vector<CKvsTimer>& timers, std::string& emsg);
+	// the live generation of key's blob, its number of chunks and its size; false on a db error:
+	bool				BlobChunks(const std::string& key, int64_t& gen, int64_t& chunks, uint64_t& size);
+	// ExpireKeys() for a caller holding m_mutex:
+	int32_t			ReclaimExpired(void);
+	// a written key's expiry, and its timer; the wheel built again without stale timers:
+	void				SetExpiry(const std::string& key, CKeyValue& kv, int64_t before, int64_t expires);
+	void				RebuildWheel(void);
+
+	// puts a value in its on-disk form, compressing if large enough and encrypting if a
+	// key was given; safe to run off the calling thread as it touches no store state:
+	bool				PackValue(const CKeyValue& kv, CPackedValue& packed);
+	bool				PackBatch(const std::vector<const CKeyValue*>& batch, std::vector<CPackedValue>& packed);
+	// binds ?1 key, ?2 value, ?3 codec, ?4 expires; packed must live until the statement is stepped:
+	bool				BindKeyValue(sqlite3_stmt* statement, const CKeyValue& kv, const CPackedValue& packed);
+	// packs and steps each row next() gives into a prepared REPLACE until it gives NULL, counting
+	// them into rows and bytes; false if any failed. The caller holds m_dbMutex and the transaction:
+	bool				StepRows(sqlite3_stmt* statement, const std::function<const CKeyValue*(void)>& next, uint64_t& rows, uint64_t& bytes);
+	// a paced sync's keys' rows (see pacing.cpp): called without m_dbMutex, it commits chunk after
+	// chunk and returns holding it, in the last chunk's transaction, for the caller to end:
+	bool				PacedRows(sqlite3_stmt* statement, std::unique_lock<std::mutex>& dbLock, const CKvsSyncPacing& pacing,
+	                      const CKvsSyncFilter& filter, const std::vector<std::string>& sharedDeletes,
+	                      uint64_t logSequence, uint64_t logOffset, uint64_t& rows, uint64_t& bytes);
+	// decompresses a value still in its loaded form, under m_mutex; false if it would not decode:
+	bool				DecodePacked(CKeyValue& kv);
+	// DecodePacked() for the loading threads: p_openCtx may be a thread's own cipher context
+	bool				DecodeValue(CKeyValue& kv, EVP_CIPHER_CTX* p_openCtx, std::string& emsg);
+	// under m_mutex, before a write changes or erases key (it is m_pairs.end() for a new
+	// key): keeps the value for any snapshot that can see it, returning the new version
+	uint64_t		NextVersion(const std::string& key, CKvsPairs::iterator it);
+	// key as of a snapshot's version and time, without binary bytes or counter; false if missing:
+	bool				SnapshotValue(uint64_t version, int64_t at_ms, const std::string& key, CKeyValue& out);
+	void				ReleaseSnapshot(uint64_t version);
+	// true, with m_emsg set, when the store is frozen and op, a write, is refused:
+	bool				RejectFrozen(const char* op);
+	// a binary key's bytes for ReadBinary(), or ReadBinaryView() in place; the caller holds m_mutex:
+	uint8_t*		BinaryData(const std::string& key, CKeyValue& kv, uint8_t* defaultValue, uint32_t byte_size, bool view);
+	// ReadBinary() of a value held at another size: m_emsg says so, and defaultValue is read:
+	uint8_t*		BinarySizeMismatch(const std::string& key, uint32_t held, uint32_t byte_size, uint8_t* defaultValue);
+	// key's entry in this thread's read cache, filled if need be; NULL when the cache is off,
+	// or key is missing, a counter or has a ttl:
+	CKvsCachedValue* CachedRead(std::string& key);
+	// the counter of key, converting or creating the key as needed; NULL if its value won't decode:
+	std::atomic<int32_t>* Counter(std::string& key);
+	// a follower's record, with value its text; 1 when applied, 0 if applied before, -1
+	// upon an error in emsg. next_offset is where the record after it starts in the file:
+	int32_t			ApplyLogRecord(uint64_t sequence, uint8_t op, std::string& key, std::string& value,
+	                           int64_t expires, uint64_t next_offset, std::string& emsg);
+	// named integers in the keyValueMeta table, on mp_db; the caller holds m_dbMutex or has
+	// the store to itself, as at load:
+	bool				ReadMeta(const char* name, int64_t& value);
+	bool				WriteMeta(const char* name, int64_t value);
+	// the db's change sequence and PRAGMA data_version, read in one transaction; the caller
+	// holds m_dbMutex or has the store to itself:
+	bool				ReadChangeSeq(int64_t& seq, int64_t& data_version);
+	// a sync's part, in its last transaction: deletes the tombstones past their age, if
+	// none were lately; false, with m_emsg set, if it failed, to be tried by a later sync:
+	bool				PruneTombstones(void);
+	// the digest tree (see digest.cpp), all under m_mutex: FlushDigests() brings it up to
+	// date, UncountDigest() takes out a key about to be written:
+	uint64_t		ValueDigest(CKeyValue& kv);
+	void				FlushDigests(void);
+	void				UncountDigest(const std::string& key, CKvsPairs::iterator it);
+	// structs (see structs.cpp): their values' bytes, header and all, checked against the
+	// type, version and size wanted; ReadStructBytes() returns the struct's bytes held by
+	// shared or copy, NULL if there are none to give:
+	bool				WriteStructBytes(std::string& key, uint32_t typeId, uint32_t version, const uint8_t* data, uint32_t byte_size);
+	const uint8_t*	ReadStructBytes(std::string& key, uint32_t typeId, uint32_t version, uint32_t byte_size,
+	                            CKvsSharedRef& shared, std::shared_ptr<uint8_t>& copy);
+	// shared binary values (see dedup.cpp): ShareBinary() is WriteBinary() of a hashed value
+	// under m_mutex, its log record carrying expires; ResolveShared() finds the entry a packed shared row names, with a
+	// reference taken; LoadShared() follows the load; the others are a sync's part:
+	bool				ShareBinary(std::string& key, CKvsPairs::iterator it, const std::string& hash,
+	                        const uint8_t* data, uint32_t byte_size, uint64_t version, int64_t expires = 0);
+	CKvsShared*	ResolveShared(const CKeyValue& kv, EVP_CIPHER_CTX* p_openCtx);
+	bool				LoadShared(void);
+	bool				LoadSharedValues(void);		// LoadShared()'s entries, without resolving keys
+	void				RekeyShared(void);				// LoadShared()'s renaming of plainly hashed entries
+	void				CollectShared(std::vector< std::pair<CKvsShared*, int32_t> >& dirty, std::vector<std::string>& deletes, bool all = false);
+	bool				PersistShared(const std::vector< std::pair<CKvsShared*, int32_t> >& dirty, const std::vector<std::string>& deletes);
+	void				ReleaseShared(std::vector< std::pair<CKvsShared*, int32_t> >& dirty, std::vector<std::string>& deletes, bool ok);
 };
 
 
@@ -172,5 +665,9 @@ public:
 
 
 
+#include "snapshot.h"
+#include "transaction.h"
+#include "cursor.h"
+
 #endif // _KVS_H_
 
@@ -0,0 +1,194 @@
+////////////////////////////////////////////////////////////////////////////
+// Name:        pacing.cpp
+// Purpose:     the token bucket pacing a CKeyValueStore's syncs
+/////////////////////////////////////////////////////////////////////////////
+
+#include "kvs.h"
+
+///////////////////////////////////////////////////////////////////////////////////
+CKvsSyncPacer::CKvsSyncPacer()
+	: m_tokens(0), m_filled(std::chrono::steady_clock::now()), m_urgent(0)
+{
+}
+
+///////////////////////////////////////////////////////////////////////////////////
+// the bucket starts full, so a store's first sync after pacing is set is not held back
+void CKvsSyncPacer::Configure( const CKvsSyncPacing& pacing )
+{
+	std::lock_guard<std::mutex> lock( m_mutex );
+	m_pacing = pacing;
+	m_tokens = (double)pacing.m_burstBytes;
+	m_filled = std::chrono::steady_clock::now();
+}
+
+///////////////////////////////////////////////////////////////////////////////////
+CKvsSyncPacing CKvsSyncPacer::Pacing( void )
+{
+	std::lock_guard<std::mutex> lock( m_mutex );
+	return m_pacing;
+}
+
+///////////////////////////////////////////////////////////////////////////////////
+uint32_t CKvsSyncPacer::Take( uint64_t byte_size )
+{
+	std::lock_guard<std::mutex> lock( m_mutex );
+
+	if (m_pacing.m_bytesPerSec == 0)
+		return 0;
+
+	// refill for the time since the last take, up to the bucket's size:
+	std::chrono::steady_clock::time_point now = std::chrono::steady_clock::now();
+	double elapsed = std::chrono::duration<double>( now - m_filled ).count();
+	m_filled = now;
+	m_tokens += elapsed * (double)m_pacing.m_bytesPerSec;
+	if (m_tokens > (double)m_pacing.m_burstBytes)
+		m_tokens = (double)m_pacing.m_burstBytes;
+
+	m_tokens -= (double)byte_size;
+	if (m_tokens >= 0)
+		return 0;
+
+	return (uint32_t)(-m_tokens * 1000.0 / (double)m_pacing.m_bytesPerSec) + 1;
+}
+
+///////////////////////////////////////////////////////////////////////////////////
+bool CKvsSyncPacer::Wait( uint32_t ms )
+{
+	std::unique_lock<std::mutex> lock( m_mutex );
+	return !m_wake.wait_for( lock, std::chrono::milliseconds( ms ), [this]() { return Urgent(); } );
+}
+
+///////////////////////////////////////////////////////////////////////////////////
+void CKvsSyncPacer::BeginUrgent( void )
+{
+	{
+		std::lock_guard<std::mutex> lock( m_mutex );
+		m_urgent.fetch_add( 1, std::memory_order_acq_rel );
+	}
+	m_wake.notify_all();
+}
+
+///////////////////////////////////////////////////////////////////////////////////
+void CKvsSyncPacer::EndUrgent( void )
+{
+	m_urgent.fetch_sub( 1, std::memory_order_acq_rel );
+}
+
+///////////////////////////////////////////////////////////////////////////////////
+// each chunk's rows are copied under m_mutex, which is let go only once m_dbMutex is
+// taken: a key deleted after its copy then has its row deleted after the chunk's, never
+// brought back by it. Only the copies are packed (see CKvsSyncFilter::Copy()). A chunk
+// stepped for its time is cut short there, the rest of its copies dropped, and the next
+// starts past its last key
+bool CKeyValueStore::PacedRows( sqlite3_stmt* statement, std::unique_lock<std::mutex>& dbLock, const CKvsSyncPacing& pacing,
+                                const CKvsSyncFilter& filter, const std::vector<std::string>& sharedDeletes,
+                                uint64_t logSequence, uint64_t logOffset, uint64_t& rows, uint64_t& bytes )
+{
+	std::vector< std::pair<CKvsShared*, int32_t> > noDirty;
+	std::vector<CKeyValue> chunk;
+	std::string resume;
+	size_t      chunkRows = KVS_SYNC_BATCH_ROWS;
+	bool        started = false;
+	bool        preempted = false;
+
+	while (true)
+	{
+		bool        done;
+		std::string scannedTo;		// the last key looked at, copied or not
+		chunk.clear();
+		{
+			CKvsTimedLock guard(m_mutex, m_stats);
+
+			// keys not written since the last sync are passed over, up to a bound, so a large
+			// store with few changes does not hold m_mutex for a walk of all of it:
+			CKvsPairs::iterator it = (started) ? m_pairs.upper_bound( resume ) : m_pairs.begin();
+			size_t scanned = 0;
+			while (it != m_pairs.end() && chunk.size() < chunkRows && scanned < KVS_PACE_MAX_CHUNK_ROWS)
+			{
+				scanned++;
+				if (filter.Dirty( it->second ))
+					filter.Copy( it->second, chunk );
+				++it;
+			}
+			done = (it == m_pairs.end());
+			if (scanned)
+				scannedTo = std::prev( it )->second.m_key;
+
+			dbLock.lock();
+		}
+		started = true;
+
+		// a chunk that fails to begin or commit fails the sync, its keys staying dirty:
+		if (sqlite3_exec(mp_db, "BEGIN IMMEDIATE TRANSACTION", NULL, NULL, NULL) != SQLITE_OK)
+		{
+			m_emsg = std::string("SyncToDiskStorage() ") + std::string(sqlite3_errmsg(mp_db));
+			return false;
+		}
+
+		std::chrono::steady_clock::time_point chunkStart = std::chrono::steady_clock::now();
+		std::chrono::milliseconds chunkMs( pacing.m_maxChunkMs );
+		uint64_t chunkBytes = bytes;
+		size_t   next = 0;
+		bool     cut = false;
+
+		if (!StepRows( statement, [&]() -> const CKeyValue* {
+				if (next == chunk.size() || cut)
+					return NULL;
+				if (next && std::chrono::steady_clock::now() - chunkStart >= chunkMs)
+				{
+					cut = true;
+					return NULL;
+				}
+				return &chunk[next++];
+			}, rows, bytes ))
+			return false;
+
+		if (done && !cut)
+		{
+			// the last chunk, once every key's row names only values still in the db:
+			if (!PersistShared( noDirty, sharedDeletes ))
+				return false;
+			PruneTombstones();		// housekeeping, left to a later sync if it fails
+
+			// where replication stands, as of the rows just written or earlier:
+			if (logSequence && (!WriteMeta( "logSequence", (int64_t)logSequence ) || !WriteMeta( "logOffset", (int64_t)logOffset )))
+				return false;
+			return true;
+		}
+
+		resume = (cut) ? chunk[next - 1].m_key : scannedTo;
+		if (sqlite3_exec(mp_db, "END TRANSACTION", NULL, NULL, NULL) != SQLITE_OK)
+		{
+			m_emsg = std::string("SyncToDiskStorage() ") + std::string(sqlite3_errmsg(mp_db));
+			return false;
+		}
+		dbLock.unlock();
+		if (next)
+			m_stats.Add( KVS_STAT_SYNC_CHUNKS, 1 );
+
+		// as many rows next time as fit in the time this one had:
+		if (cut)
+			chunkRows = (next > KVS_SYNC_BATCH_ROWS) ? next : KVS_SYNC_BATCH_ROWS;
+		else if (chunkRows < KVS_PACE_MAX_CHUNK_ROWS)
+			chunkRows *= 2;
+
+		uint32_t waitMs = m_pacer.Take( bytes - chunkBytes );
+		if (!preempted && m_pacer.Urgent())
+		{
+			preempted = true;
+			m_stats.Add( KVS_STAT_SYNC_PREEMPTED, 1 );
+		}
+		if (waitMs && !preempted)
+		{
+			std::chrono::steady_clock::time_point waitStart = std::chrono::steady_clock::now();
+			m_stats.Add( KVS_STAT_SYNC_PACED_WAITS, 1 );
+			if (!m_pacer.Wait( waitMs ))
+			{
+				preempted = true;
+				m_stats.Add( KVS_STAT_SYNC_PREEMPTED, 1 );
+			}
+			m_stats.Add( KVS_STAT_SYNC_PACED_NS, (uint64_t)std::chrono::duration_cast<std::chrono::nanoseconds>(
+			                                          std::chrono::steady_clock::now() - waitStart).count() );
+		}
+	}
+}
@@ -0,0 +1,80 @@
+/////////////////////////////////////////////////////////////////////////////
+// Name:        pacing.h
+// Purpose:     paced syncs. By default a sync writes every changed row in
+//							one transaction, holding the db lock until it is done; on a
+//							large store a DeleteKey() or commit meanwhile waits for all
+//							of it.
+//
+//							With a rate set, a sync copies its rows out under m_mutex a
+//							chunk at a time instead, and commits each chunk, letting the
+//							db lock go between them. A chunk is ended once it has held
+//							the db lock m_maxChunkMs. The bytes each chunk wrote are
+//							taken from a token bucket refilled at m_bytesPerSec and
+//							holding at most m_burstBytes, shared by all the store's
+//							syncs; a chunk that leaves it short waits for the refill
+//							before the next. Each key's row is whole in every chunk, but
+//							a paced sync cut short, or a backup or crash between its
+//							chunks, sees some rows newer than others.
+//
+//							An urgent sync, such as the destructor's, is never paced and
+//							writes in one transaction as an unpaced sync does; while one
+//							is waiting or running, paced syncs stop waiting and write
+//							their remaining chunks at once.
+/////////////////////////////////////////////////////////////////////////////
+
+#ifndef _KVS_PACING_H_
+#define _KVS_PACING_H_
+
+#include <cstdint>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
+#include <chrono>
+
+#define KVS_PACE_CHUNK_MS       (20)          // longest a paced sync holds the db lock per chunk, by default
+#define KVS_PACE_BURST_BYTES    (4 << 20)     // bytes a paced sync may write before waiting, by default
+#define KVS_PACE_MAX_CHUNK_ROWS (65536)       // most rows copied out for one chunk
+
+class CKvsSyncPacing
+{
+public:
+	CKvsSyncPacing() : m_bytesPerSec(0), m_burstBytes(KVS_PACE_BURST_BYTES), m_maxChunkMs(KVS_PACE_CHUNK_MS) {}
+
+	uint64_t m_bytesPerSec;     // target write rate of syncs; 0, the default, leaves them unpaced
+	uint64_t m_burstBytes;      // the bucket's size, written at full speed after a quiet spell
+	uint32_t m_maxChunkMs;      // a chunk ends once it has held the db lock this long
+};
+
+// the store's pacing and its token bucket, safe to use from any thread:
+class CKvsSyncPacer
+{
+public:
+	CKvsSyncPacer();
+
+	void           Configure( const CKvsSyncPacing& pacing );
+	CKvsSyncPacing Pacing( void );
+
+	// takes byte_size written from the bucket, returning the ms until it is full enough
+	// for the next chunk, 0 if it already is:
+	uint32_t       Take( uint64_t byte_size );
+	// sleeps ms, unless an urgent sync begins meanwhile; false if one cut it short:
+	bool           Wait( uint32_t ms );
+
+	// brackets an urgent sync, waking every paced sync's Wait():
+	void           BeginUrgent( void );
+	void           EndUrgent( void );
+	bool           Urgent( void ) { return m_urgent.load( std::memory_order_acquire ) > 0; }
+
+private:
+	std::mutex              m_mutex;
+	std::condition_variable m_wake;
+	CKvsSyncPacing          m_pacing;
+	double                  m_tokens;       // bytes that may be written now; negative when overdrawn
+	std::chrono::steady_clock::time_point m_filled;   // when m_tokens was last refilled
+	std::atomic<int32_t>    m_urgent;       // urgent syncs waiting or running
+
+	CKvsSyncPacer( const CKvsSyncPacer& );
+	CKvsSyncPacer& operator=( const CKvsSyncPacer& );
+};
+
+#endif // _KVS_PACING_H_
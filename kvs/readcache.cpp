@@ -0,0 +1,89 @@
+////////////////////////////////////////////////////////////////////////////
+// Name:        readcache.cpp
+// Purpose:     the per-thread cache behind a CKeyValueStore's cached reads
+/////////////////////////////////////////////////////////////////////////////
+
+#include "kvs.h"
+
+static std::atomic<uint64_t> g_nextCacheId(1);
+
+static thread_local CKvsCachedValue t_slots[KVS_READ_CACHE_SLOTS];
+
+///////////////////////////////////////////////////////////////////////////////////
+// FNV-1a, cheap for the short keys worth caching
+static inline uint32_t kvs_cache_slot( uint64_t store, const std::string& key )
+{
+	uint32_t h = 2166136261u ^ (uint32_t)store;
+	for (size_t i = 0; i < key.size(); i++)
+		h = (h ^ (uint8_t)key[i]) * 16777619u;
+	return h & (KVS_READ_CACHE_SLOTS - 1);
+}
+
+///////////////////////////////////////////////////////////////////////////////////
+CKvsCachedValue* CKvsReadCache::Find( uint64_t store, uint64_t epoch, const std::string& key )
+{
+	CKvsCachedValue& slot = t_slots[ kvs_cache_slot( store, key ) ];
+	if (slot.m_store == store && slot.m_epoch == epoch && slot.m_key == key)
+		return &slot;
+	return NULL;
+}
+
+///////////////////////////////////////////////////////////////////////////////////
+CKvsCachedValue* CKvsReadCache::Fill( uint64_t store, uint64_t epoch, const std::string& key, const std::string& value )
+{
+	CKvsCachedValue& slot = t_slots[ kvs_cache_slot( store, key ) ];
+	slot.m_store = store;
+	slot.m_epoch = epoch;
+	slot.m_key = key;
+	slot.m_value = value;
+
+	char* p;
+	slot.m_int = strtol( value.c_str(), &p, 0 );
+	slot.m_isInt = (*p == 0);
+	slot.m_real = (float)strtod( value.c_str(), &p );
+	slot.m_isReal = (*p == 0);
+	return &slot;
+}
+
+///////////////////////////////////////////////////////////////////////////////////
+uint64_t CKvsReadCache::NextId( void )
+{
+	return g_nextCacheId.fetch_add( 1 );
+}
+
+///////////////////////////////////////////////////////////////////////////////////
+void CKeyValueStore::EnableReadCache( bool enable )
+{
+	m_readCache.store( enable );
+}
+
+///////////////////////////////////////////////////////////////////////////////////
+// the hit path skips LazyInit(), as a filled entry means the store was loaded
+CKvsCachedValue* CKeyValueStore::CachedRead( std::string& key )
+{
+	if (!m_readCache.load( std::memory_order_relaxed ))
+		return NULL;
+
+	CKvsCachedValue* p_cached = CKvsReadCache::Find( m_cacheId, m_writeEpoch.m_value.load( std::memory_order_relaxed ), key );
+	if (p_cached)
+	{
+		m_stats.Add( KVS_STAT_READ_CACHE_HITS, 1 );
+		return p_cached;
+	}
+
+	LazyInit(); // even if LazyInit fails, we continue...
+
+	// the epoch and value are taken together under the lock, so a write can't slip between:
+	CKvsTimedLock guard(m_mutex, m_stats);
+
+	CKvsPairs::iterator it = m_pairs.find( key );
+	if (it == m_pairs.end())
+		return NULL;
+
+	CKeyValue& kv = it->second;
+	if (kv.mp_counter || kv.m_expires || kv.m_shared || !DecodePacked( kv ))
+		return NULL;
+
+	m_stats.Add( KVS_STAT_READ_HITS, 1 );
+	return CKvsReadCache::Fill( m_cacheId, m_writeEpoch.m_value.load( std::memory_order_relaxed ), key, kv.m_value );
+}
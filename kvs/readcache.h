@@ -0,0 +1,61 @@
+/////////////////////////////////////////////////////////////////////////////
+// Name:        readcache.h
+// Purpose:     a per-thread cache of decoded values, for keys read far more
+//							often than they are written.
+//
+//							Each thread has its own direct mapped table of slots, shared
+//							by every store it reads, so a hit touches no cache line
+//							another thread writes. An entry is tagged with the store's
+//							write epoch when it was filled; every change to the store
+//							advances the epoch, so a hit is a probe of this thread's
+//							table plus one relaxed load of the epoch. Any write at all
+//							invalidates every thread's entries of that store, which
+//							suits keys written rarely, such as configuration.
+//
+//							Counters, keys with a ttl and shared binary values are not
+//							cached.
+/////////////////////////////////////////////////////////////////////////////
+
+#ifndef _KVS_READCACHE_H_
+#define _KVS_READCACHE_H_
+
+#include <cstdint>
+#include <string>
+#include <atomic>
+
+#define KVS_READ_CACHE_SLOTS  (256)   // per thread, for all stores; a power of 2
+
+// a store's write epoch, on a cache line of its own as every cached read loads it:
+struct alignas(64) CKvsEpoch
+{
+	std::atomic<uint64_t> m_value;
+};
+
+class CKvsCachedValue
+{
+public:
+	CKvsCachedValue() : m_store(0), m_epoch(0), m_int(0), m_isInt(false), m_real(0), m_isReal(false) {}
+
+	uint64_t    m_store;        // the store's cache id, 0 for an empty slot
+	uint64_t    m_epoch;        // the store's write epoch when filled
+	std::string m_key;
+	std::string m_value;        // decoded text
+	int32_t     m_int;          // m_value parsed once, as ReadInt() and ReadReal() would
+	bool        m_isInt;
+	float       m_real;
+	bool        m_isReal;
+};
+
+class CKvsReadCache
+{
+public:
+	// this thread's entry for key of store, if it was filled at epoch; NULL if not:
+	static CKvsCachedValue* Find( uint64_t store, uint64_t epoch, const std::string& key );
+	// puts value in this thread's slot for key, replacing whatever was there:
+	static CKvsCachedValue* Fill( uint64_t store, uint64_t epoch, const std::string& key, const std::string& value );
+
+	// an id no other store has had, so slots of a deleted store never match a new one:
+	static uint64_t         NextId( void );
+};
+
+#endif // _KVS_READCACHE_H_
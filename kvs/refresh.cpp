@@ -0,0 +1,504 @@
+////////////////////////////////////////////////////////////////////////////
+// Name:        refresh.cpp
+// Purpose:     merging other processes' changes to the db into a
+//							CKeyValueStore, and which rows its syncs write
+/////////////////////////////////////////////////////////////////////////////
+
+#include <algorithm>
+#include "kvs.h"
+
+#ifdef __linux__
+#include <poll.h>
+#include <unistd.h>
+#include <sys/inotify.h>
+#endif
+
+// a row or tombstone read by Refresh():
+class CKvsChange
+{
+public:
+	CKvsChange() : m_seq(0), m_deleted(false), m_kv( "", "" ) {}
+
+	int64_t     m_seq;
+	bool        m_deleted;
+	CKeyValue   m_kv;           // as loaded, the value still packed
+};
+
+///////////////////////////////////////////////////////////////////////////////////
+bool CKvsSyncFilter::Dirty( const CKeyValue& kv ) const
+{
+	if (m_all)
+		return true;
+	if (!m_unsynced.empty() && m_unsynced.count( kv.m_key ) != 0)
+		return true;
+	if (kv.m_version > m_from)
+	{
+		std::unordered_map<std::string, uint64_t>::const_iterator r = m_refreshed.find( kv.m_key );
+		return r == m_refreshed.end() || r->second != kv.m_version;
+	}
+	return false;
+}
+
+///////////////////////////////////////////////////////////////////////////////////
+void CKvsSyncFilter::Copy( const CKeyValue& kv, std::vector<CKeyValue>& rows ) const
+{
+	rows.push_back( kv );
+	CKeyValue& copy = rows.back();
+	copy.mp_binaryData = NULL;
+	copy.m_binarySize = 0;
+	if (copy.mp_counter)
+	{
+		copy.m_value = std::to_string( copy.mp_counter->load() );
+		copy.mp_counter = NULL;
+	}
+}
+
+///////////////////////////////////////////////////////////////////////////////////
+// the counter whose value p_value is; the index is built upon the first call of a
+// refresh, so a refresh is linear in its rows and the counters rather than their product
+static CKvsCounter* kvs_find_counter( std::deque<CKvsCounter>& counters, std::unordered_map<const std::atomic<int32_t>*, CKvsCounter*>& index,
+                                      std::atomic<int32_t>* p_value )
+{
+	if (!p_value)
+		return NULL;
+	if (index.empty())
+	{
+		index.reserve( counters.size() );
+		for (std::deque<CKvsCounter>::iterator c = counters.begin(); c != counters.end(); ++c)
+			index[&c->m_value] = &*c;
+	}
+	std::unordered_map<const std::atomic<int32_t>*, CKvsCounter*>::iterator c = index.find( p_value );
+	return (c != index.end()) ? c->second : NULL;
+}
+
+///////////////////////////////////////////////////////////////////////////////////
+bool CKeyValueStore::ReadChangeSeq( int64_t& seq, int64_t& data_version )
+{
+	if (!ReadMeta( "changeSeq", seq ))
+		return false;
+
+	sqlite3_stmt* statement;
+	if (sqlite3_prepare_v2( mp_db, "PRAGMA data_version;", -1, &statement, NULL ) != SQLITE_OK)
+		return false;
+	bool found = (sqlite3_step( statement ) == SQLITE_ROW);
+	if (found)
+		data_version = sqlite3_column_int64( statement, 0 );
+	sqlite3_finalize( statement );
+	return found;
+}
+
+///////////////////////////////////////////////////////////////////////////////////
+void CKeyValueStore::SetTombstoneAge( uint64_t age_ms )
+{
+	std::lock_guard<std::mutex> dbLock(m_dbMutex);
+	m_tombstoneAgeMs = age_ms;
+	m_prunedMs = 0;
+}
+
+///////////////////////////////////////////////////////////////////////////////////
+// prunedSeq is raised before the tombstones go, in the same transaction, so a refresh
+// never sees them gone without it
+bool CKeyValueStore::PruneTombstones( void )
+{
+	int64_t now = kvs_now_ms();
+	if (now - m_prunedMs < KVS_TOMBSTONE_PRUNE_MS)
+		return true;
+
+	static const char* sql[2] = {
+		"UPDATE keyValueMeta SET value = MAX(value, (SELECT IFNULL(MAX(seq), 0) FROM keyValueDeleted WHERE at < ?1)) WHERE name = 'prunedSeq';",
+		"DELETE FROM keyValueDeleted WHERE at < ?1;" };
+
+	for (int32_t i = 0; i < 2; i++)
+	{
+		sqlite3_stmt* statement;
+		if (sqlite3_prepare_v2( mp_db, sql[i], -1, &statement, NULL ) != SQLITE_OK)
+		{
+			m_emsg = std::string("PruneTombstones() Prepare Error: ") + sqlite3_errmsg(mp_db);
+			return false;
+		}
+		sqlite3_bind_int64( statement, 1, now - (int64_t)m_tombstoneAgeMs );
+		bool ok = (sqlite3_step( statement ) == SQLITE_DONE);
+		sqlite3_finalize( statement );
+		if (!ok)
+		{
+			m_emsg = std::string("PruneTombstones() ") + sqlite3_errmsg(mp_db);
+			return false;
+		}
+	}
+
+	m_stats.Add( KVS_STAT_TOMBSTONES_PRUNED, (uint64_t)sqlite3_changes( mp_db ) );
+	m_prunedMs = now;
+	return true;
+}
+
+///////////////////////////////////////////////////////////////////////////////////
+// every key in the db, for a refresh that may have missed pruned tombstones; the caller
+// holds m_dbMutex, in the read transaction the change sequence was read in
+static bool kvs_select_keys( sqlite3* db, std::unordered_set<std::string>& keys, std::string& emsg )
+{
+	keys.clear();
+
+	sqlite3_stmt* statement;
+	if (sqlite3_prepare_v2( db, "SELECT key FROM keyValueStore;", -1, &statement, NULL ) != SQLITE_OK)
+	{
+		emsg = std::string("Refresh() Prepare Error: ") + sqlite3_errmsg(db);
+		return false;
+	}
+	while (sqlite3_step( statement ) == SQLITE_ROW)
+	{
+		const char* keyText = reinterpret_cast<const char*>(sqlite3_column_text(statement, 0));
+		if (keyText)
+			keys.insert( std::string( keyText, sqlite3_column_bytes(statement, 0) ) );
+	}
+	sqlite3_finalize( statement );
+	return true;
+}
+
+///////////////////////////////////////////////////////////////////////////////////
+// the caller holds m_dbMutex, in the read transaction the change sequence was read in,
+// so the rows are those up to it. Changes come sorted by sequence
+static bool kvs_select_changes( sqlite3* db, int64_t after, std::vector<CKvsChange>& changes, std::string& emsg )
+{
+	changes.clear();
+
+	bool ok = true;
+	sqlite3_stmt* statement;
+	if (sqlite3_prepare_v2( db, "SELECT key, value, codec, expires, seq FROM keyValueStore WHERE seq > ?1;", -1, &statement, NULL ) != SQLITE_OK)
+		ok = false;
+	else
+	{
+		sqlite3_bind_int64( statement, 1, after );
+		while (sqlite3_step( statement ) == SQLITE_ROW)
+		{
+			const char* keyText = reinterpret_cast<const char*>(sqlite3_column_text(statement, 0));
+			if (!keyText)
+				continue;
+
+			changes.push_back( CKvsChange() );
+			CKvsChange& change = changes.back();
+			change.m_kv.m_key = keyText;
+			change.m_kv.m_codec = sqlite3_column_int(statement, 2);
+			if (change.m_kv.m_codec == KVS_CODEC_NONE)
+			{
+				const char* valText = reinterpret_cast<const char*>(sqlite3_column_text(statement, 1));
+				if (valText)
+					change.m_kv.m_value = valText;
+			}
+			else
+			{
+				const char* packed = reinterpret_cast<const char*>(sqlite3_column_blob(statement, 1));
+				change.m_kv.m_packed.assign( (packed) ? packed : "", sqlite3_column_bytes(statement, 1) );
+			}
+			change.m_kv.m_expires = sqlite3_column_int64(statement, 3);
+			change.m_seq = sqlite3_column_int64(statement, 4);
+		}
+		sqlite3_finalize( statement );
+	}
+
+	if (!ok || sqlite3_prepare_v2( db, "SELECT key, seq FROM keyValueDeleted WHERE seq > ?1;", -1, &statement, NULL ) != SQLITE_OK)
+		ok = false;
+	else
+	{
+		sqlite3_bind_int64( statement, 1, after );
+		while (sqlite3_step( statement ) == SQLITE_ROW)
+		{
+			const char* keyText = reinterpret_cast<const char*>(sqlite3_column_text(statement, 0));
+			if (!keyText)
+				continue;
+
+			changes.push_back( CKvsChange() );
+			changes.back().m_kv.m_key = keyText;
+			changes.back().m_seq = sqlite3_column_int64(statement, 1);
+			changes.back().m_deleted = true;
+		}
+		sqlite3_finalize( statement );
+	}
+	if (!ok)
+		emsg = std::string("Refresh() Prepare Error: ") + sqlite3_errmsg(db);
+
+
+	std::sort( changes.begin(), changes.end(), []( const CKvsChange& a, const CKvsChange& b ) { return a.m_seq < b.m_seq; } );
+	return ok;
+}
+
+///////////////////////////////////////////////////////////////////////////////////
+// a refresh applies rows only to keys not written here since the last sync, and the
+// rows it reads with the store let go are only applied if nothing was written meanwhile:
+// otherwise a local write and sync between the read and the apply would be overwritten
+// in RAM by the older row. After a few tries the read is made with the store held.
+// Once another connection has committed, rows this store synced since its last refresh
+// are read back with the rest; they hold what RAM does, and are applied as any other.
+// A refresh whose tombstones may have been pruned deletes, as their tombstones would,
+// the keys gone from the db that have not been written here since the last sync
+int32_t CKeyValueStore::Refresh( void )
+{
+	LazyInit(); // even if LazyInit fails, we continue...
+
+	if (!mp_db)
+	{
+		m_emsg = "Refresh() mp_db=0";
+		return -1;
+	}
+	if (isFrozen())
+	{
+		m_emsg = "Refresh() the store is frozen";
+		return -1;
+	}
+
+	std::lock_guard<std::mutex> refreshLock( m_refreshMutex );
+
+	std::vector<CKvsChange> changes;
+	std::unordered_set<std::string> dbKeys;
+
+	for (int32_t tries = 1; tries <= KVS_REFRESH_TRIES; tries++)
+	{
+		bool held = (tries == KVS_REFRESH_TRIES);
+
+		std::unique_lock<std::mutex> storeLock( m_mutex );
+		uint64_t readVersion = m_version;
+		if (!held)
+			storeLock.unlock();
+
+		int64_t     seq = 0, dataVersion = 0, prunedSeq = 0;
+		bool        any = false, rescan = false, ok;
+		std::string emsg;
+		{
+			// after m_mutex when held, as everywhere:
+			std::lock_guard<std::mutex> dbLock(m_dbMutex);
+			sqlite3_exec( mp_db, "BEGIN TRANSACTION", NULL, NULL, NULL );
+			ok = ReadChangeSeq( seq, dataVersion );
+			if (!ok)
+				emsg = std::string("Refresh() unable to read the change sequence: ") + sqlite3_errmsg(mp_db);
+			any = (ok && dataVersion != m_dataVersion && seq > m_refreshSeq);
+			if (any)
+				ok = kvs_select_changes( mp_db, m_refreshSeq, changes, emsg );
+			rescan = (any && ok && ReadMeta( "prunedSeq", prunedSeq ) && prunedSeq > m_refreshSeq);
+			if (rescan)
+				ok = kvs_select_keys( mp_db, dbKeys, emsg );
+			sqlite3_exec( mp_db, "COMMIT TRANSACTION", NULL, NULL, NULL );
+		}
+		if (!ok)
+		{
+			m_emsg = emsg;
+			return -1;
+		}
+
+		// no other connection has committed, so every change since is this store's own:
+		if (!any)
+		{
+			m_refreshSeq = seq;
+			m_dataVersion = dataVersion;
+			return 0;
+		}
+
+		if (!held)
+			storeLock.lock();
+		if (m_version != readVersion && !held)
+			continue;
+
+		// keys gone from the db whose tombstones may be pruned go ahead of the changes, as
+		// their deletions came before any change still to be seen. Those never yet synced,
+		// such as defaults a read created, are not in the db and are passed over:
+		if (rescan)
+		{
+			std::unordered_set<std::string> unsynced( m_unsyncedKeys.begin(), m_unsyncedKeys.end() );
+			std::vector<CKvsChange> gone;
+			for (CKvsPairs::iterator it = m_pairs.begin(); it != m_pairs.end(); ++it)
+			{
+				if (dbKeys.count( it->second.m_key ) || unsynced.count( it->second.m_key ))
+					continue;
+				gone.push_back( CKvsChange() );
+				gone.back().m_kv.m_key = it->second.m_key;
+				gone.back().m_deleted = true;
+			}
+			changes.insert( changes.begin(), gone.begin(), gone.end() );
+			m_stats.Add( KVS_STAT_REFRESH_RESCANS, 1 );
+		}
+
+		int32_t changed = 0;
+		bool    sharedLoaded = false;
+		std::unordered_map<const std::atomic<int32_t>*, CKvsCounter*> counters;
+		for (size_t i = 0; i < changes.size(); i++)
+		{
+			CKeyValue&  row = changes[i].m_kv;
+			std::string key = row.m_key;
+
+			// written here since the last sync, the key keeps its value, which that sync writes:
+			CKvsPairs::iterator it = m_pairs.find( key );
+			if (it != m_pairs.end() && it->second.m_version > m_syncedVersion)
+			{
+				std::unordered_map<std::string, uint64_t>::iterator r = m_refreshedKeys.find( key );
+				if (r == m_refreshedKeys.end() || r->second != it->second.m_version)
+					continue;
+			}
+
+			// as is a counter changed here since, which has no version to tell by:
+			CKvsCounter* p_counter = (it != m_pairs.end()) ? kvs_find_counter( m_counters, counters, it->second.mp_counter ) : NULL;
+			if (p_counter && p_counter->m_value.load() != p_counter->m_synced)
+				continue;
+
+			if (changes[i].m_deleted)
+			{
+				if (it == m_pairs.end())
+					continue;
+				NextVersion( key, it );
+				it->second.FreeBinary();
+				m_pairs.erase( it );
+				m_refreshedKeys.erase( key );
+				changed++;
+				continue;
+			}
+
+			uint64_t version = NextVersion( key, it );
+			if (it == m_pairs.end())
+				it = kvs_insert_pair( m_pairs, m_pairs.end(), CKeyValue( key.c_str(), "" ) ).first;
+
+			CKeyValue& kv = it->second;
+			if (p_counter && DecodeValue( row, NULL, emsg ))
+			{
+				// a counter keeps counting where the row says:
+				int32_t numVal = 0;
+				isParam( row.m_value, numVal );
+				kv.mp_counter->store( numVal );
+				p_counter->m_synced = numVal;
+				p_counter->m_logged = numVal;
+			}
+			else
+			{
+				kv.SetValue( "" );
+				kv.m_value.swap( row.m_value );
+				kv.m_codec = row.m_codec;
+				kv.m_packed.swap( row.m_packed );
+
+				// a value shared by the other process may be new here:
+				if ((kv.m_codec & KVS_CODEC_MASK) == KVS_CODEC_SHARED)
+				{
+					CKvsShared* p_shared = ResolveShared( kv, NULL );
+					if (!p_shared && !sharedLoaded)
+					{
+						std::lock_guard<std::mutex> dbLock(m_dbMutex);
+						LoadSharedValues();
+						sharedLoaded = true;
+						p_shared = ResolveShared( kv, NULL );
+					}
+					if (p_shared)
+						kv.Share( p_shared );
+				}
+				else if (m_decodeOnLoad)
+				{
+					DecodeValue( kv, NULL, emsg );
+				}
+			}
+			kv.m_expires = row.m_expires;
+			kv.m_version = version;
+			if (kv.m_expires)
+				m_wheel.Schedule( key, kv.m_expires );
+
+			// its row is already in the db, so syncs leave it be:
+			m_refreshedKeys[key] = version;
+			changed++;
+		}
+
+		m_refreshSeq = seq;
+		m_dataVersion = dataVersion;
+
+		m_stats.Add( KVS_STAT_REFRESHES, 1 );
+		m_stats.Add( KVS_STAT_REFRESH_KEYS, (uint64_t)changed );
+		return changed;
+	}
+
+	return 0;
+}
+
+///////////////////////////////////////////////////////////////////////////////////
+// sqlite replaces the journal and write ahead log files beside the db, so the directory
+// is watched for any of them changing. This store's own syncs wake it too, and are
+// told apart by the data version at the cost of one query
+bool CKeyValueStore::Watch( uint32_t poll_ms, KVS_REFRESH_CALLBACK callback )
+{
+	LazyInit(); // even if LazyInit fails, we continue...
+
+	if (!mp_db)
+	{
+		m_emsg = "Watch() mp_db=0";
+		return false;
+	}
+
+	Unwatch();
+	m_watching.store( true );
+
+	std::string dir = GetPath( m_db_fname );
+	std::string name = m_db_fname.substr( (dir.empty()) ? 0 : dir.size() + 1 );
+	if (dir.empty())
+		dir = ".";
+	if (poll_ms == 0)
+		poll_ms = KVS_WATCH_POLL_MS;
+
+	m_watcher = std::thread( [this, dir, name, poll_ms, callback]() {
+#ifdef __linux__
+		int32_t fd = inotify_init1( IN_NONBLOCK | IN_CLOEXEC );
+		if (fd >= 0 && inotify_add_watch( fd, dir.c_str(), IN_MODIFY | IN_CLOSE_WRITE | IN_MOVED_TO | IN_CREATE ) < 0)
+		{
+			close( fd );
+			fd = -1;
+		}
+#endif
+		// events are checked for at least every KVS_WATCH_POLL_MS, so Unwatch() is not kept waiting long:
+		int64_t nextPoll = kvs_now_ms() + poll_ms;
+		while (m_watching.load())
+		{
+			bool changed = false;
+#ifdef __linux__
+			if (fd >= 0)
+			{
+				pollfd p;
+				p.fd = fd;
+				p.events = POLLIN;
+				p.revents = 0;
+				if (poll( &p, 1, (int)std::min<uint32_t>( poll_ms, KVS_WATCH_POLL_MS ) ) > 0)
+				{
+					alignas(inotify_event) char events[4096];
+					ssize_t got;
+					while ((got = read( fd, events, sizeof(events) )) > 0)
+					{
+						for (char* e = events; e < events + got; e += sizeof(inotify_event) + ((inotify_event*)e)->len)
+						{
+							const inotify_event* p_event = (const inotify_event*)e;
+							if (p_event->len && std::string( p_event->name ).compare( 0, name.size(), name ) == 0)
+								changed = true;
+						}
+					}
+				}
+			}
+			else
+#endif
+			{
+				std::this_thread::sleep_for( std::chrono::milliseconds( std::min<uint32_t>( poll_ms, KVS_WATCH_POLL_MS ) ) );
+			}
+
+			if (!changed && kvs_now_ms() < nextPoll)
+				continue;
+			nextPoll = kvs_now_ms() + poll_ms;
+
+			if (!m_watching.load())
+				break;
+			int32_t refreshed = Refresh();
+			if (refreshed != 0 && callback)
+				callback( refreshed );
+		}
+#ifdef __linux__
+		if (fd >= 0)
+			close( fd );
+#endif
+	} );
+
+	return true;
+}
+
+///////////////////////////////////////////////////////////////////////////////////
+void CKeyValueStore::Unwatch( void )
+{
+	m_watching.store( false );
+	if (m_watcher.joinable())
+		m_watcher.join();
+}
@@ -0,0 +1,83 @@
+/////////////////////////////////////////////////////////////////////////////
+// Name:        refresh.h
+// Purpose:     changes made to the db by other processes, merged into RAM
+//							without a reload; and syncs writing only changed rows.
+//
+//							Every row written, by any process or tool, takes the next
+//							change sequence in its seq column, kept as changeSeq in
+//							keyValueMeta: a sync numbers its rows itself, and triggers
+//							in the db number the rest. A deleted row leaves a tombstone
+//							in keyValueDeleted with its own. Refresh() first asks sqlite
+//							whether any other connection has committed since it last
+//							looked (PRAGMA data_version), which costs no read of the db;
+//							only if one has does it select the rows and tombstones past
+//							the sequence it last saw, by the seq index, and apply them.
+//
+//							Tombstones older than the tombstone age are pruned by syncs,
+//							at most once per KVS_TOMBSTONE_PRUNE_MS, and prunedSeq in
+//							keyValueMeta raised to the newest pruned. A store whose last
+//							refresh is older than that may have missed deletions, so its
+//							next refresh also reads every key in the db, and deletes the
+//							keys it holds that are gone from there.
+//
+//							A key written here since the last sync keeps its value, as
+//							the next sync writes it over the other process's. Keys the
+//							refresh applies are already in the db, so syncs leave them
+//							be; this is what keeps two stores from echoing each other's
+//							changes back and forth.
+//
+//							A sync writes the rows of keys written since the last sync
+//							that succeeded, rather than every key: those with a version
+//							past m_syncedVersion, counters whose value has changed since,
+//							and keys whose stored form changed without a write, such as
+//							a shared value read as text. A full sync writes every key's
+//							row, and every shared value's, as syncs did before they
+//							were incremental: rows loaded from a db written before a
+//							key or compression threshold was set are then sealed and
+//							compressed as new ones are.
+//
+//							Watch() starts a thread refreshing upon inotify events in
+//							the db's directory, or every poll_ms if there are none or
+//							inotify is not available.
+/////////////////////////////////////////////////////////////////////////////
+
+#ifndef _KVS_REFRESH_H_
+#define _KVS_REFRESH_H_
+
+#include <cstdint>
+#include <string>
+#include <vector>
+#include <unordered_map>
+#include <unordered_set>
+#include <functional>
+
+class CKeyValue;
+struct CKvsCounter;
+
+#define KVS_WATCH_POLL_MS       (1000)    // Watch()'s refresh with no event seen, by default
+#define KVS_REFRESH_TRIES       (3)       // unlocked reads raced by local writes before the store is held
+#define KVS_TOMBSTONE_AGE_MS    (3600000) // tombstones older than this are pruned, by default
+#define KVS_TOMBSTONE_PRUNE_MS  (60000)   // least time between a store's prunes
+
+// called by the watcher after each Refresh() that changed keys, or failed (-1):
+typedef std::function<void(int32_t changed)> KVS_REFRESH_CALLBACK;
+
+// the rows a sync writes, as of its start:
+class CKvsSyncFilter
+{
+public:
+	CKvsSyncFilter() : m_from(0), m_all(false) {}
+
+	bool Dirty( const CKeyValue& kv ) const;
+	// appends a copy of kv a sync can write without m_mutex: no raw binary bytes, which a
+	// write may free, the base64 standing in for them, and a counter's value as text:
+	void Copy( const CKeyValue& kv, std::vector<CKeyValue>& rows ) const;
+
+	uint64_t m_from;                                        // the store's m_syncedVersion
+	bool     m_all;                                         // a full sync, writing every row
+	std::unordered_set<std::string> m_unsynced;             // its m_unsyncedKeys
+	std::unordered_map<std::string, uint64_t> m_refreshed;  // its m_refreshedKeys
+	std::vector< std::pair<CKvsCounter*, int32_t> > m_counters;   // counters changed since, with the value seen
+};
+
+#endif // _KVS_REFRESH_H_
@@ -0,0 +1,875 @@
+////////////////////////////////////////////////////////////////////////////
+// Name:        replication.cpp
+// Purpose:     log shipping from a primary CKeyValueStore to followers
+/////////////////////////////////////////////////////////////////////////////
+
+#include <boost/filesystem.hpp>
+#include "kvs.h"
+#ifdef _WIN32
+#include <io.h>
+#else
+#include <unistd.h>
+#endif
+
+///////////////////////////////////////////////////////////////////////////////////
+// fseek() takes a long, only 32 bits on Windows, and a log can outgrow 2 GB
+static int32_t kvs_log_seek( FILE* p_file, int64_t offset, int32_t whence )
+{
+#ifdef _WIN32
+	return _fseeki64( p_file, offset, whence );
+#else
+	return fseeko( p_file, (off_t)offset, whence );
+#endif
+}
+
+///////////////////////////////////////////////////////////////////////////////////
+static int32_t kvs_log_fsync( FILE* p_file )
+{
+#ifdef _WIN32
+	return _commit( _fileno( p_file ) );
+#else
+	return fsync( fileno( p_file ) );
+#endif
+}
+
+///////////////////////////////////////////////////////////////////////////////////
+static void kvs_log_put_u32( std::string& out, uint32_t v )
+{
+	char b[4] = { (char)v, (char)(v >> 8), (char)(v >> 16), (char)(v >> 24) };
+	out.append( b, 4 );
+}
+
+///////////////////////////////////////////////////////////////////////////////////
+static void kvs_log_put_u64( std::string& out, uint64_t v )
+{
+	kvs_log_put_u32( out, (uint32_t)v );
+	kvs_log_put_u32( out, (uint32_t)(v >> 32) );
+}
+
+///////////////////////////////////////////////////////////////////////////////////
+static uint32_t kvs_log_get_u32( const char* p )
+{
+	const uint8_t* b = reinterpret_cast<const uint8_t*>(p);
+	return (uint32_t)b[0] | ((uint32_t)b[1] << 8) | ((uint32_t)b[2] << 16) | ((uint32_t)b[3] << 24);
+}
+
+///////////////////////////////////////////////////////////////////////////////////
+static uint64_t kvs_log_get_u64( const char* p )
+{
+	return (uint64_t)kvs_log_get_u32( p ) | ((uint64_t)kvs_log_get_u32( p + 4 ) << 32);
+}
+
+///////////////////////////////////////////////////////////////////////////////////
+// the fields of a record body, the part after its size; false if it is malformed
+static bool kvs_log_parse( const char* body, uint32_t size, uint64_t& sequence, uint8_t& op,
+                           std::string& key, std::string& value, int64_t& expires )
+{
+	if (size < 8 + 1 + 4)
+		return false;
+	sequence = kvs_log_get_u64( body );
+	op = (uint8_t)body[8];
+
+	uint32_t at = 9;
+	uint32_t keySize = kvs_log_get_u32( body + at );
+	at += 4;
+	if (keySize > size - at || size - at - keySize < 4)
+		return false;
+	key.assign( body + at, keySize );
+	at += keySize;
+
+	uint32_t valueSize = kvs_log_get_u32( body + at );
+	at += 4;
+	if (valueSize > size - at || size - at - valueSize != 8)
+		return false;
+	value.assign( body + at, valueSize );
+	at += valueSize;
+
+	expires = (int64_t)kvs_log_get_u64( body + at );
+	return true;
+}
+
+///////////////////////////////////////////////////////////////////////////////////
+static bool kvs_log_header_ok( FILE* p_file )
+{
+	char header[KVS_LOG_HEADER_SIZE];
+	return fread( header, 1, KVS_LOG_HEADER_SIZE, p_file ) == KVS_LOG_HEADER_SIZE &&
+	       memcmp( header, KVS_LOG_MAGIC, 4 ) == 0 && kvs_log_get_u32( header + 4 ) == KVS_LOG_FORMAT;
+}
+
+///////////////////////////////////////////////////////////////////////////////////
+// the size and sequence of the record at the file's position; false at its end, or at
+// a record cut short
+static bool kvs_log_next( FILE* p_file, uint32_t& size, uint64_t& sequence )
+{
+	char head[12];
+	if (fread( head, 1, sizeof(head), p_file ) != sizeof(head))
+		return false;
+
+	size = kvs_log_get_u32( head );
+	sequence = kvs_log_get_u64( head + 4 );
+	if (size < 8 || size > KVS_LOG_MAX_RECORD)
+		return false;
+
+	// the rest has to be there, so a record is only taken whole:
+	if (kvs_log_seek( p_file, (int64_t)size - 9, SEEK_CUR ) != 0)
+		return false;
+	char last;
+	if (fread( &last, 1, 1, p_file ) != 1)
+		return false;
+	return true;
+}
+
+///////////////////////////////////////////////////////////////////////////////////
+CKvsMutationLog::CKvsMutationLog()
+{
+	mp_file = NULL;
+	mp_cipher = NULL;
+	m_sequence = 0;
+	m_size = 0;
+	m_written = 0;
+}
+
+///////////////////////////////////////////////////////////////////////////////////
+CKvsMutationLog::~CKvsMutationLog()
+{
+	if (mp_file)
+		fclose( mp_file );
+}
+
+///////////////////////////////////////////////////////////////////////////////////
+bool CKvsMutationLog::Open( const std::string& path, uint64_t last_sequence, CKvsCipher* p_cipher, std::string& emsg )
+{
+	m_path = path;
+	mp_cipher = p_cipher;
+	m_sequence = last_sequence;
+	m_size = 0;
+	m_written = 0;
+	m_index.clear();
+
+	// an existing log is read through once, to find where its whole records end:
+	FILE* p_read = fopen( path.c_str(), "rb" );
+	if (p_read)
+	{
+		if (!kvs_log_header_ok( p_read ))
+		{
+			fclose( p_read );
+			emsg = std::string("OpenMutationLog() not a mutation log: ") + path;
+			return false;
+		}
+
+		uint64_t offset = KVS_LOG_HEADER_SIZE;
+		uint32_t size;
+		uint64_t sequence;
+		while (kvs_log_next( p_read, size, sequence ))
+		{
+			Index( sequence, offset );
+			if (sequence > m_sequence)
+				m_sequence = sequence;
+			offset += 4 + (uint64_t)size;
+		}
+		fclose( p_read );
+
+		// a record torn by a crash mid write is cut off, so appends follow a whole one:
+		boost::system::error_code ec;
+		if (boost::filesystem::file_size( path, ec ) != offset)
+		{
+			boost::filesystem::resize_file( path, offset, ec );
+			if (ec)
+			{
+				emsg = std::string("OpenMutationLog() truncate: ") + ec.message();
+				return false;
+			}
+		}
+		m_size = offset;
+
+		mp_file = fopen( path.c_str(), "ab" );
+	}
+	else
+	{
+		mp_file = fopen( path.c_str(), "wb" );
+		if (mp_file)
+		{
+			std::string header( KVS_LOG_MAGIC );
+			kvs_log_put_u32( header, KVS_LOG_FORMAT );
+			if (fwrite( header.data(), 1, header.size(), mp_file ) != header.size() || fflush( mp_file ) != 0)
+			{
+				fclose( mp_file );
+				mp_file = NULL;
+			}
+			m_size = KVS_LOG_HEADER_SIZE;
+		}
+	}
+
+	if (!mp_file)
+	{
+		emsg = std::string("OpenMutationLog() unable to open: ") + path;
+		return false;
+	}
+	return true;
+}
+
+///////////////////////////////////////////////////////////////////////////////////
+void CKvsMutationLog::Append( uint8_t op, const std::string& key, const std::string& value, int64_t expires )
+{
+	const std::string* p_value = &value;
+	if (mp_cipher && !value.empty())
+	{
+		// bound to the key, as values in the db are:
+		if (mp_cipher->Seal( key, (const uint8_t*)value.data(), (uint32_t)value.size(), m_sealed ))
+		{
+			op |= KVS_LOG_SEALED;
+			p_value = &m_sealed;
+		}
+	}
+
+	uint32_t size = 8 + 1 + 4 + (uint32_t)key.size() + 4 + (uint32_t)p_value->size() + 8;
+	kvs_log_put_u32( m_buffer, size );
+	kvs_log_put_u64( m_buffer, ++m_sequence );
+	m_buffer.push_back( (char)op );
+	kvs_log_put_u32( m_buffer, (uint32_t)key.size() );
+	m_buffer += key;
+	kvs_log_put_u32( m_buffer, (uint32_t)p_value->size() );
+	m_buffer += *p_value;
+	kvs_log_put_u64( m_buffer, (uint64_t)expires );
+}
+
+///////////////////////////////////////////////////////////////////////////////////
+void CKvsMutationLog::TakeBuffer( std::string& out )
+{
+	out.swap( m_buffer );
+	m_buffer.clear();
+}
+
+///////////////////////////////////////////////////////////////////////////////////
+bool CKvsMutationLog::Write( const std::string& records, bool durable, std::string& emsg )
+{
+	if (!records.empty())
+	{
+		if (fwrite( records.data(), 1, records.size(), mp_file ) != records.size() || fflush( mp_file ) != 0)
+		{
+			emsg = std::string("FlushMutationLog() write failed: ") + m_path;
+			return false;
+		}
+
+		for (size_t at = 0; at + 12 <= records.size(); )
+		{
+			uint32_t size = kvs_log_get_u32( records.data() + at );
+			Index( kvs_log_get_u64( records.data() + at + 4 ), m_size );
+			m_size += 4 + (uint64_t)size;
+			at += 4 + (size_t)size;
+		}
+	}
+
+	if (durable && kvs_log_fsync( mp_file ) != 0)
+	{
+		emsg = std::string("FlushMutationLog() sync failed: ") + m_path;
+		return false;
+	}
+	return true;
+}
+
+///////////////////////////////////////////////////////////////////////////////////
+// the records kept are copied to a new file beside the log, made durable, and renamed
+// over it; until then the log is untouched, so a failure or crash leaves it as it was
+bool CKvsMutationLog::Truncate( uint64_t through, std::string& emsg )
+{
+	std::string rolled = m_path + ".roll";
+
+	uint64_t from;
+	uint64_t end;
+	Locate( through, from, end );
+
+	FILE* p_read = fopen( m_path.c_str(), "rb" );
+	FILE* p_write = fopen( rolled.c_str(), "wb" );
+	bool  ok = p_read && p_write && kvs_log_seek( p_read, (int64_t)from, SEEK_SET ) == 0;
+
+	std::string header( KVS_LOG_MAGIC );
+	kvs_log_put_u32( header, KVS_LOG_FORMAT );
+	ok = ok && fwrite( header.data(), 1, header.size(), p_write ) == header.size();
+
+	// the kept records go over as they are, their sequences and sealed values unchanged:
+	std::map<uint64_t, uint64_t> index;
+	uint64_t    size = KVS_LOG_HEADER_SIZE;
+	uint64_t    written = 0;
+	std::string record;
+	while (ok && from < end)
+	{
+		char head[12];
+		if (fread( head, 1, sizeof(head), p_read ) != sizeof(head))
+		{
+			ok = false;
+			break;
+		}
+		uint32_t recordSize = kvs_log_get_u32( head );
+		uint64_t sequence = kvs_log_get_u64( head + 4 );
+		if (recordSize < 8 || recordSize > KVS_LOG_MAX_RECORD)
+		{
+			ok = false;
+			break;
+		}
+		from += 4 + (uint64_t)recordSize;
+
+		if (sequence <= through)
+		{
+			ok = kvs_log_seek( p_read, (int64_t)recordSize - 8, SEEK_CUR ) == 0;
+			continue;
+		}
+
+		record.assign( head, sizeof(head) );
+		record.resize( 4 + (size_t)recordSize );
+		ok = fread( &record[sizeof(head)], 1, recordSize - 8, p_read ) == recordSize - 8 &&
+		     fwrite( record.data(), 1, record.size(), p_write ) == record.size();
+
+		if (written++ % KVS_LOG_INDEX_EVERY == 0)
+			index[sequence] = size;
+		size += record.size();
+	}
+
+	ok = ok && fflush( p_write ) == 0 && kvs_log_fsync( p_write ) == 0;
+	if (p_read)
+		fclose( p_read );
+	if (p_write)
+		fclose( p_write );
+
+	boost::system::error_code ec;
+	if (!ok)
+	{
+		boost::filesystem::remove( rolled, ec );
+		emsg = std::string("TruncateMutationLog() unable to copy the records kept to: ") + rolled;
+		return false;
+	}
+
+	fclose( mp_file );
+	boost::filesystem::rename( rolled, m_path, ec );
+	if (ec)
+	{
+		boost::filesystem::remove( rolled, ec );
+		mp_file = fopen( m_path.c_str(), "ab" );
+		emsg = std::string("TruncateMutationLog() rename: ") + ec.message();
+		return false;
+	}
+
+	mp_file = fopen( m_path.c_str(), "ab" );
+	if (!mp_file)
+	{
+		emsg = std::string("TruncateMutationLog() unable to open: ") + m_path;
+		return false;
+	}
+
+	m_index.swap( index );
+	m_size = size;
+	m_written = written;
+	return true;
+}
+
+///////////////////////////////////////////////////////////////////////////////////
+void CKvsMutationLog::Index( uint64_t sequence, uint64_t offset )
+{
+	if (m_written++ % KVS_LOG_INDEX_EVERY == 0)
+		m_index[sequence] = offset;
+}
+
+///////////////////////////////////////////////////////////////////////////////////
+uint64_t CKvsMutationLog::Sequence( void )
+{
+	return m_sequence;
+}
+
+///////////////////////////////////////////////////////////////////////////////////
+void CKvsMutationLog::Locate( uint64_t after, uint64_t& from, uint64_t& end )
+{
+	from = KVS_LOG_HEADER_SIZE;
+	end = m_size;
+
+	// the last indexed record at or before the first one wanted:
+	std::map<uint64_t, uint64_t>::iterator it = m_index.upper_bound( after + 1 );
+	if (it != m_index.begin())
+		from = (--it)->second;
+}
+
+///////////////////////////////////////////////////////////////////////////////////
+const std::string& CKvsMutationLog::Path( void )
+{
+	return m_path;
+}
+
+///////////////////////////////////////////////////////////////////////////////////
+CKvsFollower::CKvsFollower( CKeyValueStore* p_store, const std::string& path )
+{
+	mp_store = p_store;
+	m_path = path;
+	mp_file = NULL;
+	m_offset = 0;
+}
+
+///////////////////////////////////////////////////////////////////////////////////
+CKvsFollower::~CKvsFollower()
+{
+	if (mp_file)
+		fclose( mp_file );
+}
+
+///////////////////////////////////////////////////////////////////////////////////
+uint64_t CKvsFollower::Sequence( void )
+{
+	CKvsTimedLock guard(mp_store->m_mutex, mp_store->m_stats);
+	return mp_store->m_logSequence;
+}
+
+///////////////////////////////////////////////////////////////////////////////////
+std::string CKvsFollower::GetErrorMsg( void )
+{
+	return m_emsg;
+}
+
+///////////////////////////////////////////////////////////////////////////////////
+// starts at the offset the store last recorded when the record there is the next one
+// wanted, and otherwise reads the log from its start, skipping what was applied
+bool CKvsFollower::Reopen( void )
+{
+	if (mp_file)
+		fclose( mp_file );
+	m_pending.clear();
+
+	mp_file = fopen( m_path.c_str(), "rb" );
+	if (!mp_file)
+	{
+		m_emsg = std::string("CKvsFollower unable to open: ") + m_path;
+		return false;
+	}
+	if (!kvs_log_header_ok( mp_file ))
+	{
+		m_emsg = std::string("CKvsFollower not a mutation log: ") + m_path;
+		fclose( mp_file );
+		mp_file = NULL;
+		return false;
+	}
+
+	uint64_t applied;
+	uint64_t hint;
+	{
+		CKvsTimedLock guard(mp_store->m_mutex, mp_store->m_stats);
+		applied = mp_store->m_logSequence;
+		hint = mp_store->m_logOffset;
+	}
+
+	m_offset = KVS_LOG_HEADER_SIZE;
+	if (hint > KVS_LOG_HEADER_SIZE && kvs_log_seek( mp_file, (int64_t)hint, SEEK_SET ) == 0)
+	{
+		uint32_t size;
+		uint64_t sequence;
+		if (kvs_log_next( mp_file, size, sequence ) && sequence == applied + 1)
+			m_offset = hint;
+	}
+
+	kvs_log_seek( mp_file, (int64_t)m_offset, SEEK_SET );
+	return true;
+}
+
+///////////////////////////////////////////////////////////////////////////////////
+int64_t CKvsFollower::Poll( void )
+{
+	if (m_path.empty())
+	{
+		m_emsg = "CKvsFollower::Poll() has no log file; use Apply()";
+		return -1;
+	}
+	if (!mp_file && !Reopen())
+		return -1;
+
+	// a log replaced by a shorter one, such as a new log after the old was removed, is
+	// read afresh; its records already applied are skipped:
+	boost::system::error_code ec;
+	uint64_t onDisk = (uint64_t)boost::filesystem::file_size( m_path, ec );
+	if (!ec && onDisk < m_offset + m_pending.size())
+	{
+		{
+			CKvsTimedLock guard(mp_store->m_mutex, mp_store->m_stats);
+			mp_store->m_logOffset = 0;
+		}
+		if (!Reopen())
+			return -1;
+	}
+
+	int64_t applied = 0;
+	bool    rolled = false;
+	std::string chunk( KVS_LOG_READ_SIZE, '\0' );
+	for (;;)
+	{
+		size_t got = fread( &chunk[0], 1, chunk.size(), mp_file );
+		if (got)
+		{
+			m_pending.append( chunk.data(), got );
+			int64_t n = Consume();
+			if (n < 0)
+				return -1;
+			applied += n;
+		}
+		if (got < chunk.size())
+		{
+			// at the end for now; more may be appended before the next call:
+			clearerr( mp_file );
+
+			// unless the log was rolled over by TruncateMutationLog(): the file at the path
+			// is then a new one, grown past where the one open ends, and is read from the
+			// record past the last applied:
+			onDisk = (uint64_t)boost::filesystem::file_size( m_path, ec );
+			if (got || ec || onDisk <= m_offset + m_pending.size() || rolled)
+				return applied;
+			if (!Reopen())
+				return -1;
+			rolled = true;
+		}
+	}
+}
+
+///////////////////////////////////////////////////////////////////////////////////
+int64_t CKvsFollower::Apply( const char* data, size_t size )
+{
+	m_pending.append( data, size );
+	return Consume();
+}
+
+///////////////////////////////////////////////////////////////////////////////////
+int64_t CKvsFollower::Consume( void )
+{
+	int64_t     applied = 0;
+	size_t      at = 0;
+	uint64_t    sequence;
+	uint8_t     op;
+	std::string key;
+	std::string value;
+	int64_t     expires;
+
+	while (m_pending.size() - at >= 4)
+	{
+		uint32_t size = kvs_log_get_u32( m_pending.data() + at );
+		if (size > KVS_LOG_MAX_RECORD)
+		{
+			m_emsg = "CKvsFollower bad record size";
+			return -1;
+		}
+		if (m_pending.size() - at - 4 < size)
+			break;
+
+		if (!kvs_log_parse( m_pending.data() + at + 4, size, sequence, op, key, value, expires ))
+		{
+			m_emsg = "CKvsFollower malformed record";
+			return -1;
+		}
+		at += 4 + (size_t)size;
+
+		// the offset is only meaningful reading the file:
+		uint64_t next = (m_path.empty()) ? 0 : m_offset + at;
+		int32_t rc = mp_store->ApplyLogRecord( sequence, op, key, value, expires, next, m_emsg );
+		if (rc < 0)
+		{
+			m_pending.erase( 0, at - 4 - size );
+			m_offset += at - 4 - size;
+			return -1;
+		}
+		applied += rc;
+	}
+
+	m_pending.erase( 0, at );
+	m_offset += at;
+	return applied;
+}
+
+///////////////////////////////////////////////////////////////////////////////////
+bool CKeyValueStore::OpenMutationLog( const std::string& path )
+{
+	LazyInit(); // even if LazyInit fails, we continue...
+
+	CKvsMutationLog* p_log = new CKvsMutationLog;
+
+	uint64_t last;
+	{
+		CKvsTimedLock guard(m_mutex, m_stats);
+		last = m_logSequence;
+	}
+	if (!p_log->Open( path, last, mp_cipher, m_emsg ))
+	{
+		delete p_log;
+		return false;
+	}
+
+	CKvsTimedLock guard(m_mutex, m_stats);
+	if (mp_log)
+	{
+		m_emsg = "OpenMutationLog() a log is already open";
+		delete p_log;
+		return false;
+	}
+	mp_log = p_log;
+	m_logSequence = p_log->Sequence();
+	return true;
+}
+
+///////////////////////////////////////////////////////////////////////////////////
+// counters change without the lock, so they are logged here by value, those that
+// changed since they were last logged
+bool CKeyValueStore::FlushMutationLog( bool durable )
+{
+	if (!mp_log)
+		return true;
+
+	std::lock_guard<std::mutex> flushGuard( mp_log->m_flushMutex );
+
+	std::string records;
+	{
+		CKvsTimedLock guard(m_mutex, m_stats);
+
+		for (std::deque<CKvsCounter>::iterator c = m_counters.begin(); c != m_counters.end(); ++c)
+		{
+			int32_t value = c->m_value.load();
+			if (value == c->m_logged)
+				continue;
+
+			// a counter whose key has since been deleted or rewritten is no longer its value:
+			c->m_logged = value;
+			CKvsPairs::iterator it = m_pairs.find( c->m_key );
+			if (it != m_pairs.end() && it->second.mp_counter == &c->m_value)
+				mp_log->Append( KVS_LOG_SET, c->m_key, std::to_string( value ), it->second.m_expires );
+		}
+
+		mp_log->TakeBuffer( records );
+		m_logSequence = mp_log->Sequence();
+	}
+
+	return mp_log->Write( records, durable, m_emsg );
+}
+
+///////////////////////////////////////////////////////////////////////////////////
+uint64_t CKeyValueStore::GetLogSequence( void )
+{
+	CKvsTimedLock guard(m_mutex, m_stats);
+	return (mp_log) ? mp_log->Sequence() : m_logSequence;
+}
+
+///////////////////////////////////////////////////////////////////////////////////
+// what is buffered stays in RAM and is appended to the new file by the next flush
+bool CKeyValueStore::TruncateMutationLog( uint64_t acked_sequence )
+{
+	if (!mp_log)
+	{
+		m_emsg = "TruncateMutationLog() no mutation log is open";
+		return false;
+	}
+
+	std::lock_guard<std::mutex> flushGuard( mp_log->m_flushMutex );
+	return mp_log->Truncate( acked_sequence, m_emsg );
+}
+
+///////////////////////////////////////////////////////////////////////////////////
+CKvsFollower* CKeyValueStore::Follow( const std::string& path )
+{
+	LazyInit(); // even if LazyInit fails, we continue...
+
+	return new CKvsFollower( this, path );
+}
+
+///////////////////////////////////////////////////////////////////////////////////
+// whole records only, read from the file as written so far, past what was flushed
+bool CKeyValueStore::ReadMutationLog( uint64_t after_sequence, uint32_t max_bytes, std::string& records )
+{
+	records.clear();
+	if (!mp_log)
+	{
+		m_emsg = "ReadMutationLog() no mutation log is open";
+		return false;
+	}
+
+	// opened with the offsets, so a log rolled over meanwhile is read as it was:
+	uint64_t from;
+	uint64_t end;
+	FILE*    p_file;
+	{
+		std::lock_guard<std::mutex> flushGuard( mp_log->m_flushMutex );
+		mp_log->Locate( after_sequence, from, end );
+		p_file = fopen( mp_log->Path().c_str(), "rb" );
+	}
+
+	if (!p_file || kvs_log_seek( p_file, (int64_t)from, SEEK_SET ) != 0)
+	{
+		m_emsg = std::string("ReadMutationLog() unable to read: ") + mp_log->Path();
+		if (p_file)
+			fclose( p_file );
+		return false;
+	}
+
+	std::string record;
+	bool        ok = true;
+	while (from < end && records.size() < max_bytes)
+	{
+		char head[12];
+		if (fread( head, 1, sizeof(head), p_file ) != sizeof(head))
+		{
+			ok = false;
+			break;
+		}
+		uint32_t size = kvs_log_get_u32( head );
+		uint64_t sequence = kvs_log_get_u64( head + 4 );
+		if (size < 8 || size > KVS_LOG_MAX_RECORD)
+		{
+			ok = false;
+			break;
+		}
+
+		if (sequence <= after_sequence)
+		{
+			if (kvs_log_seek( p_file, (int64_t)size - 8, SEEK_CUR ) != 0)
+			{
+				ok = false;
+				break;
+			}
+		}
+		else
+		{
+			record.assign( head, sizeof(head) );
+			record.resize( 4 + (size_t)size );
+			if (fread( &record[sizeof(head)], 1, size - 8, p_file ) != size - 8)
+			{
+				ok = false;
+				break;
+			}
+			records += record;
+		}
+		from += 4 + (uint64_t)size;
+	}
+	fclose( p_file );
+
+	if (!ok)
+		m_emsg = std::string("ReadMutationLog() bad record in: ") + mp_log->Path();
+	return ok;
+}
+
+///////////////////////////////////////////////////////////////////////////////////
+// 1 when applied, 0 for a record applied before, -1 upon an error. The sequence only
+// moves on once the change is made, so a record may be applied again after a crash;
+// every op gives the same result applied twice
+int32_t CKeyValueStore::ApplyLogRecord( uint64_t sequence, uint8_t op, std::string& key, std::string& value,
+                                        int64_t expires, uint64_t next_offset, std::string& emsg )
+{
+	uint64_t applied;
+	bool     logging;
+	{
+		CKvsTimedLock guard(m_mutex, m_stats);
+		applied = m_logSequence;
+		logging = (mp_log != NULL);
+	}
+	// its sequence would be its own log's, not the one followed:
+	if (logging)
+	{
+		emsg = "CKvsFollower a store with a mutation log of its own cannot follow another";
+		return -1;
+	}
+	if (sequence <= applied)
+		return 0;
+	if (isFrozen())
+	{
+		emsg = "CKvsFollower the store is frozen";
+		return -1;
+	}
+	if (applied && sequence != applied + 1)
+	{
+		emsg = "CKvsFollower the log skips from " + std::to_string(applied) + " to " + std::to_string(sequence) +
+		       "; the follower needs a fresh copy of the primary's db";
+		return -1;
+	}
+
+	if (op & KVS_LOG_SEALED)
+	{
+		std::string plain;
+		if (!mp_cipher || !mp_cipher->Open( key, (const uint8_t*)value.data(), (uint32_t)value.size(), plain ))
+		{
+			emsg = "CKvsFollower unable to open a sealed value of " + key + "; the primary's key is needed";
+			return -1;
+		}
+		value.swap( plain );
+	}
+
+	switch (op & ~KVS_LOG_SEALED)
+	{
+		case KVS_LOG_DELETE:
+			DeleteKey( key );
+			break;
+
+		case KVS_LOG_DELETE_PREFIX:
+			DeleteKeysStartingWith( key );
+			break;
+
+		case KVS_LOG_SET:
+		case KVS_LOG_EXPIRE:
+		{
+			CKvsTimedLock guard(m_mutex, m_stats);
+
+			CKvsPairs::iterator it = m_pairs.find( key );
+			if ((op & ~KVS_LOG_SEALED) == KVS_LOG_EXPIRE && it == m_pairs.end())
+				break;
+
+			uint64_t version = NextVersion( key, it );
+			if (it == m_pairs.end())
+				it = kvs_insert_pair( m_pairs, m_pairs.end(), CKeyValue( key.c_str(), "" ) ).first;
+
+			CKeyValue& kv = it->second;
+			if ((op & ~KVS_LOG_SEALED) == KVS_LOG_SET)
+			{
+				if (kv.mp_counter)
+				{
+					int32_t numVal = 0;
+					isParam( value, numVal );
+					kv.mp_counter->store( numVal );
+				}
+				else
+				{
+					kv.SetValue( "" );
+					kv.m_value.swap( value );
+				}
+			}
+			kv.m_expires = expires;
+			kv.m_version = version;
+			if (expires)
+				m_wheel.Schedule( key, expires );
+			break;
+		}
+
+		default:
+			emsg = "CKvsFollower unknown record op " + std::to_string( op );
+			return -1;
+	}
+
+	CKvsTimedLock guard(m_mutex, m_stats);
+	m_logSequence = sequence;
+	m_logOffset = next_offset;
+	return 1;
+}
+
+///////////////////////////////////////////////////////////////////////////////////
+bool CKeyValueStore::ReadMeta( const char* name, int64_t& value )
+{
+	sqlite3_stmt* statement;
+	if (sqlite3_prepare_v2( mp_db, "SELECT value FROM keyValueMeta WHERE name = ?1;", -1, &statement, NULL ) != SQLITE_OK)
+		return false;
+
+	sqlite3_bind_text( statement, 1, name, -1, SQLITE_STATIC );
+	bool found = (sqlite3_step( statement ) == SQLITE_ROW);
+	if (found)
+		value = sqlite3_column_int64( statement, 0 );
+	sqlite3_finalize( statement );
+	return found;
+}
+
+///////////////////////////////////////////////////////////////////////////////////
+bool CKeyValueStore::WriteMeta( const char* name, int64_t value )
+{
+	sqlite3_stmt* statement;
+	if (sqlite3_prepare_v2( mp_db, "REPLACE INTO keyValueMeta (name, value) VALUES (?1, ?2);", -1, &statement, NULL ) != SQLITE_OK)
+		return false;
+
+	sqlite3_bind_text( statement, 1, name, -1, SQLITE_STATIC );
+	sqlite3_bind_int64( statement, 2, value );
+	bool ok = (sqlite3_step( statement ) == SQLITE_DONE);
+	sqlite3_finalize( statement );
+	return ok;
+}
@@ -0,0 +1,148 @@
+/////////////////////////////////////////////////////////////////////////////
+// Name:        replication.h
+// Purpose:     log shipping from a primary CKeyValueStore to followers.
+//
+//							A primary given OpenMutationLog() appends a record of every
+//							change to a file: writes, ttls, deletes, prefix deletes, the
+//							rows of a BulkLoad() and transaction commits, each numbered
+//							by a sequence that continues across restarts. Counters are
+//							logged by value upon each flush, when they have changed.
+//							Records are buffered in RAM and written out by
+//							FlushMutationLog(), and durably by each sync, ahead of the
+//							db commit.
+//
+//							A follower store tails the log with Follow(), applying only
+//							the records past the last it applied, so keeping up costs in
+//							proportion to the changes. It records the last applied in its
+//							own db as it syncs, so a restart resumes from there. Log bytes
+//							from anywhere else, such as a socket, can be given to Apply().
+//
+//							Once every follower has applied the records up to a sequence,
+//							TruncateMutationLog() drops them: the rest are copied to a new
+//							file, renamed over the log, so a crash leaves one or the other
+//							whole. Numbering goes on from the last record logged, and a
+//							follower tailing the file reopens the new one when it sees it.
+//
+//							With an encryption key values are sealed in the log too, so
+//							a follower needs the primary's key. Keys reclaimed upon
+//							expiry are not logged; a follower expires them itself.
+//
+//							A log file is "KVSL", a u32 format version, then records:
+//							u32 size of the rest, u64 sequence, u8 op, u32 key size, key,
+//							u32 value size, value, i64 expires (kvs_now_ms() time, 0 for
+//							never); all little endian.
+/////////////////////////////////////////////////////////////////////////////
+
+#ifndef _KVS_REPLICATION_H_
+#define _KVS_REPLICATION_H_
+
+#include <cstdint>
+#include <cstdio>
+#include <string>
+#include <mutex>
+#include <map>
+
+#define KVS_LOG_MAGIC         "KVSL"
+#define KVS_LOG_FORMAT        (1)
+#define KVS_LOG_HEADER_SIZE   (8)         // magic and format
+#define KVS_LOG_MAX_RECORD    (0x40000000)
+#define KVS_LOG_READ_SIZE     (256 * 1024) // bytes a follower reads per call while tailing
+#define KVS_LOG_INDEX_EVERY   (1024)      // records between the offsets kept to find a sequence
+
+// record ops:
+#define KVS_LOG_SET           (1)         // key = value, expiring at expires
+#define KVS_LOG_EXPIRE        (2)         // key's value stays, expiring at expires
+#define KVS_LOG_DELETE        (3)
+#define KVS_LOG_DELETE_PREFIX (4)         // every key starting with key
+#define KVS_LOG_SEALED        (0x80)      // flag: the value is sealed by the store's CKvsCipher
+
+class CKeyValueStore;
+class CKvsCipher;
+
+// the primary's side, owned by the store:
+class CKvsMutationLog
+{
+public:
+	CKvsMutationLog();
+	~CKvsMutationLog();
+
+	// opens path to append, creating it, or continuing after its last whole record with
+	// a torn one cut off; sequence numbers continue from the larger of its and last_sequence:
+	bool        Open( const std::string& path, uint64_t last_sequence, CKvsCipher* p_cipher, std::string& emsg );
+
+	// buffers a record, the caller holding the store's m_mutex so records go in the order
+	// of the changes:
+	void        Append( uint8_t op, const std::string& key, const std::string& value, int64_t expires );
+	//
+	// hands over what is buffered, under the store's m_mutex:
+	void        TakeBuffer( std::string& out );
+	// writes out what TakeBuffer() gave, with durable waiting for the disk; the caller
+	// holds m_flushMutex from TakeBuffer() on, so buffers are written in order:
+	bool        Write( const std::string& records, bool durable, std::string& emsg );
+
+	uint64_t    Sequence( void );       // of the last record appended
+	// where to read from for the records past after, and where the written ones end; the
+	// caller holds m_flushMutex:
+	void        Locate( uint64_t after, uint64_t& from, uint64_t& end );
+	// rolls the file over to one without the records through the sequence given, what
+	// is left keeping its numbering; the caller holds m_flushMutex:
+	bool        Truncate( uint64_t through, std::string& emsg );
+	const std::string& Path( void );
+
+	std::mutex  m_flushMutex;
+
+private:
+	CKvsMutationLog( const CKvsMutationLog& );
+	CKvsMutationLog& operator=( const CKvsMutationLog& );
+
+	// notes the offset of every KVS_LOG_INDEX_EVERY-th record as records are written:
+	void        Index( uint64_t sequence, uint64_t offset );
+
+	std::string m_path;
+	FILE*       mp_file;
+	CKvsCipher* mp_cipher;
+	std::string m_buffer;
+	uint64_t    m_sequence;
+	std::string m_sealed;               // scratch for sealing a value
+
+	// guarded by m_flushMutex:
+	uint64_t    m_size;                 // bytes in the file
+	uint64_t    m_written;              // records in the file
+	std::map<uint64_t, uint64_t> m_index; // sequence to offset
+};
+
+class CKvsFollower
+{
+public:
+	~CKvsFollower();
+
+	// applies what the log file has gained since the last call, returning how many
+	// records were applied; -1 upon an error, when GetErrorMsg() says why:
+	int64_t     Poll( void );
+	// applies log records from any other source, a record split between calls kept until
+	// it is whole; without the file header. Returns as Poll() does:
+	int64_t     Apply( const char* data, size_t size );
+
+	uint64_t    Sequence( void );       // of the last record applied
+	std::string GetErrorMsg( void );
+
+private:
+	friend class CKeyValueStore;
+	CKvsFollower( CKeyValueStore* p_store, const std::string& path );
+	CKvsFollower( const CKvsFollower& );
+	CKvsFollower& operator=( const CKvsFollower& );
+
+	// opens the file, positioned after the last record applied; false upon an error:
+	bool        Reopen( void );
+	// applies the whole records in m_pending:
+	int64_t     Consume( void );
+
+	CKeyValueStore* mp_store;
+	std::string     m_path;             // empty when fed by Apply() alone
+	FILE*           mp_file;
+	uint64_t        m_offset;           // of the next record in the file
+	std::string     m_pending;          // bytes of a record not yet whole
+	std::string     m_emsg;
+};
+
+#endif // _KVS_REPLICATION_H_
@@ -0,0 +1,109 @@
+////////////////////////////////////////////////////////////////////////////
+// Name:        snapshot.cpp
+// Purpose:     versioned read views of a CKeyValueStore
+/////////////////////////////////////////////////////////////////////////////
+
+#include "kvs.h"
+
+///////////////////////////////////////////////////////////////////////////////////
+CKvsSnapshot::CKvsSnapshot( CKeyValueStore* p_store, uint64_t version, int64_t at_ms )
+{
+	mp_store = p_store;
+	m_version = version;
+	m_atMs = at_ms;
+}
+
+///////////////////////////////////////////////////////////////////////////////////
+CKvsSnapshot::~CKvsSnapshot()
+{
+	mp_store->ReleaseSnapshot( m_version );
+}
+
+///////////////////////////////////////////////////////////////////////////////////
+uint64_t CKvsSnapshot::GetVersion( void )
+{
+	return m_version;
+}
+
+///////////////////////////////////////////////////////////////////////////////////
+// the store hands back a copy, so decoding happens here, outside its lock
+bool CKvsSnapshot::Value( std::string& key, std::string& value )
+{
+	CKeyValue kv( key.c_str(), "" );
+	if (!mp_store->SnapshotValue( m_version, m_atMs, key, kv ))
+		return false;
+
+	std::string emsg;
+	if (!mp_store->DecodeValue( kv, NULL, emsg ))
+		return false;
+
+	value.swap( kv.m_value );
+	kv.FreeBinary();	// decoding a binary value makes its raw bytes too
+	return true;
+}
+
+///////////////////////////////////////////////////////////////////////////////////
+bool CKvsSnapshot::isKey( std::string& key )
+{
+	CKeyValue kv( key.c_str(), "" );
+	return mp_store->SnapshotValue( m_version, m_atMs, key, kv );
+}
+
+///////////////////////////////////////////////////////////////////////////////////
+bool CKvsSnapshot::ReadBool( std::string& key, bool defaultValue )
+{
+	std::string value;
+	int32_t     numVal;
+	if (Value( key, value ))
+		return (mp_store->isParam( value, numVal )) ? (numVal != 0) : defaultValue;
+
+	return kvs_default_bool( mp_store->m_defaults.Find( key ), defaultValue );
+}
+
+///////////////////////////////////////////////////////////////////////////////////
+int32_t CKvsSnapshot::ReadInt( std::string& key, int32_t defaultValue )
+{
+	std::string value;
+	int32_t     numVal;
+	if (Value( key, value ))
+		return (mp_store->isParam( value, numVal )) ? numVal : defaultValue;
+
+	return kvs_default_int( mp_store->m_defaults.Find( key ), defaultValue );
+}
+
+///////////////////////////////////////////////////////////////////////////////////
+float CKvsSnapshot::ReadReal( std::string& key, float defaultValue )
+{
+	std::string value;
+	float       numVal;
+	if (Value( key, value ))
+		return (mp_store->isParam( value, numVal )) ? numVal : defaultValue;
+
+	return kvs_default_real( mp_store->m_defaults.Find( key ), defaultValue );
+}
+
+///////////////////////////////////////////////////////////////////////////////////
+std::string CKvsSnapshot::ReadString( std::string& key, char* defaultValue )
+{
+	std::string value;
+	if (Value( key, value ))
+		return value;
+
+	const char* registered = mp_store->m_defaults.Find( key );
+	return std::string( (registered) ? registered : defaultValue );
+}
+
+///////////////////////////////////////////////////////////////////////////////////
+bool CKvsSnapshot::ReadBinary( std::string& key, uint8_t* dest, uint32_t byte_size )
+{
+	std::string value;
+	if (!Value( key, value ))
+		return false;
+
+	std::string raw = mp_store->base64_decode( value );
+	if (raw.size() != byte_size)
+		return false;
+
+	memcpy( dest, raw.data(), byte_size );
+	return true;
+}
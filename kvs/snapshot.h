@@ -0,0 +1,60 @@
+/////////////////////////////////////////////////////////////////////////////
+// Name:        snapshot.h
+// Purpose:     a consistent, read only view of a CKeyValueStore as of one
+//							moment, from CKeyValueStore::Snapshot().
+//
+//							Every write takes the next store version. A snapshot is just
+//							the version current when it was taken: reading a key gives
+//							the value whose version range covers it, either the live one
+//							or one the store kept aside when a later write replaced it.
+//							Writers never wait on snapshots, and keeping old values only
+//							costs anything while some snapshot is open.
+//
+//							Reads do not create missing keys, and expiry is judged as of
+//							the snapshot's time. A default inserted by a plain Read* has
+//							no version, so every snapshot sees it. Counters are also an
+//							exception to the view:
+//							Increment() & co are lock free and unversioned, so a counter
+//							reads its current value.
+/////////////////////////////////////////////////////////////////////////////
+
+#ifndef _KVS_SNAPSHOT_H_
+#define _KVS_SNAPSHOT_H_
+
+#include <cstdint>
+#include <string>
+
+class CKeyValueStore;
+class CKeyValue;
+
+class CKvsSnapshot
+{
+public:
+	~CKvsSnapshot();		// lets the store drop old values no other snapshot needs
+
+	bool        ReadBool(   std::string& key, bool     defaultValue );
+	int32_t     ReadInt(    std::string& key, int32_t  defaultValue );
+	float       ReadReal(   std::string& key, float    defaultValue );
+	std::string ReadString( std::string& key, char*    defaultValue );
+	//
+	// copies byte_size bytes into dest; false, with dest untouched, if the key is missing:
+	bool        ReadBinary( std::string& key, uint8_t* dest, uint32_t byte_size );
+
+	bool        isKey( std::string& key );
+	// the decoded text of key as of this snapshot, binary as base64; false if it is missing:
+	bool        Value( std::string& key, std::string& value );
+
+	uint64_t    GetVersion( void );
+
+private:
+	friend class CKeyValueStore;
+	CKvsSnapshot( CKeyValueStore* p_store, uint64_t version, int64_t at_ms );
+	CKvsSnapshot( const CKvsSnapshot& );
+	CKvsSnapshot& operator=( const CKvsSnapshot& );
+
+	CKeyValueStore* mp_store;
+	uint64_t        m_version;
+	int64_t         m_atMs;
+};
+
+#endif // _KVS_SNAPSHOT_H_
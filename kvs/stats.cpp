@@ -0,0 +1,349 @@
+////////////////////////////////////////////////////////////////////////////
+// Name:        stats.cpp
+// Purpose:     per-thread store counters, summed on read
+/////////////////////////////////////////////////////////////////////////////
+
+#include <set>
+#include <cstring>
+#include <cstdio>
+#include "stats.h"
+
+#ifdef _MSC_VER
+#include <intrin.h>
+#endif
+
+static std::atomic<uint64_t> g_nextStatsId(1);
+
+// ids of the stats objects still alive, so threads can drop entries of dead ones:
+static std::mutex         g_liveMutex;
+static std::set<uint64_t> g_liveIds;
+
+struct CKvsLocalEntry
+{
+	uint64_t         m_id;
+	CKvsThreadStats* mp_stats;
+};
+
+// the block this thread used last, then every block this thread owns:
+static thread_local CKvsLocalEntry              t_last = { 0, NULL };
+static thread_local std::vector<CKvsLocalEntry> t_entries;
+
+///////////////////////////////////////////////////////////////////////////////////
+CKvsThreadStats::CKvsThreadStats()
+{
+	for (int32_t i = 0; i < KVS_STAT_COUNT; i++)
+		m_counters[i].store( 0, std::memory_order_relaxed );
+
+	for (int32_t h = 0; h < KVS_HIST_COUNT; h++)
+	{
+		m_histSum[h].store( 0, std::memory_order_relaxed );
+		for (int32_t b = 0; b < KVS_HIST_BUCKETS; b++)
+			m_hist[h][b].store( 0, std::memory_order_relaxed );
+	}
+}
+
+///////////////////////////////////////////////////////////////////////////////////
+CKvsStatsSnapshot::CKvsStatsSnapshot()
+{
+	memset( m_counters, 0, sizeof(m_counters) );
+	memset( m_histSum, 0, sizeof(m_histSum) );
+	memset( m_hist, 0, sizeof(m_hist) );
+}
+
+///////////////////////////////////////////////////////////////////////////////////
+uint64_t CKvsStatsSnapshot::Count( KVS_HIST hist )
+{
+	uint64_t count = 0;
+	for (int32_t b = 0; b < KVS_HIST_BUCKETS; b++)
+		count += m_hist[hist][b];
+	return count;
+}
+
+///////////////////////////////////////////////////////////////////////////////////
+uint64_t CKvsStatsSnapshot::Percentile( KVS_HIST hist, double q )
+{
+	uint64_t count = Count( hist );
+	if (count == 0)
+		return 0;
+
+	uint64_t rank = (uint64_t)(q * (double)count);
+	if (rank >= count)
+		rank = count - 1;
+
+	uint64_t seen = 0;
+	for (uint32_t b = 0; b < KVS_HIST_BUCKETS; b++)
+	{
+		seen += m_hist[hist][b];
+		if (seen > rank)
+			return CKvsStats::BucketLowerBound( b + 1 ) - 1;	// the bucket's upper bound
+	}
+	return CKvsStats::BucketLowerBound( KVS_HIST_BUCKETS - 1 );
+}
+
+///////////////////////////////////////////////////////////////////////////////////
+const char* CKvsStatsSnapshot::Name( KVS_STAT stat )
+{
+	switch (stat)
+	{
+		case KVS_STAT_READ_HITS:            return "read_hits";
+		case KVS_STAT_READ_MISSES:          return "read_misses";
+		case KVS_STAT_READ_DEFAULT_INSERTS: return "read_default_inserts";
+		case KVS_STAT_READ_CACHE_HITS:      return "read_cache_hits";
+		case KVS_STAT_WRITES_BOOL:          return "writes_bool";
+		case KVS_STAT_WRITES_INT:           return "writes_int";
+		case KVS_STAT_WRITES_REAL:          return "writes_real";
+		case KVS_STAT_WRITES_STRING:        return "writes_string";
+		case KVS_STAT_WRITES_BINARY:        return "writes_binary";
+		case KVS_STAT_DEDUP_HITS:           return "dedup_hits";
+		case KVS_STAT_DELETES:              return "deletes";
+		case KVS_STAT_COUNTER_OPS:          return "counter_ops";
+		case KVS_STAT_EXPIRED:              return "expired_keys";
+		case KVS_STAT_TXN_COMMITS:          return "txn_commits";
+		case KVS_STAT_TXN_CONFLICTS:        return "txn_conflicts";
+		case KVS_STAT_LOCK_CONTENDED:       return "lock_contended";
+		case KVS_STAT_LOCK_WAIT_NS:         return "lock_wait_ns";
+		case KVS_STAT_SYNCS:                return "syncs";
+		case KVS_STAT_SYNC_FAILURES:        return "sync_failures";
+		case KVS_STAT_SYNC_ROWS:            return "sync_rows";
+		case KVS_STAT_BYTES_PERSISTED:      return "bytes_persisted";
+		case KVS_STAT_SYNC_CHUNKS:          return "sync_chunks";
+		case KVS_STAT_SYNC_PACED_WAITS:     return "sync_paced_waits";
+		case KVS_STAT_SYNC_PACED_NS:        return "sync_paced_ns";
+		case KVS_STAT_SYNC_PREEMPTED:       return "sync_preempted";
+		case KVS_STAT_BACKUP_PAGES:         return "backup_pages";
+		case KVS_STAT_CHECKPOINTS:          return "checkpoints";
+		case KVS_STAT_REFRESHES:            return "refreshes";
+		case KVS_STAT_REFRESH_KEYS:         return "refresh_keys";
+		case KVS_STAT_REFRESH_RESCANS:      return "refresh_rescans";
+		case KVS_STAT_TOMBSTONES_PRUNED:    return "tombstones_pruned";
+		case KVS_STAT_DIGEST_KEYS:          return "digest_keys";
+		case KVS_STAT_READ_MISMATCHES:      return "read_mismatches";
+		case KVS_STAT_STRUCT_UPGRADES:      return "struct_upgrades";
+		case KVS_STAT_LOADS:                return "loads";
+		case KVS_STAT_LOAD_NS:              return "load_ns";
+		case KVS_STAT_LOAD_ROWS:            return "load_rows";
+		default:                            break;
+	}
+	return "unknown";
+}
+
+///////////////////////////////////////////////////////////////////////////////////
+const char* CKvsStatsSnapshot::Name( KVS_HIST hist )
+{
+	switch (hist)
+	{
+		case KVS_HIST_READ:  return "read";
+		case KVS_HIST_WRITE: return "write";
+		case KVS_HIST_SYNC:  return "sync";
+		default:             break;
+	}
+	return "unknown";
+}
+
+///////////////////////////////////////////////////////////////////////////////////
+// Prometheus text exposition format; labels is inserted verbatim, e.g. store="cfg"
+void CKvsStatsSnapshot::WritePrometheus( std::string& out, const std::string& labels )
+{
+	char line[512];
+
+	for (int32_t i = 0; i < KVS_STAT_COUNT; i++)
+	{
+		std::string name = Name( (KVS_STAT)i );
+		double      value = (double)m_counters[i];
+
+		// nanosecond totals are exported in seconds, as Prometheus expects:
+		size_t ns = name.rfind( "_ns" );
+		if (ns != std::string::npos && ns + 3 == name.size())
+		{
+			name = name.substr( 0, ns ) + "_seconds";
+			value /= 1e9;
+		}
+
+		snprintf( line, sizeof(line), "# TYPE kvs_%s_total counter\nkvs_%s_total{%s} %.17g\n",
+		          name.c_str(), name.c_str(), labels.c_str(), value );
+		out += line;
+	}
+
+	for (int32_t h = 0; h < KVS_HIST_COUNT; h++)
+	{
+		const char* name = Name( (KVS_HIST)h );
+		snprintf( line, sizeof(line), "# TYPE kvs_%s_latency_seconds histogram\n", name );
+		out += line;
+
+		// one exported bucket per power of two from 1us to about a minute; the
+		// internal buckets align with powers of two, so the counts are exact:
+		uint64_t cumulative = 0;
+		uint32_t b = 0;
+		for (uint32_t pow2 = 10; pow2 <= 36; pow2++)
+		{
+			uint64_t le = (uint64_t)1 << pow2;
+			while (b < KVS_HIST_BUCKETS && CKvsStats::BucketLowerBound( b ) < le)
+				cumulative += m_hist[h][b++];
+
+			snprintf( line, sizeof(line), "kvs_%s_latency_seconds_bucket{%s,le=\"%.9g\"} %llu\n",
+			          name, labels.c_str(), (double)le / 1e9, (unsigned long long)cumulative );
+			out += line;
+		}
+
+		uint64_t count = Count( (KVS_HIST)h );
+		snprintf( line, sizeof(line),
+		          "kvs_%s_latency_seconds_bucket{%s,le=\"+Inf\"} %llu\n"
+		          "kvs_%s_latency_seconds_sum{%s} %.9f\n"
+		          "kvs_%s_latency_seconds_count{%s} %llu\n",
+		          name, labels.c_str(), (unsigned long long)count,
+		          name, labels.c_str(), (double)m_histSum[h] / 1e9,
+		          name, labels.c_str(), (unsigned long long)count );
+		out += line;
+	}
+}
+
+///////////////////////////////////////////////////////////////////////////////////
+CKvsStats::CKvsStats()
+{
+	m_id = g_nextStatsId.fetch_add( 1 );
+	m_recordLatency.store( true );
+
+	std::lock_guard<std::mutex> guard(g_liveMutex);
+	g_liveIds.insert( m_id );
+}
+
+///////////////////////////////////////////////////////////////////////////////////
+CKvsStats::~CKvsStats()
+{
+	{
+		std::lock_guard<std::mutex> guard(g_liveMutex);
+		g_liveIds.erase( m_id );
+	}
+
+	// the destroying thread may still point at this; other threads only match by id:
+	if (t_last.m_id == m_id)
+		t_last.m_id = 0;
+
+	for (size_t i = 0; i < m_threads.size(); i++)
+		delete m_threads[i];
+}
+
+///////////////////////////////////////////////////////////////////////////////////
+CKvsThreadStats* CKvsStats::Local( void )
+{
+	if (t_last.m_id == m_id)
+		return t_last.mp_stats;
+
+	for (size_t i = 0; i < t_entries.size(); i++)
+	{
+		if (t_entries[i].m_id == m_id)
+		{
+			t_last = t_entries[i];
+			return t_last.mp_stats;
+		}
+	}
+
+	return Register();
+}
+
+///////////////////////////////////////////////////////////////////////////////////
+// first use of this store's stats by the calling thread
+CKvsThreadStats* CKvsStats::Register( void )
+{
+	{
+		// forget blocks of stores that have since been destroyed:
+		std::lock_guard<std::mutex> guard(g_liveMutex);
+		size_t kept = 0;
+		for (size_t i = 0; i < t_entries.size(); i++)
+		{
+			if (g_liveIds.count( t_entries[i].m_id ))
+				t_entries[kept++] = t_entries[i];
+		}
+		t_entries.resize( kept );
+	}
+
+	CKvsThreadStats* p_stats = new CKvsThreadStats();
+	{
+		std::lock_guard<std::mutex> guard(m_mutex);
+		m_threads.push_back( p_stats );
+	}
+
+	CKvsLocalEntry entry = { m_id, p_stats };
+	t_entries.push_back( entry );
+	t_last = entry;
+
+	return p_stats;
+}
+
+///////////////////////////////////////////////////////////////////////////////////
+uint32_t CKvsStats::BucketIndex( uint64_t ns )
+{
+	if (ns < KVS_HIST_SUBS)
+		return (uint32_t)ns;
+
+#ifdef _MSC_VER
+	unsigned long msb;
+	_BitScanReverse64( &msb, ns );
+#else
+	uint32_t msb = 63 - (uint32_t)__builtin_clzll( ns );
+#endif
+
+	uint32_t shift = (uint32_t)msb - KVS_HIST_SUB_BITS;
+	uint32_t sub = (uint32_t)(ns >> shift) & (KVS_HIST_SUBS - 1);
+	return (shift + 1) * KVS_HIST_SUBS + sub;
+}
+
+///////////////////////////////////////////////////////////////////////////////////
+uint64_t CKvsStats::BucketLowerBound( uint32_t bucket )
+{
+	if (bucket < KVS_HIST_SUBS)
+		return bucket;
+
+	uint32_t shift = bucket / KVS_HIST_SUBS - 1;
+	uint32_t sub = bucket % KVS_HIST_SUBS;
+	if (shift + KVS_HIST_SUB_BITS >= 64)
+		return UINT64_MAX;
+	return (uint64_t)(KVS_HIST_SUBS + sub) << shift;
+}
+
+///////////////////////////////////////////////////////////////////////////////////
+void CKvsStats::Record( KVS_HIST hist, uint64_t start )
+{
+	uint64_t now = Now();
+	RecordValue( hist, (now > start) ? now - start : 0 );
+}
+
+///////////////////////////////////////////////////////////////////////////////////
+void CKvsStats::RecordValue( KVS_HIST hist, uint64_t ns )
+{
+	CKvsThreadStats* p_stats = Local();
+
+	std::atomic<uint64_t>& bucket = p_stats->m_hist[hist][ BucketIndex(ns) ];
+	bucket.store( bucket.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed );
+
+	std::atomic<uint64_t>& sum = p_stats->m_histSum[hist];
+	sum.store( sum.load(std::memory_order_relaxed) + ns, std::memory_order_relaxed );
+}
+
+///////////////////////////////////////////////////////////////////////////////////
+void CKvsStats::EnableLatency( bool enable )
+{
+	m_recordLatency.store( enable );
+}
+
+///////////////////////////////////////////////////////////////////////////////////
+void CKvsStats::Snapshot( CKvsStatsSnapshot& snapshot )
+{
+	snapshot = CKvsStatsSnapshot();
+
+	std::lock_guard<std::mutex> guard(m_mutex);
+	for (size_t t = 0; t < m_threads.size(); t++)
+	{
+		CKvsThreadStats* p_stats = m_threads[t];
+
+		for (int32_t i = 0; i < KVS_STAT_COUNT; i++)
+			snapshot.m_counters[i] += p_stats->m_counters[i].load( std::memory_order_relaxed );
+
+		for (int32_t h = 0; h < KVS_HIST_COUNT; h++)
+		{
+			snapshot.m_histSum[h] += p_stats->m_histSum[h].load( std::memory_order_relaxed );
+			for (int32_t b = 0; b < KVS_HIST_BUCKETS; b++)
+				snapshot.m_hist[h][b] += p_stats->m_hist[h][b].load( std::memory_order_relaxed );
+		}
+	}
+}
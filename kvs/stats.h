@@ -0,0 +1,193 @@
+/////////////////////////////////////////////////////////////////////////////
+// Name:        stats.h
+// Purpose:     low overhead counters and latency histograms for a
+//							CKeyValueStore.
+//
+//							Each thread updating a store's stats gets its own block of
+//							counters, so the hot path is a plain load and store with no
+//							locked instruction and no cache line shared between threads.
+//							The blocks are only summed when the stats are read.
+//
+//							Histograms are log-linear in the style of HdrHistogram:
+//							each power of two is split into 8 linear sub-buckets, which
+//							keeps every recorded latency within 12.5% of its true value.
+/////////////////////////////////////////////////////////////////////////////
+
+#ifndef _KVS_STATS_H_
+#define _KVS_STATS_H_
+
+#include <cstdint>
+#include <string>
+#include <vector>
+#include <mutex>
+#include <atomic>
+#include <chrono>
+
+enum KVS_STAT
+{
+	KVS_STAT_READ_HITS,
+	KVS_STAT_READ_MISSES,
+	KVS_STAT_READ_DEFAULT_INSERTS,
+	KVS_STAT_READ_CACHE_HITS,     // reads served by a thread's read cache, not counted in read hits
+	KVS_STAT_WRITES_BOOL,
+	KVS_STAT_WRITES_INT,
+	KVS_STAT_WRITES_REAL,
+	KVS_STAT_WRITES_STRING,
+	KVS_STAT_WRITES_BINARY,
+	KVS_STAT_DEDUP_HITS,          // binary writes of a value the store already shared
+	KVS_STAT_DELETES,
+	KVS_STAT_COUNTER_OPS,         // Increment(), FetchAdd() and CompareAndSwap() calls
+	KVS_STAT_EXPIRED,             // keys reclaimed after their ttl ran out
+	KVS_STAT_TXN_COMMITS,
+	KVS_STAT_TXN_CONFLICTS,       // commits refused because a key read had been written
+	KVS_STAT_LOCK_CONTENDED,      // m_mutex acquisitions that had to wait
+	KVS_STAT_LOCK_WAIT_NS,        // total time spent waiting on m_mutex
+	KVS_STAT_SYNCS,
+	KVS_STAT_SYNC_FAILURES,
+	KVS_STAT_SYNC_ROWS,
+	KVS_STAT_BYTES_PERSISTED,
+	KVS_STAT_SYNC_CHUNKS,         // transactions committed by paced syncs
+	KVS_STAT_SYNC_PACED_WAITS,    // times a paced sync waited for its token bucket
+	KVS_STAT_SYNC_PACED_NS,       // total time paced syncs spent waiting
+	KVS_STAT_SYNC_PREEMPTED,      // paced syncs that stopped waiting for an urgent sync
+	KVS_STAT_BACKUP_PAGES,        // db pages copied by completed backups
+	KVS_STAT_CHECKPOINTS,
+	KVS_STAT_REFRESHES,           // Refresh() calls that found changes from other connections
+	KVS_STAT_REFRESH_KEYS,        // keys they changed in RAM
+	KVS_STAT_REFRESH_RESCANS,     // refreshes that read every key, having missed pruned tombstones
+	KVS_STAT_TOMBSTONES_PRUNED,
+	KVS_STAT_DIGEST_KEYS,         // keys hashed into the digest tree
+	KVS_STAT_READ_MISMATCHES,     // ReadBinary()/ReadStruct()s of a value of another size, type or version
+	KVS_STAT_STRUCT_UPGRADES,     // struct values ReadStruct() upgraded
+	KVS_STAT_LOADS,
+	KVS_STAT_LOAD_NS,             // db open plus reading every row into RAM
+	KVS_STAT_LOAD_ROWS,
+	KVS_STAT_COUNT
+};
+
+enum KVS_HIST
+{
+	KVS_HIST_READ,
+	KVS_HIST_WRITE,
+	KVS_HIST_SYNC,
+	KVS_HIST_COUNT
+};
+
+#define KVS_HIST_SUB_BITS  (3)
+#define KVS_HIST_SUBS      (1 << KVS_HIST_SUB_BITS)
+#define KVS_HIST_BUCKETS   (64 * KVS_HIST_SUBS)
+
+// one thread's counters; only that thread writes them
+class CKvsThreadStats
+{
+public:
+	CKvsThreadStats();
+
+	std::atomic<uint64_t> m_counters[KVS_STAT_COUNT];
+	std::atomic<uint64_t> m_histSum[KVS_HIST_COUNT];
+	std::atomic<uint64_t> m_hist[KVS_HIST_COUNT][KVS_HIST_BUCKETS];
+};
+
+// the stats of a store summed over all threads at one moment
+class CKvsStatsSnapshot
+{
+public:
+	CKvsStatsSnapshot();
+
+	uint64_t m_counters[KVS_STAT_COUNT];
+	uint64_t m_histSum[KVS_HIST_COUNT];           // nanoseconds
+	uint64_t m_hist[KVS_HIST_COUNT][KVS_HIST_BUCKETS];
+
+	uint64_t Count( KVS_HIST hist );
+	// the latency in nanoseconds below which fraction q (0..1) of the samples fall:
+	uint64_t Percentile( KVS_HIST hist, double q );
+
+	// appends the snapshot in Prometheus text format, labels given as name="value" pairs:
+	void WritePrometheus( std::string& out, const std::string& labels );
+
+	static const char* Name( KVS_STAT stat );
+	static const char* Name( KVS_HIST hist );
+};
+
+class CKvsStats
+{
+public:
+	CKvsStats();
+	~CKvsStats();
+
+	inline void Add( KVS_STAT stat, uint64_t n )
+	{
+		std::atomic<uint64_t>& c = Local()->m_counters[stat];
+		c.store( c.load(std::memory_order_relaxed) + n, std::memory_order_relaxed );
+	}
+
+	// returns 0 when latencies are not being recorded:
+	inline uint64_t Now( void )
+	{
+		if (!m_recordLatency.load(std::memory_order_relaxed))
+			return 0;
+		return (uint64_t)std::chrono::duration_cast<std::chrono::nanoseconds>(
+		                   std::chrono::steady_clock::now().time_since_epoch()).count();
+	}
+
+	// records the time since start, a value returned by Now():
+	void Record( KVS_HIST hist, uint64_t start );
+	void RecordValue( KVS_HIST hist, uint64_t ns );
+
+	void EnableLatency( bool enable );
+	void Snapshot( CKvsStatsSnapshot& snapshot );
+
+	static uint32_t BucketIndex( uint64_t ns );
+	static uint64_t BucketLowerBound( uint32_t bucket );
+
+private:
+	CKvsStats( const CKvsStats& );
+	CKvsStats& operator=( const CKvsStats& );
+
+	CKvsThreadStats* Local( void );
+	CKvsThreadStats* Register( void );
+
+	uint64_t                       m_id;         // unique for the life of the process
+	std::atomic<bool>              m_recordLatency;
+	std::mutex                     m_mutex;      // guards m_threads
+	std::vector<CKvsThreadStats*>  m_threads;
+};
+
+// times an operation into a histogram when it goes out of scope:
+class CKvsOpTimer
+{
+public:
+	CKvsOpTimer( CKvsStats& stats, KVS_HIST hist ) : m_stats(stats), m_hist(hist) { m_start = stats.Now(); }
+	~CKvsOpTimer() { if (m_start) m_stats.Record( m_hist, m_start ); }
+
+private:
+	CKvsStats& m_stats;
+	KVS_HIST   m_hist;
+	uint64_t   m_start;
+};
+
+// a std::lock_guard that accounts the time spent waiting when the mutex is contended:
+class CKvsTimedLock
+{
+public:
+	CKvsTimedLock( std::mutex& mutex, CKvsStats& stats ) : m_mutex(mutex)
+	{
+		if (m_mutex.try_lock())
+			return;
+
+		std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+		m_mutex.lock();
+		stats.Add( KVS_STAT_LOCK_CONTENDED, 1 );
+		stats.Add( KVS_STAT_LOCK_WAIT_NS, (uint64_t)std::chrono::duration_cast<std::chrono::nanoseconds>(
+		                                    std::chrono::steady_clock::now() - start).count() );
+	}
+	~CKvsTimedLock() { m_mutex.unlock(); }
+
+private:
+	CKvsTimedLock( const CKvsTimedLock& );
+	CKvsTimedLock& operator=( const CKvsTimedLock& );
+
+	std::mutex& m_mutex;
+};
+
+#endif // _KVS_STATS_H_
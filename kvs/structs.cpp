@@ -0,0 +1,227 @@
+////////////////////////////////////////////////////////////////////////////
+// Name:        structs.cpp
+// Purpose:     the struct values of a CKeyValueStore
+/////////////////////////////////////////////////////////////////////////////
+
+#include "kvs.h"
+
+///////////////////////////////////////////////////////////////////////////////////
+// a struct's value: the header, then its bytes
+static std::string kvs_struct_value( uint32_t typeId, uint32_t version, const uint8_t* data, uint32_t byte_size )
+{
+	CKvsStructHeader header;
+	header.m_magic = KVS_STRUCT_MAGIC;
+	header.m_typeId = typeId;
+	header.m_size = byte_size;
+	header.m_version = version;
+
+	std::string value( (const char*)&header, sizeof(header) );
+	value.append( (const char*)data, byte_size );
+	return value;
+}
+
+///////////////////////////////////////////////////////////////////////////////////
+// false if the value_size bytes at p_value are not a struct's value
+static bool kvs_struct_header( const uint8_t* p_value, uint32_t value_size, CKvsStructHeader& header )
+{
+	if (value_size < sizeof(header))
+		return false;
+
+	memcpy( &header, p_value, sizeof(header) );
+	return header.m_magic == KVS_STRUCT_MAGIC && header.m_size == value_size - sizeof(header);
+}
+
+///////////////////////////////////////////////////////////////////////////////////
+// byte_size bytes aligned for any struct, for a view to hold
+static std::shared_ptr<uint8_t> kvs_struct_copy( const uint8_t* data, uint32_t byte_size )
+{
+	std::align_val_t align = (std::align_val_t)KVS_STRUCT_ALIGN;
+	std::shared_ptr<uint8_t> copy( (uint8_t*)::operator new( (byte_size) ? byte_size : 1, align, std::nothrow ),
+	                               [align]( uint8_t* p ) { ::operator delete( p, align ); } );
+	if (copy)
+		memcpy( copy.get(), data, byte_size );
+	return copy;
+}
+
+///////////////////////////////////////////////////////////////////////////////////
+bool CKeyValueStore::WriteStructBytes( std::string& key, uint32_t typeId, uint32_t version, const uint8_t* data, uint32_t byte_size )
+{
+	LazyInit(); // even if LazyInit fails, we continue...
+
+	if (RejectFrozen( "WriteStruct()" ))
+		return false;
+
+	CKvsOpTimer timer(m_stats, KVS_HIST_WRITE);
+	m_stats.Add( KVS_STAT_WRITES_BINARY, 1 );
+
+	// shared whatever the dedup threshold, so reads can hold the bytes; hashed before the lock:
+	std::string value = kvs_struct_value( typeId, version, data, byte_size );
+	std::string hash = m_dedup.Hash( (const uint8_t*)value.data(), (uint32_t)value.size() );
+	if (hash.empty())
+	{
+		m_emsg = std::string("WriteStruct() unable to hash value of key ") + key;
+		return false;
+	}
+
+	// prevent other threads from changing our data during this operation:
+	CKvsTimedLock guard(m_mutex, m_stats);
+
+	CKvsPairs::iterator it = m_pairs.find( key );
+	uint64_t storeVersion = NextVersion( key, it );
+	if (!ShareBinary( key, it, hash, (const uint8_t*)value.data(), (uint32_t)value.size(), storeVersion ))
+	{
+		m_emsg = std::string("WriteStruct() out of memory for key ") + key;
+		return false;
+	}
+	return true;
+}
+
+///////////////////////////////////////////////////////////////////////////////////
+// the lock is held only to find the value and take a reference to its bytes, or to
+// share or upgrade it upon its first read
+const uint8_t* CKeyValueStore::ReadStructBytes( std::string& key, uint32_t typeId, uint32_t version, uint32_t byte_size,
+                                                CKvsSharedRef& shared, std::shared_ptr<uint8_t>& copy )
+{
+	LazyInit(); // even if LazyInit fails, we continue...
+
+	CKvsOpTimer timer(m_stats, KVS_HIST_READ);
+
+	// prevent other threads from changing our data during this operation:
+	CKvsTimedLock guard(m_mutex, m_stats);
+
+	CKvsPairs::iterator it = m_pairs.find( key );
+	if (it == m_pairs.end() || it->second.Expired())
+	{
+		m_stats.Add( KVS_STAT_READ_MISSES, 1 );
+		return NULL;
+	}
+	m_stats.Add( KVS_STAT_READ_HITS, 1 );
+
+	CKeyValue&       kv = it->second;
+	std::string      decoded;		// the value, when not yet shared
+	const uint8_t*   p_value;
+	uint32_t         valueSize;
+	CKvsStructHeader header;
+
+	if (kv.m_shared)
+	{
+		shared = kv.m_shared;
+		p_value = shared->mp_data;
+		valueSize = shared->m_size;
+	}
+	else
+	{
+		if (kv.mp_counter || !DecodePacked( kv ))
+		{
+			m_emsg = std::string("ReadStruct() key ") + key + " holds no binary value";
+			m_stats.Add( KVS_STAT_READ_MISMATCHES, 1 );
+			return NULL;
+		}
+		decoded = base64_decode( kv.m_value );
+		p_value = (const uint8_t*)decoded.data();
+		valueSize = (uint32_t)decoded.size();
+	}
+
+	bool isStruct = kvs_struct_header( p_value, valueSize, header );
+	if (!isStruct || header.m_typeId != typeId || header.m_version > version ||
+	    (header.m_version == version && header.m_size != byte_size))
+	{
+		m_emsg = std::string("ReadStruct() key ") + key + " holds ";
+		if (!isStruct)
+			m_emsg += "no struct";
+		else if (header.m_typeId != typeId)
+			m_emsg += "type " + std::to_string( header.m_typeId ) + ", not " + std::to_string( typeId );
+		else if (header.m_version > version)
+			m_emsg += "version " + std::to_string( header.m_version ) + ", newer than " + std::to_string( version );
+		else
+			m_emsg += std::to_string( header.m_size ) + " bytes, not " + std::to_string( byte_size );
+		m_stats.Add( KVS_STAT_READ_MISMATCHES, 1 );
+		shared.Reset();
+		return NULL;
+	}
+
+	if (header.m_version == version)
+	{
+		if (shared)
+			return shared->mp_data + sizeof(header);
+
+		// a value from the replication log or WriteBinary() is made shared, as it would have
+		// been written; its row is written in that form by the next sync. A frozen store is
+		// left as it is, and the read copies:
+		std::string hash;
+		bool        found;
+		CKvsShared* p_shared = NULL;
+		if (!isFrozen() && !(hash = m_dedup.Hash( p_value, valueSize )).empty())
+			p_shared = m_dedup.Acquire( hash, p_value, valueSize, found );
+		if (!p_shared)
+		{
+			copy = kvs_struct_copy( p_value + sizeof(header), byte_size );
+			return copy.get();
+		}
+
+		int64_t expires = kv.m_expires;
+		kv.SetValue( "" );
+		kv.Share( p_shared );
+		kv.m_expires = expires;
+		m_unsyncedKeys.push_back( kv.m_key );	// changed without a version, so listed for the sync
+
+		shared = kv.m_shared;
+		return shared->mp_data + sizeof(header);
+	}
+
+	// an older version, brought up one version at a time:
+	std::string bytes( (const char*)p_value + sizeof(header), header.m_size );
+	for (uint32_t from = header.m_version; from < version; from++)
+	{
+		std::map<std::pair<uint32_t, uint32_t>, KVS_STRUCT_UPGRADE>::iterator u = m_structUpgrades.find( std::make_pair( typeId, from ) );
+		std::string upgraded;
+		if (u == m_structUpgrades.end() || !u->second( (const uint8_t*)bytes.data(), (uint32_t)bytes.size(), upgraded ))
+		{
+			m_emsg = std::string("ReadStruct() key ") + key + " holds version " + std::to_string( from ) + ", which " +
+			         ((u == m_structUpgrades.end()) ? "no upgrade is registered for" : "failed to upgrade");
+			m_stats.Add( KVS_STAT_READ_MISMATCHES, 1 );
+			shared.Reset();
+			return NULL;
+		}
+		bytes.swap( upgraded );
+	}
+	shared.Reset();
+
+	if (bytes.size() != byte_size)
+	{
+		m_emsg = std::string("ReadStruct() key ") + key + " upgraded to " + std::to_string( bytes.size() ) +
+		         " bytes, not " + std::to_string( byte_size );
+		m_stats.Add( KVS_STAT_READ_MISMATCHES, 1 );
+		return NULL;
+	}
+	m_stats.Add( KVS_STAT_STRUCT_UPGRADES, 1 );
+
+	// written back, so the next read is in place; frozen, or out of memory, the read copies:
+	std::string value = kvs_struct_value( typeId, version, (const uint8_t*)bytes.data(), byte_size );
+	std::string hash;
+	if (!isFrozen() && !(hash = m_dedup.Hash( (const uint8_t*)value.data(), (uint32_t)value.size() )).empty())
+	{
+		int64_t expires = kv.m_expires;
+		if (ShareBinary( key, it, hash, (const uint8_t*)value.data(), (uint32_t)value.size(), NextVersion( key, it ), expires ))
+		{
+			kv.m_expires = expires;
+
+			shared = kv.m_shared;
+			return shared->mp_data + sizeof(header);
+		}
+		kv.m_expires = expires;
+	}
+
+	copy = kvs_struct_copy( (const uint8_t*)bytes.data(), byte_size );
+	return copy.get();
+}
+
+///////////////////////////////////////////////////////////////////////////////////
+// called under m_mutex by reads, so an upgrade must not use the store
+void CKeyValueStore::RegisterStructUpgrade( uint32_t typeId, uint32_t fromVersion, KVS_STRUCT_UPGRADE upgrade )
+{
+	// prevent other threads from changing our data during this operation:
+	CKvsTimedLock guard(m_mutex, m_stats);
+
+	m_structUpgrades[std::make_pair( typeId, fromVersion )] = upgrade;
+}
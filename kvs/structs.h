@@ -0,0 +1,78 @@
+/////////////////////////////////////////////////////////////////////////////
+// Name:        structs.h
+// Purpose:     trivially copyable structs held as binary values, each behind
+//							a header naming its type, size and version, so a read of a
+//							value of another layout is refused rather than copied.
+//
+//							WriteStruct() always holds the value as a shared binary value
+//							(see dedup.h), whatever the dedup threshold: its bytes live
+//							once, 16 byte aligned, counted by the keys and views naming
+//							them. ReadStruct() returns a view straight into those bytes,
+//							with a reference that keeps them alive through later writes
+//							of the key, so a read neither decodes nor copies. A value
+//							that came in as base64, from the replication log or an older
+//							WriteBinary(), is made shared upon its first such read.
+//
+//							A value of an older version is brought up to date by the
+//							upgrades registered for its type, one version at a time, and
+//							written back so the next read is in place again.
+/////////////////////////////////////////////////////////////////////////////
+
+#ifndef _KVS_STRUCTS_H_
+#define _KVS_STRUCTS_H_
+
+#include <cstdint>
+#include <string>
+#include <memory>
+#include <new>
+#include <functional>
+#include <type_traits>
+
+#define KVS_STRUCT_MAGIC      (0x5453564B)  // "KVST", little endian
+#define KVS_STRUCT_ALIGN      (16)          // of the bytes after the header
+
+// before each struct's bytes; its size keeps them as aligned as the value's storage:
+class CKvsStructHeader
+{
+public:
+	uint32_t m_magic;
+	uint32_t m_typeId;
+	uint32_t m_size;        // of the bytes after the header
+	uint32_t m_version;
+};
+static_assert( sizeof(CKvsStructHeader) == KVS_STRUCT_ALIGN, "the header keeps the struct aligned" );
+
+// a struct's type id and version, from its KVS_TYPE_ID and KVS_VERSION members, or
+// specialized for a type that cannot have them:
+template <typename T>
+class CKvsStructType
+{
+public:
+	static constexpr uint32_t m_typeId = T::KVS_TYPE_ID;
+	static constexpr uint32_t m_version = T::KVS_VERSION;
+};
+
+// brings the bytes of a struct at one version to the next, false if it cannot:
+typedef std::function<bool(const uint8_t* data, uint32_t byte_size, std::string& upgraded)> KVS_STRUCT_UPGRADE;
+
+// a struct as read, valid for as long as the view is held; empty if the key was missing
+// or holds something else:
+template <typename T>
+class CKvsStructView
+{
+public:
+	CKvsStructView() : mp_value(NULL) {}
+
+	const T* Get( void ) const        { return mp_value; }
+	const T* operator->( void ) const { return mp_value; }
+	const T& operator*( void ) const  { return *mp_value; }
+	explicit operator bool( void ) const { return mp_value != NULL; }
+
+	// one of the two holds the bytes: the shared value read in place, or an upgraded
+	// copy that could not be written back, as in a frozen store:
+	CKvsSharedRef            m_shared;
+	std::shared_ptr<uint8_t> m_copy;
+	const T*                 mp_value;
+};
+
+#endif // _KVS_STRUCTS_H_
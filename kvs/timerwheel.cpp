@@ -0,0 +1,120 @@
+////////////////////////////////////////////////////////////////////////////
+// Name:        timerwheel.cpp
+// Purpose:     hierarchical timer wheel for key expiry
+/////////////////////////////////////////////////////////////////////////////
+
+#include "timerwheel.h"
+
+///////////////////////////////////////////////////////////////////////////////////
+CKvsTimerWheel::CKvsTimerWheel( int64_t now_ms, uint32_t tick_ms )
+{
+	m_tickMs = (tick_ms) ? tick_ms : 1;
+	m_origin = now_ms;
+	m_tick = 0;
+	m_size = 0;
+}
+
+///////////////////////////////////////////////////////////////////////////////////
+size_t CKvsTimerWheel::Size( void )
+{
+	return m_size;
+}
+
+///////////////////////////////////////////////////////////////////////////////////
+void CKvsTimerWheel::Schedule( const std::string& key, int64_t expires_ms )
+{
+	CKvsTimer timer;
+	timer.m_key = key;
+	timer.m_expires = expires_ms;
+
+	m_size++;
+	Place( timer, NULL );
+}
+
+///////////////////////////////////////////////////////////////////////////////////
+// a timer goes in the finest level whose slot block it shares with the current tick,
+// so its slot there is still ahead of the current one and comes around in this rotation
+void CKvsTimerWheel::Place( CKvsTimer& timer, std::vector<CKvsTimer>* p_due )
+{
+	// rounded up, so a timer never fires before its time:
+	int64_t  offset = timer.m_expires - m_origin;
+	uint64_t tick = (offset <= 0) ? 0 : (uint64_t)((offset + m_tickMs - 1) / m_tickMs);
+
+	if (tick <= m_tick)
+	{
+		if (p_due)
+		{
+			m_size--;
+			p_due->push_back( std::move(timer) );
+			return;
+		}
+		tick = m_tick + 1;	// due already, taken by the next Advance()
+	}
+
+	for (uint32_t level = 0; level < KVS_WHEEL_LEVELS; level++)
+	{
+		uint32_t shift = KVS_WHEEL_BITS * (level + 1);
+		if ((tick >> shift) == (m_tick >> shift))
+		{
+			uint32_t slot = (uint32_t)(tick >> (KVS_WHEEL_BITS * level)) & (KVS_WHEEL_SLOTS - 1);
+			m_slots[level][slot].push_back( std::move(timer) );
+			return;
+		}
+	}
+
+	m_overflow.push_back( std::move(timer) );
+}
+
+///////////////////////////////////////////////////////////////////////////////////
+void CKvsTimerWheel::Cascade( uint32_t level, std::vector<CKvsTimer>& due )
+{
+	std::vector<CKvsTimer> moving;
+	if (level == KVS_WHEEL_LEVELS)
+	{
+		moving.swap( m_overflow );
+	}
+	else
+	{
+		uint32_t slot = (uint32_t)(m_tick >> (KVS_WHEEL_BITS * level)) & (KVS_WHEEL_SLOTS - 1);
+		moving.swap( m_slots[level][slot] );
+	}
+
+	for (size_t i = 0; i < moving.size(); i++)
+		Place( moving[i], &due );
+}
+
+///////////////////////////////////////////////////////////////////////////////////
+void CKvsTimerWheel::Advance( int64_t now_ms, std::vector<CKvsTimer>& due )
+{
+	if (now_ms < m_origin)
+		return;
+
+	uint64_t target = (uint64_t)((now_ms - m_origin) / m_tickMs);
+	while (m_tick < target)
+	{
+		// an empty wheel has nothing to cascade, so it jumps straight to the target:
+		if (m_size == 0)
+		{
+			m_tick = target;
+			break;
+		}
+
+		m_tick++;
+
+		// cascade every level whose block begins at this tick, coarsest first, so timers
+		// it brings down into a finer level's current slot are cascaded in turn:
+		uint32_t top = 0;
+		while (top < KVS_WHEEL_LEVELS && (m_tick & (((uint64_t)1 << (KVS_WHEEL_BITS * (top + 1))) - 1)) == 0)
+			top++;
+		for (uint32_t level = top; level >= 1; level--)
+			Cascade( level, due );
+
+		std::vector<CKvsTimer>& slot = m_slots[0][m_tick & (KVS_WHEEL_SLOTS - 1)];
+		for (size_t i = 0; i < slot.size(); i++)
+		{
+			m_size--;
+			due.push_back( std::move(slot[i]) );
+		}
+		slot.clear();
+	}
+}
@@ -0,0 +1,71 @@
+/////////////////////////////////////////////////////////////////////////////
+// Name:        timerwheel.h
+// Purpose:     a hierarchical timer wheel tracking when keys with a TTL expire.
+//
+//							Five levels of 64 slots; a slot at level L spans 64^L ticks.
+//							Scheduling puts a timer straight into the slot of the coarsest
+//							level it fits, and as time advances a level's slot is cascaded
+//							down into the finer levels once it comes around. Each timer
+//							moves at most once per level, so expiry is O(1) amortized with
+//							no scan of the keys.
+//
+//							Timers are never cancelled: a key rewritten or deleted leaves
+//							its old timer in place, and whoever takes the timer when it
+//							falls due checks it still matches the key's expiry. The store
+//							counts the stale timers it leaves, and once they outnumber
+//							half its keys builds the wheel again from the keys' expiries.
+/////////////////////////////////////////////////////////////////////////////
+
+#ifndef _KVS_TIMERWHEEL_H_
+#define _KVS_TIMERWHEEL_H_
+
+#include <cstdint>
+#include <string>
+#include <vector>
+#include <chrono>
+
+#define KVS_WHEEL_BITS    (6)
+#define KVS_WHEEL_SLOTS   (1 << KVS_WHEEL_BITS)
+#define KVS_WHEEL_LEVELS  (5)     // with 100ms ticks, 64^5 ticks is over 3 years
+#define KVS_TTL_TICK_MS   (100)   // the granularity of reclaiming expired keys
+#define KVS_STALE_TIMERS_MIN (1024) // stale timers left in the wheel before it may be built again
+
+// wall clock time in milliseconds, as persisted in the expires column:
+inline int64_t kvs_now_ms( void )
+{
+	return (int64_t)std::chrono::duration_cast<std::chrono::milliseconds>(
+	                  std::chrono::system_clock::now().time_since_epoch()).count();
+}
+
+struct CKvsTimer
+{
+	std::string m_key;
+	int64_t     m_expires;    // kvs_now_ms() time
+};
+
+class CKvsTimerWheel
+{
+public:
+	CKvsTimerWheel( int64_t now_ms, uint32_t tick_ms );
+
+	void   Schedule( const std::string& key, int64_t expires_ms );
+
+	// moves every timer due by now_ms into due:
+	void   Advance( int64_t now_ms, std::vector<CKvsTimer>& due );
+
+	size_t Size( void );
+
+private:
+	void   Place( CKvsTimer& timer, std::vector<CKvsTimer>* p_due );
+	void   Cascade( uint32_t level, std::vector<CKvsTimer>& due );
+
+	uint64_t                m_tick;       // the current tick, all before it processed
+	int64_t                 m_origin;     // ms of tick 0
+	uint32_t                m_tickMs;
+	size_t                  m_size;
+
+	std::vector<CKvsTimer>  m_slots[KVS_WHEEL_LEVELS][KVS_WHEEL_SLOTS];
+	std::vector<CKvsTimer>  m_overflow;   // beyond the top level, placed again as it wraps
+};
+
+#endif // _KVS_TIMERWHEEL_H_
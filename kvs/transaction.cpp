@@ -0,0 +1,379 @@
+////////////////////////////////////////////////////////////////////////////
+// Name:        transaction.cpp
+// Purpose:     optimistic multi-key transactions
+/////////////////////////////////////////////////////////////////////////////
+
+#include "kvs.h"
+
+///////////////////////////////////////////////////////////////////////////////////
+CKvsTransaction::CKvsTransaction( CKeyValueStore* p_store )
+{
+	mp_store = p_store;
+}
+
+///////////////////////////////////////////////////////////////////////////////////
+void CKvsTransaction::Reset( void )
+{
+	m_reads.clear();
+	m_writes.clear();
+}
+
+///////////////////////////////////////////////////////////////////////////////////
+std::string CKvsTransaction::GetErrorMsg( void )
+{
+	return m_emsg;
+}
+
+///////////////////////////////////////////////////////////////////////////////////
+bool CKvsTransaction::Value( std::string& key, std::string& value )
+{
+	// this transaction's own writes first:
+	std::map<std::string, CWrite>::iterator w = m_writes.find(key);
+	if (w != m_writes.end())
+	{
+		if (w->second.m_delete)
+			return false;
+		value = w->second.m_value;
+		return true;
+	}
+
+	// then what it read before, so reads repeat:
+	std::map<std::string, CRead>::iterator r = m_reads.find(key);
+	if (r == m_reads.end())
+	{
+		mp_store->LazyInit();
+
+		// the live value and its version, copied under the store's lock:
+		CRead     read;
+		CKeyValue kv( key.c_str(), "" );
+		read.m_exists = mp_store->SnapshotValue( UINT64_MAX, kvs_now_ms(), key, kv );
+		read.m_version = kv.m_version;
+
+		if (read.m_exists)
+		{
+			std::string emsg;
+			if (mp_store->DecodeValue( kv, NULL, emsg ))
+				read.m_value.swap( kv.m_value );
+			kv.FreeBinary();
+		}
+
+		r = m_reads.insert( std::make_pair( key, read ) ).first;
+	}
+
+	if (!r->second.m_exists)
+		return false;
+	value = r->second.m_value;
+	return true;
+}
+
+///////////////////////////////////////////////////////////////////////////////////
+bool CKvsTransaction::isKey( std::string& key )
+{
+	std::string value;
+	return Value( key, value );
+}
+
+///////////////////////////////////////////////////////////////////////////////////
+bool CKvsTransaction::ReadBool( std::string& key, bool defaultValue )
+{
+	std::string value;
+	int32_t     numVal;
+	if (Value( key, value ))
+		return (mp_store->isParam( value, numVal )) ? (numVal != 0) : defaultValue;
+
+	return kvs_default_bool( mp_store->m_defaults.Find( key ), defaultValue );
+}
+
+///////////////////////////////////////////////////////////////////////////////////
+int32_t CKvsTransaction::ReadInt( std::string& key, int32_t defaultValue )
+{
+	std::string value;
+	int32_t     numVal;
+	if (Value( key, value ))
+		return (mp_store->isParam( value, numVal )) ? numVal : defaultValue;
+
+	return kvs_default_int( mp_store->m_defaults.Find( key ), defaultValue );
+}
+
+///////////////////////////////////////////////////////////////////////////////////
+float CKvsTransaction::ReadReal( std::string& key, float defaultValue )
+{
+	std::string value;
+	float       numVal;
+	if (Value( key, value ))
+		return (mp_store->isParam( value, numVal )) ? numVal : defaultValue;
+
+	return kvs_default_real( mp_store->m_defaults.Find( key ), defaultValue );
+}
+
+///////////////////////////////////////////////////////////////////////////////////
+std::string CKvsTransaction::ReadString( std::string& key, char* defaultValue )
+{
+	std::string value;
+	if (Value( key, value ))
+		return value;
+
+	const char* registered = mp_store->m_defaults.Find( key );
+	return std::string( (registered) ? registered : defaultValue );
+}
+
+///////////////////////////////////////////////////////////////////////////////////
+bool CKvsTransaction::ReadBinary( std::string& key, uint8_t* dest, uint32_t byte_size )
+{
+	std::string value;
+	if (!Value( key, value ))
+		return false;
+
+	std::string raw = mp_store->base64_decode( value );
+	if (raw.size() != byte_size)
+		return false;
+
+	memcpy( dest, raw.data(), byte_size );
+	return true;
+}
+
+///////////////////////////////////////////////////////////////////////////////////
+void CKvsTransaction::Write( std::string& key, const std::string& value )
+{
+	CWrite& w = m_writes[key];
+	w.m_delete = false;
+	w.m_isBinary = false;
+	w.m_value = value;
+	w.m_binary.clear();
+}
+
+///////////////////////////////////////////////////////////////////////////////////
+void CKvsTransaction::WriteString( std::string& key, char* value )
+{
+	Write( key, value );
+}
+
+///////////////////////////////////////////////////////////////////////////////////
+void CKvsTransaction::WriteBool( std::string& key, bool value )
+{
+	Write( key, (value) ? "1" : "0" );
+}
+
+///////////////////////////////////////////////////////////////////////////////////
+void CKvsTransaction::WriteInt( std::string& key, int32_t value )
+{
+	Write( key, std::to_string(value) );
+}
+
+///////////////////////////////////////////////////////////////////////////////////
+void CKvsTransaction::WriteReal( std::string& key, float value )
+{
+	Write( key, std::to_string(value) );
+}
+
+///////////////////////////////////////////////////////////////////////////////////
+void CKvsTransaction::WriteBinary( std::string& key, uint8_t* valuePtr, uint32_t byte_size )
+{
+	Write( key, mp_store->base64_encode( valuePtr, byte_size ) );
+
+	CWrite& w = m_writes[key];
+	w.m_isBinary = true;
+	w.m_binary.assign( (const char*)valuePtr, byte_size );
+}
+
+///////////////////////////////////////////////////////////////////////////////////
+void CKvsTransaction::DeleteKey( std::string& key )
+{
+	CWrite& w = m_writes[key];
+	w.m_delete = true;
+	w.m_isBinary = false;
+	w.m_value.clear();
+	w.m_binary.clear();
+}
+
+///////////////////////////////////////////////////////////////////////////////////
+int32_t CKvsTransaction::Commit( void )
+{
+	mp_store->LazyInit(); // even if LazyInit fails, we continue...
+
+	if (mp_store->isFrozen())
+	{
+		m_emsg = "Commit() the store is frozen";
+		Reset();
+		return KVS_TXN_FROZEN;
+	}
+
+	CKvsStats& stats = mp_store->m_stats;
+	CKvsPairs& pairs = mp_store->m_pairs;
+
+	std::vector<CKeyValue>   rows;
+	std::vector<std::string> deletes;
+	std::unique_lock<std::mutex> dbLock;
+
+	{
+		// the one critical section: validate, then apply
+		CKvsTimedLock guard(mp_store->m_mutex, stats);
+
+		int64_t now = kvs_now_ms();
+		std::map<std::string, CRead>::iterator r;
+		for (r = m_reads.begin(); r != m_reads.end(); r++)
+		{
+			CKvsPairs::iterator it = pairs.find( r->first );
+			bool exists = it != pairs.end() && !(it->second.m_expires && it->second.m_expires <= now);
+
+			if (exists != r->second.m_exists || (exists && it->second.m_version != r->second.m_version))
+			{
+				m_emsg = std::string("Commit() conflict on key ") + r->first;
+				stats.Add( KVS_STAT_TXN_CONFLICTS, 1 );
+				Reset();
+				return KVS_TXN_CONFLICT;
+			}
+		}
+
+		std::map<std::string, CWrite>::iterator w;
+		for (w = m_writes.begin(); w != m_writes.end(); w++)
+		{
+			std::string& key = const_cast<std::string&>( w->first );
+			CKvsPairs::iterator it = pairs.find( key );
+			uint64_t version = mp_store->NextVersion( key, it );
+
+			if (w->second.m_delete)
+			{
+				if (it != pairs.end())
+				{
+					it->second.FreeBinary();
+					pairs.erase( it );
+				}
+				if (mp_store->mp_log)
+					mp_store->mp_log->Append( KVS_LOG_DELETE, key, std::string(), 0 );
+				deletes.push_back( key );
+				continue;
+			}
+
+			if (it == pairs.end())
+				it = kvs_insert_pair( pairs, pairs.end(), CKeyValue( key.c_str(), "" ) ).first;
+
+			CKeyValue& kv = it->second;
+			kv.SetValue( w->second.m_value.c_str() );
+			kv.m_version = version;
+			if (w->second.m_isBinary)
+			{
+				// binary keeps its raw bytes beside the base64, as WriteBinary() does:
+				uint32_t byte_size = (uint32_t)w->second.m_binary.size();
+				kv.mp_binaryData = (uint8_t*)malloc( sizeof(uint8_t) * ((byte_size) ? byte_size : 1) );
+				if (kv.mp_binaryData)
+				{
+					kv.m_binarySize = byte_size;
+					memcpy( kv.mp_binaryData, w->second.m_binary.data(), byte_size );
+				}
+			}
+
+			if (mp_store->mp_log)
+				mp_store->mp_log->Append( KVS_LOG_SET, key, kv.m_value, 0 );
+
+			// the copy persisted goes without the raw bytes, which a later write may free:
+			rows.push_back( kv );
+			rows.back().mp_binaryData = NULL;
+			rows.back().m_binarySize = 0;
+		}
+
+		// the db lock is taken before the store's lock is let go, so commits reach the
+		// db in the order they were applied, without holding writers up meanwhile:
+		dbLock = std::unique_lock<std::mutex>( mp_store->m_dbMutex );
+	}
+
+	stats.Add( KVS_STAT_TXN_COMMITS, 1 );
+	Reset();
+
+	if (!Persist( rows, deletes ))
+	{
+		// rolled back: the rows written are still due, with versions past the last sync, and
+		// the deleted keys' rows go with the next sync's deletes:
+		dbLock.unlock();
+		for (size_t i = 0; i < deletes.size(); i++)
+			mp_store->RequeueDelete( deletes[i], false );
+		return KVS_TXN_PERSIST_FAILED;
+	}
+
+	if (mp_store->mp_db && !rows.empty())
+	{
+		// its rows are in the db now, so syncs leave them be, as they do the rows BulkLoad()
+		// writes; unless written again since. The db lock goes first, as it comes after m_mutex:
+		dbLock.unlock();
+		CKvsTimedLock guard(mp_store->m_mutex, stats);
+		for (size_t i = 0; i < rows.size(); i++)
+		{
+			CKvsPairs::iterator it = pairs.find( rows[i].m_key );
+			if (it != pairs.end() && it->second.m_version == rows[i].m_version)
+				mp_store->m_refreshedKeys[rows[i].m_key] = rows[i].m_version;
+		}
+	}
+
+	return KVS_TXN_OK;
+}
+
+///////////////////////////////////////////////////////////////////////////////////
+// expects the caller to hold the store's m_dbMutex
+bool CKvsTransaction::Persist( const std::vector<CKeyValue>& rows, const std::vector<std::string>& deletes )
+{
+	sqlite3* db = mp_store->mp_db;
+
+	// a store whose db failed to open runs from RAM alone, as its Write*s do:
+	if (!db)
+		return true;
+
+	bool          ok = true;
+	sqlite3_stmt* replace = NULL;
+	sqlite3_stmt* remove = NULL;
+
+	if (sqlite3_prepare_v2(db, KVS_SQL_REPLACE_ROW, -1, &replace, NULL) != SQLITE_OK ||
+	    sqlite3_prepare_v2(db, "DELETE FROM keyValueStore WHERE key = ?1;", -1, &remove, NULL) != SQLITE_OK)
+	{
+		m_emsg = std::string("Persist() Prepare Error: ") + std::string(sqlite3_errmsg(db));
+		sqlite3_finalize(replace);
+		sqlite3_finalize(remove);
+		return false;
+	}
+
+	// immediate, holding the db's write lock for the change sequences the rows take:
+	if (sqlite3_exec(db, "BEGIN IMMEDIATE TRANSACTION", NULL, NULL, NULL) != SQLITE_OK)
+	{
+		m_emsg = std::string("Persist() ") + std::string(sqlite3_errmsg(db));
+		sqlite3_finalize(replace);
+		sqlite3_finalize(remove);
+		return false;
+	}
+
+	for (size_t i = 0; i < deletes.size() && ok; i++)
+	{
+		sqlite3_bind_text(remove, 1, deletes[i].c_str(), (int)deletes[i].size(), SQLITE_STATIC);
+		if (sqlite3_step(remove) != SQLITE_DONE)
+		{
+			m_emsg = std::string("Persist() ") + std::string(sqlite3_errmsg(db));
+			ok = false;
+		}
+		sqlite3_reset(remove);
+	}
+
+	// the rows go as a sync's do, each taking the next change sequence, so other stores
+	// refreshing from the db see them:
+	size_t   next = 0;
+	uint64_t count = 0;
+	uint64_t bytes = 0;
+	if (ok && !mp_store->StepRows( replace, [&]() -> const CKeyValue* {
+			return (next == rows.size()) ? NULL : &rows[next++];
+		}, count, bytes ))
+	{
+		// a row that fails, such as a value that cannot be sealed, aborts the whole commit:
+		m_emsg = std::string("Persist() unable to write the rows: ") + std::string(sqlite3_errmsg(db));
+		ok = false;
+	}
+
+	if (ok && sqlite3_exec(db, "END TRANSACTION", NULL, NULL, NULL) != SQLITE_OK)
+	{
+		m_emsg = std::string("Persist() ") + std::string(sqlite3_errmsg(db));
+		ok = false;
+	}
+	if (!ok)
+		sqlite3_exec(db, "ROLLBACK TRANSACTION", NULL, NULL, NULL);
+
+	sqlite3_finalize(replace);
+	sqlite3_finalize(remove);
+
+	return ok;
+}
@@ -0,0 +1,91 @@
+/////////////////////////////////////////////////////////////////////////////
+// Name:        transaction.h
+// Purpose:     optimistic multi-key transactions on a CKeyValueStore.
+//
+//							A transaction buffers its writes, and notes the version of
+//							each key it reads. Commit() takes the store's lock once,
+//							checks that none of the keys read has been written since,
+//							and applies every write, or none when one has. A conflict
+//							fails at once rather than waiting, for the caller to Reset()
+//							and run again. The writes then go to the db in a single
+//							sqlite transaction, in commit order.
+//
+//							Reads are repeatable: a key reads the same for the life of the
+//							transaction, or as written by it. Counters changed through
+//							Increment() & co don't change a key's version, so are not
+//							validated; a transaction write replaces a counter's value.
+/////////////////////////////////////////////////////////////////////////////
+
+#ifndef _KVS_TRANSACTION_H_
+#define _KVS_TRANSACTION_H_
+
+#include <cstdint>
+#include <string>
+#include <vector>
+#include <map>
+
+#define KVS_TXN_OK              (0)
+#define KVS_TXN_CONFLICT        (1)   // a key read was written by someone else; nothing applied
+#define KVS_TXN_PERSIST_FAILED  (2)   // applied in RAM, but the db write failed; see GetErrorMsg()
+#define KVS_TXN_FROZEN          (3)   // the store is frozen; nothing applied
+
+class CKeyValueStore;
+class CKeyValue;
+
+class CKvsTransaction
+{
+public:
+	CKvsTransaction( CKeyValueStore* p_store );
+
+	bool        ReadBool(   std::string& key, bool     defaultValue );
+	int32_t     ReadInt(    std::string& key, int32_t  defaultValue );
+	float       ReadReal(   std::string& key, float    defaultValue );
+	std::string ReadString( std::string& key, char*    defaultValue );
+	// copies byte_size bytes into dest; false, with dest untouched, if the key is missing:
+	bool        ReadBinary( std::string& key, uint8_t* dest, uint32_t byte_size );
+	bool        isKey(      std::string& key );
+
+	void        WriteString( std::string& key, char*    value );
+	void        WriteBool(   std::string& key, bool     value );
+	void        WriteInt(    std::string& key, int32_t  value );
+	void        WriteReal(   std::string& key, float    value );
+	void        WriteBinary( std::string& key, uint8_t* valuePtr, uint32_t byte_size );
+	void        DeleteKey(   std::string& key );
+
+	// returns one of KVS_TXN_*; the transaction is finished either way:
+	int32_t     Commit( void );
+	// drops everything read and written, to run the transaction again:
+	void        Reset( void );
+
+	std::string GetErrorMsg( void );
+
+private:
+	CKvsTransaction( const CKvsTransaction& );
+	CKvsTransaction& operator=( const CKvsTransaction& );
+
+	struct CRead
+	{
+		bool        m_exists;
+		uint64_t    m_version;
+		std::string m_value;
+	};
+	struct CWrite
+	{
+		bool        m_delete;
+		bool        m_isBinary;
+		std::string m_value;      // base64 for binary
+		std::string m_binary;     // raw bytes of binary
+	};
+
+	// the key's value as this transaction sees it; false if missing:
+	bool        Value( std::string& key, std::string& value );
+	void        Write( std::string& key, const std::string& value );
+	bool        Persist( const std::vector<CKeyValue>& rows, const std::vector<std::string>& deletes );
+
+	CKeyValueStore*               mp_store;
+	std::map<std::string, CRead>  m_reads;
+	std::map<std::string, CWrite> m_writes;
+	std::string                   m_emsg;
+};
+
+#endif // _KVS_TRANSACTION_H_
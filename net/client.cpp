@@ -0,0 +1,698 @@
+////////////////////////////////////////////////////////////////////////////
+// Name:        client.cpp
+// Purpose:     a connection to a kvs_server
+/////////////////////////////////////////////////////////////////////////////
+
+#include <cerrno>
+#include <cstdlib>
+#include <algorithm>
+#include <unistd.h>
+#include <netdb.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include "client.h"
+
+#define KVS_CLIENT_READ_SIZE  (64 * 1024)
+
+///////////////////////////////////////////////////////////////////////////////////
+// parsed as CKeyValueStore::isParam() does, hex and octal included
+static bool kvs_client_param( const std::string& valueStr, int32_t& value )
+{
+	char* p;
+	value = strtol( valueStr.c_str(), &p, 0 );
+	return *p == 0;
+}
+
+///////////////////////////////////////////////////////////////////////////////////
+static bool kvs_client_param( const std::string& valueStr, float& value )
+{
+	char* p;
+	value = (float)strtod( valueStr.c_str(), &p );
+	return *p == 0;
+}
+
+///////////////////////////////////////////////////////////////////////////////////
+CKvsClient::CKvsClient()
+{
+	m_fd = -1;
+	m_nextId = 1;
+	m_outPos = 0;
+	m_inPos = 0;
+}
+
+///////////////////////////////////////////////////////////////////////////////////
+CKvsClient::~CKvsClient()
+{
+	Close();
+}
+
+///////////////////////////////////////////////////////////////////////////////////
+bool CKvsClient::Connect( const std::string& address )
+{
+	Close();
+	m_emsg.clear();
+
+	if (address.compare( 0, 5, "unix:" ) == 0)
+	{
+		std::string path = address.substr( 5 );
+
+		sockaddr_un addr;
+		memset( &addr, 0, sizeof(addr) );
+		addr.sun_family = AF_UNIX;
+		if (path.empty() || path.size() >= sizeof(addr.sun_path))
+			return Fail( std::string("CKvsClient::Connect() bad unix socket path: ") + path );
+		memcpy( addr.sun_path, path.c_str(), path.size() );
+
+		m_fd = socket( AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0 );
+		if (m_fd < 0 || connect( m_fd, (sockaddr*)&addr, sizeof(addr) ) != 0)
+			return Fail( std::string("CKvsClient::Connect() ") + address + ": " + strerror( errno ) );
+		return true;
+	}
+
+	if (address.compare( 0, 4, "tcp:" ) != 0)
+		return Fail( std::string("CKvsClient::Connect() expected tcp:host:port or unix:/path, not: ") + address );
+
+	std::string hostPort = address.substr( 4 );
+	size_t      colon = hostPort.rfind( ':' );
+	if (colon == std::string::npos)
+		return Fail( std::string("CKvsClient::Connect() no port in: ") + address );
+	std::string host = hostPort.substr( 0, colon );
+	std::string port = hostPort.substr( colon + 1 );
+	if (host.size() >= 2 && host[0] == '[' && host[host.size() - 1] == ']')
+		host = host.substr( 1, host.size() - 2 );
+
+	addrinfo hints;
+	memset( &hints, 0, sizeof(hints) );
+	hints.ai_family = AF_UNSPEC;
+	hints.ai_socktype = SOCK_STREAM;
+
+	addrinfo* p_info = NULL;
+	int32_t rc = getaddrinfo( (host.empty()) ? "localhost" : host.c_str(), port.c_str(), &hints, &p_info );
+	if (rc != 0)
+		return Fail( std::string("CKvsClient::Connect() ") + address + ": " + gai_strerror( rc ) );
+
+	// the first address that takes the connection:
+	std::string why;
+	for (addrinfo* p_ai = p_info; p_ai && m_fd < 0; p_ai = p_ai->ai_next)
+	{
+		m_fd = socket( p_ai->ai_family, SOCK_STREAM | SOCK_CLOEXEC, 0 );
+		if (m_fd >= 0 && connect( m_fd, p_ai->ai_addr, p_ai->ai_addrlen ) != 0)
+		{
+			why = strerror( errno );
+			close( m_fd );
+			m_fd = -1;
+		}
+	}
+	freeaddrinfo( p_info );
+	if (m_fd < 0)
+		return Fail( std::string("CKvsClient::Connect() ") + address + ": " + why );
+
+	int32_t one = 1;
+	setsockopt( m_fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one) );
+	return true;
+}
+
+///////////////////////////////////////////////////////////////////////////////////
+void CKvsClient::Close( void )
+{
+	if (m_fd >= 0)
+		close( m_fd );
+	m_fd = -1;
+
+	m_out.clear();
+	m_outPos = 0;
+	m_in.clear();
+	m_inPos = 0;
+	m_queuedOps.clear();
+}
+
+///////////////////////////////////////////////////////////////////////////////////
+bool CKvsClient::isConnected( void )
+{
+	return m_fd >= 0;
+}
+
+///////////////////////////////////////////////////////////////////////////////////
+std::string CKvsClient::GetErrorMsg( void )
+{
+	return m_emsg;
+}
+
+///////////////////////////////////////////////////////////////////////////////////
+// a connection that failed part way through a frame can't be trusted, so is closed
+bool CKvsClient::Fail( const std::string& emsg )
+{
+	m_emsg = emsg;
+	Close();
+	return false;
+}
+
+///////////////////////////////////////////////////////////////////////////////////
+bool CKvsClient::SendAll( void )
+{
+	while (m_outPos < m_out.size())
+	{
+		ssize_t sent = send( m_fd, m_out.data() + m_outPos, m_out.size() - m_outPos, MSG_NOSIGNAL );
+		if (sent < 0)
+		{
+			if (errno == EINTR)
+				continue;
+			return Fail( std::string("CKvsClient send: ") + strerror( errno ) );
+		}
+		m_outPos += sent;
+	}
+	m_out.clear();
+	m_outPos = 0;
+	return true;
+}
+
+///////////////////////////////////////////////////////////////////////////////////
+// takes a whole reply frame off the front of what was received, without reading more
+bool CKvsClient::TakeReply( uint8_t& status, uint32_t& id )
+{
+	size_t left = m_in.size() - m_inPos;
+	if (left < KVS_NET_HEADER_SIZE)
+		return false;
+
+	const char* p_frame = m_in.data() + m_inPos;
+	uint32_t    body = kvs_net_get_u32( p_frame );
+	if (left < KVS_NET_HEADER_SIZE + (size_t)body)
+		return false;
+
+	status = (uint8_t)p_frame[4];
+	id = kvs_net_get_u32( p_frame + 5 );
+	m_reply.assign( p_frame + KVS_NET_HEADER_SIZE, body );
+	m_inPos += KVS_NET_HEADER_SIZE + body;
+
+	if (m_inPos == m_in.size())
+	{
+		m_in.clear();
+		m_inPos = 0;
+	}
+	else if (m_inPos > KVS_CLIENT_READ_SIZE)
+	{
+		m_in.erase( 0, m_inPos );
+		m_inPos = 0;
+	}
+	return true;
+}
+
+///////////////////////////////////////////////////////////////////////////////////
+// one recv(), waiting for it
+bool CKvsClient::Receive( void )
+{
+	if (m_in.size() - m_inPos >= KVS_NET_HEADER_SIZE && kvs_net_get_u32( m_in.data() + m_inPos ) > KVS_NET_MAX_FRAME)
+		return Fail( "CKvsClient reply too large" );
+
+	for (;;)
+	{
+		size_t have = m_in.size();
+		m_in.resize( have + KVS_CLIENT_READ_SIZE );
+		ssize_t got = recv( m_fd, &m_in[have], KVS_CLIENT_READ_SIZE, 0 );
+		m_in.resize( have + ((got > 0) ? got : 0) );
+
+		if (got > 0)
+			return true;
+		if (got == 0)
+			return Fail( "CKvsClient connection closed by the server" );
+		if (errno != EINTR)
+			return Fail( std::string("CKvsClient recv: ") + strerror( errno ) );
+	}
+}
+
+///////////////////////////////////////////////////////////////////////////////////
+int32_t CKvsClient::Call( uint8_t op, const std::string& body )
+{
+	if (m_fd < 0)
+	{
+		m_emsg = "CKvsClient not connected";
+		return KVS_NET_ERROR;
+	}
+	if (!m_queuedOps.empty())
+	{
+		m_emsg = "CKvsClient requests are queued, Flush() them first";
+		return KVS_NET_ERROR;
+	}
+
+	uint32_t id = m_nextId++;
+	size_t   at = kvs_net_begin_frame( m_out, op, id );
+	m_out += body;
+	kvs_net_end_frame( m_out, at );
+	if (!SendAll())
+		return KVS_NET_ERROR;
+
+	uint8_t  status;
+	uint32_t replyId;
+	while (!TakeReply( status, replyId ))
+	{
+		if (!Receive())
+			return KVS_NET_ERROR;
+	}
+	if (replyId != id)
+	{
+		Fail( "CKvsClient reply out of order" );
+		return KVS_NET_ERROR;
+	}
+
+	if (status == KVS_NET_ERROR)
+	{
+		CKvsNetReader in( m_reply.data(), m_reply.size() );
+		if (!in.Str( m_emsg ))
+			m_emsg = "CKvsClient server error";
+	}
+	else if (status != KVS_NET_OK)
+	{
+		m_emsg = "CKvsClient bad request";
+	}
+	return status;
+}
+
+///////////////////////////////////////////////////////////////////////////////////
+bool CKvsClient::Value( std::string& key, uint8_t flags, std::string& value )
+{
+	m_body.clear();
+	kvs_net_put_u32( m_body, 1 );
+	kvs_net_put_u8( m_body, flags );
+	kvs_net_put_str( m_body, key );
+	if (Call( KVS_OP_GET, m_body ) != KVS_NET_OK)
+		return false;
+
+	CKvsNetReader in( m_reply.data(), m_reply.size() );
+	uint8_t       found;
+	return in.U8( found ) && in.Str( value ) && found;
+}
+
+///////////////////////////////////////////////////////////////////////////////////
+bool CKvsClient::SetOne( std::string& key, uint8_t flags, const char* value, uint32_t size, uint64_t ttl_ms )
+{
+	m_body.clear();
+	kvs_net_put_u32( m_body, 1 );
+	kvs_net_put_u8( m_body, flags );
+	kvs_net_put_str( m_body, key );
+	kvs_net_put_str( m_body, value, size );
+	kvs_net_put_u64( m_body, ttl_ms );
+	return Call( KVS_OP_SET, m_body ) == KVS_NET_OK;
+}
+
+///////////////////////////////////////////////////////////////////////////////////
+bool CKvsClient::ReadBool( std::string& key, bool defaultValue )
+{
+	std::string value;
+	int32_t     numVal;
+	if (Value( key, 0, value ) && kvs_client_param( value, numVal ))
+		return (numVal != 0);
+
+	return defaultValue;
+}
+
+///////////////////////////////////////////////////////////////////////////////////
+int32_t CKvsClient::ReadInt( std::string& key, int32_t defaultValue )
+{
+	std::string value;
+	int32_t     numVal;
+	if (Value( key, 0, value ) && kvs_client_param( value, numVal ))
+		return numVal;
+
+	return defaultValue;
+}
+
+///////////////////////////////////////////////////////////////////////////////////
+float CKvsClient::ReadReal( std::string& key, float defaultValue )
+{
+	std::string value;
+	float       numVal;
+	if (Value( key, 0, value ) && kvs_client_param( value, numVal ))
+		return numVal;
+
+	return defaultValue;
+}
+
+///////////////////////////////////////////////////////////////////////////////////
+std::string CKvsClient::ReadString( std::string& key, char* defaultValue )
+{
+	std::string value;
+	if (Value( key, 0, value ))
+		return value;
+
+	return std::string( defaultValue );
+}
+
+///////////////////////////////////////////////////////////////////////////////////
+// the server decodes the base64, so raw bytes cross the wire
+bool CKvsClient::ReadBinary( std::string& key, uint8_t* dest, uint32_t byte_size )
+{
+	std::string raw;
+	if (!Value( key, KVS_NET_BINARY, raw ) || raw.size() != byte_size)
+		return false;
+
+	memcpy( dest, raw.data(), byte_size );
+	return true;
+}
+
+///////////////////////////////////////////////////////////////////////////////////
+char* CKvsClient::WriteString( std::string& key, char* value, uint64_t ttl_ms )
+{
+	SetOne( key, 0, value, (uint32_t)strlen( value ), ttl_ms );
+	return value;
+}
+
+///////////////////////////////////////////////////////////////////////////////////
+bool CKvsClient::WriteBool( std::string& key, bool value, uint64_t ttl_ms )
+{
+	SetOne( key, 0, (value) ? "1" : "0", 1, ttl_ms );
+	return value;
+}
+
+///////////////////////////////////////////////////////////////////////////////////
+int32_t CKvsClient::WriteInt( std::string& key, int32_t value, uint64_t ttl_ms )
+{
+	std::string text = std::to_string( value );
+	SetOne( key, 0, text.data(), (uint32_t)text.size(), ttl_ms );
+	return value;
+}
+
+///////////////////////////////////////////////////////////////////////////////////
+float CKvsClient::WriteReal( std::string& key, float value, uint64_t ttl_ms )
+{
+	std::string text = std::to_string( value );
+	SetOne( key, 0, text.data(), (uint32_t)text.size(), ttl_ms );
+	return value;
+}
+
+///////////////////////////////////////////////////////////////////////////////////
+// the server base64 encodes, so raw bytes cross the wire
+uint8_t* CKvsClient::WriteBinary( std::string& key, uint8_t* valuePtr, uint32_t byte_size, uint64_t ttl_ms )
+{
+	SetOne( key, KVS_NET_BINARY, (const char*)valuePtr, byte_size, ttl_ms );
+	return valuePtr;
+}
+
+///////////////////////////////////////////////////////////////////////////////////
+bool CKvsClient::isKey( std::string& key )
+{
+	std::string value;
+	return Value( key, 0, value );
+}
+
+///////////////////////////////////////////////////////////////////////////////////
+bool CKvsClient::DeleteKey( std::string& key )
+{
+	std::vector<std::string> keys( 1, key );
+	return Del( keys ) == 1;
+}
+
+///////////////////////////////////////////////////////////////////////////////////
+bool CKvsClient::SyncToDiskStorage( void )
+{
+	return Call( KVS_OP_SYNC, std::string() ) == KVS_NET_OK;
+}
+
+///////////////////////////////////////////////////////////////////////////////////
+bool CKvsClient::Ping( void )
+{
+	return Call( KVS_OP_PING, std::string() ) == KVS_NET_OK;
+}
+
+///////////////////////////////////////////////////////////////////////////////////
+bool CKvsClient::Get( const std::vector<std::string>& keys, std::vector<std::string>& values, std::vector<bool>& found )
+{
+	m_body.clear();
+	kvs_net_put_u32( m_body, (uint32_t)keys.size() );
+	for (size_t i = 0; i < keys.size(); i++)
+	{
+		kvs_net_put_u8( m_body, 0 );
+		kvs_net_put_str( m_body, keys[i] );
+	}
+	if (Call( KVS_OP_GET, m_body ) != KVS_NET_OK)
+		return false;
+
+	values.resize( keys.size() );
+	found.resize( keys.size() );
+
+	CKvsNetReader in( m_reply.data(), m_reply.size() );
+	for (size_t i = 0; i < keys.size(); i++)
+	{
+		uint8_t hit = 0;
+		if (!in.U8( hit ) || !in.Str( values[i] ))
+			return Fail( "CKvsClient::Get() bad reply" );
+		found[i] = (hit != 0);
+	}
+	return true;
+}
+
+///////////////////////////////////////////////////////////////////////////////////
+bool CKvsClient::Set( const std::vector<std::string>& keys, const std::vector<std::string>& values, uint64_t ttl_ms )
+{
+	if (keys.size() != values.size())
+	{
+		m_emsg = "CKvsClient::Set() keys and values differ in number";
+		return false;
+	}
+
+	m_body.clear();
+	kvs_net_put_u32( m_body, (uint32_t)keys.size() );
+	for (size_t i = 0; i < keys.size(); i++)
+	{
+		kvs_net_put_u8( m_body, 0 );
+		kvs_net_put_str( m_body, keys[i] );
+		kvs_net_put_str( m_body, values[i] );
+		kvs_net_put_u64( m_body, ttl_ms );
+	}
+	return Call( KVS_OP_SET, m_body ) == KVS_NET_OK;
+}
+
+///////////////////////////////////////////////////////////////////////////////////
+int32_t CKvsClient::Del( const std::vector<std::string>& keys )
+{
+	m_body.clear();
+	kvs_net_put_u32( m_body, (uint32_t)keys.size() );
+	for (size_t i = 0; i < keys.size(); i++)
+		kvs_net_put_str( m_body, keys[i] );
+	if (Call( KVS_OP_DEL, m_body ) != KVS_NET_OK)
+		return -1;
+
+	CKvsNetReader in( m_reply.data(), m_reply.size() );
+	uint32_t      deleted;
+	if (!in.U32( deleted ))
+		return -1;
+	return (int32_t)deleted;
+}
+
+///////////////////////////////////////////////////////////////////////////////////
+bool CKvsClient::Scan( const std::string& prefix, const std::string& after, uint32_t limit,
+                       std::vector<std::pair<std::string, std::string> >& rows, bool& more )
+{
+	rows.clear();
+	more = false;
+
+	m_body.clear();
+	kvs_net_put_str( m_body, prefix );
+	kvs_net_put_str( m_body, after );
+	kvs_net_put_u32( m_body, limit );
+	if (Call( KVS_OP_SCAN, m_body ) != KVS_NET_OK)
+		return false;
+
+	CKvsNetReader in( m_reply.data(), m_reply.size() );
+	uint32_t      n;
+	if (!in.U32( n ))
+		return Fail( "CKvsClient::Scan() bad reply" );
+
+	rows.resize( n );
+	for (uint32_t i = 0; i < n; i++)
+	{
+		if (!in.Str( rows[i].first ) || !in.Str( rows[i].second ))
+			return Fail( "CKvsClient::Scan() bad reply" );
+	}
+
+	uint8_t hasMore;
+	if (!in.U8( hasMore ))
+		return Fail( "CKvsClient::Scan() bad reply" );
+	more = (hasMore != 0);
+	return true;
+}
+
+///////////////////////////////////////////////////////////////////////////////////
+bool CKvsClient::Tail( uint64_t after, uint32_t max_bytes, std::string& records )
+{
+	records.clear();
+
+	m_body.clear();
+	kvs_net_put_u64( m_body, after );
+	kvs_net_put_u32( m_body, max_bytes );
+	if (Call( KVS_OP_TAIL, m_body ) != KVS_NET_OK)
+		return false;
+
+	CKvsNetReader in( m_reply.data(), m_reply.size() );
+	if (!in.Str( records ) || !in.AtEnd())
+		return Fail( "CKvsClient::Tail() bad reply" );
+	return true;
+}
+
+///////////////////////////////////////////////////////////////////////////////////
+bool CKvsClient::Digest( std::string& tree )
+{
+	tree.clear();
+
+	if (Call( KVS_OP_DIGEST, std::string() ) != KVS_NET_OK)
+		return false;
+
+	CKvsNetReader in( m_reply.data(), m_reply.size() );
+	if (!in.Str( tree ) || !in.AtEnd())
+		return Fail( "CKvsClient::Digest() bad reply" );
+	return true;
+}
+
+///////////////////////////////////////////////////////////////////////////////////
+bool CKvsClient::DigestKeys( const std::vector<uint32_t>& leaves, std::vector<std::pair<std::string, uint64_t> >& keys )
+{
+	keys.clear();
+
+	m_body.clear();
+	kvs_net_put_u32( m_body, (uint32_t)leaves.size() );
+	for (size_t i = 0; i < leaves.size(); i++)
+		kvs_net_put_u32( m_body, leaves[i] );
+	if (Call( KVS_OP_DIGEST_KEYS, m_body ) != KVS_NET_OK)
+		return false;
+
+	CKvsNetReader in( m_reply.data(), m_reply.size() );
+	uint32_t n;
+	if (!in.U32( n ))
+		return Fail( "CKvsClient::DigestKeys() bad reply" );
+	keys.reserve( std::min( (size_t)n, in.Left() / 12 ) );
+	for (uint32_t i = 0; i < n; i++)
+	{
+		std::string key;
+		uint64_t    digest;
+		if (!in.Str( key ) || !in.U64( digest ))
+			return Fail( "CKvsClient::DigestKeys() bad reply" );
+		keys.push_back( std::make_pair( std::move(key), digest ) );
+	}
+	if (!in.AtEnd())
+		return Fail( "CKvsClient::DigestKeys() bad reply" );
+	return true;
+}
+
+///////////////////////////////////////////////////////////////////////////////////
+void CKvsClient::QueueGet( const std::string& key )
+{
+	size_t at = kvs_net_begin_frame( m_out, KVS_OP_GET, m_nextId++ );
+	kvs_net_put_u32( m_out, 1 );
+	kvs_net_put_u8( m_out, 0 );
+	kvs_net_put_str( m_out, key );
+	kvs_net_end_frame( m_out, at );
+	m_queuedOps.push_back( KVS_OP_GET );
+}
+
+///////////////////////////////////////////////////////////////////////////////////
+void CKvsClient::QueueSet( const std::string& key, const std::string& value, uint64_t ttl_ms )
+{
+	size_t at = kvs_net_begin_frame( m_out, KVS_OP_SET, m_nextId++ );
+	kvs_net_put_u32( m_out, 1 );
+	kvs_net_put_u8( m_out, 0 );
+	kvs_net_put_str( m_out, key );
+	kvs_net_put_str( m_out, value );
+	kvs_net_put_u64( m_out, ttl_ms );
+	kvs_net_end_frame( m_out, at );
+	m_queuedOps.push_back( KVS_OP_SET );
+}
+
+///////////////////////////////////////////////////////////////////////////////////
+void CKvsClient::QueueDel( const std::string& key )
+{
+	size_t at = kvs_net_begin_frame( m_out, KVS_OP_DEL, m_nextId++ );
+	kvs_net_put_u32( m_out, 1 );
+	kvs_net_put_str( m_out, key );
+	kvs_net_end_frame( m_out, at );
+	m_queuedOps.push_back( KVS_OP_DEL );
+}
+
+///////////////////////////////////////////////////////////////////////////////////
+size_t CKvsClient::Queued( void )
+{
+	return m_queuedOps.size();
+}
+
+///////////////////////////////////////////////////////////////////////////////////
+// replies are taken while requests are still going out, so a pipeline larger than the
+// socket buffers can't leave both ends waiting on each other
+bool CKvsClient::Flush( std::vector<CKvsReply>& replies )
+{
+	replies.clear();
+	if (m_fd < 0)
+	{
+		m_queuedOps.clear();
+		m_out.clear();
+		m_emsg = "CKvsClient not connected";
+		return false;
+	}
+
+	size_t   count = m_queuedOps.size();
+	uint32_t firstId = m_nextId - (uint32_t)count;
+	replies.resize( count );
+
+	size_t taken = 0;
+	while (taken < count)
+	{
+		uint8_t  status;
+		uint32_t id;
+		while (taken < count && TakeReply( status, id ))
+		{
+			if (id != firstId + (uint32_t)taken)
+				return Fail( "CKvsClient reply out of order" );
+
+			CKvsReply&    reply = replies[taken];
+			CKvsNetReader in( m_reply.data(), m_reply.size() );
+			uint8_t       found = 0;
+
+			reply.m_status = status;
+			if (status == KVS_NET_ERROR)
+				in.Str( reply.m_value );
+			else if (status == KVS_NET_OK && m_queuedOps[taken] == KVS_OP_GET)
+				reply.m_found = in.U8( found ) && in.Str( reply.m_value ) && found;
+			else if (status == KVS_NET_OK && m_queuedOps[taken] == KVS_OP_DEL)
+				in.U32( reply.m_count );
+			taken++;
+		}
+		if (taken == count)
+			break;
+
+		if (m_outPos < m_out.size())
+		{
+			pollfd pfd;
+			pfd.fd = m_fd;
+			pfd.events = POLLIN | POLLOUT;
+			pfd.revents = 0;
+			if (poll( &pfd, 1, -1 ) < 0)
+			{
+				if (errno == EINTR)
+					continue;
+				return Fail( std::string("CKvsClient poll: ") + strerror( errno ) );
+			}
+
+			if (pfd.revents & POLLOUT)
+			{
+				ssize_t sent = send( m_fd, m_out.data() + m_outPos, m_out.size() - m_outPos, MSG_NOSIGNAL | MSG_DONTWAIT );
+				if (sent < 0 && errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)
+					return Fail( std::string("CKvsClient send: ") + strerror( errno ) );
+				if (sent > 0)
+					m_outPos += sent;
+				if (m_outPos == m_out.size())
+				{
+					m_out.clear();
+					m_outPos = 0;
+				}
+			}
+			if (!(pfd.revents & (POLLIN | POLLHUP | POLLERR)))
+				continue;
+		}
+
+		if (!Receive())
+			return false;
+	}
+
+	m_queuedOps.clear();
+	return true;
+}
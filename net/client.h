@@ -0,0 +1,122 @@
+/////////////////////////////////////////////////////////////////////////////
+// Name:        client.h
+// Purpose:     a connection to a kvs_server, with the Read/Write API of a
+//							CKeyValueStore and batched and pipelined requests on top.
+//
+//							Values are formatted and parsed as the store does, so a
+//							client and an embedded store agree on every key. Unlike the
+//							store, a Read* of a missing key returns the default without
+//							creating the key, as a snapshot read does.
+//
+//							Each call is a round trip, unless it is queued: Queue*()
+//							requests go out together upon Flush(), which then reads
+//							their replies in order. Batches, Get(), Set() and Del(),
+//							carry many keys in one request. A client is not thread safe;
+//							give each thread its own.
+/////////////////////////////////////////////////////////////////////////////
+
+#ifndef _KVS_NET_CLIENT_H_
+#define _KVS_NET_CLIENT_H_
+
+#include <cstdint>
+#include <string>
+#include <vector>
+#include <utility>
+#include "protocol.h"
+
+// the outcome of one queued request, in the order queued:
+class CKvsReply
+{
+public:
+	CKvsReply() : m_status(KVS_NET_OK), m_found(false), m_count(0) {}
+
+	int32_t     m_status;       // KVS_NET_OK, or an error, with m_value its message
+	bool        m_found;        // a get: the key exists
+	std::string m_value;        // a get: its value
+	uint32_t    m_count;        // a del: keys deleted
+};
+
+class CKvsClient
+{
+public:
+	CKvsClient();
+	~CKvsClient();
+
+	// "tcp:host:port" or "unix:/path":
+	bool        Connect( const std::string& address );
+	void        Close( void );
+	bool        isConnected( void );
+	std::string GetErrorMsg( void );
+
+	bool        ReadBool(   std::string& key, bool     defaultValue );
+	int32_t     ReadInt(    std::string& key, int32_t  defaultValue );
+	float       ReadReal(   std::string& key, float    defaultValue );
+	std::string ReadString( std::string& key, char*    defaultValue );
+	//
+	// copies byte_size bytes into dest; false, with dest untouched, if the key is missing:
+	bool        ReadBinary( std::string& key, uint8_t* dest, uint32_t byte_size );
+
+	// each returns the value passed, as the store's do, even when the write fails:
+	char*       WriteString( std::string& key, char*    value, uint64_t ttl_ms = 0 );
+	bool        WriteBool(   std::string& key, bool     value, uint64_t ttl_ms = 0 );
+	int32_t     WriteInt(    std::string& key, int32_t  value, uint64_t ttl_ms = 0 );
+	float       WriteReal(   std::string& key, float    value, uint64_t ttl_ms = 0 );
+	uint8_t*    WriteBinary( std::string& key, uint8_t* valuePtr, uint32_t byte_size, uint64_t ttl_ms = 0 );
+
+	bool        isKey( std::string& key );
+	bool        DeleteKey( std::string& key );
+	bool        SyncToDiskStorage( void );
+	bool        Ping( void );
+
+	// batches, each one request read or written as a whole; false upon an error:
+	bool        Get( const std::vector<std::string>& keys, std::vector<std::string>& values, std::vector<bool>& found );
+	bool        Set( const std::vector<std::string>& keys, const std::vector<std::string>& values, uint64_t ttl_ms = 0 );
+	int32_t     Del( const std::vector<std::string>& keys );       // keys deleted, -1 upon an error
+	// a page of up to limit keys starting with prefix, past after ("" to start), in key
+	// order; more is set when there are others, the next page starting after the last:
+	bool        Scan( const std::string& prefix, const std::string& after, uint32_t limit,
+	                  std::vector<std::pair<std::string, std::string> >& rows, bool& more );
+	// the server's mutation log records past sequence after, up to about max_bytes of
+	// them, for a CKvsFollower's Apply(); records is empty when there are none yet:
+	bool        Tail( uint64_t after, uint32_t max_bytes, std::string& records );
+	// the server's digest tree, serialized for a CKvsDigestTree's Parse(); and the keys in
+	// leaves of it, sorted, with their digests, as the store's DigestKeys() gives them:
+	bool        Digest( std::string& tree );
+	bool        DigestKeys( const std::vector<uint32_t>& leaves, std::vector<std::pair<std::string, uint64_t> >& keys );
+
+	// pipelining: requests queued go out together upon Flush(), which waits for all their
+	// replies. False if the connection failed; a request's own error is in its reply:
+	void        QueueGet( const std::string& key );
+	void        QueueSet( const std::string& key, const std::string& value, uint64_t ttl_ms = 0 );
+	void        QueueDel( const std::string& key );
+	size_t      Queued( void );
+	bool        Flush( std::vector<CKvsReply>& replies );
+
+private:
+	CKvsClient( const CKvsClient& );
+	CKvsClient& operator=( const CKvsClient& );
+
+	// one request and its reply, the reply body left in m_reply:
+	int32_t     Call( uint8_t op, const std::string& body );
+	bool        Value( std::string& key, uint8_t flags, std::string& value );
+	bool        SetOne( std::string& key, uint8_t flags, const char* value, uint32_t size, uint64_t ttl_ms );
+
+	bool        SendAll( void );
+	// a whole reply frame off what was received, its body to m_reply; false if none yet:
+	bool        TakeReply( uint8_t& status, uint32_t& id );
+	bool        Receive( void );
+	bool        Fail( const std::string& emsg );
+
+	int                  m_fd;
+	uint32_t             m_nextId;
+	std::string          m_out;          // frames to send
+	size_t               m_outPos;
+	std::string          m_in;           // bytes received, from m_inPos on not yet taken
+	size_t               m_inPos;
+	std::string          m_reply;        // the body of the last reply taken
+	std::string          m_body;         // scratch for building a request body
+	std::vector<uint8_t> m_queuedOps;    // the op of each frame queued in m_out
+	std::string          m_emsg;
+};
+
+#endif // _KVS_NET_CLIENT_H_
@@ -0,0 +1,167 @@
+////////////////////////////////////////////////////////////////////////////
+// Name:        kvs_server.cpp
+// Purpose:     serves a CKeyValueStore over TCP and/or Unix sockets until
+//							SIGINT or SIGTERM, syncing it to disk every --sync seconds
+//							and once more upon exit. With --sync-rate those periodic
+//							syncs are paced to that many MB/s; the one upon exit and any
+//							a client asks for are not. With --log it keeps a mutation log
+//							for followers, flushed every --log-flush ms; followers tail
+//							the file, or ask the server with a TAIL request.
+//
+//							kvs_server --db <path> [--listen tcp:host:port | unix:/path]...
+//							           [--threads n] [--sync seconds] [--sync-rate MB/s]
+//							           [--key-file <path>] [--log <path>] [--log-flush ms]
+/////////////////////////////////////////////////////////////////////////////
+
+#include <csignal>
+#include <cstdlib>
+#include <ctime>
+#include <thread>
+#include <fstream>
+#include <iostream>
+#include <pthread.h>
+#include "server.h"
+#include "kvs.h"
+
+#define KVS_SERVER_SYNC_SECONDS   (5)
+#define KVS_SERVER_LOG_FLUSH_MS   (100)
+
+///////////////////////////////////////////////////////////////////////////////////
+static int Usage( void )
+{
+	std::cerr << "usage: kvs_server --db <path> [--listen tcp:host:port | unix:/path]... [--threads n]"
+	          << " [--sync seconds] [--sync-rate MB/s] [--key-file <path>] [--log <path>] [--log-flush ms]" << std::endl
+	          << "  --listen defaults to tcp:127.0.0.1:" << KVS_NET_DEFAULT_PORT
+	          << ", --threads to the hardware threads, --sync to " << KVS_SERVER_SYNC_SECONDS
+	          << " (0 for only upon exit), --sync-rate to unpaced, --log-flush to " << KVS_SERVER_LOG_FLUSH_MS << std::endl;
+	return 1;
+}
+
+///////////////////////////////////////////////////////////////////////////////////
+int main( int argc, char** argv )
+{
+	std::string              db;
+	std::string              keyFile;
+	std::vector<std::string> listen;
+	uint32_t                 threads = std::thread::hardware_concurrency();
+	int32_t                  syncSeconds = KVS_SERVER_SYNC_SECONDS;
+	double                   syncRate = 0;
+	std::string              logPath;
+	int32_t                  logFlushMs = KVS_SERVER_LOG_FLUSH_MS;
+
+	for (int i = 1; i < argc; i++)
+	{
+		std::string arg = argv[i];
+		if (arg == "--db" && i + 1 < argc)
+			db = argv[++i];
+		else if (arg == "--listen" && i + 1 < argc)
+			listen.push_back( argv[++i] );
+		else if (arg == "--threads" && i + 1 < argc)
+			threads = (uint32_t)atoi( argv[++i] );
+		else if (arg == "--sync" && i + 1 < argc)
+			syncSeconds = atoi( argv[++i] );
+		else if (arg == "--sync-rate" && i + 1 < argc)
+			syncRate = atof( argv[++i] );
+		else if (arg == "--key-file" && i + 1 < argc)
+			keyFile = argv[++i];
+		else if (arg == "--log" && i + 1 < argc)
+			logPath = argv[++i];
+		else if (arg == "--log-flush" && i + 1 < argc)
+			logFlushMs = atoi( argv[++i] );
+		else
+			return Usage();
+	}
+	if (db.empty() || logFlushMs <= 0 || syncRate < 0)
+		return Usage();
+	if (listen.empty())
+		listen.push_back( "tcp:127.0.0.1:" + std::to_string(KVS_NET_DEFAULT_PORT) );
+
+	// the passphrase is read from a file, so it does not show in the process list:
+	std::string passphrase;
+	if (!keyFile.empty())
+	{
+		std::ifstream in( keyFile.c_str() );
+		if (!in || !std::getline( in, passphrase ) || passphrase.empty())
+		{
+			std::cerr << "kvs_server: no key in " << keyFile << std::endl;
+			return 1;
+		}
+	}
+
+	// the signals are taken by sigtimedwait() below, so every thread started must block them:
+	sigset_t signals;
+	sigemptyset( &signals );
+	sigaddset( &signals, SIGINT );
+	sigaddset( &signals, SIGTERM );
+	pthread_sigmask( SIG_BLOCK, &signals, NULL );
+
+	CKeyValueStore* p_store = (passphrase.empty())
+		? new CKeyValueStore( db.c_str(), NULL, NULL )
+		: new CKeyValueStore( db.c_str(), NULL, NULL, (const uint8_t*)passphrase.data(), (uint32_t)passphrase.size() );
+	if (syncRate > 0)
+	{
+		CKvsSyncPacing pacing;
+		pacing.m_bytesPerSec = (uint64_t)(syncRate * 1024 * 1024);
+		p_store->SetSyncPacing( pacing );
+	}
+	p_store->Init();
+
+	if (!logPath.empty() && !p_store->OpenMutationLog( logPath ))
+	{
+		std::cerr << "kvs_server: " << p_store->m_emsg << std::endl;
+		delete p_store;
+		return 1;
+	}
+
+	CKvsServer* p_server = new CKvsServer( p_store );
+	bool ok = true;
+	for (size_t l = 0; ok && l < listen.size(); l++)
+		ok = p_server->Listen( listen[l] );
+	ok = ok && p_server->Start( threads );
+	if (!ok)
+	{
+		std::cerr << "kvs_server: " << p_server->GetErrorMsg() << std::endl;
+		delete p_server;
+		delete p_store;
+		return 1;
+	}
+
+	for (size_t l = 0; l < listen.size(); l++)
+		std::cerr << "kvs_server: listening on " << listen[l] << std::endl;
+
+	// with a log, the wait is cut to its flush interval, syncing once enough have passed:
+	int64_t waitMs = (syncSeconds > 0) ? (int64_t)syncSeconds * 1000 : 3600 * 1000;
+	if (!logPath.empty() && logFlushMs < waitMs)
+		waitMs = logFlushMs;
+	int64_t nextSync = kvs_now_ms() + (int64_t)syncSeconds * 1000;
+
+	for (;;)
+	{
+		timespec wait;
+		wait.tv_sec = (time_t)(waitMs / 1000);
+		wait.tv_nsec = (long)(waitMs % 1000) * 1000000;
+
+		int32_t sig = sigtimedwait( &signals, NULL, &wait );
+		if (sig == SIGINT || sig == SIGTERM)
+			break;
+
+		if (syncSeconds > 0 && kvs_now_ms() >= nextSync)
+		{
+			if (!p_store->SyncToDiskStorage())
+				std::cerr << "kvs_server: SyncToDiskStorage() failed" << std::endl;
+			nextSync = kvs_now_ms() + (int64_t)syncSeconds * 1000;
+		}
+		else if (!logPath.empty() && !p_store->FlushMutationLog())
+		{
+			std::cerr << "kvs_server: FlushMutationLog() failed" << std::endl;
+		}
+	}
+
+	std::cerr << "kvs_server: stopping" << std::endl;
+	p_server->Stop();
+	delete p_server;
+
+	ok = p_store->SyncToDiskStorage( false, true );
+	delete p_store;
+	return (ok) ? 0 : 1;
+}
@@ -0,0 +1,198 @@
+/////////////////////////////////////////////////////////////////////////////
+// Name:        protocol.h
+// Purpose:     the binary protocol between kvs_server and CKvsClient.
+//
+//							Every message is a frame: a 9 byte header, then its body.
+//							The header is a u32 body size, a u8 op (requests) or status
+//							(replies), and a u32 id the reply echoes back. A client may
+//							send any number of frames before reading replies; a
+//							connection's replies come back in the order of its requests.
+//
+//							All integers are little endian. A str is a u32 size and its
+//							bytes. Request bodies, and the bodies of their OK replies:
+//
+//							GET   u32 n, n x {u8 flags, str key}
+//							      -> n x {u8 found, str value}
+//							SET   u32 n, n x {u8 flags, str key, str value, u64 ttl_ms}
+//							      -> nothing
+//							DEL   u32 n, n x {str key}
+//							      -> u32 deleted
+//							SCAN  str prefix, str after, u32 limit
+//							      -> u32 n, n x {str key, str value}, u8 more
+//							SYNC  nothing -> nothing
+//							PING  nothing -> nothing
+//							TAIL  u64 after, u32 max_bytes
+//							      -> str records
+//							DIGEST       nothing -> str tree
+//							DIGEST_KEYS  u32 n, n x {u32 leaf}
+//							      -> u32 n, n x {str key, u64 digest}
+//
+//							TAIL gives the mutation log records past sequence after, up
+//							to about max_bytes of them, for a CKvsFollower's Apply(); an
+//							empty str when there are none yet. It is an ERROR on a server
+//							without a log.
+//
+//							DIGEST gives the store's digest tree, serialized as a
+//							CKvsDigestTree's Serialize(); DIGEST_KEYS the keys in the
+//							leaves asked for, sorted, with their digests (see digest.h).
+//							It is an ERROR if they would fill more than half a frame.
+//
+//							Values travel in their stored text form, unless the item's
+//							flags have KVS_NET_BINARY: then a SET value is raw bytes
+//							written as WriteBinary() would, and a GET value is the raw
+//							bytes of a base64 value. An ERROR reply's body is a str
+//							message; a BAD_REQUEST reply's is empty.
+/////////////////////////////////////////////////////////////////////////////
+
+#ifndef _KVS_NET_PROTOCOL_H_
+#define _KVS_NET_PROTOCOL_H_
+
+#include <cstdint>
+#include <cstring>
+#include <string>
+
+#define KVS_NET_HEADER_SIZE   (9)
+#define KVS_NET_MAX_FRAME     (64 * 1024 * 1024)  // larger bodies close the connection
+#define KVS_NET_DEFAULT_PORT  (7411)
+
+// ops:
+#define KVS_OP_GET            (1)
+#define KVS_OP_SET            (2)
+#define KVS_OP_DEL            (3)
+#define KVS_OP_SCAN           (4)
+#define KVS_OP_SYNC           (5)
+#define KVS_OP_PING           (6)
+#define KVS_OP_TAIL           (7)
+#define KVS_OP_DIGEST         (8)
+#define KVS_OP_DIGEST_KEYS    (9)
+
+// reply statuses:
+#define KVS_NET_OK            (0)
+#define KVS_NET_ERROR         (1)
+#define KVS_NET_BAD_REQUEST   (2)
+
+// item flags:
+#define KVS_NET_BINARY        (0x01)
+
+///////////////////////////////////////////////////////////////////////////////////
+inline void kvs_net_put_u8( std::string& out, uint8_t v )
+{
+	out.push_back( (char)v );
+}
+
+///////////////////////////////////////////////////////////////////////////////////
+inline void kvs_net_put_u32( std::string& out, uint32_t v )
+{
+	char b[4];
+	for (int32_t i = 0; i < 4; i++)
+		b[i] = (char)(v >> (8 * i));
+	out.append( b, 4 );
+}
+
+///////////////////////////////////////////////////////////////////////////////////
+inline void kvs_net_put_u64( std::string& out, uint64_t v )
+{
+	char b[8];
+	for (int32_t i = 0; i < 8; i++)
+		b[i] = (char)(v >> (8 * i));
+	out.append( b, 8 );
+}
+
+///////////////////////////////////////////////////////////////////////////////////
+inline void kvs_net_put_str( std::string& out, const char* data, uint32_t size )
+{
+	kvs_net_put_u32( out, size );
+	out.append( data, size );
+}
+
+///////////////////////////////////////////////////////////////////////////////////
+inline void kvs_net_put_str( std::string& out, const std::string& s )
+{
+	kvs_net_put_str( out, s.data(), (uint32_t)s.size() );
+}
+
+///////////////////////////////////////////////////////////////////////////////////
+inline uint32_t kvs_net_get_u32( const char* p )
+{
+	const uint8_t* b = reinterpret_cast<const uint8_t*>(p);
+	return (uint32_t)b[0] | ((uint32_t)b[1] << 8) | ((uint32_t)b[2] << 16) | ((uint32_t)b[3] << 24);
+}
+
+///////////////////////////////////////////////////////////////////////////////////
+// appends a frame header, its body size 0 until EndFrame() patches it
+inline size_t kvs_net_begin_frame( std::string& out, uint8_t op_or_status, uint32_t id )
+{
+	size_t at = out.size();
+	kvs_net_put_u32( out, 0 );
+	kvs_net_put_u8( out, op_or_status );
+	kvs_net_put_u32( out, id );
+	return at;
+}
+
+///////////////////////////////////////////////////////////////////////////////////
+inline void kvs_net_end_frame( std::string& out, size_t at )
+{
+	uint32_t body = (uint32_t)(out.size() - at - KVS_NET_HEADER_SIZE);
+	for (int32_t i = 0; i < 4; i++)
+		out[at + i] = (char)(body >> (8 * i));
+}
+
+///////////////////////////////////////////////////////////////////////////////////
+// reads the fields of a body in turn; once one runs past the end every later read
+// fails too, so a body can be parsed whole and checked once with Ok()
+class CKvsNetReader
+{
+public:
+	CKvsNetReader( const char* data, size_t size ) : mp_next(data), mp_end(data + size), m_ok(true) {}
+
+	bool U8( uint8_t& v )
+	{
+		if (!Need( 1 ))
+			return false;
+		v = (uint8_t)*mp_next++;
+		return true;
+	}
+	bool U32( uint32_t& v )
+	{
+		if (!Need( 4 ))
+			return false;
+		v = kvs_net_get_u32( mp_next );
+		mp_next += 4;
+		return true;
+	}
+	bool U64( uint64_t& v )
+	{
+		if (!Need( 8 ))
+			return false;
+		v = (uint64_t)kvs_net_get_u32( mp_next ) | ((uint64_t)kvs_net_get_u32( mp_next + 4 ) << 32);
+		mp_next += 8;
+		return true;
+	}
+	bool Str( std::string& s )
+	{
+		uint32_t size;
+		if (!U32( size ) || !Need( size ))
+			return false;
+		s.assign( mp_next, size );
+		mp_next += size;
+		return true;
+	}
+
+	bool   Ok( void )        { return m_ok; }
+	bool   AtEnd( void )     { return m_ok && mp_next == mp_end; }
+	size_t Left( void )      { return (size_t)(mp_end - mp_next); }
+
+private:
+	bool Need( size_t size )
+	{
+		if (m_ok && (size_t)(mp_end - mp_next) < size)
+			m_ok = false;
+		return m_ok;
+	}
+
+	const char* mp_next;
+	const char* mp_end;
+	bool        m_ok;
+};
+
+#endif // _KVS_NET_PROTOCOL_H_
@@ -0,0 +1,769 @@
+////////////////////////////////////////////////////////////////////////////
+// Name:        server.cpp
+// Purpose:     serves a CKeyValueStore over TCP or Unix sockets
+/////////////////////////////////////////////////////////////////////////////
+
+#include <cerrno>
+#include <algorithm>
+#include <unistd.h>
+#include <netdb.h>
+#include <fcntl.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include "server.h"
+#include "kvs.h"
+
+///////////////////////////////////////////////////////////////////////////////////
+CKvsServer::CKvsServer( CKeyValueStore* p_store )
+{
+	mp_store = p_store;
+	m_port = 0;
+	m_wake = -1;
+	m_running = false;
+}
+
+///////////////////////////////////////////////////////////////////////////////////
+CKvsServer::~CKvsServer()
+{
+	Stop();
+}
+
+///////////////////////////////////////////////////////////////////////////////////
+uint16_t CKvsServer::GetPort( void )
+{
+	return m_port;
+}
+
+///////////////////////////////////////////////////////////////////////////////////
+std::string CKvsServer::GetErrorMsg( void )
+{
+	return m_emsg;
+}
+
+///////////////////////////////////////////////////////////////////////////////////
+bool CKvsServer::Listen( const std::string& address )
+{
+	int fd = -1;
+
+	if (address.compare( 0, 5, "unix:" ) == 0)
+	{
+		std::string path = address.substr( 5 );
+
+		sockaddr_un addr;
+		memset( &addr, 0, sizeof(addr) );
+		addr.sun_family = AF_UNIX;
+		if (path.empty() || path.size() >= sizeof(addr.sun_path))
+		{
+			m_emsg = std::string("CKvsServer::Listen() bad unix socket path: ") + path;
+			return false;
+		}
+		memcpy( addr.sun_path, path.c_str(), path.size() );
+
+		// a socket file left by a server that did not stop cleanly would fail the bind:
+		unlink( path.c_str() );
+
+		fd = socket( AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0 );
+		if (fd < 0 || bind( fd, (sockaddr*)&addr, sizeof(addr) ) != 0 || listen( fd, KVS_NET_BACKLOG ) != 0)
+		{
+			m_emsg = std::string("CKvsServer::Listen() ") + address + ": " + strerror( errno );
+			if (fd >= 0)
+				close( fd );
+			return false;
+		}
+		m_unixPaths.push_back( path );
+	}
+	else if (address.compare( 0, 4, "tcp:" ) == 0)
+	{
+		std::string hostPort = address.substr( 4 );
+		size_t      colon = hostPort.rfind( ':' );
+		if (colon == std::string::npos)
+		{
+			m_emsg = std::string("CKvsServer::Listen() no port in: ") + address;
+			return false;
+		}
+		std::string host = hostPort.substr( 0, colon );
+		std::string port = hostPort.substr( colon + 1 );
+		if (host.size() >= 2 && host[0] == '[' && host[host.size() - 1] == ']')
+			host = host.substr( 1, host.size() - 2 );
+
+		addrinfo hints;
+		memset( &hints, 0, sizeof(hints) );
+		hints.ai_family = AF_UNSPEC;
+		hints.ai_socktype = SOCK_STREAM;
+		hints.ai_flags = AI_PASSIVE;
+
+		addrinfo* p_info = NULL;
+		int32_t rc = getaddrinfo( (host.empty()) ? NULL : host.c_str(), port.c_str(), &hints, &p_info );
+		if (rc != 0)
+		{
+			m_emsg = std::string("CKvsServer::Listen() ") + address + ": " + gai_strerror( rc );
+			return false;
+		}
+
+		int32_t one = 1;
+		fd = socket( p_info->ai_family, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0 );
+		if (fd >= 0)
+			setsockopt( fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one) );
+		if (fd < 0 || bind( fd, p_info->ai_addr, p_info->ai_addrlen ) != 0 || listen( fd, KVS_NET_BACKLOG ) != 0)
+		{
+			m_emsg = std::string("CKvsServer::Listen() ") + address + ": " + strerror( errno );
+			if (fd >= 0)
+				close( fd );
+			freeaddrinfo( p_info );
+			return false;
+		}
+		freeaddrinfo( p_info );
+
+		sockaddr_storage bound;
+		socklen_t        boundSize = sizeof(bound);
+		if (getsockname( fd, (sockaddr*)&bound, &boundSize ) == 0)
+		{
+			if (bound.ss_family == AF_INET)
+				m_port = ntohs( ((sockaddr_in*)&bound)->sin_port );
+			else if (bound.ss_family == AF_INET6)
+				m_port = ntohs( ((sockaddr_in6*)&bound)->sin6_port );
+		}
+	}
+	else
+	{
+		m_emsg = std::string("CKvsServer::Listen() expected tcp:host:port or unix:/path, not: ") + address;
+		return false;
+	}
+
+	m_listeners.push_back( fd );
+	return true;
+}
+
+///////////////////////////////////////////////////////////////////////////////////
+bool CKvsServer::Start( uint32_t threads )
+{
+	if (m_running || m_listeners.empty())
+	{
+		m_emsg = (m_running) ? "CKvsServer::Start() already started" : "CKvsServer::Start() nothing to listen on";
+		return false;
+	}
+
+	m_wake = eventfd( 0, EFD_NONBLOCK | EFD_CLOEXEC );
+	if (m_wake < 0)
+	{
+		m_emsg = std::string("CKvsServer::Start() eventfd: ") + strerror( errno );
+		return false;
+	}
+
+	m_running = true;
+	for (uint32_t t = 0; t < std::max( threads, 1u ); t++)
+	{
+		CLoop* p_loop = new CLoop;
+		p_loop->m_epoll = epoll_create1( EPOLL_CLOEXEC );
+		p_loop->mp_cursor = NULL;
+
+		bool ok = (p_loop->m_epoll >= 0);
+		epoll_event ev;
+		memset( &ev, 0, sizeof(ev) );
+
+		// each new connection wakes a single loop:
+		for (size_t l = 0; ok && l < m_listeners.size(); l++)
+		{
+			ev.events = EPOLLIN | EPOLLEXCLUSIVE;
+			ev.data.fd = m_listeners[l];
+			ok = (epoll_ctl( p_loop->m_epoll, EPOLL_CTL_ADD, m_listeners[l], &ev ) == 0);
+		}
+		// the eventfd stays readable once written, waking every loop:
+		ev.events = EPOLLIN;
+		ev.data.fd = m_wake;
+		ok = ok && (epoll_ctl( p_loop->m_epoll, EPOLL_CTL_ADD, m_wake, &ev ) == 0);
+
+		if (!ok)
+		{
+			m_emsg = std::string("CKvsServer::Start() epoll: ") + strerror( errno );
+			if (p_loop->m_epoll >= 0)
+				close( p_loop->m_epoll );
+			delete p_loop;
+			Stop();
+			return false;
+		}
+
+		m_loops.push_back( p_loop );
+		p_loop->m_thread = std::thread( &CKvsServer::Run, this, p_loop );
+	}
+
+	return true;
+}
+
+///////////////////////////////////////////////////////////////////////////////////
+void CKvsServer::Stop( void )
+{
+	m_running = false;
+	if (m_wake >= 0)
+	{
+		uint64_t one = 1;
+		if (write( m_wake, &one, sizeof(one) ) < 0)
+			m_emsg = std::string("CKvsServer::Stop() eventfd: ") + strerror( errno );
+	}
+
+	for (size_t t = 0; t < m_loops.size(); t++)
+	{
+		CLoop* p_loop = m_loops[t];
+		if (p_loop->m_thread.joinable())
+			p_loop->m_thread.join();
+
+		for (std::unordered_map<int, CConnection*>::iterator it = p_loop->m_connections.begin(); it != p_loop->m_connections.end(); ++it)
+		{
+			close( it->first );
+			delete it->second;
+		}
+		close( p_loop->m_epoll );
+		delete p_loop->mp_cursor;
+		delete p_loop;
+	}
+	m_loops.clear();
+
+	for (size_t l = 0; l < m_listeners.size(); l++)
+		close( m_listeners[l] );
+	m_listeners.clear();
+	for (size_t u = 0; u < m_unixPaths.size(); u++)
+		unlink( m_unixPaths[u].c_str() );
+	m_unixPaths.clear();
+
+	if (m_wake >= 0)
+		close( m_wake );
+	m_wake = -1;
+}
+
+///////////////////////////////////////////////////////////////////////////////////
+void CKvsServer::Run( CLoop* p_loop )
+{
+	epoll_event events[KVS_NET_MAX_EVENTS];
+
+	while (m_running)
+	{
+		int32_t n = epoll_wait( p_loop->m_epoll, events, KVS_NET_MAX_EVENTS, -1 );
+		if (n < 0)
+		{
+			if (errno == EINTR)
+				continue;
+			return;
+		}
+
+		for (int32_t i = 0; i < n; i++)
+		{
+			int fd = events[i].data.fd;
+			if (fd == m_wake)
+				return;
+
+			if (std::find( m_listeners.begin(), m_listeners.end(), fd ) != m_listeners.end())
+			{
+				Accept( p_loop, fd );
+				continue;
+			}
+
+			std::unordered_map<int, CConnection*>::iterator it = p_loop->m_connections.find( fd );
+			if (it == p_loop->m_connections.end())
+				continue;
+			CConnection* p_conn = it->second;
+
+			// a hang up still delivers what was sent before it:
+			uint32_t what = events[i].events;
+			if ((what & (EPOLLIN | EPOLLHUP | EPOLLERR)) && !Receive( p_conn ))
+			{
+				Close( p_loop, p_conn );
+				continue;
+			}
+			if (!Serve( p_loop, p_conn ))
+				Close( p_loop, p_conn );
+		}
+	}
+}
+
+///////////////////////////////////////////////////////////////////////////////////
+void CKvsServer::Accept( CLoop* p_loop, int listen_fd )
+{
+	for (;;)
+	{
+		int fd = accept4( listen_fd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC );
+		if (fd < 0)
+			return;		// EAGAIN once another loop took it, or nothing left
+
+		// replies go out as soon as they are written; a unix socket just ignores this:
+		int32_t one = 1;
+		setsockopt( fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one) );
+
+		CConnection* p_conn = new CConnection;
+		p_conn->m_fd = fd;
+		p_conn->m_inPos = 0;
+		p_conn->m_outPos = 0;
+		p_conn->m_events = EPOLLIN;
+
+		epoll_event ev;
+		memset( &ev, 0, sizeof(ev) );
+		ev.events = EPOLLIN;
+		ev.data.fd = fd;
+		if (epoll_ctl( p_loop->m_epoll, EPOLL_CTL_ADD, fd, &ev ) != 0)
+		{
+			close( fd );
+			delete p_conn;
+			continue;
+		}
+		p_loop->m_connections[fd] = p_conn;
+	}
+}
+
+///////////////////////////////////////////////////////////////////////////////////
+// reads what the client has sent, up to the socket running dry
+bool CKvsServer::Receive( CConnection* p_conn )
+{
+	for (;;)
+	{
+		size_t have = p_conn->m_in.size();
+		p_conn->m_in.resize( have + KVS_NET_READ_SIZE );
+		ssize_t got = recv( p_conn->m_fd, &p_conn->m_in[have], KVS_NET_READ_SIZE, 0 );
+		p_conn->m_in.resize( have + ((got > 0) ? got : 0) );
+
+		if (got == 0)
+			return false;
+		if (got < 0)
+		{
+			if (errno == EINTR)
+				continue;
+			return (errno == EAGAIN || errno == EWOULDBLOCK);
+		}
+		if (got < KVS_NET_READ_SIZE)
+			return true;
+	}
+}
+
+///////////////////////////////////////////////////////////////////////////////////
+// the size of the whole frame at the front of what was received, 0 if there is none yet
+size_t CKvsServer::NextFrame( CConnection* p_conn )
+{
+	size_t left = p_conn->m_in.size() - p_conn->m_inPos;
+	if (left < KVS_NET_HEADER_SIZE)
+		return 0;
+
+	size_t frame = KVS_NET_HEADER_SIZE + (size_t)kvs_net_get_u32( p_conn->m_in.data() + p_conn->m_inPos );
+	return (left < frame) ? 0 : frame;
+}
+
+///////////////////////////////////////////////////////////////////////////////////
+// executes every whole frame received while the replies pending stay under
+// KVS_NET_MAX_PENDING, sending the replies after each round
+bool CKvsServer::Serve( CLoop* p_loop, CConnection* p_conn )
+{
+	for (;;)
+	{
+		while (p_conn->m_out.size() - p_conn->m_outPos < KVS_NET_MAX_PENDING)
+		{
+			if (p_conn->m_in.size() - p_conn->m_inPos >= KVS_NET_HEADER_SIZE &&
+			    kvs_net_get_u32( p_conn->m_in.data() + p_conn->m_inPos ) > KVS_NET_MAX_FRAME)
+				return false;
+
+			size_t frame = NextFrame( p_conn );
+			if (!frame)
+				break;
+
+			const char* p_frame = p_conn->m_in.data() + p_conn->m_inPos;
+			Execute( p_loop, (uint8_t)p_frame[4], kvs_net_get_u32( p_frame + 5 ), p_frame + KVS_NET_HEADER_SIZE,
+			         (uint32_t)(frame - KVS_NET_HEADER_SIZE), p_conn->m_out );
+			p_conn->m_inPos += frame;
+		}
+
+		// keeps only the part of a frame not yet whole:
+		if (p_conn->m_inPos == p_conn->m_in.size())
+		{
+			p_conn->m_in.clear();
+			p_conn->m_inPos = 0;
+		}
+		else if (p_conn->m_inPos > KVS_NET_READ_SIZE)
+		{
+			p_conn->m_in.erase( 0, p_conn->m_inPos );
+			p_conn->m_inPos = 0;
+		}
+
+		if (!Send( p_conn ))
+			return false;
+
+		// replies sent below the limit can let frames already received run:
+		if (p_conn->m_out.size() - p_conn->m_outPos >= KVS_NET_MAX_PENDING || !NextFrame( p_conn ))
+			break;
+	}
+
+	return Watch( p_loop, p_conn );
+}
+
+///////////////////////////////////////////////////////////////////////////////////
+bool CKvsServer::Send( CConnection* p_conn )
+{
+	while (p_conn->m_outPos < p_conn->m_out.size())
+	{
+		ssize_t sent = send( p_conn->m_fd, p_conn->m_out.data() + p_conn->m_outPos,
+		                     p_conn->m_out.size() - p_conn->m_outPos, MSG_NOSIGNAL );
+		if (sent < 0)
+		{
+			if (errno == EINTR)
+				continue;
+			if (errno == EAGAIN || errno == EWOULDBLOCK)
+				break;
+			return false;
+		}
+		p_conn->m_outPos += sent;
+	}
+
+	if (p_conn->m_outPos == p_conn->m_out.size())
+	{
+		p_conn->m_out.clear();
+		p_conn->m_outPos = 0;
+	}
+	else if (p_conn->m_outPos > KVS_NET_MAX_PENDING)
+	{
+		p_conn->m_out.erase( 0, p_conn->m_outPos );
+		p_conn->m_outPos = 0;
+	}
+	return true;
+}
+
+///////////////////////////////////////////////////////////////////////////////////
+// reading pauses while too many replies are pending, and writing is only waited on
+// while there are some
+bool CKvsServer::Watch( CLoop* p_loop, CConnection* p_conn )
+{
+	size_t   pending = p_conn->m_out.size() - p_conn->m_outPos;
+	uint32_t events = 0;
+	if (pending < KVS_NET_MAX_PENDING)
+		events |= EPOLLIN;
+	if (pending)
+		events |= EPOLLOUT;
+
+	if (events == p_conn->m_events)
+		return true;
+
+	epoll_event ev;
+	memset( &ev, 0, sizeof(ev) );
+	ev.events = events;
+	ev.data.fd = p_conn->m_fd;
+	p_conn->m_events = events;
+	return (epoll_ctl( p_loop->m_epoll, EPOLL_CTL_MOD, p_conn->m_fd, &ev ) == 0);
+}
+
+///////////////////////////////////////////////////////////////////////////////////
+void CKvsServer::Close( CLoop* p_loop, CConnection* p_conn )
+{
+	epoll_ctl( p_loop->m_epoll, EPOLL_CTL_DEL, p_conn->m_fd, NULL );
+	close( p_conn->m_fd );
+	p_loop->m_connections.erase( p_conn->m_fd );
+	delete p_conn;
+}
+
+///////////////////////////////////////////////////////////////////////////////////
+void CKvsServer::Execute( CLoop* p_loop, uint8_t op, uint32_t id, const char* body, uint32_t size, std::string& out )
+{
+	CKvsNetReader in( body, size );
+	std::string   emsg;
+	bool          ok = true;
+
+	size_t at = kvs_net_begin_frame( out, KVS_NET_OK, id );
+	switch (op)
+	{
+		case KVS_OP_GET:
+			Get( in, out );
+			break;
+
+		case KVS_OP_SET:
+			Set( in );
+			break;
+
+		case KVS_OP_DEL:
+		{
+			uint32_t deleted = Del( in );
+			kvs_net_put_u32( out, deleted );
+			break;
+		}
+
+		case KVS_OP_SCAN:
+			ok = Scan( p_loop, in, out, emsg );
+			break;
+
+		case KVS_OP_SYNC:
+			// a client asking for durability is not kept waiting on the pacing of periodic syncs:
+			ok = mp_store->SyncToDiskStorage( false, true );
+			if (!ok)
+				emsg = "SyncToDiskStorage() failed";
+			break;
+
+		case KVS_OP_PING:
+			break;
+
+		case KVS_OP_TAIL:
+			ok = Tail( in, out, emsg );
+			break;
+
+		case KVS_OP_DIGEST:
+		{
+			CKvsDigestTree tree;
+			mp_store->Digest( tree );
+			kvs_net_put_str( out, tree.Serialize() );
+			break;
+		}
+
+		case KVS_OP_DIGEST_KEYS:
+			ok = DigestKeys( in, out, emsg );
+			break;
+
+		default:
+			break;
+	}
+
+	if (op < KVS_OP_GET || op > KVS_OP_DIGEST_KEYS || !in.AtEnd())
+	{
+		out.resize( at );
+		kvs_net_end_frame( out, kvs_net_begin_frame( out, KVS_NET_BAD_REQUEST, id ) );
+	}
+	else if (!ok)
+	{
+		out.resize( at );
+		at = kvs_net_begin_frame( out, KVS_NET_ERROR, id );
+		kvs_net_put_str( out, emsg );
+		kvs_net_end_frame( out, at );
+	}
+	else
+	{
+		kvs_net_end_frame( out, at );
+	}
+}
+
+///////////////////////////////////////////////////////////////////////////////////
+// a batch of several keys is read through one snapshot, so its keys agree with each
+// other; a single key is copied out under the store's lock, as of now, with no snapshot
+// for writers to keep old values for
+void CKvsServer::Get( CKvsNetReader& in, std::string& out )
+{
+	uint32_t n;
+	if (!in.U32( n ))
+		return;
+
+	CKvsSnapshot* p_snap = (n > 1) ? mp_store->Snapshot() : NULL;
+	std::string   key;
+	std::string   value;
+	std::string   emsg;
+
+	for (uint32_t i = 0; i < n; i++)
+	{
+		uint8_t flags;
+		if (!in.U8( flags ) || !in.Str( key ))
+			break;
+
+		value.clear();
+		bool found;
+		if (p_snap)
+		{
+			found = p_snap->Value( key, value );
+		}
+		else
+		{
+			CKeyValue kv( "", "" );
+			found = mp_store->SnapshotValue( UINT64_MAX, kvs_now_ms(), key, kv ) && mp_store->DecodeValue( kv, NULL, emsg );
+			if (found)
+				value.swap( kv.m_value );
+			kv.FreeBinary();	// decoding a binary value makes its raw bytes too
+		}
+		if (found && (flags & KVS_NET_BINARY))
+			value = mp_store->base64_decode( value );
+
+		kvs_net_put_u8( out, (found) ? 1 : 0 );
+		kvs_net_put_str( out, value );
+	}
+
+	delete p_snap;
+}
+
+///////////////////////////////////////////////////////////////////////////////////
+// a batch is parsed whole before any of it is written, so a bad one writes nothing
+void CKvsServer::Set( CKvsNetReader& in )
+{
+	struct CItem
+	{
+		uint8_t     m_flags;
+		std::string m_key;
+		std::string m_value;
+		uint64_t    m_ttl;
+	};
+
+	uint32_t n;
+	if (!in.U32( n ))
+		return;
+
+	// each item is at least 17 bytes, so a bogus count can't reserve much:
+	std::vector<CItem> items;
+	items.reserve( std::min( (size_t)n, in.Left() / 17 ) );
+	for (uint32_t i = 0; i < n; i++)
+	{
+		CItem item;
+		if (!in.U8( item.m_flags ) || !in.Str( item.m_key ) || !in.Str( item.m_value ) || !in.U64( item.m_ttl ))
+			return;
+		items.push_back( std::move(item) );
+	}
+	if (!in.AtEnd())
+		return;
+
+	for (size_t i = 0; i < items.size(); i++)
+	{
+		CItem& item = items[i];
+		if (item.m_flags & KVS_NET_BINARY)
+		{
+			uint8_t* p_data = (uint8_t*)item.m_value.data();
+			if (item.m_ttl)
+				mp_store->WriteBinary( item.m_key, p_data, (uint32_t)item.m_value.size(), item.m_ttl );
+			else
+				mp_store->WriteBinary( item.m_key, p_data, (uint32_t)item.m_value.size() );
+		}
+		else
+		{
+			char* p_text = (char*)item.m_value.c_str();
+			if (item.m_ttl)
+				mp_store->WriteString( item.m_key, p_text, item.m_ttl );
+			else
+				mp_store->WriteString( item.m_key, p_text );
+		}
+	}
+}
+
+///////////////////////////////////////////////////////////////////////////////////
+uint32_t CKvsServer::Del( CKvsNetReader& in )
+{
+	uint32_t n;
+	if (!in.U32( n ))
+		return 0;
+
+	std::vector<std::string> keys;
+	keys.reserve( std::min( (size_t)n, in.Left() / 4 ) );
+	for (uint32_t i = 0; i < n; i++)
+	{
+		std::string key;
+		if (!in.Str( key ))
+			return 0;
+		keys.push_back( std::move(key) );
+	}
+	if (!in.AtEnd())
+		return 0;
+
+	uint32_t deleted = 0;
+	for (size_t i = 0; i < keys.size(); i++)
+	{
+		if (mp_store->DeleteKey( keys[i] ))
+			deleted++;
+	}
+	return deleted;
+}
+
+///////////////////////////////////////////////////////////////////////////////////
+// what is buffered is flushed first, so a follower polling sees every change made so
+// far; a reply is kept to half of KVS_NET_MAX_FRAME
+bool CKvsServer::Tail( CKvsNetReader& in, std::string& out, std::string& emsg )
+{
+	uint64_t after;
+	uint32_t maxBytes;
+	if (!in.U64( after ) || !in.U32( maxBytes ) || !in.AtEnd())
+		return true;
+
+	std::string records;
+	if (!mp_store->FlushMutationLog() ||
+	    !mp_store->ReadMutationLog( after, std::min( maxBytes, (uint32_t)KVS_NET_MAX_FRAME / 2 ), records ))
+	{
+		emsg = mp_store->m_emsg;
+		return false;
+	}
+
+	kvs_net_put_str( out, records );
+	return true;
+}
+
+///////////////////////////////////////////////////////////////////////////////////
+bool CKvsServer::DigestKeys( CKvsNetReader& in, std::string& out, std::string& emsg )
+{
+	uint32_t n;
+	if (!in.U32( n ))
+		return true;
+
+	std::vector<uint32_t> leaves;
+	leaves.reserve( std::min( (size_t)n, in.Left() / 4 ) );
+	for (uint32_t i = 0; i < n; i++)
+	{
+		uint32_t leaf;
+		if (!in.U32( leaf ))
+			return true;
+		leaves.push_back( leaf );
+	}
+	if (!in.AtEnd())
+		return true;
+
+	std::vector<KVS_DIGEST_KEY> keys;
+	if (!mp_store->DigestKeys( leaves, keys ))
+	{
+		emsg = mp_store->m_emsg;
+		return false;
+	}
+
+	size_t start = out.size();
+	kvs_net_put_u32( out, (uint32_t)keys.size() );
+	for (size_t i = 0; i < keys.size(); i++)
+	{
+		kvs_net_put_str( out, keys[i].first );
+		kvs_net_put_u64( out, keys[i].second );
+		if (out.size() - start >= KVS_NET_MAX_FRAME / 2)
+		{
+			emsg = "DIGEST_KEYS too many keys; ask for fewer leaves at a time";
+			return false;
+		}
+	}
+	return true;
+}
+
+///////////////////////////////////////////////////////////////////////////////////
+// a page of up to limit keys past after; it ends early, with more set, once its reply
+// reaches half of KVS_NET_MAX_FRAME
+bool CKvsServer::Scan( CLoop* p_loop, CKvsNetReader& in, std::string& out, std::string& emsg )
+{
+	std::string prefix;
+	std::string after;
+	uint32_t    limit;
+	if (!in.Str( prefix ) || !in.Str( after ) || !in.U32( limit ) || !in.AtEnd())
+		return true;
+
+	// each loop keeps one cursor, so its db connection is opened once rather than per page:
+	uint32_t prefetch = std::min( limit, (uint32_t)KVS_CURSOR_PREFETCH ) + 1;
+	if (!p_loop->mp_cursor)
+		p_loop->mp_cursor = mp_store->Cursor( prefix, prefetch, after );
+	else
+		p_loop->mp_cursor->Restart( prefix, prefetch, after );
+	CKvsCursor* p_cursor = p_loop->mp_cursor;
+
+	size_t   countAt = out.size();
+	size_t   start = out.size();
+	uint32_t count = 0;
+	bool     more = false;
+
+	kvs_net_put_u32( out, 0 );
+	while (p_cursor->Next())
+	{
+		if (count == limit || out.size() - start >= KVS_NET_MAX_FRAME / 2)
+		{
+			more = true;
+			break;
+		}
+		kvs_net_put_str( out, p_cursor->Key() );
+		kvs_net_put_str( out, p_cursor->Value() );
+		count++;
+	}
+
+	emsg = p_cursor->GetErrorMsg();
+	if (!emsg.empty())
+		return false;
+
+	for (int32_t i = 0; i < 4; i++)
+		out[countAt + i] = (char)(count >> (8 * i));
+	kvs_net_put_u8( out, (more) ? 1 : 0 );
+	return true;
+}
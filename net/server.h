@@ -0,0 +1,110 @@
+/////////////////////////////////////////////////////////////////////////////
+// Name:        server.h
+// Purpose:     serves a CKeyValueStore over TCP or Unix sockets, speaking the
+//							protocol in protocol.h. Linux only.
+//
+//							Each of the server's threads runs its own epoll loop, with
+//							every listening socket in it as EPOLLEXCLUSIVE, so a new
+//							connection wakes one loop and stays on that thread from then
+//							on. A loop reads whatever a connection has sent, executes
+//							every whole frame in it, and writes the replies back with as
+//							few sends as it can, so pipelined requests cost a syscall or
+//							two per batch rather than per request. A connection with
+//							more than KVS_NET_MAX_PENDING bytes of replies not yet taken
+//							by its client is not read again until they drain.
+//
+//							Requests run on the loop thread against the store, a GET
+//							batch of several keys through one Snapshot(), a SCAN through
+//							the loop's one cursor, restarted for each page; a SYNC holds
+//							up its loop for the sync's duration.
+/////////////////////////////////////////////////////////////////////////////
+
+#ifndef _KVS_NET_SERVER_H_
+#define _KVS_NET_SERVER_H_
+
+#include <cstdint>
+#include <string>
+#include <vector>
+#include <atomic>
+#include <thread>
+#include <unordered_map>
+#include "protocol.h"
+
+#define KVS_NET_MAX_PENDING   (8 * 1024 * 1024)   // reply bytes a connection may leave unread
+#define KVS_NET_READ_SIZE     (64 * 1024)         // bytes per recv()
+#define KVS_NET_MAX_EVENTS    (256)               // epoll events taken per wait
+#define KVS_NET_BACKLOG       (1024)
+
+class CKeyValueStore;
+class CKvsCursor;
+
+class CKvsServer
+{
+public:
+	CKvsServer( CKeyValueStore* p_store );
+	~CKvsServer();		// stops, if Stop() was not called
+
+	// adds a listening socket, before Start(): "tcp:host:port", "tcp::port" for every
+	// interface, or "unix:/path". A tcp port of 0 picks a free one, see GetPort():
+	bool        Listen( const std::string& address );
+	// starts threads loops, returning at once:
+	bool        Start( uint32_t threads );
+	// closes every connection and listening socket, once the loops have finished the
+	// requests they are executing:
+	void        Stop( void );
+
+	uint16_t    GetPort( void );      // of the last tcp socket listening
+	std::string GetErrorMsg( void );
+
+private:
+	CKvsServer( const CKvsServer& );
+	CKvsServer& operator=( const CKvsServer& );
+
+	struct CConnection
+	{
+		int         m_fd;
+		std::string m_in;         // bytes received, from m_inPos on not yet executed
+		size_t      m_inPos;
+		std::string m_out;        // replies, from m_outPos on not yet sent
+		size_t      m_outPos;
+		uint32_t    m_events;     // what epoll is watching for
+	};
+
+	struct CLoop
+	{
+		int                                       m_epoll;
+		std::unordered_map<int, CConnection*>     m_connections;
+		std::thread                               m_thread;
+		CKvsCursor*                               mp_cursor;   // SCANs', made upon the first
+	};
+
+	void        Run( CLoop* p_loop );
+	void        Accept( CLoop* p_loop, int listen_fd );
+	// false when the connection is to be closed:
+	bool        Receive( CConnection* p_conn );
+	bool        Serve( CLoop* p_loop, CConnection* p_conn );
+	bool        Send( CConnection* p_conn );
+	bool        Watch( CLoop* p_loop, CConnection* p_conn );
+	size_t      NextFrame( CConnection* p_conn );
+	void        Close( CLoop* p_loop, CConnection* p_conn );
+
+	// executes one whole frame, appending its reply, BAD_REQUEST if it can't be parsed:
+	void        Execute( CLoop* p_loop, uint8_t op, uint32_t id, const char* body, uint32_t size, std::string& out );
+	void        Get( CKvsNetReader& in, std::string& out );
+	void        Set( CKvsNetReader& in );
+	uint32_t    Del( CKvsNetReader& in );
+	bool        Scan( CLoop* p_loop, CKvsNetReader& in, std::string& out, std::string& emsg );
+	bool        Tail( CKvsNetReader& in, std::string& out, std::string& emsg );
+	bool        DigestKeys( CKvsNetReader& in, std::string& out, std::string& emsg );
+
+	CKeyValueStore*           mp_store;
+	std::vector<int>          m_listeners;
+	std::vector<std::string>  m_unixPaths;    // unlinked upon Stop()
+	uint16_t                  m_port;
+	std::vector<CLoop*>       m_loops;
+	int                       m_wake;         // an eventfd, readable once stopping
+	std::atomic<bool>         m_running;
+	std::string               m_emsg;
+};
+
+#endif // _KVS_NET_SERVER_H_
@@ -0,0 +1,277 @@
+////////////////////////////////////////////////////////////////////////////
+// Name:        kvs_test.cpp
+// Purpose:     regression tests of a CKeyValueStore, each reopening its store
+//							to check what reached the db, as well as RAM.
+//
+//							kvs_test [--dir <scratch dir>] [<test name>...]
+/////////////////////////////////////////////////////////////////////////////
+
+#include <atomic>
+#include <thread>
+#include <algorithm>
+#include <cstring>
+#include <iostream>
+#include <boost/filesystem.hpp>
+#include "kvs.h"
+
+#define TEST_KEYS           (200)
+
+// fails the test it is in, saying where:
+#define TEST_CHECK(c) \
+	do { if (!(c)) { std::cerr << "  " << __FILE__ << ":" << __LINE__ << " failed: " << #c << std::endl; return false; } } while (0)
+
+static std::string gTestDir = "kvs_test_data";
+
+///////////////////////////////////////////////////////////////////////////////////
+static std::string TestPath( const char* name )
+{
+	std::string path = gTestDir + "/" + name + ".sqlite";
+	std::remove( path.c_str() );
+	return path;
+}
+
+///////////////////////////////////////////////////////////////////////////////////
+static std::string TestKey( int32_t i )
+{
+	return "key/" + std::to_string(i);
+}
+
+///////////////////////////////////////////////////////////////////////////////////
+// a delete's row goes before the store lets go of the key, so a rewrite on another thread
+// synced straight after it is not deleted by it; nor is one of a key a prefix delete took
+static bool TestDeleteRewriteSync( void )
+{
+	std::string path = TestPath( "delete_rewrite_sync" );
+	{
+		CKeyValueStore store( path.c_str(), NULL, NULL );
+		TEST_CHECK( store.Init() == 0 );
+		for (int32_t i = 0; i < TEST_KEYS; i++)
+		{
+			std::string key = TestKey( i );
+			std::string child = key + "/child";
+			store.WriteString( key, (char*)"first" );
+			store.WriteString( child, (char*)"first" );
+		}
+		TEST_CHECK( store.SyncToDiskStorage() );
+
+		// each key is written again, and synced, as soon as it is seen gone from RAM, while
+		// more syncs hold the db lock deletes wait on:
+		std::atomic<bool> done( false );
+		std::thread syncer( [&]() { while (!done) store.SyncToDiskStorage(); } );
+		std::thread writer( [&]() {
+			for (int32_t i = 0; i < TEST_KEYS; i++)
+			{
+				std::string key = TestKey( i );
+				std::string child = key + "/child";
+				while (store.isKey( child ))
+					std::this_thread::yield();
+				store.WriteString( child, (char*)"second" );
+				store.SyncToDiskStorage();
+				while (store.isKey( key ))
+					std::this_thread::yield();
+				store.WriteString( key, (char*)"second" );
+				store.SyncToDiskStorage();
+			}
+		} );
+		for (int32_t i = 0; i < TEST_KEYS; i++)
+		{
+			std::string key = TestKey( i );
+			std::string prefix = key + "/";
+			store.DeleteKeysStartingWith( prefix );
+			store.DeleteKey( key );
+		}
+		writer.join();
+		done = true;
+		syncer.join();
+		TEST_CHECK( store.SyncToDiskStorage() );
+	}
+
+	CKeyValueStore store( path.c_str(), NULL, NULL );
+	TEST_CHECK( store.Init() == 0 );
+	for (int32_t i = 0; i < TEST_KEYS; i++)
+	{
+		std::string key = TestKey( i );
+		std::string child = key + "/child";
+		TEST_CHECK( store.ReadString( key, (char*)"" ) == "second" );
+		TEST_CHECK( store.ReadString( child, (char*)"" ) == "second" );
+	}
+	return true;
+}
+
+///////////////////////////////////////////////////////////////////////////////////
+// a delete the db refuses, held by another connection, is made by the next sync, and a
+// key written again since keeps its row
+static bool TestDeleteRequeued( void )
+{
+	std::string path = TestPath( "delete_requeued" );
+	{
+		CKeyValueStore store( path.c_str(), NULL, NULL );
+		TEST_CHECK( store.Init() == 0 );
+		std::string gone = "gone", back = "back", prefix = "dir/", child = "dir/child";
+		store.WriteString( gone, (char*)"1" );
+		store.WriteString( back, (char*)"1" );
+		store.WriteString( child, (char*)"1" );
+		TEST_CHECK( store.SyncToDiskStorage() );
+
+		sqlite3* db = NULL;
+		TEST_CHECK( sqlite3_open( path.c_str(), &db ) == SQLITE_OK );
+		TEST_CHECK( sqlite3_exec( db, "BEGIN IMMEDIATE TRANSACTION", NULL, NULL, NULL ) == SQLITE_OK );
+		TEST_CHECK( store.DeleteKey( gone ) );
+		TEST_CHECK( store.DeleteKey( back ) );
+		TEST_CHECK( store.DeleteKeysStartingWith( prefix ) == 1 );
+		sqlite3_exec( db, "ROLLBACK TRANSACTION", NULL, NULL, NULL );
+		sqlite3_close( db );
+
+		store.WriteString( back, (char*)"2" );
+		TEST_CHECK( store.SyncToDiskStorage() );
+	}
+
+	CKeyValueStore store( path.c_str(), NULL, NULL );
+	TEST_CHECK( store.Init() == 0 );
+	std::string gone = "gone", back = "back", child = "dir/child";
+	TEST_CHECK( !store.isKey( gone ) );
+	TEST_CHECK( !store.isKey( child ) );
+	TEST_CHECK( store.ReadString( back, (char*)"" ) == "2" );
+	return true;
+}
+
+///////////////////////////////////////////////////////////////////////////////////
+// a commit's rows take change sequences, as a sync's do, so another store on the db sees
+// them by refreshing
+static bool TestCommitRefreshed( void )
+{
+	std::string path = TestPath( "commit_refreshed" );
+	CKeyValueStore primary( path.c_str(), NULL, NULL );
+	TEST_CHECK( primary.Init() == 0 );
+	std::string key = "committed", other = "other";
+	primary.WriteString( key, (char*)"1" );
+	TEST_CHECK( primary.SyncToDiskStorage() );
+
+	CKeyValueStore second( path.c_str(), NULL, NULL );
+	TEST_CHECK( second.Init() == 0 );
+	TEST_CHECK( second.ReadString( key, (char*)"" ) == "1" );
+
+	CKvsTransaction txn( &primary );
+	txn.WriteString( key, (char*)"2" );
+	txn.WriteString( other, (char*)"3" );
+	TEST_CHECK( txn.Commit() == KVS_TXN_OK );
+
+	TEST_CHECK( second.Refresh() >= 2 );
+	TEST_CHECK( second.ReadString( key, (char*)"" ) == "2" );
+	TEST_CHECK( second.ReadString( other, (char*)"" ) == "3" );
+	return true;
+}
+
+///////////////////////////////////////////////////////////////////////////////////
+// a commit the db refuses keeps its changes in RAM, and the next sync makes them, deletes
+// as well as writes
+static bool TestCommitRequeued( void )
+{
+	std::string path = TestPath( "commit_requeued" );
+	std::string gone = "gone", kept = "kept";
+	{
+		CKeyValueStore store( path.c_str(), NULL, NULL );
+		TEST_CHECK( store.Init() == 0 );
+		store.WriteString( gone, (char*)"1" );
+		TEST_CHECK( store.SyncToDiskStorage() );
+
+		sqlite3* db = NULL;
+		TEST_CHECK( sqlite3_open( path.c_str(), &db ) == SQLITE_OK );
+		TEST_CHECK( sqlite3_exec( db, "BEGIN IMMEDIATE TRANSACTION", NULL, NULL, NULL ) == SQLITE_OK );
+		CKvsTransaction txn( &store );
+		txn.DeleteKey( gone );
+		txn.WriteString( kept, (char*)"2" );
+		int32_t rc = txn.Commit();
+		sqlite3_exec( db, "ROLLBACK TRANSACTION", NULL, NULL, NULL );
+		sqlite3_close( db );
+
+		TEST_CHECK( rc == KVS_TXN_PERSIST_FAILED );
+		TEST_CHECK( store.SyncToDiskStorage() );
+	}
+
+	CKeyValueStore store( path.c_str(), NULL, NULL );
+	TEST_CHECK( store.Init() == 0 );
+	TEST_CHECK( !store.isKey( gone ) );
+	TEST_CHECK( store.ReadString( kept, (char*)"" ) == "2" );
+	return true;
+}
+
+///////////////////////////////////////////////////////////////////////////////////
+// a shared value is read through ReadBinary() as each key's own bytes, so writing through
+// one key's changes no other key's, nor the db's; ReadBinaryView() reads the shared bytes
+static bool TestSharedReadPrivate( void )
+{
+	std::string path = TestPath( "shared_read_private" );
+	std::string first = "first", second = "second";
+	uint8_t value[64];
+	memset( value, 0x5a, sizeof(value) );
+	{
+		CKeyValueStore store( path.c_str(), NULL, NULL );
+		TEST_CHECK( store.Init() == 0 );
+		store.SetDedupThreshold( sizeof(value) );
+		store.WriteBinary( first, value, sizeof(value) );
+		store.WriteBinary( second, value, sizeof(value) );
+		TEST_CHECK( store.SyncToDiskStorage() );
+
+		const uint8_t* p_view = store.ReadBinaryView( second, sizeof(value) );
+		TEST_CHECK( p_view != NULL );
+		TEST_CHECK( p_view == store.ReadBinaryView( first, sizeof(value) ) );
+		TEST_CHECK( store.ReadBinaryView( first, sizeof(value) + 1 ) == NULL );
+
+		uint8_t* p_first = store.ReadBinary( first, NULL, sizeof(value) );
+		TEST_CHECK( p_first != NULL && p_first != p_view );
+		memset( p_first, 0xa5, sizeof(value) );
+		TEST_CHECK( store.ReadBinary( first, NULL, sizeof(value) ) == p_first );
+
+		uint8_t* p_second = store.ReadBinary( second, NULL, sizeof(value) );
+		TEST_CHECK( p_second != NULL && p_second != p_first );
+		TEST_CHECK( memcmp( p_second, value, sizeof(value) ) == 0 );
+		TEST_CHECK( memcmp( store.ReadBinaryView( second, sizeof(value) ), value, sizeof(value) ) == 0 );
+		TEST_CHECK( store.SyncToDiskStorage() );
+	}
+
+	CKeyValueStore store( path.c_str(), NULL, NULL );
+	TEST_CHECK( store.Init() == 0 );
+	uint8_t* p_first = store.ReadBinary( first, NULL, sizeof(value) );
+	uint8_t* p_second = store.ReadBinary( second, NULL, sizeof(value) );
+	TEST_CHECK( p_first != NULL && memcmp( p_first, value, sizeof(value) ) == 0 );
+	TEST_CHECK( p_second != NULL && memcmp( p_second, value, sizeof(value) ) == 0 );
+	return true;
+}
+
+///////////////////////////////////////////////////////////////////////////////////
+int main( int argc, char* argv[] )
+{
+	static const struct { const char* name; bool (*test)( void ); } tests[] =
+	{
+		{ "delete_rewrite_sync", TestDeleteRewriteSync },
+		{ "delete_requeued",     TestDeleteRequeued },
+		{ "commit_refreshed",    TestCommitRefreshed },
+		{ "commit_requeued",     TestCommitRequeued },
+		{ "shared_read_private", TestSharedReadPrivate },
+	};
+
+	std::vector<std::string> only;
+	for (int32_t i = 1; i < argc; i++)
+	{
+		std::string arg = argv[i];
+		if (arg == "--dir" && i + 1 < argc)
+			gTestDir = argv[++i];
+		else
+			only.push_back( arg );
+	}
+	boost::filesystem::create_directories( gTestDir );
+
+	int32_t failed = 0;
+	for (size_t t = 0; t < sizeof(tests) / sizeof(tests[0]); t++)
+	{
+		if (!only.empty() && std::find( only.begin(), only.end(), tests[t].name ) == only.end())
+			continue;
+
+		bool ok = tests[t].test();
+		std::cerr << ((ok) ? "ok     " : "FAILED ") << tests[t].name << std::endl;
+		if (!ok)
+			failed++;
+	}
+	return (failed) ? 1 : 0;
+}